@@ -0,0 +1,213 @@
+#!/bin/sh
+# bench.sh - Measure how fast peapod proxies EAPOL packets
+#
+# Connects peapod in a network namespace of its own to peapod-bench in
+# another by two veth pairs, then for each scenario below runs peapod with a
+# config generated for it and has peapod-bench send packets through it:
+#
+#        peapod-bench                      peapod
+#         [bA0] <--- veth ---> [bA1] ingress
+#                                          |
+#         [bB0] <--- veth ---> [bB1] egress
+#
+# Prints one line of results per scenario. With -s, also saves them as a
+# baseline; with -b, compares them with a baseline saved earlier and exits
+# with status 1 if any scenario got slower by more than BENCH_TOLERANCE
+# percent (default: 10), in packets per second or 99th percentile latency,
+# or dropped more packets than that.
+#
+# Packets are sent at BENCH_RATE per second (default: 50000), or 0 for as fast
+# as possible, BENCH_COUNT at a time (default: 100000); the latency scenario
+# always sends at 10000 per second, and the script scenario at 200.
+#
+# Needs root, ip(8) with network namespaces and veth(4), and peapod and
+# peapod-bench built in bin/; run by "make bench".
+
+usage() {
+	echo "Usage: $0 [-b <baseline>] [-s <baseline>]" >&2
+	exit 2
+}
+
+BASELINE=
+SAVE=
+while getopts b:s:h opt; do
+	case $opt in
+	b) BASELINE=$OPTARG ;;
+	s) SAVE=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+
+BIN=${BIN:-$(dirname "$0")/../bin}
+PEAPOD=$(realpath "$BIN/peapod")
+BENCH=$(realpath "$BIN/peapod-bench")
+TOLERANCE=${BENCH_TOLERANCE:-10}
+COUNT=${BENCH_COUNT:-100000}
+RATE=${BENCH_RATE:-50000}
+
+PROXY=peapod-bench-proxy
+GEN=peapod-bench-gen
+
+[ -x "$PEAPOD" ] && [ -x "$BENCH" ] || {
+	echo "$0: build peapod and peapod-bench first" >&2
+	exit 2
+}
+[ -z "$BASELINE" ] || [ -r "$BASELINE" ] || {
+	echo "$0: cannot read baseline '$BASELINE'" >&2
+	exit 2
+}
+
+TMP=$(mktemp -d)
+PID=
+
+cleanup() {
+	[ -n "$PID" ] && kill "$PID" 2> /dev/null && wait "$PID"
+	ip netns del $PROXY 2> /dev/null
+	ip netns del $GEN 2> /dev/null
+	rm -rf "$TMP"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+setup() {
+	ip netns add $PROXY && ip netns add $GEN || exit 1
+	for side in A B; do
+		ip link add b${side}0 netns $GEN type veth \
+			peer name b${side}1 netns $PROXY || exit 1
+		ip -n $GEN link set b${side}0 up
+		ip -n $PROXY link set b${side}1 up
+	done
+}
+
+# run <label> <peapod-bench options...>
+#   Start peapod with $TMP/<label>.conf, then send packets through it
+run() {
+	label=$1
+	shift
+
+	ip netns exec $PROXY "$PEAPOD" -c "$TMP/$label.conf" \
+		> "$TMP/$label.log" 2>&1 &
+	PID=$!
+	sleep 1
+	kill -0 "$PID" 2> /dev/null || {
+		echo "$0: peapod did not start for '$label'" >&2
+		cat "$TMP/$label.log" >&2
+		exit 1
+	}
+
+	ip netns exec $GEN "$BENCH" -l "$label" "$@" bA0 bB0 | tee -a "$TMP/results"
+
+	kill "$PID"
+	wait "$PID"
+	PID=
+}
+
+# compare <baseline> <results>
+#   Print how each result changed from its baseline, flagging regressions
+compare() {
+	awk -v tol="$TOLERANCE" '
+	function field(name,    i) {
+		for (i = 2; i < NF; i += 2)
+			if ($i == name)
+				return $(i + 1)
+		return ""
+	}
+	FNR == NR {
+		label = $1
+		pps[label] = field("pps")
+		p99[label] = field("p99_us")
+		drop[label] = field("dropped") / field("sent")
+		next
+	}
+	{
+		label = $1
+		if (!(label in pps)) {
+			printf "%-12s no baseline\n", label
+			next
+		}
+		cur_pps = field("pps")
+		cur_p99 = field("p99_us")
+		cur_drop = field("dropped") / field("sent")
+		bad = ""
+		if (cur_pps < pps[label] * (1 - tol / 100))
+			bad = bad " pps"
+		if (cur_p99 > p99[label] * (1 + tol / 100))
+			bad = bad " p99"
+		if (cur_drop > drop[label] + tol / 100)
+			bad = bad " dropped"
+		printf "%-12s pps %s -> %s, p99_us %s -> %s, dropped %.1f%% -> %.1f%%%s\n",
+		       label, pps[label], cur_pps, p99[label], cur_p99,
+		       drop[label] * 100, cur_drop * 100,
+		       bad == "" ? "" : "  REGRESSION:" bad
+		if (bad != "")
+			failed = 1
+	}
+	END {
+		exit failed
+	}' "$1" "$2"
+}
+
+setup
+
+cat > "$TMP/script.sh" <<SCRIPT
+#!/bin/sh
+exit 0
+SCRIPT
+chmod 755 "$TMP/script.sh"
+
+# Proxied as is
+cat > "$TMP/plain.conf" <<CONF
+iface bA1;
+iface bB1;
+CONF
+cp "$TMP/plain.conf" "$TMP/latency.conf"
+
+# Tagged on the way out
+cat > "$TMP/dot1q.conf" <<CONF
+iface bA1;
+iface bB1 {
+	egress {
+		dot1q {
+			id 100;
+			priority 5;
+		};
+	};
+};
+CONF
+
+# One packet in three dropped on the way in
+cat > "$TMP/filter.conf" <<CONF
+iface bA1 {
+	ingress {
+		filter start;
+	};
+};
+iface bB1;
+CONF
+
+# A script run for every packet on the way out
+cat > "$TMP/script.conf" <<CONF
+iface bA1;
+iface bB1 {
+	egress {
+		exec all "$TMP/script.sh";
+	};
+};
+CONF
+
+run plain -n "$COUNT" -r "$RATE"
+run latency -n "$COUNT" -r 10000
+run dot1q -n "$COUNT" -r "$RATE"
+run filter -n "$COUNT" -r "$RATE" -t start,eap,key -f start
+run script -n 1000 -r 200 -w 2000
+
+status=0
+if [ -n "$BASELINE" ]; then
+	echo
+	compare "$BASELINE" "$TMP/results" || status=1
+fi
+if [ -n "$SAVE" ]; then
+	cp "$TMP/results" "$SAVE" && echo "saved baseline to '$SAVE'"
+fi
+
+exit $status
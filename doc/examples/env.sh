@@ -48,6 +48,24 @@
 # PKT_REQRESP_TYPE=6                                (Number from 1 to 255)
 # PKT_REQRESP_DESC=Generic Token Card (GTC)
 #
+# - Vendor-Id and Vendor-Type of an Expanded Type.
+# Condition: As above, and $PKT_REQRESP_TYPE is 254.
+# PKT_REQRESP_VENDOR_ID=00372a                      (six hexdigits)
+# PKT_REQRESP_VENDOR_TYPE=1                         (number)
+#
+# - Session of the supplicant the packet belongs to.
+# Condition: Config has a sessions stanza, and the packet belongs to a session.
+# PKT_SESSION_SUPPLICANT=xx:xx:xx:xx:xx:xx          (hexdigit pairs)
+# PKT_SESSION_STATE=authenticated                   (session state keyword)
+# PKT_SESSION_STATE_PREV=authenticating             (same, or "none")
+# PKT_SESSION_PACKETS=9                             (number)
+# PKT_SESSION_START=1514764790.069263               (unixtime.microsecs)
+#
+# - Packets a batched script is executed for.
+# Condition: The exec is coalesced with "coalesce ... batch".
+# PKT_COALESCED=12                                  (number)
+# PKT_COALESCED_START=1514764789.880914             (unixtime.microsecs)
+#
 # - 802.1Q Tag Control Information.
 # Raw 802.1Q TCI in hex, i.e. last 2 bytes of 4-byte 802.1Q VLAN tag containing
 # PCP, DEI, and VID fields.
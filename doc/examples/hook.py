@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+# Filename: hook.py
+# Description: Example hook for peapod - EAPOL Proxy Daemon
+#
+# Unlike a script, which peapod executes once per matching EAPOL packet, a hook
+# is started once and then handed one event record per matching packet. Use a
+# hook when scripts would be executed so often that creating processes for them
+# becomes expensive.
+#
+# peapod passes a SOCK_SEQPACKET socket as the hook's stdin, so each read
+# returns exactly one record. A record is a sequence of fields, each made up of
+# the 2-byte length of its name, the 2-byte length of its value (both
+# big-endian), its name, and its value. Fields are named and formatted as the
+# environment variables available to scripts (see env.sh), except that PKT_ORIG
+# and PKT contain the raw Ethernet frames instead of Base64.
+#
+# A hook that exits is restarted. A hook that does not keep up misses events.
+#
+# See peapod.conf(5), "hook".
+import os
+import struct
+import sys
+
+# Output file
+OUTPUT = "/tmp/peapodhook.txt"
+
+# Sample entry in output file:
+#
+#    eth0 EAPOL-EAP Response 00:11:22:33:44:55 > 01:80:c2:00:00:03 (64 bytes)
+with open(OUTPUT, "a") as out:
+    while True:
+        rec = os.read(sys.stdin.fileno(), 65536)
+        if not rec:
+            break
+
+        pkt = {}
+        pos = 0
+        while pos + 4 <= len(rec):
+            name_len, val_len = struct.unpack_from("!HH", rec, pos)
+            pos += 4
+            name = rec[pos:pos + name_len].decode()
+            pos += name_len
+            pkt[name] = rec[pos:pos + val_len]
+            pos += val_len
+
+        desc = pkt["PKT_TYPE_DESC"].decode()
+        if "PKT_CODE_DESC" in pkt:
+            desc += " " + pkt["PKT_CODE_DESC"].decode()
+        out.write("%s %s %s > %s (%d bytes)\n" % (
+                  pkt["PKT_IFACE"].decode(), desc,
+                  pkt["PKT_SOURCE"].decode(), pkt["PKT_DEST"].decode(),
+                  len(pkt["PKT"])))
+        out.flush()
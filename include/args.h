@@ -47,7 +47,43 @@ struct args_t {
 	 * @p PEAPOD_LOG_PATH.
 	 */
 	char *logfile;
+	/**
+	 * @brief The path to the statistics region
+	 *
+	 * Controls whether counters are published in a file for other
+	 * processes to map, cf. @p stats.h. If @p -S is not provided, remains
+	 * @p NULL. Otherwise, may be the optional argument to @p -S, or the
+	 * default of @p PEAPOD_STATS_PATH.
+	 */
+	char *statsfile;
+	/**
+	 * @brief The path to the trace file
+	 *
+	 * Controls whether packets are recorded in a trace file rather than
+	 * decoded in the log, cf. @p trace.h. If @p -T is not provided, remains
+	 * @p NULL. Otherwise, may be the optional argument to @p -T, or the
+	 * default of @p PEAPOD_TRACE_PATH.
+	 */
+	char *tracefile;
+	/**
+	 * @brief The path to a capture file to replay
+	 *
+	 * If @p -r is provided, packets are read from this pcap or pcapng file
+	 * instead of being received on the interfaces, cf. @p replay.h.
+	 * Otherwise, remains @p NULL.
+	 */
+	char *replay;
+	/**
+	 * @brief The path to write replayed packets to
+	 *
+	 * If @p -w is provided along with @p -r, packets are written to this
+	 * pcapng file instead of being sent on the interfaces. Otherwise,
+	 * remains @p NULL, and packets replayed are not written anywhere.
+	 */
+	char *replay_out;
+	uint8_t noexec;		/**< @brief Flag: Was @p -n provided? */
 	uint8_t syslog;		/**< @brief Flag: Was @p -s provided? */
+	uint8_t async;		/**< @brief Flag: Was @p -a provided? */
 	uint8_t quiet;		/**< @brief Flag: Was @p -q provided? */
 	uint8_t color;		/**< @brief Flag: Was @p -C provided? */
 	uint8_t oneshot;	/**< @brief Flag: Was @p -o provided? */
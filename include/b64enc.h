@@ -7,4 +7,11 @@
 #include <stdint.h>
 #include <stdlib.h>
 
-char *b64enc(const uint8_t *in, size_t len);
+/**
+ * @brief The length of the resulting Base64-encoded string, including the null
+ *        terminator, from an input of length @p len
+ */
+#define b64len(len) (4 * ((len) / 3) + 5)
+
+size_t b64enc_to(char *out, const uint8_t *in, size_t len);
+const char *b64enc_kernel(unsigned n);
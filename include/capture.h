@@ -0,0 +1,43 @@
+/**
+ * @file capture.h
+ * @brief Function prototypes for @p capture.c
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "packet.h"
+
+/**
+ * @name Capture directions
+ * @see @p capture_packet()
+ * @{
+ */
+#define CAPTURE_IN			1	/**< @brief Received, cf. the @p epb_flags option */
+#define CAPTURE_OUT			2	/**< @brief Sent */
+/** @} */
+
+/**
+ * @brief Size of the chunks a capture file with @p mmap grows by
+ * @note A multiple of the page size
+ */
+#define CAPTURE_MMAP_CHUNK		(1 << 20)
+
+/**
+ * @name pcapng block building
+ * @see @p capture_shb(), @p capture_idb(), @p capture_epb()
+ * @{
+ */
+#define CAPTURE_BLOCK_MAX		128	/**< @brief Room for any block or options built here */
+#define CAPTURE_EPB_HDR			28	/**< @brief Length of an Enhanced Packet Block before its packet data */
+/** @} */
+
+size_t capture_shb(uint8_t *buf);
+size_t capture_idb(uint8_t *buf, const char *name);
+size_t capture_epb(uint8_t *hdr, uint8_t *opts, uint32_t id,
+		   struct timespec ts, uint32_t caplen, uint8_t dir,
+		   const char *comment);
+void capture_ifaces(struct iface_t *ifaces, struct iface_t *old);
+void capture_packet(struct capture_t *capture,
+		    const struct peapod_packet *packet, uint8_t dir);
@@ -0,0 +1,83 @@
+/**
+ * @file decode.h
+ * @brief Function prototypes for @p decode.c
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "packet.h"
+
+/**
+ * @brief Size of a buffer for a line of a hexadecimal dump
+ * @see @p decode_hex()
+ */
+#define DECODE_HEX_SIZ			64
+
+/**
+ * @name What follows a field with a given value
+ * @see The @p flags field of <tt>struct decode_t</tt>
+ * @{
+ */
+#define DECODE_BODY			0x1	/**< @brief EAPOL Packet Type: a Packet Body that is decoded */
+#define DECODE_TYPE			0x2	/**< @brief EAP Code: a Type field */
+#define DECODE_EXPANDED			0x4	/**< @brief EAP Type: Vendor-Id and Vendor-Type fields */
+/** @} */
+
+/**
+ * @brief Describes a single-byte value in an EAPOL packet
+ *
+ * The value in question may be an EAPOL Packet Type, EAP Code, EAP
+ * Request/Response Type, or EAPOL-Key Descriptor Type. Each table of these has
+ * an entry for every possible value, so that looking a value up is indexing
+ * the table with it.
+ *
+ * @see @p packet_decode()
+ */
+struct decode_t {
+	const char *desc;		/**< @brief Description, or @p NULL if unknown */
+	/**
+	 * @brief Length of the fields that follow, if they are there
+	 *
+	 * That is, in bytes: of the decoded part of the Packet Body for an
+	 * EAPOL Packet Type, of the rest of the EAP header for an EAP Code, and
+	 * of the Type-Data decoded for an EAP Type.
+	 */
+	uint8_t len;
+	uint8_t flags;			/**< @brief @p DECODE_BODY, @p DECODE_TYPE, and/or @p DECODE_EXPANDED */
+};
+
+/**
+ * @name Descriptions of values
+ * @{
+ */
+extern const struct decode_t eapol_types[256];		/**< @brief EAPOL Packet Types */
+extern const struct decode_t eap_codes[256];		/**< @brief EAP Codes */
+extern const struct decode_t eap_types[256];		/**< @brief EAP-Request/Response Types */
+extern const struct decode_t eapol_key_types[256];	/**< @brief EAPOL-Key Descriptor Types */
+/** @} */
+
+/**
+ * @brief Decode a byte in an EAPOL packet to a C string
+ *
+ * The byte may be one of the following:
+ * -# the Type field of an EAPOL packet,
+ * -# the Code field of an EAP packet encapsulated in an EAPOL-EAP packet,
+ * -# the Type field of an EAP-Request or EAP-Response encapsulated in an EAP
+ *    packet, or
+ * -# the Descriptor Type field of an EAPOL-Key packet.
+ *
+ * @param val Value of the relevant byte to decode
+ * @param decode One of the tables of <tt>struct decode_t</tt> above
+ * @return A description, or "Unknown" if the value does not have a
+ *         corresponding description in @p decode.
+ */
+static inline const char *packet_decode(uint8_t val,
+					const struct decode_t *decode)
+{
+	return decode[val].desc != NULL ? decode[val].desc : "Unknown";
+}
+
+int decode_frame(char *buf, size_t size, const char *verb, const char *name,
+		 size_t len, const uint8_t *frame, size_t caplen);
+size_t decode_hex(char *buf, const uint8_t *data, size_t len, size_t pos);
@@ -10,5 +10,7 @@
 #define PEAPOD_PID_PATH		"/var/run/peapod.pid"
 #define PEAPOD_CONF_PATH	"/etc/peapod.conf"
 #define PEAPOD_LOG_PATH		"/var/log/peapod.log"
+#define PEAPOD_STATS_PATH	"/var/run/peapod.stats"
+#define PEAPOD_TRACE_PATH	"/var/log/peapod.trace"
 
 #define PEAPOD_ROOT_PATH	"/"
@@ -6,9 +6,38 @@
 
 #include "parser.h"
 
-int iface_init(struct iface_t *ifaces, int epfd);
+/**
+ * @name In-kernel packet counts
+ * @see @p iface_kstat()
+ * @{
+ */
+#define IFACE_KSTAT_FILTERED		0	/**< @brief Dropped for being filtered */
+#define IFACE_KSTAT_FORWARDED		1	/**< @brief Forwarded by the in-kernel datapath */
+#define IFACE_KSTAT_NR			2
+/** @} */
+
+/**
+ * @name What changed about an interface when the config was reloaded
+ * @see @p iface_reconf()
+ * @{
+ */
+#define IFACE_RECONF_CHANGED		0x1	/**< @brief Anything at all */
+#define IFACE_RECONF_REOPEN		0x2	/**< @brief Anything that needs a new raw socket */
+/** @} */
+
+int iface_init(struct iface_t *ifaces, const int *epfds);
+int iface_open(struct iface_t *ifaces, struct iface_t *iface, int epfd);
+void iface_close(struct iface_t *iface);
+int iface_reconf(struct iface_t *iface, struct iface_t *conf);
+void iface_down(struct iface_t *iface, int epfd);
+int iface_up(struct iface_t *ifaces, struct iface_t *iface, int epfd);
+int iface_routes(const struct iface_t *from, const struct iface_t *to);
+void iface_trunks(struct iface_t *ifaces);
 int iface_count(struct iface_t *ifaces);
+unsigned iface_workers(struct iface_t *ifaces);
+int iface_kstat_map(struct iface_t *iface);
+unsigned long iface_kstat(struct iface_t *iface, uint32_t key);
 void iface_reset_flags(struct iface_t *iface);
 int iface_set_flags(struct iface_t *iface);
 int iface_set_mac(struct iface_t *iface, u_char *src_mac);
-char *iface_strmac(u_char *mac);
+char *iface_strmac(const u_char *mac);
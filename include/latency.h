@@ -0,0 +1,13 @@
+/**
+ * @file latency.h
+ * @brief Function prototypes for @p latency.c
+ */
+#pragma once
+
+#include "parser.h"
+
+void latency_socket(struct iface_t *iface);
+void latency_epoll(int epfd);
+void latency_thread(unsigned id);
+void latency_lock(void);
+void latency_spawn(uint8_t spawning);
@@ -0,0 +1,39 @@
+/**
+ * @file limit.h
+ * @brief Function prototypes for @p limit.c, data structures
+ */
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include "parser.h"
+
+/**
+ * @name Sketch dimensions
+ * @see <tt>struct sketch_t</tt>
+ * @{
+ */
+#define LIMIT_SKETCH_ROWS		2	/**< @brief Buckets per source address */
+#define LIMIT_SKETCH_BITS		10	/**< @brief Base 2 logarithm of the number of buckets per row */
+/** @} */
+
+/**
+ * @brief Token buckets shared by source addresses that have none of their own
+ *
+ * Each address hashes to one bucket per row, and takes its tokens from the
+ * fullest of them, leaving none of the others any fuller than that one. Other
+ * addresses can only ever make its limit stricter, and only if every one of
+ * its buckets is shared, which is unlikely until there are a few hundred.
+ *
+ * @see @p limit_sketch()
+ */
+struct sketch_t {
+	uint64_t seed[LIMIT_SKETCH_ROWS];	/**< @brief Keys the hash of each row */
+	uint64_t full[LIMIT_SKETCH_ROWS][1 << LIMIT_SKETCH_BITS];	/**< @brief The buckets, cf. @p limit_take() */
+};
+
+int limit_take(uint64_t *full, const struct limit_t *limit,
+	       const struct timespec *now);
+void limit_sketch_init(struct sketch_t *sketch);
+int limit_sketch(struct sketch_t *sketch, const uint8_t *mac,
+		 const struct limit_t *limit, const struct timespec *now);
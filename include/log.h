@@ -73,4 +73,6 @@
 
 int log_init(void);
 int log_daemonize(void);
+void log_start(void);
+void log_thread(unsigned id);
 void log_msg(int level, const char *file, int line, const char *fmt, ...);
@@ -0,0 +1,11 @@
+/**
+ * @file netlink.h
+ * @brief Function prototypes for @p netlink.c
+ */
+#pragma once
+
+#include "parser.h"
+
+int netlink_init(int epfd);
+int netlink_dump(struct iface_t *ifaces);
+int netlink_recv(struct iface_t *ifaces);
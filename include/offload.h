@@ -0,0 +1,17 @@
+/**
+ * @file offload.h
+ * @brief Function prototypes for @p offload.c
+ */
+#pragma once
+
+#include "parser.h"
+
+/**
+ * @brief @p skb->mark of packets sent by an in-kernel datapath
+ *
+ * Our raw sockets ignore packets so marked, which were already proxied.
+ */
+#define OFFLOAD_MARK			0x0ea90d00
+
+int offload_attach(struct iface_t *iface, struct iface_t *ifaces);
+void offload_detach(struct iface_t *iface);
@@ -5,9 +5,16 @@
 #pragma once
 
 #include <stdlib.h>
+#include <time.h>
 #include <linux/types.h>
 #include "parser.h"
 
+/**
+ * @brief Maximum number of packets received with one @p recvmmsg(2)
+ * @see @p packet_recvmmsg()
+ */
+#define PACKET_RX_BATCH			32
+
 /**
  * @name EAPOL Packet Types
  * @see IEEE Std 802.1X-2010 §11.3.2
@@ -106,6 +113,16 @@ struct eapol_eap {
 	//__u8 type_data[];		/**< @brief EAP Packet (variable length) */
 }__attribute__((packed));
 
+/**
+ * @brief Type-Data of an EAP-Request/Response of Expanded Type.
+ * @see RFC 3748 §5.7
+ */
+struct eap_expanded {
+	__u8 vendor_id[3];		/**< @brief Vendor-Id (SMI Network Management Private Enterprise Code) */
+	__be32 vendor_type;		/**< @brief Vendor-Type */
+	//__u8 vendor_data[];		/**< @brief Vendor data (variable length) */
+}__attribute__((packed));
+
 /**
  * @brief EAPOL-Key (Key Descriptor) format.
  * @note Should only be used with RC4 key descriptors (now deprecated); however,
@@ -142,7 +159,8 @@ struct eapol_mpdu {
 
 /** @brief Represents an EAPOL packet with some metadata already extracted. */
 struct peapod_packet {
-	struct timeval tv;		/**< @brief Packet timestamp */
+	struct timespec ts;		/**< @brief Packet timestamp, on @p CLOCK_REALTIME unless timestamped in hardware */
+	unsigned long seq;		/**< @brief Sequence number, unique for the life of the process */
 	struct iface_t *iface;		/**< @brief Current interface */
 	struct iface_t *iface_orig;	/**< @brief Interface on which packet was originally received */
 	ssize_t len;			/**< @brief Current length */
@@ -155,87 +173,101 @@ struct peapod_packet {
 	struct tci_t tci_orig;		/**< @brief Original 802.1Q Tag Control Information */
 	uint8_t type;			/**< @brief EAPOL Packet Type */
 	uint8_t code;			/**< @brief EAP Code */
+	uint8_t state;			/**< @brief Session state after the packet, or @p SESSION_NONE if untracked, cf. @p session.h */
+	uint8_t state_prev;		/**< @brief Session state before the packet */
+	uint8_t supplicant[ETH_ALEN];	/**< @brief MAC address of the supplicant whose session the packet belongs to */
+	unsigned supplicant_iface;	/**< @brief Index of the interface on which the supplicant was last seen */
+	unsigned long session_packets;	/**< @brief Packets in the session, this one included */
+	struct timespec session_start;	/**< @brief When the supplicant was first seen */
+	unsigned long coalesced;	/**< @brief Events a batched script is executed for, or 0, cf. @p COALESCE_BATCH */
+	struct timespec coalesced_start;	/**< @brief Timestamp of the first of them */
+	/**
+	 * @brief The EAPOL MPDU
+	 *
+	 * Points either into the main EAPOL packet buffer or into a frame in the
+	 * RX ring of the interface on which the packet was received. Either way,
+	 * it is preceded by at least 16 bytes that @p packet_buf() may use to
+	 * reconstruct the Ethernet header.
+	 */
+	uint8_t *mpdu;
 };
 
 /**
- * @brief Matches a single-byte value with a description.
- *
- * The value in question may be an EAPOL Packet Type, EAP Code,
- * or EAP-Request/Reponse Type.
+ * @name Whether a packet is sent with an 802.1Q tag
+ * @see The @p dot1q field of <tt>struct route_t</tt>
+ * @{
  */
-struct decode_t {
-	uint8_t val;			/**< @brief Value */
-	char *desc;			/**< @brief Description */
-};
+#define ROUTE_DOT1Q_KEEP		0	/**< @brief If it was received with one */
+#define ROUTE_DOT1Q_NONE		1	/**< @brief Never */
+#define ROUTE_DOT1Q_SET			2	/**< @brief Always */
+/** @} */
 
 /**
- * @brief EAPOL Packet Type descriptions.
- * @see IEEE Std 802.1X-2010 §11.3.2
+ * @brief An egress interface, as resolved for the dispatch plan of an ingress
+ *        interface
+ *
+ * Everything the egress phase needs to know about the interface, so that none
+ * of it has to be looked up per packet.
+ *
+ * @see <tt>struct plan_t</tt>
  */
-static const struct decode_t eapol_types[] = {
-	{ EAPOL_EAP,			"EAPOL-EAP" },
-	{ EAPOL_START,			"EAPOL-Start" },
-	{ EAPOL_LOGOFF,			"EAPOL-Logoff" },
-	{ EAPOL_KEY,			"EAPOL-Key" },
-	{ EAPOL_ENCAPSULATED_ASF_ALERT,	"EAPOL-Encapsulated-ASF-Alert" },
-	{ EAPOL_MKA,			"EAPOL-MKA" },
-	{ EAPOL_ANNOUNCEMENT_GENERIC,	"EAPOL-Announcement (Generic)" },
-	{ EAPOL_ANNOUNCEMENT_SPECIFIC,	"EAPOL-Announcement (Specific)" },
-	{ EAPOL_ANNOUNCEMENT_REQ,	"EAPOL-Announcement-Req" },
-	{ 0, NULL }
+struct route_t {
+	struct iface_t *iface;		/**< @brief Egress interface */
+	struct filter_t filter;		/**< @brief Egress filter, or all zeroes */
+	const struct action_t *action;	/**< @brief Egress scripts/hooks, or @p NULL */
+	struct capture_t *capture;	/**< @brief Egress capture, or @p NULL */
+	/**
+	 * @name 802.1Q tag template
+	 * @see @p packet_route()
+	 * @{
+	 */
+	uint8_t dot1q;			/**< @brief @p ROUTE_DOT1Q_KEEP, @p ROUTE_DOT1Q_NONE or @p ROUTE_DOT1Q_SET */
+	uint16_t tci_keep;		/**< @brief TCI bits kept from the received tag */
+	uint32_t tag;			/**< @brief The tag, less any kept bits, in host order */
+	/** @} */
 };
 
-/**
- * @brief EAP Code descriptions.
- * @see RFC 2284 §2.2
- */
-static const struct decode_t eap_codes[] = {
-	{ EAP_CODE_REQUEST,		"Request" },
-	{ EAP_CODE_RESPONSE,		"Response" },
-	{ EAP_CODE_SUCCESS,		"Success" },
-	{ EAP_CODE_FAILURE,		"Failure" },
-	{ 0, NULL }
-};
+struct mmsghdr;
 
 /**
- * @brief EAP-Request/Response Type descriptions.
+ * @brief Where packets are received from and sent to
  *
- * The text of the descriptions is as stated in the relevant RFCs.
- */
-static const struct decode_t eap_types[] = {
-	{ EAP_TYPE_IDENTITY,		"Identity" },
-	{ EAP_TYPE_NOTIFICATION,	"Notification" },
-	{ EAP_TYPE_NAK,			"Nak (Response only)" },
-	{ EAP_TYPE_MD5_CHALLENGE,	"MD5-Challenge" },
-	{ EAP_TYPE_OTP,			"One Time Password (OTP)" },
-	{ EAP_TYPE_GTC,			"Generic Token Card (GTC)" },
-	{ EAP_TYPE_TLS,			"EAP TLS" },
-	{ EAP_TYPE_SIM,			"EAP-SIM" },
-	{ EAP_TYPE_TTLS,		"EAP-TTLS" },
-	{ EAP_TYPE_AKA_OLD,		"EAP-AKA" },
-	{ EAP_TYPE_PEAP,		"PEAP" },
-	{ EAP_TYPE_MS_CHAP_V2,		"EAP MS-CHAP-V2" },
-	{ EAP_TYPE_MS_CHAP_V2_OLD,	"EAP MS-CHAP V2" },
-	{ EAP_TYPE_FAST,		"EAP-FAST" },
-	{ EAP_TYPE_IKEV2,		"EAP-IKEv2"},
-	{ EAP_TYPE_EXPANDED_TYPES,	"Expanded Types" },
-	{ EAP_TYPE_EXPERIMENTAL_USE,	"Experimental use" },
-	{ 0, NULL }
-};
-
-/**
- * @brief Descriptions for EAPOL-Key Descriptor Type.
- * @see IEEE Std 802.1X-2010 §11.9
+ * Normally the raw socket of each interface; the functions here stand in for
+ * the system calls made on it. Interfaces with an RX or TX ring always use
+ * the ring.
+ *
+ * @see @p packet_backend()
  */
-static const struct decode_t eapol_key_types[] = {
-	{ EAPOL_KEY_TYPE_RC4,		"RC4" },
-	{ EAPOL_KEY_TYPE_IEEE_80211,	"IEEE 802.11" },
-	{ 0, NULL }
+struct packet_backend_t {
+	/**
+	 * @brief Receive up to @p n packets, as with @p recvmmsg(2)
+	 * @return The number of packets received, 0 if none were ready, or -1
+	 *         if unsuccessful
+	 */
+	int (*recv)(struct iface_t *iface, struct mmsghdr *msgs, unsigned n);
+	/**
+	 * @brief Send up to @p n packets, as with @p sendmmsg(2)
+	 *
+	 * @p ts holds when each packet was received.
+	 *
+	 * @return The number of packets sent, or -1 if unsuccessful
+	 */
+	int (*send)(struct iface_t *iface, struct mmsghdr *msgs,
+		    const struct timespec *ts, unsigned n);
+	/** @brief Get the current time, on the clock of receive timestamps */
+	void (*now)(struct timespec *now);
 };
 
+void packet_backend(const struct packet_backend_t *backend);
+void packet_now(struct timespec *now);
 void packet_init(struct iface_t *ifaces);
-uint8_t *packet_buf(struct peapod_packet packet, uint8_t orig);
-char* packet_decode(uint8_t val, const struct decode_t *decode);
+void packet_ifaces(struct iface_t *ifaces);
+void packet_thread(unsigned id);
+void packet_thread_exit(void);
+void packet_route(struct route_t *route, const struct tci_t *tci);
+uint8_t *packet_buf(const struct peapod_packet *packet, uint8_t orig);
 uint32_t packet_tcitonl(struct tci_t tci);
-int packet_send(struct peapod_packet packet, struct iface_t *iface);
-struct peapod_packet packet_recvmsg(struct iface_t *iface);
+int packet_send(struct peapod_packet *packet, const struct route_t *route);
+int packet_flush(struct iface_t *ifaces);
+int packet_recvmmsg(struct iface_t *iface, struct peapod_packet *packets, int n);
+int packet_recvring(struct iface_t *iface, struct peapod_packet *packet);
@@ -7,7 +7,9 @@
 #pragma once
 
 #include <stdint.h>
+#include <time.h>
 #include <net/if.h>
+#include <sys/types.h>
 #include <linux/if_ether.h>
 
 /**
@@ -20,6 +22,72 @@
 #define TCI_UNTOUCHED_16		0xffff
 /** @} */
 
+/**
+ * @brief Default maximum number of packets received per interface per wakeup
+ * @see The @p budget field of <tt>struct iface_t</tt>
+ */
+#define IFACE_BUDGET			64
+
+/**
+ * @name Worker threads
+ * @see The @p worker field of <tt>struct iface_t</tt>
+ * @{
+ */
+#define IFACE_WORKERS_MAX		64	/**< @brief Maximum number of workers */
+#define IFACE_WORKER_AUTO		(~0U)	/**< @brief Not assigned a worker in the config */
+/** @} */
+
+/**
+ * @name Virtual interfaces on a trunk
+ * @see The @p trunk field of <tt>struct iface_t</tt>
+ * @{
+ */
+#define IFACE_VLANS			4096	/**< @brief Number of 802.1Q VLAN IDs */
+/**
+ * @brief Index of a virtual interface, given that of its trunk and its VLAN
+ *
+ * Kernel interface indexes are positive ints, so this is never one of them.
+ */
+#define IFACE_VIRTUAL_INDEX(trunk, vid)	(0x80000000U | (trunk) << 12 | (vid))
+/** @} */
+
+/**
+ * @name RX/TX ring defaults
+ * @see <tt>struct ring_t</tt>
+ * @{
+ */
+#define RING_BLOCK_NR			8
+#define RING_BLOCK_SIZE			(1 << 16)
+#define RING_TIMEOUT			1
+/** @} */
+
+/**
+ * @name Script executor defaults
+ * @see <tt>struct scripts_t</tt>
+ * @{
+ */
+#define SCRIPTS_MAX			8
+#define SCRIPTS_QUEUE			64
+#define SCRIPTS_TIMEOUT			0
+/** @} */
+
+/**
+ * @name Session table defaults
+ * @see <tt>struct sessions_t</tt>
+ * @{
+ */
+#define SESSIONS_MAX			1024
+#define SESSIONS_TIMEOUT		3600
+/** @} */
+
+/**
+ * @name Low-latency defaults
+ * @see <tt>struct latency_t</tt>
+ * @{
+ */
+#define LATENCY_BUSY_POLL		50
+/** @} */
+
 /**
  * @brief 802.1Q VLAN Tag Control Information
  *
@@ -32,10 +100,10 @@ struct tci_t {
 };
 
 /**
- * @brief Bitmasks for filtering on EAPOL Packet Type or EAP Code.
+ * @brief Bitmasks for filtering on EAPOL Packet Type, EAP Code or session state.
  *
- * The respective ranges of EAPOL Packet Types and EAP Codes are 0-8 (requires 2
- * bytes) and 1-4.
+ * The respective ranges of EAPOL Packet Types, EAP Codes and session states
+ * are 0-8 (requires 2 bytes), 1-4 and 1-5.
  * @note Whether an instance of <tt>struct filter_t</tt> stores ingress or
  * egress filters depends on whether its parent is a <tt>struct ingress_t</tt>
  * or a <tt>struct egress_t</tt>.
@@ -43,28 +111,116 @@ struct tci_t {
 struct filter_t {
 	uint16_t type;			/**< @brief Filter on EAPOL Packet Type */
 	uint8_t code;			/**< @brief Filter on EAP Code */
+	uint8_t state;			/**< @brief Filter on session state before the packet, cf. @p session.h */
+};
+
+/**
+ * @brief A long-lived helper process that is sent events over a socket
+ *
+ * Also a node in a singly linked list of <tt>struct hook_t</tt> structures.
+ * Each helper is started once, however many actions refer to it.
+ *
+ * @note Only @p path is set by the parser.
+ */
+struct hook_t {
+	char *path;			/**< @brief Path of the helper */
+	int skt;			/**< @brief Our end of a @p SOCK_SEQPACKET socket, or -1 */
+	pid_t pid;			/**< @brief Process ID, or 0 if not running */
+	time_t started;			/**< @brief When the helper was last started */
+	unsigned dropped;		/**< @brief Events dropped since the helper last kept up */
+	struct hook_t *next;		/**< @brief Next node */
+};
+
+/**
+ * @name Which of the events in a coalescing window a script is executed for
+ * @see The @p mode field of <tt>struct coalesce_t</tt>
+ * @{
+ */
+#define COALESCE_LEADING		0	/**< @brief The first, right away */
+#define COALESCE_TRAILING		1	/**< @brief The latest, once the window closes */
+#define COALESCE_BATCH			2	/**< @brief The latest, once the window closes, with a count */
+/** @} */
+
+/**
+ * @brief How often the scripts of a <tt>struct action_t</tt> may be executed
+ *
+ * Each script is executed for at most one event per window of @p window
+ * milliseconds, or with @p per_mac, per window and source address.
+ *
+ * @see @p process_script()
+ */
+struct coalesce_t {
+	unsigned window;		/**< @brief Window length in milliseconds */
+	uint8_t mode;			/**< @brief @p COALESCE_LEADING, @p COALESCE_TRAILING or @p COALESCE_BATCH */
+	uint8_t per_mac;		/**< @brief Flag: A window per source address? */
 };
 
 /**
- * @brief Scripts to execute on EAPOL Packet Type or EAP Code
+ * @brief Scripts to execute or hooks to notify on EAPOL Packet Type, EAP Code
+ *        or session state transition
  *
- * @p type and @p code are arrays of C strings. Each element contains either the
- * path to an executable script or @p NULL.
+ * @p type, @p code and @p state are arrays of C strings. Each element contains
+ * either the path to an executable script or @p NULL. Likewise for
+ * @p hook_type, @p hook_code and @p hook_state, which point to hooks instead.
  *
  * @note Whether an instance of <tt>struct filter_t</tt> stores ingress or
  * egress scripts depends on whether its parent is a <tt>struct ingress_t</tt>
  * or a <tt>struct egress_t</tt>.
- * @note EAP Codes only range from 1-4, so @p packet[0] is always @p NULL.
+ * @note EAP Codes only range from 1-4 and session states from 1-5, so
+ *       @p code[0] and @p state[0] are always @p NULL.
  */
 struct action_t {
 	char *type[9];			/**< @brief Run script on EAPOL Packet Type */
 	char *code[5];			/**< @brief Run script on EAP Code */
+	char *state[6];			/**< @brief Run script on transition into session state */
+	struct hook_t *hook_type[9];	/**< @brief Notify hook on EAPOL Packet Type */
+	struct hook_t *hook_code[5];	/**< @brief Notify hook on EAP Code */
+	struct hook_t *hook_state[6];	/**< @brief Notify hook on transition into session state */
+	struct coalesce_t *coalesce;	/**< @brief Coalesce script executions, or @p NULL */
+};
+
+struct capfile_t;			/* capture.c */
+
+/**
+ * @brief A pcapng capture file for the packets received or sent on an interface
+ *
+ * The file at @p path is the one being written. Once it reaches @p size MiB,
+ * or with the first packet after it has been written for @p interval seconds,
+ * it is renamed after the time it was started and a new one is started in its
+ * place.
+ *
+ * @note Whether an instance of <tt>struct capture_t</tt> captures received or
+ * sent packets depends on whether its parent is a <tt>struct ingress_t</tt>
+ * or a <tt>struct egress_t</tt>.
+ */
+struct capture_t {
+	char *path;			/**< @brief Path of the capture file */
+	unsigned size;			/**< @brief Rotate after this many MiB, or 0 */
+	unsigned interval;		/**< @brief Rotate after this many seconds, or 0 */
+	uint8_t mmap;			/**< @brief Flag: Write through @p mmap(2) rather than a buffer? */
+	struct capfile_t *file;		/**< @brief The open file, or @p NULL */
+};
+
+/**
+ * @brief A token bucket rate limit on the packets received on an interface
+ *
+ * The bucket holds up to @p burst tokens and gains @p pps of them a second.
+ * Each packet takes a token, and is dropped if there is none to take.
+ *
+ * @see @p limit_take()
+ */
+struct limit_t {
+	unsigned pps;			/**< @brief Packets per second */
+	unsigned burst;			/**< @brief Size of the bucket, in packets */
 };
 
 /** @brief Behavior during the ingress phase for an interface */
 struct ingress_t {
 	struct action_t *action;	/**< @brief Run script on ingress */
 	struct filter_t *filter;	/**< @brief Filter on ingress */
+	struct capture_t *capture;	/**< @brief Capture on ingress */
+	struct limit_t *limit;		/**< @brief Rate limit for the interface as a whole */
+	struct limit_t *limit_mac;	/**< @brief Rate limit for each source MAC address */
 };
 
 /** @brief Behavior during the egress phase for an interface */
@@ -72,8 +228,96 @@ struct egress_t {
 	struct tci_t *tci;		/**< @brief Add/edit/remove VLAN tag on egress */
 	struct filter_t *filter;	/**< @brief Filter on egress */
 	struct action_t *action;	/**< @brief Run script on egress */
+	struct capture_t *capture;	/**< @brief Capture on egress */
 };
 
+/**
+ * @brief A memory-mapped @p TPACKET_V3 receive or transmit ring
+ *
+ * The first three fields are set by the parser. The rest describe the ring at
+ * runtime and are (re)set whenever the raw socket of the parent interface is.
+ *
+ * @note @p timeout only applies to an RX ring and @p frame_size only to a TX
+ *       ring, which is made up of fixed-size frames rather than blocks of
+ *       packets.
+ * @see @p packet(7), "Packet MMAP"
+ */
+struct ring_t {
+	unsigned block_nr;		/**< @brief Number of blocks */
+	unsigned block_size;		/**< @brief Size of a block in bytes */
+	unsigned timeout;		/**< @brief Block retire timeout in ms */
+	uint8_t *map;			/**< @brief The ring as mapped by @p mmap(2) */
+	unsigned frame_size;		/**< @brief Size of a frame in bytes */
+	unsigned block;			/**< @brief Index of current block (RX) or next free frame (TX) */
+	unsigned frames;		/**< @brief Frames left to walk in current block (RX) or queued (TX) */
+	/**
+	 * @brief Next frame to walk in current block
+	 *
+	 * Not @p NULL while we own the current block, even after its last
+	 * frame has been walked. Unused for a TX ring.
+	 */
+	uint8_t *frame;
+};
+
+/**
+ * @brief Limits on script execution
+ *
+ * Scripts are executed asynchronously, up to @p max at a time. Up to @p queue
+ * more wait for a free slot; any beyond that are dropped.
+ */
+struct scripts_t {
+	unsigned max;			/**< @brief Max scripts executing at once */
+	unsigned queue;			/**< @brief Max scripts waiting to execute */
+	uint8_t drop_oldest;		/**< @brief Flag: Drop oldest rather than newest when queue is full? */
+	unsigned timeout;		/**< @brief Seconds before a script is terminated, or 0 */
+	struct hook_t *hooks;		/**< @brief All configured hooks */
+};
+
+/**
+ * @brief Limits on the session table
+ *
+ * The table holds up to @p max supplicants, the least recently seen of which
+ * makes way for a new one once it is full.
+ *
+ * @see @p session.c
+ */
+struct sessions_t {
+	unsigned max;			/**< @brief Max supplicants tracked, or 0 not to track any */
+	unsigned timeout;		/**< @brief Seconds before an idle supplicant is forgotten, or 0 */
+};
+
+/**
+ * @brief An interface named by @p egress-to
+ *
+ * Also a node in a singly linked list of <tt>struct peer_t</tt> structures.
+ */
+struct peer_t {
+	char name[IFNAMSIZ];		/**< @brief Network interface name */
+	struct peer_t *next;		/**< @brief Next node */
+};
+
+/**
+ * @brief Low-latency operation
+ *
+ * With @p enabled, the raw sockets and @p epoll instances busy poll for up to
+ * @p busy_poll microseconds, each worker is pinned to a CPU from @p cpu, in
+ * turn, and runs at @p SCHED_FIFO priority @p realtime, and all our memory is
+ * locked.
+ *
+ * @see @p latency.c
+ */
+struct latency_t {
+	uint8_t enabled;		/**< @brief Flag: Was there a low-latency stanza? */
+	unsigned busy_poll;		/**< @brief Microseconds to busy poll for, or 0 */
+	unsigned cpu[IFACE_WORKERS_MAX];	/**< @brief CPUs to pin workers to */
+	unsigned cpu_nr;		/**< @brief Number of CPUs, or 0 not to pin workers */
+	unsigned realtime;		/**< @brief @p SCHED_FIFO priority, or 0 to keep the normal policy */
+};
+
+struct txq_t;				/* packet.c */
+struct plan_t;				/* proxy.c */
+struct stats_t;				/* stats.c */
+
 /**
  * @brief Represents a network interface and its associated config
  *
@@ -83,12 +327,63 @@ struct iface_t {
 	char name[IFNAMSIZ];		/**< @brief Network interface name. */
 	unsigned index;			/**< @brief Interface index */
 	int mtu;			/**< @brief Maximum Transmission Unit */
+	unsigned flags;			/**< @brief Interface flags, e.g. @p IFF_UP, as last reported by the kernel */
+	unsigned short type;		/**< @brief ARP hardware type, e.g. @p ARPHRD_ETHER, as last reported by the kernel */
+	u_char mac[ETH_ALEN];		/**< @brief MAC address as last reported by the kernel */
 	int skt;			/**< @brief Raw socket bound to the interface */
+	/**
+	 * @brief Flag: Is @p skt out of service until the interface is back up?
+	 *
+	 * Set by the worker receiving on the interface when it goes down, and
+	 * cleared by the main thread once @p skt has been reopened.
+	 */
+	uint8_t down;
 	unsigned recv_ctr;		/**< @brief Number of EAPOL packets received */
-	unsigned send_ctr;		/**< @brief Number of EAPOL packets sent */
+	struct stats_t *stats;		/**< @brief Counters and histograms, one set per worker */
 	struct ingress_t *ingress;	/**< @brief Ingress options */
 	struct egress_t *egress;	/**< @brief Egress options */
+	/**
+	 * @brief Interfaces to send packets received on this interface on
+	 *
+	 * If @p NULL, packets are sent on every other interface, except that
+	 * a spoke never sends them on another spoke.
+	 *
+	 * @see @p iface_routes()
+	 */
+	struct peer_t *egress_to;
+	uint8_t spoke;			/**< @brief Flag: Is this interface a spoke? */
+	uint8_t unicast;		/**< @brief Flag: Send packets for a supplicant only on the interface it was last seen on? */
+	/**
+	 * @brief Trunk that this virtual interface is on, or @p NULL
+	 *
+	 * A virtual interface has no raw socket of its own. It receives the
+	 * frames tagged with its VLAN on the raw socket of its trunk, as if
+	 * untagged, and sends on that socket, tagging frames with its VLAN.
+	 *
+	 * @see @p iface_trunks()
+	 */
+	struct iface_t *trunk;
+	char trunk_name[IFNAMSIZ];	/**< @brief Name of @p trunk, or empty */
+	uint16_t vid;			/**< @brief VLAN of a virtual interface */
+	unsigned vlan_nr;		/**< @brief Number of virtual interfaces on this one */
+	struct iface_t **vlan;		/**< @brief Virtual interfaces on this one, indexed by VLAN, or @p NULL */
 	uint8_t promisc;		/**< @brief Flag: Set promiscuous mode on @p skt? */
+	uint8_t hw_timestamps;		/**< @brief Flag: Timestamp packets received on @p skt in hardware if possible? */
+	struct ring_t *rx_ring;		/**< @brief RX ring on @p skt, or @p NULL to use @p recvmmsg(2) */
+	struct ring_t *tx_ring;		/**< @brief TX ring on @p skt, or @p NULL to use @p sendmmsg(2) */
+	struct txq_t *txq;		/**< @brief Frames queued for @p sendmmsg(2), one queue per worker */
+	struct plan_t *plan;		/**< @brief What to do with packets received on this interface */
+	unsigned budget;		/**< @brief Max packets to receive before servicing other interfaces */
+	int kstat_map;			/**< @brief @p bpf(2) map of in-kernel packet counts, or 0 */
+	uint8_t offload;		/**< @brief Flag: Forward packets received on this interface in-kernel if possible? */
+	int offload_link;		/**< @brief @p bpf(2) link attaching the in-kernel datapath, or 0 */
+	/**
+	 * @brief Worker that receives packets on this interface
+	 *
+	 * Worker 0 is the main thread. Packets may be sent on the interface by
+	 * any worker.
+	 */
+	unsigned worker;
 	/**
 	 * @brief A MAC address, plus a magic number
 	 *
@@ -108,6 +403,11 @@ struct iface_t {
 	 * the current interface's MAC address will be changed to match the
 	 * packet's source MAC address, and this field will be cleared.
 	 *
+	 * With a session table, the MAC address is instead changed to that of
+	 * each supplicant behind that interface to authenticate, unless the
+	 * supplicant it was last changed to is still authenticated, and this
+	 * field is kept.
+	 *
 	 * @note If this is set by the parser, the @p set_mac field will not
 	 *       be set.
 	 */
@@ -115,5 +415,13 @@ struct iface_t {
 	struct iface_t *next;		/**< @brief Next node */
 };
 
-struct iface_t *parse_config(const char *path, uint8_t *level);
+struct iface_t *parse_config(const char *path, uint8_t *level,
+			     struct scripts_t *scripts,
+			     struct sessions_t *sessions,
+			     struct latency_t *latency);
+struct iface_t *parse_reload(const char *path, uint8_t *level,
+			     struct scripts_t *scripts,
+			     struct sessions_t *sessions,
+			     struct latency_t *latency);
+void parser_free(struct iface_t *list, struct hook_t *hooks);
 void parser_print_ifaces(struct iface_t *list);
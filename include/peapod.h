@@ -5,4 +5,5 @@
 #pragma once
 
 int peapod_close_fds(void);
+int peapod_cloexec_fds(void);
 int peapod_redir_stdfds(void);
@@ -9,5 +9,15 @@
 #define PROCESS_INGRESS		0	/**< @brief Ingress phase */
 #define PROCESS_EGRESS		1	/**< @brief Egress phase */
 
-int process_filter(struct peapod_packet packet);
-void process_script(struct peapod_packet packet);
+int process_filter(const struct peapod_packet *packet,
+		   const struct filter_t *filter);
+void process_script(const struct peapod_packet *packet,
+		    const struct action_t *action);
+int process_init(struct iface_t *ifaces, int epfd);
+void process_thread(unsigned id);
+void process_wake(void);
+void process_deferred(void);
+void process_reload(struct iface_t *ifaces, struct scripts_t *conf);
+int process_idle(void);
+int process_timeout(void);
+void process_jobs(void);
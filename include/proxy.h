@@ -4,4 +4,21 @@
  */
 #pragma once
 
+/**
+ * @name Tags for @p epoll event sources other than interfaces
+ *
+ * Stored in the @p data.ptr field of a <tt>struct epoll_event</tt> where an
+ * interface would store a pointer to its <tt>struct iface_t</tt>. No valid
+ * pointer is this small.
+ * @{
+ */
+#define PROXY_TAG_SCRIPTS		((void *)1)	/**< @brief Script executor */
+#define PROXY_TAG_DEFERRED		((void *)2)	/**< @brief Events from workers */
+#define PROXY_TAG_WORKERS		((void *)3)	/**< @brief A worker has stopped on error */
+#define PROXY_TAG_STOP			((void *)4)	/**< @brief Workers are to stop */
+#define PROXY_TAG_NETLINK		((void *)5)	/**< @brief Link notifications */
+#define PROXY_TAG_DOWN			((void *)6)	/**< @brief An interface went down */
+/** @} */
+
 void proxy(struct iface_t *ifaces);
+void proxy_replay(struct iface_t *ifaces);
@@ -0,0 +1,22 @@
+/**
+ * @file replay.h
+ * @brief Function prototypes for @p replay.c
+ */
+#pragma once
+
+#include "iface.h"
+
+/**
+ * @name Capture file formats
+ * @{
+ */
+#define REPLAY_PCAP			1	/**< @brief pcap, timestamps in microseconds or nanoseconds */
+#define REPLAY_PCAPNG			2	/**< @brief pcapng */
+/** @} */
+
+/** @brief Size of the buffer of the file replayed packets are written to */
+#define REPLAY_BUFSIZ			(1 << 20)
+
+int replay_open(struct iface_t *ifaces);
+struct iface_t *replay_next(void);
+void replay_close(void);
@@ -0,0 +1,42 @@
+/**
+ * @file session.h
+ * @brief Function prototypes for @p session.c, session states
+ */
+#pragma once
+
+#include "packet.h"
+
+/**
+ * @name Session states
+ *
+ * Where a supplicant is in authenticating, going by the last EAPOL packet
+ * received from or for it.
+ *
+ * @see The @p state field of <tt>struct peapod_packet</tt>
+ * @{
+ */
+#define SESSION_NONE			0	/**< @brief Not tracked, or not yet seen */
+#define SESSION_STARTED			1	/**< @brief Sent EAPOL-Start */
+#define SESSION_AUTHENTICATING		2	/**< @brief Sent or was sent EAP-Request/Response */
+#define SESSION_AUTHENTICATED		3	/**< @brief Was sent EAP-Success */
+#define SESSION_FAILED			4	/**< @brief Was sent EAP-Failure */
+#define SESSION_LOGGED_OFF		5	/**< @brief Sent EAPOL-Logoff */
+#define SESSION_STATES			6
+/** @} */
+
+/**
+ * @brief Maximum number of most recently seen sessions considered for an
+ *        EAP packet sent to the PAE group address
+ * @see @p session_update()
+ */
+#define SESSION_WALK			16
+
+int session_init(void);
+void session_reload(const struct sessions_t *conf);
+int session_enabled(void);
+void session_update(struct peapod_packet *packet);
+uint8_t session_state(const uint8_t *mac);
+int session_limit(const uint8_t *mac, const struct limit_t *limit,
+		  const struct timespec *now);
+const char *session_state_desc(uint8_t state);
+void session_dump(struct iface_t *ifaces);
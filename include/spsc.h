@@ -0,0 +1,36 @@
+/**
+ * @file spsc.h
+ * @brief Function prototypes for @p spsc.c, data structures
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** @brief Assumed size of a cache line, which the two indices don't share */
+#define SPSC_CACHELINE			64
+
+/**
+ * @brief A lock-free single-producer, single-consumer ring of fixed-size slots
+ *
+ * One thread reserves and commits slots, and another peeks at and releases
+ * them, in the same order. Neither ever blocks or takes a lock.
+ *
+ * @note Must be allocated with at least @p SPSC_CACHELINE alignment.
+ */
+struct spsc_t {
+	uint8_t *slots;			/**< @brief @p nr slots of @p size bytes */
+	size_t size;			/**< @brief Size of a slot in bytes */
+	unsigned nr;			/**< @brief Number of slots, a power of 2 */
+	_Alignas(SPSC_CACHELINE) unsigned head;	/**< @brief Slots committed so far; written by producer */
+	_Alignas(SPSC_CACHELINE) unsigned tail;	/**< @brief Slots released so far; written by consumer */
+};
+
+int spsc_init(struct spsc_t *q, unsigned nr, size_t size);
+void spsc_free(struct spsc_t *q);
+void *spsc_reserve(struct spsc_t *q);
+void *spsc_reserve_nth(struct spsc_t *q, unsigned n);
+void spsc_commit(struct spsc_t *q);
+void spsc_commit_nr(struct spsc_t *q, unsigned nr);
+void *spsc_peek(struct spsc_t *q);
+void spsc_release(struct spsc_t *q);
@@ -0,0 +1,244 @@
+/**
+ * @file stats.h
+ * @brief Function prototypes for @p stats.c, data structures
+ */
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "parser.h"
+
+/**
+ * @name Packet counters, by EAPOL Packet Type and EAP Code
+ * @see @p stats_packet()
+ * @{
+ */
+#define STATS_RECEIVED			0	/**< @brief Received */
+#define STATS_SENT			1	/**< @brief Sent successfully */
+#define STATS_FILTERED_IN		2	/**< @brief Dropped by an ingress filter */
+#define STATS_FILTERED_OUT		3	/**< @brief Dropped by an egress filter */
+#define STATS_RATE_LIMITED		4	/**< @brief Dropped by an ingress rate limit */
+#define STATS_PACKETS			5
+/** @} */
+
+/**
+ * @name Event counters
+ * @see @p stats_event()
+ * @{
+ */
+#define STATS_RUNT			0	/**< @brief Runt frames dropped */
+#define STATS_GIANT			1	/**< @brief Giant frames dropped */
+#define STATS_SEND_ERRORS		2	/**< @brief Frames that could not be sent */
+#define STATS_SCRIPTS			3	/**< @brief Scripts executed */
+#define STATS_SCRIPTS_FAILED		4	/**< @brief Scripts that failed to execute or exit cleanly */
+#define STATS_SCRIPTS_COALESCED		5	/**< @brief Script events coalesced into others */
+#define STATS_EVENTS			6
+/** @} */
+
+/**
+ * @name Histograms
+ * @see @p stats_time()
+ * @{
+ */
+#define STATS_LATENCY			0	/**< @brief Receive timestamp to send completion */
+#define STATS_SCRIPT_TIME		1	/**< @brief Script execution to exit */
+#define STATS_HISTS			2
+/** @} */
+
+/** @brief Number of EAPOL Packet Types counted, the last being any other */
+#define STATS_TYPES			10
+
+/** @brief Number of EAP Codes counted, the first (0) being any other */
+#define STATS_CODES			5
+
+/**
+ * @brief Number of buckets in a histogram
+ *
+ * Bucket 0 counts durations under 1 microsecond, and bucket @p b those from
+ * 2^(b-1) up to 2^b microseconds. The last bucket also counts anything longer,
+ * i.e. from about 4 seconds on.
+ */
+#define STATS_BUCKETS			24
+
+/** @brief A log-bucketed histogram of durations in microseconds */
+struct hist_t {
+	uint64_t bucket[STATS_BUCKETS];	/**< @brief Durations counted in each bucket */
+	uint64_t sum;			/**< @brief Sum of all durations */
+	uint64_t max;			/**< @brief Longest duration */
+};
+
+/**
+ * @brief Counters and histograms of an interface
+ *
+ * Each interface has one of these per worker, so that every counter is only
+ * ever written by one thread and no two workers share a cache line. They live
+ * in the statistics region (cf. <tt>struct stats_region_t</tt>), where they may
+ * be read at any time by other processes.
+ *
+ * Updates are bracketed by @p seq, a sequence lock: it is odd while an update
+ * is under way, and readers retry until they see the same even value before
+ * and after reading, cf. @p stats_sum().
+ *
+ * @note Made up of nothing but @p uint64_t fields, which @p stats_sum() relies
+ *       on.
+ */
+struct stats_t {
+	_Alignas(64) uint64_t seq;	/**< @brief Sequence lock */
+	uint64_t type[STATS_PACKETS][STATS_TYPES];	/**< @brief By EAPOL Packet Type */
+	uint64_t code[STATS_PACKETS][STATS_CODES];	/**< @brief By EAP Code, EAPOL-EAP only */
+	uint64_t event[STATS_EVENTS];	/**< @brief Everything else */
+	struct hist_t hist[STATS_HISTS];	/**< @brief Durations */
+};
+
+/**
+ * @name Statistics region format
+ * @see <tt>struct stats_region_t</tt>
+ * @{
+ */
+#define STATS_MAGIC			0x70656173	/**< @brief "peas" */
+#define STATS_VERSION			3	/**< @brief Bumped on any change to the layout */
+/** @} */
+
+/**
+ * @brief Attempts at reading a worker's counters consistently before giving up
+ *        on them, cf. @p stats_sum()
+ *
+ * An update takes well under a microsecond, so running out means the worker
+ * stopped halfway through one, most likely because @p peapod was killed.
+ */
+#define STATS_SPINS			(1U << 20)
+
+/** @brief An interface in the statistics region */
+struct stats_iface_t {
+	char name[IFNAMSIZ];		/**< @brief Network interface name */
+	uint32_t index;			/**< @brief Interface index */
+	uint32_t worker;		/**< @brief Worker that receives on the interface */
+};
+
+/**
+ * @brief The statistics region
+ *
+ * A file that is mapped with @p mmap(2) by @p peapod and by any process that
+ * wants to read its statistics, without either having to make a system call
+ * per read. It is laid out as follows:
+ * -# this header,
+ * -# @p iface_nr <tt>struct stats_iface_t</tt> structures, then
+ * -# at @p stats_offset, @p worker_nr <tt>struct stats_t</tt> structures per
+ *    interface, in the same order.
+ *
+ * Whenever the interfaces change, the region is replaced as a whole by a new
+ * file; a reader that keeps the file mapped sees @p replaced set in the old one.
+ */
+struct stats_region_t {
+	uint32_t magic;			/**< @brief @p STATS_MAGIC */
+	uint32_t version;		/**< @brief @p STATS_VERSION */
+	uint32_t size;			/**< @brief Size of the whole region in bytes */
+	uint32_t stats_size;		/**< @brief Size of a <tt>struct stats_t</tt> */
+	uint32_t stats_offset;		/**< @brief Offset of the first <tt>struct stats_t</tt> */
+	uint32_t iface_nr;		/**< @brief Number of interfaces */
+	uint32_t worker_nr;		/**< @brief Number of workers, main thread included */
+	uint32_t replaced;		/**< @brief Flag: Has a newer region taken the place of this one? */
+	int64_t pid;			/**< @brief Process ID of @p peapod */
+	int64_t started;		/**< @brief When @p peapod started, in seconds since the Epoch */
+	struct stats_iface_t iface[];	/**< @brief The interfaces */
+};
+
+/**
+ * @name Names of counters and histograms
+ *
+ * Types and codes are named after the config file keywords, cf.
+ * @p peapod.conf(5).
+ * @{
+ */
+static const char *const stats_type_names[STATS_TYPES] = {
+	"eap", "start", "logoff", "key", "encapsulated-asf-alert", "mka",
+	"announcement-generic", "announcement-specific", "announcement-req",
+	"other-type"
+};
+
+static const char *const stats_code_names[STATS_CODES] = {
+	"other-code", "request", "response", "success", "failure"
+};
+
+static const char *const stats_packet_names[STATS_PACKETS] = {
+	"received", "sent", "filtered-in", "filtered-out", "rate-limited"
+};
+
+static const char *const stats_event_names[STATS_EVENTS] = {
+	"runt", "giant", "send-errors", "scripts", "scripts-failed",
+	"scripts-coalesced"
+};
+
+static const char *const stats_hist_names[STATS_HISTS] = {
+	"latency-us", "script-us"
+};
+/** @} */
+
+/**
+ * @brief Sum up the counters and histograms of an interface over all workers
+ *
+ * Each set is read consistently, whatever its worker is doing at the time. A
+ * set that cannot be read so within @p STATS_SPINS attempts is stale, and left
+ * out.
+ *
+ * @param sum Pointer to a <tt>struct stats_t</tt> for the result
+ * @param stats Pointer to @p nr <tt>struct stats_t</tt> structures
+ * @param nr Number of workers
+ * @return The number of workers whose counters were left out
+ */
+static inline unsigned stats_sum(struct stats_t *sum,
+				 const struct stats_t *stats, unsigned nr)
+{
+	const unsigned words = sizeof(struct stats_t) / sizeof(uint64_t);
+	uint64_t *to = (uint64_t *)sum;
+	unsigned stale = 0;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for (unsigned w = 0; w < nr; ++w) {
+		const uint64_t *from = (const uint64_t *)&stats[w];
+		struct stats_t copy;
+		uint64_t *word = (uint64_t *)&copy;
+		uint64_t seq;
+		unsigned spins = 0;
+
+		do {
+			while ((seq = __atomic_load_n(&stats[w].seq,
+						      __ATOMIC_ACQUIRE)) & 1 &&
+			       ++spins < STATS_SPINS)
+				;
+			if (seq & 1)
+				break;
+			for (unsigned i = 1; i < words; ++i)
+				word[i] = __atomic_load_n(&from[i],
+							  __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		} while (__atomic_load_n(&stats[w].seq, __ATOMIC_RELAXED) != seq &&
+			 ++spins < STATS_SPINS);
+
+		if (spins >= STATS_SPINS) {
+			++stale;
+			continue;
+		}
+
+		uint64_t max[STATS_HISTS];
+		for (int h = 0; h < STATS_HISTS; ++h)
+			max[h] = sum->hist[h].max < copy.hist[h].max ?
+				 copy.hist[h].max : sum->hist[h].max;
+		for (unsigned i = 1; i < words; ++i)
+			to[i] += word[i];
+		for (int h = 0; h < STATS_HISTS; ++h)
+			sum->hist[h].max = max[h];
+	}
+	sum->seq = 0;
+
+	return stale;
+}
+
+void stats_ifaces(struct iface_t *ifaces, unsigned nr);
+void stats_thread(unsigned id);
+void stats_packet(struct iface_t *iface, unsigned what, uint8_t type,
+		  uint8_t code);
+void stats_event(struct iface_t *iface, unsigned what);
+void stats_time(struct iface_t *iface, unsigned what, uint64_t usec);
+void stats_dump(struct iface_t *ifaces);
@@ -0,0 +1,91 @@
+/**
+ * @file trace.h
+ * @brief Function prototypes for @p trace.c, trace file format
+ */
+#pragma once
+
+#include <stdint.h>
+#include "packet.h"
+
+/**
+ * @name Trace file format
+ * @see <tt>struct trace_region_t</tt>
+ * @{
+ */
+#define TRACE_MAGIC			0x70656174	/**< @brief "peat" */
+#define TRACE_VERSION			2	/**< @brief Bumped on any change to the layout */
+#define TRACE_RECORDS			65536	/**< @brief Records in a trace file, a power of 2 */
+#define TRACE_RECSIZ			128	/**< @brief Size of a record */
+#define TRACE_IFACES			256	/**< @brief Interfaces that may be named in a trace file */
+/** @} */
+
+/**
+ * @name Trace record directions
+ * @see The @p dir field of <tt>struct trace_rec_t</tt>
+ * @{
+ */
+#define TRACE_RECV			0	/**< @brief Received */
+#define TRACE_SEND			1	/**< @brief Sent */
+/** @} */
+
+/**
+ * @brief A packet received or sent, as recorded in a trace file
+ *
+ * Holds everything @p decode_frame() and @p decode_hex() need, the Ethernet
+ * header having been split off as a <tt>struct peapod_packet</tt> has it, and
+ * the start of the EAPOL MPDU.
+ */
+struct trace_rec_t {
+	/**
+	 * @brief Number of the record plus 1
+	 *
+	 * Written last, after being cleared first, so that a record that is
+	 * still being written or was overwritten doesn't match its number.
+	 */
+	uint64_t seq;
+	int64_t sec;			/**< @brief Packet timestamp, seconds */
+	uint32_t nsec;			/**< @brief Packet timestamp, nanoseconds */
+	uint32_t index;			/**< @brief Interface index */
+	uint16_t len;			/**< @brief Length of the packet */
+	uint16_t tci;			/**< @brief 802.1Q TCI, if @p vlan_valid */
+	uint8_t vlan_valid;		/**< @brief Flag: 802.1Q tag present? */
+	uint8_t dir;			/**< @brief @p TRACE_RECV or @p TRACE_SEND */
+	uint8_t caplen;			/**< @brief Length of @p mpdu captured */
+	uint8_t pad;			/**< @brief Unused */
+	uint8_t h_dest[ETH_ALEN];	/**< @brief Destination MAC address */
+	uint8_t h_source[ETH_ALEN];	/**< @brief Source MAC address */
+	/** @brief Start of the EAPOL MPDU */
+	uint8_t mpdu[TRACE_RECSIZ - 44];
+};
+
+/** @brief An interface named in a trace file */
+struct trace_iface_t {
+	char name[IFNAMSIZ];		/**< @brief Network interface name */
+	uint32_t index;			/**< @brief Interface index */
+};
+
+/**
+ * @brief A trace file
+ *
+ * A file of fixed size, mapped with @p mmap(2), in which @p TRACE_RECORDS
+ * records are kept in a ring: record @p n lives at <tt>n % nr</tt>, and the
+ * @p nr records up to @p head are the latest. The file is laid out as follows:
+ * -# this header, then
+ * -# at @p rec_offset, the records.
+ *
+ * Every interface ever configured while tracing is named in @p iface, up to
+ * @p TRACE_IFACES, so that the file can be read after @p peapod has exited.
+ */
+struct trace_region_t {
+	uint32_t magic;			/**< @brief @p TRACE_MAGIC */
+	uint32_t version;		/**< @brief @p TRACE_VERSION */
+	uint32_t rec_size;		/**< @brief Size of a <tt>struct trace_rec_t</tt> */
+	uint32_t rec_offset;		/**< @brief Offset of the first record */
+	uint32_t nr;			/**< @brief Number of records, a power of 2 */
+	uint32_t iface_nr;		/**< @brief Number of interfaces named */
+	struct trace_iface_t iface[TRACE_IFACES];	/**< @brief The interfaces */
+	_Alignas(64) uint64_t head;	/**< @brief Records written so far */
+};
+
+void trace_ifaces(struct iface_t *ifaces);
+int trace_packet(const struct peapod_packet *packet);
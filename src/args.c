@@ -17,7 +17,7 @@
 static void print_args(void);
 
 /** @brief An optstring for @p getopt(3) */
-static char *opts = ":hdp:c:tl::svCo";
+static char *opts = ":hdp:c:tl::S::T::r:w:nsavCo";
 
 /**
  * @brief An array of <tt>struct option</tt> structures for @p getopt_long(3)
@@ -29,7 +29,13 @@ static struct option long_opts[] = {
 	{ "config", required_argument, NULL, 'c' },
 	{ "test", no_argument, NULL, 't' },
 	{ "log", optional_argument, NULL, 'l' },
+	{ "stats", optional_argument, NULL, 'S' },
+	{ "trace", optional_argument, NULL, 'T' },
+	{ "replay", required_argument, NULL, 'r' },
+	{ "out", required_argument, NULL, 'w' },
+	{ "no-exec", no_argument, NULL, 'n' },
 	{ "syslog", no_argument, NULL, 's' },
+	{ "async-log", no_argument, NULL, 'a' },
 	/* verbosity is not a long option */
 	{ "quiet-script", no_argument, NULL, 'q' },
 	{ "color", no_argument, NULL, 'C' },
@@ -53,7 +59,13 @@ static void print_args(void) {
 	debuglow("\t\ttest=%u", args.test);
 	debuglow("\t\tlevel=%u", args.level);
 	debuglow("\t\tlogfile='%s'", args.logfile);
+	debuglow("\t\tstatsfile='%s'", args.statsfile);
+	debuglow("\t\ttracefile='%s'", args.tracefile);
+	debuglow("\t\treplay='%s'", args.replay);
+	debuglow("\t\treplay_out='%s'", args.replay_out);
+	debuglow("\t\tnoexec=%u", args.noexec);
 	debuglow("\t\tsyslog=%u", args.syslog);
+	debuglow("\t\tasync=%u", args.async);
 	debuglow("\t\tcolor=%u", args.color);
 	debuglow("\t\tquiet=%u", args.quiet);
 	debuglow("\t\toneshot=%u", args.oneshot);
@@ -143,9 +155,45 @@ int args_get(int argc, char* argv[]) {
 			if ((args.logfile = args_canonpath(optarg, 1)) == NULL)
 				goto abort_path;
 			break;
+		case 'S':
+			/* As for -l */
+			if (optarg == NULL && optind < argc &&
+			    argv[optind] != NULL && argv[optind][0] != '\0' &&
+			    argv[optind][0] != '-')
+				optarg = argv[optind++];
+			if (optarg == NULL)
+				optarg = PEAPOD_STATS_PATH;
+			if ((args.statsfile = args_canonpath(optarg, 1)) == NULL)
+				goto abort_path;
+			break;
+		case 'T':
+			/* As for -l */
+			if (optarg == NULL && optind < argc &&
+			    argv[optind] != NULL && argv[optind][0] != '\0' &&
+			    argv[optind][0] != '-')
+				optarg = argv[optind++];
+			if (optarg == NULL)
+				optarg = PEAPOD_TRACE_PATH;
+			if ((args.tracefile = args_canonpath(optarg, 1)) == NULL)
+				goto abort_path;
+			break;
+		case 'r':
+			if ((args.replay = args_canonpath(optarg, 0)) == NULL)
+				goto abort_path;
+			break;
+		case 'w':
+			if ((args.replay_out = args_canonpath(optarg, 1)) == NULL)
+				goto abort_path;
+			break;
+		case 'n':
+			args.noexec = 1;
+			break;
 		case 's':
 			args.syslog = 1;
 			break;
+		case 'a':
+			args.async = 1;
+			break;
 		case 'v':
 			if (args.level < 3)
 				++args.level;
@@ -188,6 +236,16 @@ abort_mandatory:
 		return -1;
 	}
 
+	if (args.replay_out != NULL && args.replay == NULL) {
+		cerr("option -w requires -r\n");
+		return -1;
+	}
+
+	if (args.replay != NULL && args.daemon == 1) {
+		cerr("cannot replay a capture file as a daemon\n");
+		return -1;
+	}
+
 	if (args.daemon == 1 && args.pidfile == NULL &&
 	    (args.pidfile = args_canonpath(PEAPOD_PID_PATH, 1)) == NULL) {
 		ceerr("cannot use path '%s': %s\n", PEAPOD_PID_PATH);
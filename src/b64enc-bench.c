@@ -0,0 +1,257 @@
+/**
+ * @file b64enc-bench.c
+ * @brief Check and time the Base64 encoder kernels
+ *
+ * Encodes with each kernel this CPU supports, cf. @p b64enc_kernel(), and
+ * compares the result with that of the scalar encoder @p b64enc_to() replaced,
+ * kept here as @p reference():
+ *
+ * - for every input length up to @p CHECK_MAX_LEN, at every misalignment of
+ *   the input up to @p CHECK_ALIGN, checking that the output is the same, and
+ *   that nothing is written past its end; then
+ * - for each of @p sizes, timing each, and checking the output once more.
+ *
+ * Prints one line of results per size, as pairs of kernel names and
+ * nanoseconds per encoding, e.g.
+ * @code
+ *   1400 bytes: reference 1558.0 scalar 1532.4 ssse3 236.1 avx2 133.0
+ * @endcode
+ * and exits with status 1 if any output differs.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "b64enc.h"
+
+/** @brief Longest input checked, enough for every kernel to loop many times */
+#define CHECK_MAX_LEN			2048
+
+/** @brief Misalignments of the input checked */
+#define CHECK_ALIGN			16
+
+/** @brief What the output buffer is filled with past where it should end */
+#define CHECK_CANARY			0x7f
+
+/** @brief Bytes of input encoded per timing run, in total */
+#define BENCH_BYTES			(16U << 20)
+
+/** @brief Timing runs per kernel and size, of which the fastest counts */
+#define BENCH_RUNS			5
+
+/** @brief Most kernels there may be, cf. @p b64enc_kernel() */
+#define BENCH_KERNELS			8
+
+static char *reference(const uint8_t *in, size_t len);
+static int check(unsigned k, const char *name, const uint8_t *in);
+static double time_reference(const uint8_t *in, size_t len);
+static double time_kernel(char *out, const uint8_t *in, size_t len);
+static uint64_t now_ns(void);
+
+/** @brief Input sizes timed: an EAP-TLS fragment in a full frame, and smaller */
+static const size_t sizes[] = { 1400, 512, 128, 36 };
+
+/** @brief Base64 index table. */
+static const char b64[64] = {
+	'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
+	'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
+	'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
+	'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
+	'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',
+	'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
+	'w', 'x', 'y', 'z', '0', '1', '2', '3',
+	'4', '5', '6', '7', '8', '9', '+', '/'
+};
+
+/**
+ * @brief The scalar Base64 encoder, as it was before @p b64enc_to()
+ *
+ * @param in Data to be Base64-encoded
+ * @param len The length of @p in
+ * @return A newly allocated C string with the Base64-encoded contents of @p in
+ *         if successful, or @p NULL if unsuccessful
+ * @note If successful, caller is responsible for <tt>free(3)</tt>ing the result
+ */
+static char *reference(const uint8_t *in, size_t len)
+{
+	char *ret = malloc(b64len(len));
+	if (ret == NULL)
+		return NULL;
+
+	size_t i = 0;
+	size_t j = 0;
+	for (; j + 2 < len; j += 3) {
+		ret[i++] = b64[in[j] >> 2];
+		ret[i++] = b64[(in[j] & 0x3) << 4 | (in[j + 1] & 0xf0) >> 4];
+		ret[i++] = b64[(in[j + 1] & 0xf) << 2 |
+			       (in[j + 2] & 0xc0) >> 6];
+		ret[i++] = b64[in[j + 2] & 0x3f];
+	}
+	if (len - j == 1) {
+		ret[i++] = b64[in[j] >> 2];
+		ret[i++] = b64[(in[j] & 0x3) << 4];
+		ret[i++] = '=';
+		ret[i++] = '=';
+	} else if (len - j == 2) {
+		ret[i++] = b64[in[j] >> 2];
+		ret[i++] = b64[(in[j] & 0x3) << 4 | (in[j + 1] & 0xf0) >> 4];
+		ret[i++] = b64[(in[j + 1] & 0xf) << 2];
+		ret[i++] = '=';
+	}
+	ret[i] = '\0';
+
+	return ret;
+}
+
+/**
+ * @brief Check the kernel in use against @p reference() for every length and
+ *        misalignment of input
+ * @param k Number of the kernel, cf. @p b64enc_kernel()
+ * @param name Name of the kernel
+ * @param in Input of at least <tt>CHECK_MAX_LEN + CHECK_ALIGN</tt> bytes
+ * @return 0 if the output is always the same, or -1 if not
+ */
+static int check(unsigned k, const char *name, const uint8_t *in)
+{
+	static char out[b64len(CHECK_MAX_LEN) + 64];
+
+	for (size_t a = 0; a < CHECK_ALIGN; ++a) {
+		for (size_t len = 0; len <= CHECK_MAX_LEN; ++len) {
+			char *want = reference(in + a, len);
+			if (want == NULL) {
+				perror("cannot allocate memory");
+				exit(1);
+			}
+			size_t want_len = strlen(want);
+
+			memset(out, CHECK_CANARY, sizeof(out));
+			size_t got_len = b64enc_to(out, in + a, len);
+
+			int ok = got_len == want_len &&
+				 memcmp(out, want, want_len + 1) == 0;
+			for (size_t i = want_len + 1; ok && i < sizeof(out); ++i)
+				ok = out[i] == CHECK_CANARY;
+			free(want);
+
+			if (!ok) {
+				fprintf(stderr, "kernel %u (%s) differs from reference for %zu bytes at offset %zu\n",
+					k, name, len, a);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Get the current time
+ * @return Nanoseconds on @p CLOCK_MONOTONIC
+ */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Time @p reference()
+ * @param in Data to be Base64-encoded
+ * @param len The length of @p in
+ * @return The fastest of @p BENCH_RUNS runs, in nanoseconds per encoding
+ */
+static double time_reference(const uint8_t *in, size_t len)
+{
+	size_t iterations = BENCH_BYTES / len;
+	uint64_t best = UINT64_MAX;
+
+	for (int r = 0; r < BENCH_RUNS; ++r) {
+		uint64_t start = now_ns();
+		for (size_t i = 0; i < iterations; ++i) {
+			char *out = reference(in, len);
+			/* keep the encoding from being optimized out */
+			__asm__ volatile("" : : "r"(out) : "memory");
+			free(out);
+		}
+		uint64_t elapsed = now_ns() - start;
+		if (elapsed < best)
+			best = elapsed;
+	}
+	return (double)best / iterations;
+}
+
+/**
+ * @brief Time @p b64enc_to() with the kernel in use
+ * @param out Buffer of at least <tt>b64len(len)</tt> bytes
+ * @param in Data to be Base64-encoded
+ * @param len The length of @p in
+ * @return The fastest of @p BENCH_RUNS runs, in nanoseconds per encoding
+ */
+static double time_kernel(char *out, const uint8_t *in, size_t len)
+{
+	size_t iterations = BENCH_BYTES / len;
+	uint64_t best = UINT64_MAX;
+
+	for (int r = 0; r < BENCH_RUNS; ++r) {
+		uint64_t start = now_ns();
+		for (size_t i = 0; i < iterations; ++i) {
+			b64enc_to(out, in, len);
+			__asm__ volatile("" : : "r"(out) : "memory");
+		}
+		uint64_t elapsed = now_ns() - start;
+		if (elapsed < best)
+			best = elapsed;
+	}
+	return (double)best / iterations;
+}
+
+/**
+ * @brief Main function
+ * @return 0 if every kernel encodes just like @p reference(), or 1 if not
+ */
+int main(void)
+{
+	static uint8_t in[CHECK_MAX_LEN + CHECK_ALIGN];
+	static char out[b64len(CHECK_MAX_LEN)];
+	const char *names[BENCH_KERNELS];
+	unsigned nr = 0;
+
+	srand(1);
+	for (size_t i = 0; i < sizeof(in); ++i)
+		in[i] = rand();
+
+	while (nr < BENCH_KERNELS && (names[nr] = b64enc_kernel(nr)) != NULL) {
+		if (check(nr, names[nr], in) == -1)
+			return 1;
+		++nr;
+	}
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); ++s) {
+		size_t len = sizes[s];
+		char *want = reference(in, len);
+		if (want == NULL) {
+			perror("cannot allocate memory");
+			return 1;
+		}
+
+		printf("%zu bytes: reference %.1f", len,
+		       time_reference(in, len));
+		for (unsigned k = 0; k < nr; ++k) {
+			b64enc_kernel(k);
+			double ns = time_kernel(out, in, len);
+			if (strcmp(out, want) != 0) {
+				fprintf(stderr, "\nkernel %u (%s) differs from reference for %zu bytes\n",
+					k, names[k], len);
+				free(want);
+				return 1;
+			}
+			printf(" %s %.1f", names[k], ns);
+		}
+		printf("\n");
+		free(want);
+	}
+
+	return 0;
+}
@@ -1,15 +1,39 @@
 /**
  * @file b64enc.c
  * @brief Base64 encoder
+ *
+ * Bulk input is encoded by a SIMD kernel where the CPU has one (AVX2 or SSSE3
+ * on x86, NEON on AArch64) and whatever is left over by the scalar loop. The
+ * x86 kernel is chosen once, at startup, according to what the CPU supports.
+ *
+ * @see Wojciech Muła, Daniel Lemire, "Faster Base64 Encoding and Decoding
+ *      Using AVX2 Instructions", ACM Transactions on the Web 12(3), 2018
  */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define B64ENC_X86
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define B64ENC_NEON
+#endif
 
 #include "b64enc.h"
 
 /**
- * @brief The length of the resulting Base64-encoded string, including the null
- *        terminator, from an input of length @p len
+ * @brief Encode as many whole 3-byte groups at the start of the input as the
+ *        kernel handles at once
+ * @return The number of bytes of input encoded, always a multiple of 3
  */
-#define b64len(len) (4 * ((len) / 3) + 5)
+typedef size_t (*kernel_fn)(char *out, const uint8_t *in, size_t len);
+
+static size_t kernel_none(char *out, const uint8_t *in, size_t len);
+#ifdef B64ENC_X86
+static size_t kernel_ssse3(char *out, const uint8_t *in, size_t len);
+static size_t kernel_avx2(char *out, const uint8_t *in, size_t len);
+static void kernel_init(void);
+#elif defined(B64ENC_NEON)
+static size_t kernel_neon(char *out, const uint8_t *in, size_t len);
+#endif
 
 /** @brief Base64 index table. */
 static const char b64[64] = {
@@ -23,23 +47,239 @@ static const char b64[64] = {
 	'4', '5', '6', '7', '8', '9', '+', '/'
 };
 
+#ifdef B64ENC_NEON
+static kernel_fn kernel = kernel_neon;	/* NEON is baseline on AArch64 */
+#else
+static kernel_fn kernel = kernel_none;	/**< @brief Set by @p kernel_init() */
+#endif
+
+/** @brief The scalar fallback, which leaves everything to @p b64enc_to() */
+static size_t kernel_none(char *out, const uint8_t *in, size_t len)
+{
+	(void)out;
+	(void)in;
+	(void)len;
+	return 0;
+}
+
+#ifdef B64ENC_X86
+/** @brief Offsets from index to character, cf. @p translate128() */
+#define LUT_OFFSETS							\
+	'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,	\
+	'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,	\
+	'/' - 63, 'A', 0, 0
+
+/** @brief Byte shuffle feeding @p split128() from 12 contiguous input bytes */
+#define SHUF_SPLIT							\
+	1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10
+
 /**
- * @brief Base64 encoder
+ * @brief Split each group of 3 bytes into 4 indices into @p b64
+ *
+ * Each 32-bit lane of @p v must hold bytes 1, 0, 2, and 1 of a group, in that
+ * order. Multiplication by powers of two stands in for the per-lane variable
+ * shifts that SSE lacks.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i split128(__m128i v)
+{
+	__m128i hi = _mm_mulhi_epu16(_mm_and_si128(v,
+					_mm_set1_epi32(0x0fc0fc00)),
+				     _mm_set1_epi32(0x04000040));
+	__m128i lo = _mm_mullo_epi16(_mm_and_si128(v,
+					_mm_set1_epi32(0x003f03f0)),
+				     _mm_set1_epi32(0x01000010));
+	return _mm_or_si128(hi, lo);
+}
+
+/**
+ * @brief Translate each index into @p b64 to its character
+ *
+ * Indices are sorted into the five ranges of @p b64 (A-Z, a-z, 0-9, +, /), and
+ * each range is offset by a constant looked up with a byte shuffle.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i translate128(__m128i v, __m128i lut)
+{
+	__m128i range = _mm_or_si128(_mm_subs_epu8(v, _mm_set1_epi8(51)),
+				     _mm_and_si128(_mm_cmpgt_epi8(
+						_mm_set1_epi8(26), v),
+						   _mm_set1_epi8(13)));
+	return _mm_add_epi8(v, _mm_shuffle_epi8(lut, range));
+}
+
+/** @brief @p split128() for both 128-bit lanes */
+__attribute__((target("avx2")))
+static inline __m256i split256(__m256i v)
+{
+	__m256i hi = _mm256_mulhi_epu16(_mm256_and_si256(v,
+					_mm256_set1_epi32(0x0fc0fc00)),
+					_mm256_set1_epi32(0x04000040));
+	__m256i lo = _mm256_mullo_epi16(_mm256_and_si256(v,
+					_mm256_set1_epi32(0x003f03f0)),
+					_mm256_set1_epi32(0x01000010));
+	return _mm256_or_si256(hi, lo);
+}
+
+/** @brief @p translate128() for both 128-bit lanes */
+__attribute__((target("avx2")))
+static inline __m256i translate256(__m256i v, __m256i lut)
+{
+	__m256i range = _mm256_or_si256(
+		_mm256_subs_epu8(v, _mm256_set1_epi8(51)),
+		_mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), v),
+				 _mm256_set1_epi8(13)));
+	return _mm256_add_epi8(v, _mm256_shuffle_epi8(lut, range));
+}
+
+/**
+ * @brief SSSE3 kernel: 12 bytes of input to 16 characters per iteration
  *
+ * Loads 16 bytes at a time, so stops while at least 4 bytes of input remain.
+ */
+__attribute__((target("ssse3")))
+static size_t kernel_ssse3(char *out, const uint8_t *in, size_t len)
+{
+	const __m128i shuf = _mm_setr_epi8(SHUF_SPLIT);
+	const __m128i lut = _mm_setr_epi8(LUT_OFFSETS);
+
+	size_t j = 0;
+	for (; j + 16 <= len; j += 12, out += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + j));
+		v = translate128(split128(_mm_shuffle_epi8(v, shuf)), lut);
+		_mm_storeu_si128((__m128i *)out, v);
+	}
+	return j;
+}
+
+/**
+ * @brief AVX2 kernel: 24 bytes of input to 32 characters per iteration
+ *
+ * Each 128-bit lane is fed 12 bytes as in @p kernel_ssse3(), which then
+ * finishes off whatever it can of the rest.
+ */
+__attribute__((target("avx2")))
+static size_t kernel_avx2(char *out, const uint8_t *in, size_t len)
+{
+	const __m256i shuf = _mm256_setr_epi8(SHUF_SPLIT, SHUF_SPLIT);
+	const __m256i lut = _mm256_setr_epi8(LUT_OFFSETS, LUT_OFFSETS);
+
+	size_t j = 0;
+	for (; j + 28 <= len; j += 24, out += 32) {
+		__m256i v = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(
+				_mm_loadu_si128((const __m128i *)(in + j))),
+			_mm_loadu_si128((const __m128i *)(in + j + 12)), 1);
+		v = translate256(split256(_mm256_shuffle_epi8(v, shuf)), lut);
+		_mm256_storeu_si256((__m256i *)out, v);
+	}
+	return j + kernel_ssse3(out, in + j, len - j);
+}
+
+/** @brief Pick the widest kernel this CPU supports */
+__attribute__((constructor))
+static void kernel_init(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		kernel = kernel_avx2;
+	else if (__builtin_cpu_supports("ssse3"))
+		kernel = kernel_ssse3;
+}
+#elif defined(B64ENC_NEON)
+/**
+ * @brief NEON kernel: 48 bytes of input to 64 characters per iteration
+ *
+ * De-interleaving loads and interleaving stores do the shuffling, and a single
+ * 64-byte table lookup does the translating.
+ */
+static size_t kernel_neon(char *out, const uint8_t *in, size_t len)
+{
+	const uint8x16x4_t lut = {{
+		vld1q_u8((const uint8_t *)b64),
+		vld1q_u8((const uint8_t *)b64 + 16),
+		vld1q_u8((const uint8_t *)b64 + 32),
+		vld1q_u8((const uint8_t *)b64 + 48)
+	}};
+	const uint8x16_t mask = vdupq_n_u8(0x3f);
+
+	size_t j = 0;
+	for (; j + 48 <= len; j += 48, out += 64) {
+		uint8x16x3_t v = vld3q_u8(in + j);
+		uint8x16x4_t r;
+
+		r.val[0] = vshrq_n_u8(v.val[0], 2);
+		r.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(v.val[0], 4),
+					     vshrq_n_u8(v.val[1], 4)), mask);
+		r.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(v.val[1], 2),
+					     vshrq_n_u8(v.val[2], 6)), mask);
+		r.val[3] = vandq_u8(v.val[2], mask);
+
+		for (int k = 0; k < 4; ++k)
+			r.val[k] = vqtbl4q_u8(lut, r.val[k]);
+
+		vst4q_u8((uint8_t *)out, r);
+	}
+	return j;
+}
+#endif
+
+/**
+ * @brief Use the @p n th of the kernels this CPU supports from now on
+ *
+ * Kernels are numbered from 0, the scalar fallback, up to the widest, which is
+ * the one used by default. Meant for comparing them, cf. @p b64enc-bench.c.
+ *
+ * @param n Number of the kernel
+ * @return The name of the kernel, or @p NULL if there are not that many, in
+ *         which case the kernel in use is left as it is
+ */
+const char *b64enc_kernel(unsigned n)
+{
+	struct {
+		const char *name;
+		kernel_fn fn;
+	} usable[3];
+	unsigned nr = 0;
+
+	usable[nr].name = "scalar";
+	usable[nr++].fn = kernel_none;
+#ifdef B64ENC_X86
+	if (__builtin_cpu_supports("ssse3")) {
+		usable[nr].name = "ssse3";
+		usable[nr++].fn = kernel_ssse3;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		usable[nr].name = "avx2";
+		usable[nr++].fn = kernel_avx2;
+	}
+#elif defined(B64ENC_NEON)
+	usable[nr].name = "neon";
+	usable[nr++].fn = kernel_neon;
+#endif
+
+	if (n >= nr)
+		return NULL;
+
+	kernel = usable[n].fn;
+	return usable[n].name;
+}
+
+/**
+ * @brief Base64 encoder, into a caller-provided buffer
+ *
+ * @param out Buffer of at least <tt>b64len(len)</tt> bytes
  * @param in Data to be Base64-encoded
  * @param len The length of @p in
- * @return A newly allocated C string with the Base64-encoded contents of @p in
- *         if successful, or @p NULL if unsuccessful
- * @note If successful, caller is responsible for <tt>free(3)</tt>ing the result
+ * @return The length of the resulting C string written to @p out, not
+ *         including the null terminator
  */
-char *b64enc(const uint8_t *in, size_t len)
+size_t b64enc_to(char *out, const uint8_t *in, size_t len)
 {
-	char *ret = malloc(b64len(len));
-	if (ret == NULL)
-		return NULL;
+	char *ret = out;
 
-	size_t i = 0;
-	size_t j = 0;
+	size_t j = kernel(ret, in, len);
+	size_t i = j / 3 * 4;
 	for (; j + 2 < len; j += 3) {
 		ret[i++] = b64[in[j] >> 2];
 		ret[i++] = b64[(in[j] & 0x3) << 4 | (in[j + 1] & 0xf0) >> 4];
@@ -60,5 +300,5 @@ char *b64enc(const uint8_t *in, size_t len)
 	}
 	ret[i] = '\0';
 
-	return ret;
+	return i;
 }
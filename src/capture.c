@@ -0,0 +1,690 @@
+/**
+ * @file capture.c
+ * @brief Native pcapng capture
+ *
+ * An interface with @p capture in its @p ingress or @p egress stanza has the
+ * packets it receives or sends written to a pcapng file, with no script in
+ * between. Each file has one section, naming the interface, followed by an
+ * Enhanced Packet Block per packet, whose data is written straight out of the
+ * receive buffer. Received packets are captured as they were received; sent
+ * packets are captured with the 802.1Q tag they were sent with, and a comment
+ * naming the interface they were received on and the tag they were received
+ * with.
+ *
+ * Output is either buffered and flushed at most once per second, or written
+ * into the file through @p mmap(2), which then grows by @p CAPTURE_MMAP_CHUNK
+ * at a time and is truncated to size when it is closed.
+ *
+ * @see The PCAP Next Generation (pcapng) Capture File Format,
+ *      draft-ietf-opsawg-pcapng
+ */
+#define _GNU_SOURCE			/* fwrite_unlocked(3) */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "capture.h"
+#include "defaults.h"
+#include "log.h"
+
+/** @brief Size of the buffer of a capture file without @p mmap */
+#define CAPTURE_BUFSIZ			65536
+
+/** @brief Attempts at finding an unused name for a rotated capture file */
+#define CAPTURE_RENAME_ATTEMPTS		100
+
+/**
+ * @name pcapng block types, option codes and values
+ * @{
+ */
+#define PCAPNG_SHB			0x0a0d0d0a	/**< @brief Section Header Block */
+#define PCAPNG_IDB			0x00000001	/**< @brief Interface Description Block */
+#define PCAPNG_EPB			0x00000006	/**< @brief Enhanced Packet Block */
+#define PCAPNG_BYTE_ORDER		0x1a2b3c4d	/**< @brief Byte-order magic, in host order */
+#define PCAPNG_OPT_END			0	/**< @brief @p opt_endofopt */
+#define PCAPNG_OPT_COMMENT		1	/**< @brief @p opt_comment */
+#define PCAPNG_SHB_USERAPPL		4	/**< @brief @p shb_userappl */
+#define PCAPNG_IF_NAME			2	/**< @brief @p if_name */
+#define PCAPNG_IF_TSRESOL		9	/**< @brief @p if_tsresol */
+#define PCAPNG_EPB_FLAGS		2	/**< @brief @p epb_flags */
+#define PCAPNG_LINKTYPE_ETHERNET	1	/**< @brief @p LINKTYPE_ETHERNET */
+/** @} */
+
+/** @brief Round a length up to the 32-bit boundary pcapng pads everything to */
+#define PCAPNG_PAD(len)			(((len) + 3) & ~(size_t)3)
+
+/**
+ * @brief An open capture file
+ *
+ * Any worker may send on an interface, so sent packets may be captured by any
+ * of them; received packets only ever are by the worker of the interface.
+ * Either way, a capture file is written under its lock.
+ *
+ * @see The @p file field of <tt>struct capture_t</tt>
+ */
+struct capfile_t {
+	pthread_mutex_t lock;		/**< @brief Held while writing */
+	char *path;			/**< @brief As given by <tt>struct capture_t</tt> */
+	char name[IFNAMSIZ];		/**< @brief Interface named in each section */
+	uint64_t limit;			/**< @brief Rotate after this many bytes, or 0 */
+	unsigned interval;		/**< @brief Rotate after this many seconds, or 0 */
+	uint8_t mmap;			/**< @brief Flag: Write through @p mmap(2)? */
+	int fd;				/**< @brief The file, or -1 if writing it failed */
+	FILE *fp;			/**< @brief Buffer for @p fd, without @p mmap */
+	uint8_t *map;			/**< @brief Chunk of @p fd mapped at @p base, with @p mmap */
+	uint64_t base;			/**< @brief Offset of @p map in @p fd */
+	uint64_t len;			/**< @brief Bytes written to @p fd */
+	unsigned long packets;		/**< @brief Packets written to @p fd */
+	time_t started;			/**< @brief When @p fd was started */
+	time_t flushed;			/**< @brief When @p fp was last flushed */
+	struct capfile_t *next;		/**< @brief Next open capture file */
+};
+
+static size_t put_opt(uint8_t *buf, uint16_t code, const void *val,
+		      uint16_t len);
+static int cap_write(struct capfile_t *f, const void *data, size_t len);
+static int cap_start(struct capfile_t *f, time_t now);
+static int cap_finish(struct capfile_t *f);
+static int cap_rename(const char *path, time_t started);
+static int cap_rotate(struct capfile_t *f, time_t now);
+static void cap_fail(struct capfile_t *f);
+static struct capfile_t *cap_take(struct iface_t *old, const char *path,
+				  const char *name);
+static void cap_open(struct capture_t *capture, const char *name,
+		     struct iface_t *old);
+static void cap_free(struct capfile_t *f);
+static void capture_stop(void);
+
+/** @brief All open capture files, cf. @p capture_stop() */
+static struct capfile_t *capfiles = NULL;
+
+/**
+ * @brief Append a pcapng option to a buffer
+ * @param buf Where to put the option
+ * @param code Option code
+ * @param val Option value
+ * @param len Length of @p val
+ * @return Length of the option, padding included
+ */
+static size_t put_opt(uint8_t *buf, uint16_t code, const void *val,
+		      uint16_t len)
+{
+	memcpy(buf, &code, sizeof(code));
+	memcpy(buf + sizeof(code), &len, sizeof(len));
+	memcpy(buf + sizeof(code) + sizeof(len), val, len);
+	memset(buf + sizeof(code) + sizeof(len) + len, 0,
+	       PCAPNG_PAD(len) - len);
+
+	return sizeof(code) + sizeof(len) + PCAPNG_PAD(len);
+}
+
+/**
+ * @brief Build a Section Header Block
+ * @param buf Where to put it, at least @p CAPTURE_BLOCK_MAX bytes
+ * @return Length of the block
+ */
+size_t capture_shb(uint8_t *buf)
+{
+	uint32_t u32;
+	size_t len = 0;
+
+	u32 = PCAPNG_SHB;
+	memcpy(buf + len, &u32, sizeof(u32));
+	len += 2 * sizeof(u32);			/* Block Total Length, below */
+	u32 = PCAPNG_BYTE_ORDER;
+	memcpy(buf + len, &u32, sizeof(u32));
+	len += sizeof(u32);
+	uint16_t ver[2] = { 1, 0 };
+	memcpy(buf + len, ver, sizeof(ver));
+	len += sizeof(ver);
+	int64_t section_len = -1;		/* Not specified */
+	memcpy(buf + len, &section_len, sizeof(section_len));
+	len += sizeof(section_len);
+	const char *appl = PEAPOD_PROGRAM " " PEAPOD_VERSION;
+	len += put_opt(buf + len, PCAPNG_SHB_USERAPPL, appl, strlen(appl));
+	len += put_opt(buf + len, PCAPNG_OPT_END, NULL, 0);
+	u32 = len + sizeof(u32);
+	memcpy(buf + sizeof(u32), &u32, sizeof(u32));
+	memcpy(buf + len, &u32, sizeof(u32));
+
+	return len + sizeof(u32);
+}
+
+/**
+ * @brief Build an Interface Description Block for an Ethernet interface, with
+ *        timestamps in nanoseconds
+ * @param buf Where to put it, at least @p CAPTURE_BLOCK_MAX bytes
+ * @param name Name of the interface
+ * @return Length of the block
+ */
+size_t capture_idb(uint8_t *buf, const char *name)
+{
+	uint32_t u32;
+	size_t len = 0;
+
+	u32 = PCAPNG_IDB;
+	memcpy(buf + len, &u32, sizeof(u32));
+	len += 2 * sizeof(u32);
+	uint16_t linktype[2] = { PCAPNG_LINKTYPE_ETHERNET, 0 };
+	memcpy(buf + len, linktype, sizeof(linktype));
+	len += sizeof(linktype);
+	u32 = 0;				/* SnapLen: none */
+	memcpy(buf + len, &u32, sizeof(u32));
+	len += sizeof(u32);
+	len += put_opt(buf + len, PCAPNG_IF_NAME, name, strnlen(name, IFNAMSIZ));
+	uint8_t tsresol = 9;			/* Nanoseconds */
+	len += put_opt(buf + len, PCAPNG_IF_TSRESOL, &tsresol, 1);
+	len += put_opt(buf + len, PCAPNG_OPT_END, NULL, 0);
+	u32 = len + sizeof(u32);
+	memcpy(buf + sizeof(u32), &u32, sizeof(u32));
+	memcpy(buf + len, &u32, sizeof(u32));
+
+	return len + sizeof(u32);
+}
+
+/**
+ * @brief Build an Enhanced Packet Block, less the packet data
+ *
+ * The block is written as @p hdr, then the packet data padded to 32 bits, then
+ * @p opts, then the second copy of its length, which is in bytes 4:7 of
+ * @p hdr.
+ *
+ * @param hdr Where to put the start of the block, @p CAPTURE_EPB_HDR bytes
+ * @param opts Where to put its options, at least @p CAPTURE_BLOCK_MAX bytes
+ * @param id Interface ID, i.e. which Interface Description Block it follows
+ * @param ts When the packet was received or sent
+ * @param caplen Length of the packet data
+ * @param dir @p CAPTURE_IN or @p CAPTURE_OUT
+ * @param comment A comment on the packet, or @p NULL
+ * @return Length of the options
+ */
+size_t capture_epb(uint8_t *hdr, uint8_t *opts, uint32_t id,
+		   struct timespec ts, uint32_t caplen, uint8_t dir,
+		   const char *comment)
+{
+	uint64_t ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	uint32_t flags = dir;
+	size_t opts_len = 0;
+
+	opts_len += put_opt(opts, PCAPNG_EPB_FLAGS, &flags, sizeof(flags));
+	if (comment != NULL) {
+		size_t l = strlen(comment);
+		if (l > CAPTURE_BLOCK_MAX - 20)
+			l = CAPTURE_BLOCK_MAX - 20;
+		opts_len += put_opt(opts + opts_len, PCAPNG_OPT_COMMENT,
+				    comment, l);
+	}
+	opts_len += put_opt(opts + opts_len, PCAPNG_OPT_END, NULL, 0);
+
+	uint32_t block[CAPTURE_EPB_HDR / sizeof(uint32_t)] = {
+		PCAPNG_EPB,
+		CAPTURE_EPB_HDR + PCAPNG_PAD(caplen) + opts_len +
+			sizeof(uint32_t),
+		id,
+		ns >> 32, ns & 0xffffffff,
+		caplen, caplen
+	};
+	memcpy(hdr, block, sizeof(block));
+
+	return opts_len;
+}
+
+/**
+ * @brief Write to a capture file
+ *
+ * With @p mmap, the mapped chunk is moved along, and the file extended, as
+ * the data runs past its end.
+ *
+ * @param f Pointer to the capture file
+ * @param data The data
+ * @param len Length of @p data
+ * @return 0 if successful, or -1 if unsuccessful
+ */
+static int cap_write(struct capfile_t *f, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	if (f->mmap == 0) {
+		if (fwrite_unlocked(data, 1, len, f->fp) != len)
+			return -1;
+		f->len += len;
+		return 0;
+	}
+
+	while (len > 0) {
+		if (f->map == NULL || f->len == f->base + CAPTURE_MMAP_CHUNK) {
+			int err;
+
+			if (f->map != NULL) {
+				munmap(f->map, CAPTURE_MMAP_CHUNK);
+				f->map = NULL;
+				f->base += CAPTURE_MMAP_CHUNK;
+			}
+
+			if ((err = posix_fallocate(f->fd, f->base,
+						   CAPTURE_MMAP_CHUNK)) != 0) {
+				errno = err;
+				return -1;
+			}
+
+			uint8_t *map = mmap(NULL, CAPTURE_MMAP_CHUNK,
+					    PROT_READ | PROT_WRITE, MAP_SHARED,
+					    f->fd, f->base);
+			if (map == MAP_FAILED)
+				return -1;
+			f->map = map;
+		}
+
+		size_t room = f->base + CAPTURE_MMAP_CHUNK - f->len;
+		size_t n = len < room ? len : room;
+
+		memcpy(f->map + (f->len - f->base), p, n);
+		f->len += n;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Start a capture file
+ *
+ * Creates the file, moving aside any file already there as if it had been
+ * rotated, and writes a Section Header Block and an Interface Description
+ * Block.
+ *
+ * @param f Pointer to the capture file, with @p fd not open
+ * @param now The current time
+ * @return 0 if successful, or -1 if unsuccessful
+ */
+static int cap_start(struct capfile_t *f, time_t now)
+{
+	uint8_t buf[CAPTURE_BLOCK_MAX];
+	struct stat st;
+	size_t len;
+
+	if (stat(f->path, &st) == 0 && st.st_size > 0 &&
+	    cap_rename(f->path, st.st_mtime) == -1)
+		return -1;
+
+	f->fd = open(f->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (f->fd == -1)
+		return -1;
+
+	f->fp = NULL;
+	f->map = NULL;
+	f->base = f->len = 0;
+	f->packets = 0;
+	f->started = f->flushed = now;
+
+	if (f->mmap == 0) {
+		if ((f->fp = fdopen(f->fd, "w")) == NULL) {
+			close(f->fd);
+			f->fd = -1;
+			return -1;
+		}
+		setvbuf(f->fp, NULL, _IOFBF, CAPTURE_BUFSIZ);
+	}
+
+	len = capture_shb(buf);
+	if (cap_write(f, buf, len) == -1)
+		return -1;
+
+	len = capture_idb(buf, f->name);
+	return cap_write(f, buf, len);
+}
+
+/**
+ * @brief Finish writing a capture file and close it
+ * @param f Pointer to the capture file, with @p fd open
+ * @return 0 if successful, or -1 if anything written was lost
+ */
+static int cap_finish(struct capfile_t *f)
+{
+	int ret = 0;
+
+	if (f->mmap == 0) {
+		ret = fclose(f->fp) == 0 ? 0 : -1;
+	} else {
+		if (f->map != NULL)
+			munmap(f->map, CAPTURE_MMAP_CHUNK);
+		if (ftruncate(f->fd, f->len) == -1)
+			ret = -1;
+		close(f->fd);
+	}
+
+	f->fd = -1;
+	f->fp = NULL;
+	f->map = NULL;
+	return ret;
+}
+
+/**
+ * @brief Move a finished capture file aside
+ *
+ * The file is renamed after the time it was started, e.g.
+ * <tt>eth0.pcapng.20190101-000000</tt>, with a further suffix should that
+ * name be taken.
+ *
+ * @param path Path of the capture file
+ * @param started When it was started
+ * @return 0 if successful, or -1 if unsuccessful
+ */
+static int cap_rename(const char *path, time_t started)
+{
+	char tm[32], *to;
+	struct tm local;
+	struct stat st;
+
+	strftime(tm, sizeof(tm), "%Y%m%d-%H%M%S",
+		 localtime_r(&started, &local));
+
+	for (int n = 0; n < CAPTURE_RENAME_ATTEMPTS; ++n) {
+		int len = n == 0 ? asprintf(&to, "%s.%s", path, tm) :
+				   asprintf(&to, "%s.%s-%d", path, tm, n);
+		if (len == -1)
+			return -1;
+
+		if (stat(to, &st) == -1 && errno == ENOENT) {
+			int ret = rename(path, to);
+			free(to);
+			return ret;
+		}
+		free(to);
+	}
+
+	errno = EEXIST;
+	return -1;
+}
+
+/**
+ * @brief Rotate a capture file
+ * @param f Pointer to the capture file
+ * @param now The current time
+ * @return 0 if successful, or -1 if unsuccessful
+ */
+static int cap_rotate(struct capfile_t *f, time_t now)
+{
+	if (cap_finish(f) == -1 || cap_rename(f->path, f->started) == -1)
+		return -1;
+
+	debug("rotated capture file '%s'", f->path);
+
+	return cap_start(f, now);
+}
+
+/**
+ * @brief Stop writing a capture file after an error
+ * @param f Pointer to the capture file
+ * @note Logs the error, going by @p errno.
+ */
+static void cap_fail(struct capfile_t *f)
+{
+	ewarning("cannot write capture file '%s', not capturing: %s",
+		 f->path);
+
+	if (f->fd != -1) {
+		int err = errno;
+		cap_finish(f);
+		errno = err;
+	}
+}
+
+/**
+ * @brief Take over a capture file from a previous config
+ * @param old Pointer to a list of <tt>struct iface_t</tt> structures holding a
+ *            previous config, or @p NULL
+ * @param path Path of the capture file
+ * @param name Name of the interface it is for
+ * @return The capture file, no longer referred to by @p old, or @p NULL if
+ *         @p old does not have it open for @p name
+ */
+static struct capfile_t *cap_take(struct iface_t *old, const char *path,
+				  const char *name)
+{
+	for (struct iface_t *i = old; i != NULL; i = i->next) {
+		struct capture_t *c[2] = {
+			i->ingress != NULL ? i->ingress->capture : NULL,
+			i->egress != NULL ? i->egress->capture : NULL
+		};
+
+		for (int n = 0; n < 2; ++n) {
+			if (c[n] == NULL || c[n]->file == NULL ||
+			    strcmp(c[n]->file->path, path) != 0 ||
+			    strncmp(c[n]->file->name, name, IFNAMSIZ) != 0)
+				continue;
+
+			struct capfile_t *f = c[n]->file;
+			c[n]->file = NULL;
+			return f;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Open the capture file of an interface, unless already open
+ * @param capture Pointer to a <tt>struct capture_t</tt>, or @p NULL
+ * @param name Name of the interface
+ * @param old As passed to @p capture_ifaces()
+ */
+static void cap_open(struct capture_t *capture, const char *name,
+		     struct iface_t *old)
+{
+	if (capture == NULL || capture->file != NULL)
+		return;
+
+	struct capfile_t *f = cap_take(old, capture->path, name);
+	if (f != NULL) {
+		/* Carry on where the previous config left off */
+		capture->file = f;
+		f->limit = (uint64_t)capture->size << 20;
+		f->interval = capture->interval;
+		if (f->mmap != capture->mmap)
+			warning("keeping output of capture file '%s' until it is rotated",
+				f->path);
+		return;
+	}
+
+	if ((f = calloc(1, sizeof(*f))) == NULL ||
+	    (f->path = strdup(capture->path)) == NULL) {
+		ewarning("cannot allocate capture file, not capturing: %s");
+		free(f);
+		return;
+	}
+
+	pthread_mutex_init(&f->lock, NULL);
+	f->fd = -1;
+	strncpy(f->name, name, IFNAMSIZ - 1);
+	f->limit = (uint64_t)capture->size << 20;
+	f->interval = capture->interval;
+	f->mmap = capture->mmap;
+
+	if (cap_start(f, time(NULL)) == -1) {
+		cap_fail(f);
+		free(f->path);
+		free(f);
+		return;
+	}
+
+	if (capfiles == NULL)
+		atexit(capture_stop);
+	f->next = capfiles;
+	capfiles = f;
+	capture->file = f;
+
+	notice("capturing packets to '%s', interface '%s'", f->path, name);
+}
+
+/**
+ * @brief Close and free a capture file
+ * @param f Pointer to the capture file, which is unlinked from @p capfiles
+ */
+static void cap_free(struct capfile_t *f)
+{
+	for (struct capfile_t **p = &capfiles; *p != NULL; p = &(*p)->next) {
+		if (*p == f) {
+			*p = f->next;
+			break;
+		}
+	}
+
+	if (f->fd != -1 && cap_finish(f) == -1)
+		ewarning("cannot finish capture file '%s': %s", f->path);
+
+	pthread_mutex_destroy(&f->lock);
+	free(f->path);
+	free(f);
+}
+
+/**
+ * @brief Finish all capture files on exit
+ *
+ * Each file is left locked, so that a worker still running cannot write to it
+ * once it is closed.
+ *
+ * @note Registered with @p atexit(3).
+ */
+static void capture_stop(void)
+{
+	for (struct capfile_t *f = capfiles; f != NULL; f = f->next) {
+		pthread_mutex_lock(&f->lock);
+		if (f->fd != -1 && cap_finish(f) == -1)
+			ewarning("cannot finish capture file '%s': %s",
+				 f->path);
+	}
+}
+
+/**
+ * @brief Open the capture files of interfaces in a list
+ *
+ * Capture files already open are kept. A capture file that a previous config
+ * has open for the same interface is taken over rather than started anew;
+ * any others the previous config has open are closed.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @param old Pointer to a list of <tt>struct iface_t</tt> structures holding
+ *            the previous config, or @p NULL
+ * @note Workers must not be running.
+ */
+void capture_ifaces(struct iface_t *ifaces, struct iface_t *old)
+{
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next) {
+		cap_open(i->ingress != NULL ? i->ingress->capture : NULL,
+			 i->name, old);
+		cap_open(i->egress != NULL ? i->egress->capture : NULL,
+			 i->name, old);
+	}
+
+	for (struct iface_t *i = old; i != NULL; i = i->next) {
+		struct capture_t *c[2] = {
+			i->ingress != NULL ? i->ingress->capture : NULL,
+			i->egress != NULL ? i->egress->capture : NULL
+		};
+
+		for (int n = 0; n < 2; ++n) {
+			if (c[n] == NULL || c[n]->file == NULL)
+				continue;
+			info("no longer capturing packets to '%s'",
+			     c[n]->file->path);
+			cap_free(c[n]->file);
+			c[n]->file = NULL;
+		}
+	}
+}
+
+/**
+ * @brief Write a packet to a capture file
+ *
+ * A received packet is written as it was received and timestamped when it was
+ * received. A sent packet is written as it is being sent, timestamped now, and
+ * commented with where it was received and its 802.1Q tag at the time.
+ *
+ * May be called by any worker at any time.
+ *
+ * @param capture Pointer to the <tt>struct capture_t</tt> of the interface
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> representing an
+ *               EAPOL packet
+ * @param dir @p CAPTURE_IN or @p CAPTURE_OUT
+ */
+void capture_packet(struct capture_t *capture,
+		    const struct peapod_packet *packet, uint8_t dir)
+{
+	struct capfile_t *f = capture->file;
+	uint8_t hdr[CAPTURE_EPB_HDR], opts[CAPTURE_BLOCK_MAX];
+	uint8_t pad[3] = { 0, 0, 0 };
+	char comment[64];
+	uint32_t caplen, total;
+	struct timespec now;
+
+	if (f == NULL)
+		return;
+
+	/* Points into the receive buffer, cf. packet_buf() */
+	uint8_t *frame = packet_buf(packet, dir == CAPTURE_IN);
+	caplen = dir == CAPTURE_IN ? packet->len_orig : packet->len;
+
+	if (dir == CAPTURE_IN)
+		now = packet->ts;
+	else
+		packet_now(&now);
+
+	/* For sent packets, what they were received as */
+	if (dir == CAPTURE_OUT && packet->vlan_valid_orig == 1)
+		snprintf(comment, sizeof(comment),
+			 "from '%s', vlan %d (prio %d%s)",
+			 packet->iface_orig->name,
+			 packet->tci_orig.vid, packet->tci_orig.pcp,
+			 packet->tci_orig.dei ? ", dei" : "");
+	else if (dir == CAPTURE_OUT)
+		snprintf(comment, sizeof(comment), "from '%s', untagged",
+			 packet->iface_orig->name);
+
+	size_t opts_len = capture_epb(hdr, opts, 0, now, caplen, dir,
+				      dir == CAPTURE_OUT ? comment : NULL);
+	memcpy(&total, hdr + sizeof(uint32_t), sizeof(total));
+
+	pthread_mutex_lock(&f->lock);
+
+	if (f->fd == -1)
+		goto capture_unlock;
+
+	if (f->interval > 0 && f->packets > 0 &&
+	    now.tv_sec - f->started >= f->interval &&
+	    cap_rotate(f, now.tv_sec) == -1)
+		goto capture_fail;
+
+	if (cap_write(f, hdr, sizeof(hdr)) == -1 ||
+	    cap_write(f, frame, caplen) == -1 ||
+	    cap_write(f, pad, PCAPNG_PAD(caplen) - caplen) == -1 ||
+	    cap_write(f, opts, opts_len) == -1 ||
+	    cap_write(f, &total, sizeof(total)) == -1)
+		goto capture_fail;
+	++f->packets;
+
+	if (f->limit > 0 && f->len >= f->limit) {
+		if (cap_rotate(f, now.tv_sec) == -1)
+			goto capture_fail;
+	} else if (f->mmap == 0 && f->flushed != now.tv_sec) {
+		f->flushed = now.tv_sec;
+		if (fflush_unlocked(f->fp) == EOF)
+			goto capture_fail;
+	}
+
+	goto capture_unlock;
+
+capture_fail:
+	cap_fail(f);
+
+capture_unlock:
+	pthread_mutex_unlock(&f->lock);
+}
@@ -84,7 +84,7 @@ static pid_t write_pidfile(const char *pidfile, pid_t pid)
 	char buf[16] = { "" };
 	pid_t tmp = pid;	/* PID we want to write/verify */
 
-	int ifd = open(pidfile, O_SYNC | O_CREAT | O_RDWR, 0644);
+	int ifd = open(pidfile, O_SYNC | O_CREAT | O_RDWR | O_CLOEXEC, 0644);
 
 	if (flock(ifd, LOCK_EX | LOCK_NB) == -1)
 		ecritdie("cannot lock PID file: %s");
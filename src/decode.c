@@ -0,0 +1,241 @@
+/**
+ * @file decode.c
+ * @brief Describe EAPOL packets in text
+ *
+ * Used both for logging packets as they are proxied and by @p peapod-trace,
+ * which renders a trace file the same way afterwards. Nothing here depends on
+ * the rest of @p peapod.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "decode.h"
+
+/** @brief Hexadecimal digits, cf. @p decode_hex() */
+static const char hex_digits[] = "0123456789abcdef";
+
+/**
+ * @brief EAPOL Packet Type descriptions.
+ * @see IEEE Std 802.1X-2010 §11.3.2
+ */
+const struct decode_t eapol_types[256] = {
+	[EAPOL_EAP]			= { "EAPOL-EAP",
+					    offsetof(struct eapol_eap, type),
+					    DECODE_BODY },
+	[EAPOL_START]			= { "EAPOL-Start", 0, 0 },
+	[EAPOL_LOGOFF]			= { "EAPOL-Logoff", 0, 0 },
+	[EAPOL_KEY]			= { "EAPOL-Key",
+					    offsetof(struct eapol_key, key_sig),
+					    DECODE_BODY },
+	[EAPOL_ENCAPSULATED_ASF_ALERT]	= { "EAPOL-Encapsulated-ASF-Alert", 0, 0 },
+	[EAPOL_MKA]			= { "EAPOL-MKA", 0, 0 },
+	[EAPOL_ANNOUNCEMENT_GENERIC]	= { "EAPOL-Announcement (Generic)", 0, 0 },
+	[EAPOL_ANNOUNCEMENT_SPECIFIC]	= { "EAPOL-Announcement (Specific)", 0, 0 },
+	[EAPOL_ANNOUNCEMENT_REQ]	= { "EAPOL-Announcement-Req", 0, 0 }
+};
+
+/**
+ * @brief EAP Code descriptions.
+ * @see RFC 2284 §2.2
+ */
+const struct decode_t eap_codes[256] = {
+	[EAP_CODE_REQUEST]		= { "Request",
+					    sizeof(struct eapol_eap) - 1,
+					    DECODE_TYPE },
+	[EAP_CODE_RESPONSE]		= { "Response",
+					    sizeof(struct eapol_eap) - 1,
+					    DECODE_TYPE },
+	[EAP_CODE_SUCCESS]		= { "Success",
+					    offsetof(struct eapol_eap, type) - 1,
+					    0 },
+	[EAP_CODE_FAILURE]		= { "Failure",
+					    offsetof(struct eapol_eap, type) - 1,
+					    0 }
+};
+
+/**
+ * @brief EAP-Request/Response Type descriptions.
+ *
+ * The text of the descriptions is as stated in the relevant RFCs.
+ */
+const struct decode_t eap_types[256] = {
+	[EAP_TYPE_IDENTITY]		= { "Identity", 0, 0 },
+	[EAP_TYPE_NOTIFICATION]		= { "Notification", 0, 0 },
+	[EAP_TYPE_NAK]			= { "Nak (Response only)", 0, 0 },
+	[EAP_TYPE_MD5_CHALLENGE]	= { "MD5-Challenge", 0, 0 },
+	[EAP_TYPE_OTP]			= { "One Time Password (OTP)", 0, 0 },
+	[EAP_TYPE_GTC]			= { "Generic Token Card (GTC)", 0, 0 },
+	[EAP_TYPE_TLS]			= { "EAP TLS", 0, 0 },
+	[EAP_TYPE_SIM]			= { "EAP-SIM", 0, 0 },
+	[EAP_TYPE_TTLS]			= { "EAP-TTLS", 0, 0 },
+	[EAP_TYPE_AKA_OLD]		= { "EAP-AKA", 0, 0 },
+	[EAP_TYPE_PEAP]			= { "PEAP", 0, 0 },
+	[EAP_TYPE_MS_CHAP_V2]		= { "EAP MS-CHAP-V2", 0, 0 },
+	[EAP_TYPE_MS_CHAP_V2_OLD]	= { "EAP MS-CHAP V2", 0, 0 },
+	[EAP_TYPE_FAST]			= { "EAP-FAST", 0, 0 },
+	[EAP_TYPE_IKEV2]		= { "EAP-IKEv2", 0, 0 },
+	[EAP_TYPE_EXPANDED_TYPES]	= { "Expanded Types",
+					    sizeof(struct eap_expanded),
+					    DECODE_EXPANDED },
+	[EAP_TYPE_EXPERIMENTAL_USE]	= { "Experimental use", 0, 0 }
+};
+
+/**
+ * @brief Descriptions for EAPOL-Key Descriptor Type.
+ * @see IEEE Std 802.1X-2010 §11.9
+ */
+const struct decode_t eapol_key_types[256] = {
+	[EAPOL_KEY_TYPE_RC4]		= { "RC4", 0, 0 },
+	[EAPOL_KEY_TYPE_IEEE_80211]	= { "IEEE 802.11", 0, 0 }
+};
+
+/**
+ * @brief Describe an EAPOL packet in a <tt>tcpdump</tt>-like format
+ *
+ * Fields beyond the part of the packet that is available are left out.
+ *
+ * @param buf Buffer for the description
+ * @param size Size of @p buf
+ * @param verb "recv" or "send"
+ * @param name Name of the interface the packet was received or sent on
+ * @param len Length of the packet
+ * @param frame The packet, starting with its Ethernet header and including
+ *              any 802.1Q tag
+ * @param caplen Length of the part of the packet in @p frame
+ * @return Length of the description
+ */
+int decode_frame(char *buf, size_t size, const char *verb, const char *name,
+		 size_t len, const uint8_t *frame, size_t caplen)
+{
+	size_t off = ETH_ALEN * 2;
+	int l;
+
+	if (caplen < off)
+		return snprintf(buf, size, "%s %zu bytes on '%s'",
+				verb, len, name);
+
+	/* "recv 1024 bytes on 'eth0': {source MAC} > {dest MAC}" */
+	const uint8_t *s = frame + ETH_ALEN, *d = frame;
+	l = snprintf(buf, size, "%s %zu bytes on '%s': "
+		     "%.02x:%.02x:%.02x:%.02x:%.02x:%.02x > "
+		     "%.02x:%.02x:%.02x:%.02x:%.02x:%.02x", verb, len, name,
+		     s[0], s[1], s[2], s[3], s[4], s[5],
+		     d[0], d[1], d[2], d[3], d[4], d[5]);
+
+	/* "..., vlan 0 (prio 6, dei)" */
+	if (caplen >= off + 4 && frame[off] == 0x81 && frame[off + 1] == 0x00) {
+		uint16_t tci = frame[off + 2] << 8 | frame[off + 3];
+
+		l += snprintf(buf + l, size - l, ", vlan %d (prio %d%s)",
+			      tci & 0x0fff, tci >> 13,
+			      (tci & 0x1000) ? ", dei" : "");
+		off += 4;
+	}
+
+	const struct eapol_mpdu *mpdu = (const struct eapol_mpdu *)(frame + off);
+	size_t mpdu_len = caplen - off;
+	const size_t body = offsetof(struct eapol_mpdu, eap);
+
+	if (mpdu_len < offsetof(struct eapol_mpdu, pkt_body_len))
+		return l;
+
+	/* "..., EAPOL-EAP (0) v2", "..., EAPOL-Key (3) v1", */
+	const struct decode_t *t = &eapol_types[mpdu->type];
+	l += snprintf(buf + l, size - l, ", %s (%d) v%d",
+		      packet_decode(mpdu->type, eapol_types),
+		      mpdu->type, mpdu->proto_ver);
+
+	if (!(t->flags & DECODE_BODY) || mpdu_len < body + t->len)
+		return l;
+
+	/* "..., Response/Identity (1), id 123, len 456", "..., Success" */
+	if (mpdu->type == EAPOL_EAP) {
+		const struct eapol_eap *eap = &mpdu->eap;	/* convenience */
+		const struct decode_t *c = &eap_codes[eap->code];
+
+		l += snprintf(buf + l, size - l, ", %s",
+			      packet_decode(eap->code, eap_codes));
+
+		if (c->flags & DECODE_TYPE && mpdu_len >= body + 1 + c->len) {
+			l += snprintf(buf + l, size - l, "/%s (%d)",
+				      packet_decode(eap->type, eap_types),
+				      eap->type);
+
+			/* "..., Request/Expanded Types (254) 0x00372a/1" */
+			const struct eap_expanded *x = (const void *)(eap + 1);
+			if (eap_types[eap->type].flags & DECODE_EXPANDED &&
+			    mpdu_len >= body + sizeof(*eap) +
+					eap_types[eap->type].len)
+				l += snprintf(buf + l, size - l,
+					      " 0x%.02x%.02x%.02x/%u",
+					      x->vendor_id[0], x->vendor_id[1],
+					      x->vendor_id[2],
+					      ntohl(x->vendor_type));
+		}
+
+		l += snprintf(buf + l, size - l, ", id %d, len %d",
+			      eap->id, ntohs(eap->len));
+	} else if (mpdu->type == EAPOL_KEY) {
+		const struct eapol_key *key = &mpdu->key;
+
+		/* NOTE: Only really decodes the RC4 Descriptor Type */
+		if (key->desc_type == EAPOL_KEY_TYPE_RC4) {
+			/* "..., type RC4-128 (1)" */
+			l += snprintf(buf + l, size - l,
+				      ", type %s-%d (%d)",
+				      packet_decode(key->desc_type,
+						    eapol_key_types),
+				      ntohs(key->key_len) * 8, key->desc_type);
+
+			/* "..., index 64, unicast" */
+			l += snprintf(buf + l, size - l,
+				      ", index %d (%scast)",
+				      key->key_index & 0x7f,
+				      (key->key_index & 0x80) ?
+				      "uni" : "broad");
+		} else {
+			/* "..., type IEEE 802.11 (2)" */
+			l += snprintf(buf + l, size - l,
+				      ", type %s (%d)",
+				      packet_decode(key->desc_type,
+						    eapol_key_types),
+				      key->desc_type);
+		}
+	}
+
+	return l;
+}
+
+/**
+ * @brief Render a line of a hexadecimal dump
+ *
+ * Sample output:
+ * @code
+ *   0x0000:  0180 c200 0003 feed face ca11 8100 6000
+ * @endcode
+ *
+ * @param buf Buffer of at least @p DECODE_HEX_SIZ bytes for the line
+ * @param data The data being dumped
+ * @param len Length of @p data
+ * @param pos Offset of the line in @p data, a multiple of 16
+ * @return Offset of the next line, or @p len after the last line
+ */
+size_t decode_hex(char *buf, const uint8_t *data, size_t len, size_t pos)
+{
+	char *p = buf + snprintf(buf, DECODE_HEX_SIZ, "  0x%.04zx:  ", pos);
+
+	for (; pos < len; ++pos) {
+		*p++ = hex_digits[data[pos] >> 4];
+		*p++ = hex_digits[data[pos] & 0xf];
+
+		if (pos % 16 == 15) {
+			++pos;
+			break;
+		}
+		if (pos % 2 == 1)
+			*p++ = ' ';
+	}
+	*p = '\0';
+
+	return pos;
+}
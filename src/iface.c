@@ -2,22 +2,45 @@
  * @file iface.c
  * @brief Network interface and socket setup
  */
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netinet/ether.h>
+#include <linux/bpf.h>
 #include <linux/filter.h>
 #include <linux/if_packet.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include "iface.h"
+#include "latency.h"
 #include "log.h"
+#include "netlink.h"
+#include "offload.h"
 
 static int validate(struct iface_t *iface);
 static int epoll_register(int epfd, struct iface_t *iface);
-static u_char *get_mac(struct iface_t *iface);
-static int sockopt(struct iface_t *iface);
+static int sockopt(struct iface_t *iface, uint8_t first_frame);
+static void hw_timestamps(struct iface_t *iface);
+static int filter_masks(struct iface_t *iface, uint16_t *types,
+			uint8_t *codes);
+static int filter_attach(struct iface_t *iface, uint16_t types, uint8_t codes);
+static int rings(struct iface_t *iface);
+static void rings_unmap(struct iface_t *iface);
+static int same_filter(const struct filter_t *a, const struct filter_t *b);
+static int same_path(const char *a, const char *b);
+static int same_action(const struct action_t *a, const struct action_t *b);
+static int same_ring(const struct ring_t *a, const struct ring_t *b);
+static int same_capture(const struct capture_t *a, const struct capture_t *b);
+static int same_limit(const struct limit_t *a, const struct limit_t *b);
+
+extern struct sessions_t sessions;
 
 /**
  * @brief EAPOL multicast group MAC addresses
@@ -54,71 +77,131 @@ static const u_char eapol_grp_mac[3][ETH_ALEN] = {
  * The <tt>tcpdump</tt>-style @p bpf assembly equivalent is:
  * @code
  * (000) ldh	[12]
- * (001) jeq	#0x888e				jt 2	jf 3
- * (002) ret	#<decently big nonzero>
- * (003) ret	#0
+ * (001) jeq	#0x888e				jt 2	jf 5
+ * (002) ld	#mark
+ * (003) jeq	#<OFFLOAD_MARK>			jt 5	jf 4
+ * (004) ret	#<decently big nonzero>
+ * (005) ret	#0
  * @endcode
+ *
+ * Packets marked with @p OFFLOAD_MARK were sent by the in-kernel datapath of
+ * another interface, and were already proxied there.
  */
 static struct sock_filter eapol_sock_filter[] = {
 	{ 0x28, 0, 0, 0x0000000c },
-	{ 0x15, 0, 1, 0x0000888e },
+	{ 0x15, 0, 3, 0x0000888e },
+	{ 0x20, 0, 0, SKF_AD_OFF + SKF_AD_MARK },
+	{ 0x15, 1, 0, OFFLOAD_MARK },
 	{ 0x6, 0, 0, 0xbef001ed },
 	{ 0x6, 0, 0, 0x00000000 }
 };
 
 /** @brief The complete @p bpf filter program provided to @p setsockopt(3) */
 static const struct sock_fprog eapol_fprog = {
-	.len = 4,
+	.len = 6,
 	.filter = eapol_sock_filter
 };
+
+/** @brief Shorthand for an eBPF instruction */
+#define INSN(c, d, s, o, i)						\
+	{ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) }
+
+/**
+ * @name Instructions of @p eapol_ebpf_filter patched by @p filter_attach()
+ * @{
+ */
+#define EBPF_TYPES		9	/**< @brief EAPOL Packet Types to drop */
+#define EBPF_CODES		19	/**< @brief EAP Codes to drop */
+#define EBPF_MAP		24	/**< @brief Counter map */
+/** @} */
+
+/**
+ * @brief An eBPF filter for EAPOL packets that also drops filtered packets
+ *
+ * Used instead of @p eapol_sock_filter for an interface with an ingress
+ * filter, so that packets we would only throw away never leave the kernel.
+ * Each packet dropped for being filtered is counted in the map returned by
+ * @p iface_kstat_map(). In pseudo-C:
+ * @code
+ * if (ethertype != 0x888e || mark == OFFLOAD_MARK)
+ *         return 0;
+ * if (type < 16 && types & 1 << type)
+ *         goto drop;
+ * if (type != EAPOL_EAP || len < 19 || code > 7 || !(codes & 1 << code))
+ *         return len;
+ * drop:
+ * ++counter[IFACE_KSTAT_FILTERED];
+ * return 0;
+ * @endcode
+ *
+ * @see @p bpf(2), @p BPF_PROG_TYPE_SOCKET_FILTER
+ */
+static struct bpf_insn eapol_ebpf_filter[] = {
+	INSN(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0),	/* r6 = skb */
+	INSN(BPF_LD | BPF_ABS | BPF_H, 0, 0, 0, 12),		/* 1: EtherType */
+	INSN(BPF_JMP | BPF_JNE | BPF_K, 0, 0, 27, 0x888e),	/* -> 30 */
+	INSN(BPF_LDX | BPF_MEM | BPF_W, 0, 6, offsetof(struct __sk_buff, mark), 0),
+	INSN(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 25, OFFLOAD_MARK), /* -> 30 */
+	INSN(BPF_LD | BPF_ABS | BPF_B, 0, 0, 0, 15),		/* 5: Packet Type */
+	INSN(BPF_JMP | BPF_JGT | BPF_K, 0, 0, 25, 15),		/* -> 32 */
+	INSN(BPF_ALU64 | BPF_MOV | BPF_K, 1, 0, 0, 1),
+	INSN(BPF_ALU64 | BPF_LSH | BPF_X, 1, 0, 0, 0),
+	INSN(BPF_ALU64 | BPF_AND | BPF_K, 1, 0, 0, 0),		/* 9: types */
+	INSN(BPF_JMP | BPF_JNE | BPF_K, 1, 0, 10, 0),		/* -> 21 */
+	INSN(BPF_JMP | BPF_JNE | BPF_K, 0, 0, 20, 0),		/* EAP? -> 32 */
+	INSN(BPF_LDX | BPF_MEM | BPF_W, 0, 6, offsetof(struct __sk_buff, len), 0),
+	INSN(BPF_JMP | BPF_JGT | BPF_K, 0, 0, 1, 18),		/* -> 15 */
+	INSN(BPF_JMP | BPF_JA, 0, 0, 17, 0),			/* -> 32 */
+	INSN(BPF_LD | BPF_ABS | BPF_B, 0, 0, 0, 18),		/* 15: EAP Code */
+	INSN(BPF_JMP | BPF_JGT | BPF_K, 0, 0, 15, 7),		/* -> 32 */
+	INSN(BPF_ALU64 | BPF_MOV | BPF_K, 1, 0, 0, 1),
+	INSN(BPF_ALU64 | BPF_LSH | BPF_X, 1, 0, 0, 0),
+	INSN(BPF_ALU64 | BPF_AND | BPF_K, 1, 0, 0, 0),		/* 19: codes */
+	INSN(BPF_JMP | BPF_JEQ | BPF_K, 1, 0, 11, 0),		/* -> 32 */
+	INSN(BPF_ST | BPF_MEM | BPF_W, 10, 0, -4, IFACE_KSTAT_FILTERED), /* 21 */
+	INSN(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0),
+	INSN(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -4),
+	INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, 0), /* 24 */
+	INSN(0, 0, 0, 0, 0),
+	INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+	INSN(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 2, 0),		/* -> 30 */
+	INSN(BPF_ALU64 | BPF_MOV | BPF_K, 1, 0, 0, 1),
+	INSN(BPF_STX | BPF_XADD | BPF_DW, 0, 1, 0, 0),		/* ++counter */
+	INSN(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, 0),		/* 30: drop */
+	INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	INSN(BPF_LDX | BPF_MEM | BPF_W, 0, 6, offsetof(struct __sk_buff, len), 0),
+	INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)			/* 32: accept */
+};
+
+#undef INSN
 /**@}*/
 
 /**
- * @brief Check that a network interface is up and get its MTU
+ * @brief Check that a network interface is an Ethernet interface and is up
  *
- * Also sets the @p mtu field of @p iface to the interface's current MTU.
+ * Goes by the link state last read by @p netlink_dump() or received in a link
+ * notification, which also set the @p mtu field of @p iface.
  *
  * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
  * @return 0 if successful, or -1 if unsuccessful
  */
 static int validate(struct iface_t *iface)
 {
-	struct ifreq ifr;
-	int skt;
-
-	/* Unnecessary, but do it anyway so as to not depend upon iface->skt. */
-	skt = socket(AF_INET, SOCK_DGRAM, 0);
-	if (skt == -1) {
-		eerr("cannot create socket to check state, interface '%s': %s",
-		     iface->name);
+	if (iface->mtu == 0) {
+		err("no such interface '%s'", iface->name);
 		return -1;
 	}
 
-	memset(&ifr, 0, sizeof(ifr));
-	strncpy(ifr.ifr_name, iface->name, IFNAMSIZ);
-
-	if (ioctl(skt, SIOCGIFFLAGS, &ifr) == -1) {
-		eerr("cannot read flags, interface '%s': %s", iface->name);
-		close(skt);
+	if (iface->type != ARPHRD_ETHER) {
+		err("not Ethernet, interface '%s'", iface->name);
 		return -1;
 	}
 
-	if ((ifr.ifr_flags & IFF_UP) == 0) {
+	if ((iface->flags & IFF_UP) == 0) {
 		err("not up, interface '%s'", iface->name);
-		close(skt);
 		return -1;
 	}
 
-	if (ioctl(skt, SIOCGIFMTU, &ifr) == -1) {
-		ecrit("cannot read MTU, interface '%s': %s", iface->name);
-		close(skt);
-		return -1;
-	}
-
-	iface->mtu = ifr.ifr_mtu;
-
-	close(skt);
-
 	return 0;
 }
 
@@ -146,68 +229,39 @@ static int epoll_register(int epfd, struct iface_t *iface)
 	return 0;
 }
 
-/**
- * @brief Query the kernel for the MAC address of a network interface
- *
- * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
- * @return Pointer to a static buffer containing @p ETH_ALEN bytes if
- *         successful, or @p NULL if unsuccessful
- * @note For this to succeed, the interface must be an Ethernet interface
- */
-static u_char *get_mac(struct iface_t *iface)
-{
-	static u_char buf[ETH_ALEN];
-	struct ifreq ifr;
-	int skt;
-
-	memset(&ifr, 0, sizeof(ifr));
-	strncpy(ifr.ifr_name, iface->name, IFNAMSIZ);
-
-	/* Unnecessary, but do it anyway so as to not depend upon iface->skt. */
-	skt = socket(AF_INET, SOCK_DGRAM, 0);
-	if (skt == -1) {
-		eerr("cannot create socket to get MAC, interface '%s': %s",
-		     iface->name);
-		return NULL;
-	}
-
-	if (ioctl(skt, SIOCGIFHWADDR, &ifr) == -1) {
-		eerr("cannot read MAC, interface '%s': %s", iface->name);
-		close(skt);
-		return NULL;
-	}
-
-	if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
-		err("not Ethernet, interface '%s'", iface->name);
-		close(skt);
-		return NULL;
-	}
-
-	memcpy(buf, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
-
-	close(skt);
-
-	return buf;
-}
-
-
 /**
  * @brief Set socket options for the @p skt field of a struct iface_t
  *
  * Attaches a @p bpf filter for the 802.1X EtherType, sets multicast or
- * promiscuous mode, and requests a @p PACKET_AUXDATA cmsg from the kernel.
+ * promiscuous mode, and requests @p PACKET_AUXDATA and @p SCM_TIMESTAMPNS cmsgs
+ * from the kernel, as well as hardware timestamps with @p hw-timestamps.
+ *
+ * Where possible, the filter also drops the packets that ingress filtering
+ * would, so that they never leave the kernel. Ingress filtering still happens
+ * in userspace for whatever gets through, e.g. if the kernel lacks eBPF.
  *
  * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ * @param first_frame Flag: Must the first EAPOL packet be received whatever
+ *                    its type, i.e. does another interface have
+ *                    @p set-mac-from this one?
  * @return 0 if successful, or -1 if unsuccessful
  * @see @p cmsg(3)
  */
-static int sockopt(struct iface_t *iface)
+static int sockopt(struct iface_t *iface, uint8_t first_frame)
 {
-	if (setsockopt(iface->skt, SOL_SOCKET, SO_ATTACH_FILTER,
-		       &eapol_fprog, sizeof(eapol_fprog)) == -1) {
-		eerr("cannot attach filter on socket, interface '%s': %s",
-		     iface->name);
-		return -1;
+	uint16_t types;
+	uint8_t codes;
+
+	/* An offloaded interface's socket receives nothing to filter */
+	if (iface->offload_link == 0 &&
+	    (first_frame == 1 || filter_masks(iface, &types, &codes) == 0 ||
+	     filter_attach(iface, types, codes) == -1)) {
+		if (setsockopt(iface->skt, SOL_SOCKET, SO_ATTACH_FILTER,
+			       &eapol_fprog, sizeof(eapol_fprog)) == -1) {
+			eerr("cannot attach filter on socket, interface '%s': %s",
+			     iface->name);
+			return -1;
+		}
 	}
 
 	struct packet_mreq mreq;
@@ -248,69 +302,863 @@ static int sockopt(struct iface_t *iface)
 		einfo("cannot receive 802.1Q metadata on interface '%s': %s",
 		      iface->name);	/* Shouldn't happen on recent Linuxes */
 
+	/* Every packet received in a batch needs its own timestamp, which
+	 * SIOCGSTAMP can't give us. Ask for one in a control message too, to
+	 * the nanosecond.
+	 */
+	if (setsockopt(iface->skt, SOL_SOCKET,
+		       SO_TIMESTAMPNS, &tmp, sizeof(tmp)) == -1)
+		einfo("cannot receive timestamps on interface '%s': %s",
+		      iface->name);
+
+	if (iface->hw_timestamps == 1)
+		hw_timestamps(iface);
+
+	latency_socket(iface);
+
 	return 0;
 }
 
 /**
- * @brief Create raw sockets for interfaces in a list and add them to an
- *        @p epoll instance
+ * @brief Have the NIC of an interface timestamp the packets it receives
+ *
+ * Enables hardware timestamping of all received packets on the device, leaving
+ * transmit timestamping as it was, and asks for the hardware timestamps in an
+ * @p SCM_TIMESTAMPING cmsg, or in RX ring frame headers. Software timestamps
+ * are still used for any packet without a hardware timestamp.
+ *
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ * @note The hardware clock is only comparable to @p CLOCK_REALTIME if it is
+ *       kept in sync with it, e.g. by @p phc2sys(8).
+ * @see Documentation/networking/timestamping.rst
+ */
+static void hw_timestamps(struct iface_t *iface)
+{
+	struct hwtstamp_config cfg;
+	struct ifreq ifr;
+
+	memset(&cfg, 0, sizeof(cfg));
+	memset(&ifr, 0, sizeof(ifr));
+	memcpy(ifr.ifr_name, iface->name, strnlen(iface->name, IFNAMSIZ - 1));
+	ifr.ifr_data = (void *)&cfg;
+
+	/* Keep whatever else, e.g. ptp4l(8), has set up */
+	if (ioctl(iface->skt, SIOCGHWTSTAMP, &ifr) == -1)
+		cfg.tx_type = HWTSTAMP_TX_OFF;
+
+	if (cfg.rx_filter != HWTSTAMP_FILTER_ALL) {
+		cfg.rx_filter = HWTSTAMP_FILTER_ALL;
+		if (ioctl(iface->skt, SIOCSHWTSTAMP, &ifr) == -1 ||
+		    cfg.rx_filter != HWTSTAMP_FILTER_ALL) {
+			einfo("no hardware timestamps on interface '%s': %s",
+			      iface->name);
+			return;
+		}
+	}
+
+	int flags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+	if (setsockopt(iface->skt, SOL_SOCKET, SO_TIMESTAMPING,
+		       &flags, sizeof(flags)) == -1 ||
+	    (iface->rx_ring != NULL &&
+	     setsockopt(iface->skt, SOL_PACKET, PACKET_TIMESTAMP,
+			&flags, sizeof(flags)) == -1)) {
+		einfo("cannot receive hardware timestamps on interface '%s': %s",
+		      iface->name);
+		return;
+	}
+
+	debug("timestamping in hardware, interface '%s'", iface->name);
+}
+
+/**
+ * @brief Determine which ingress-filtered packets can be dropped in-kernel
+ *
+ * That is all of them, except those that would have an ingress script or hook
+ * run for them first, or none at all if the session table has to see them, or
+ * if some of them may be for virtual interfaces on this one.
+ *
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ * @param types Set to a bitmask of EAPOL Packet Types to drop
+ * @param codes Set to a bitmask of EAP Codes to drop
+ * @return 1 if anything is to be dropped, or 0 if not
+ * @see @p process_filter(), @p process_script()
+ */
+static int filter_masks(struct iface_t *iface, uint16_t *types,
+			uint8_t *codes)
+{
+	if (iface->ingress == NULL || iface->ingress->filter == NULL ||
+	    sessions.max != 0 || iface->vlan_nr != 0)
+		return 0;
+
+	struct filter_t *filter = iface->ingress->filter;
+	struct action_t *action = iface->ingress->action;
+	uint16_t act_types = 0;
+	uint8_t act_codes = 0;
+
+	for (int i = 0; action != NULL && i < 9; ++i)
+		if (action->type[i] != NULL || action->hook_type[i] != NULL)
+			act_types |= 1 << i;
+	for (int i = 1; action != NULL && i < 5; ++i)
+		if (action->code[i] != NULL || action->hook_code[i] != NULL)
+			act_codes |= 1 << i;
+
+	*types = filter->type & ~act_types;
+	*codes = filter->code & ~act_codes;
+
+	/* Bit 0 of a mask of EAPOL Packet Types is EAP, which is dropped by
+	 * Code instead if any Code is acted upon; bits 1-4 of a mask of EAP
+	 * Codes are all the valid Codes.
+	 */
+	if (*types & 1 && act_codes != 0) {
+		*types &= ~1;
+		*codes |= 0x1e & ~act_codes;
+	}
+	if (act_types & 1)
+		*codes = 0;		/* Every Code is acted upon */
+
+	return *types != 0 || *codes != 0;
+}
+
+/**
+ * @brief Attach an eBPF filter that drops the given EAPOL packets in-kernel
+ *
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ * @param types Bitmask of EAPOL Packet Types to drop
+ * @param codes Bitmask of EAP Codes to drop
+ * @return 0 if successful, or -1 if unsuccessful
+ * @see @p eapol_ebpf_filter
+ */
+static int filter_attach(struct iface_t *iface, uint16_t types, uint8_t codes)
+{
+	union bpf_attr attr;
+
+	int map = iface_kstat_map(iface);
+	if (map == -1)
+		goto filter_attach_error;
+
+	eapol_ebpf_filter[EBPF_TYPES].imm = types;
+	eapol_ebpf_filter[EBPF_CODES].imm = codes;
+	eapol_ebpf_filter[EBPF_MAP].imm = map;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+	attr.insns = (uintptr_t)eapol_ebpf_filter;
+	attr.insn_cnt = sizeof(eapol_ebpf_filter) / sizeof(struct bpf_insn);
+	attr.license = (uintptr_t)"GPL";
+
+	int prog = syscall(SYS_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+	if (prog == -1)
+		goto filter_attach_error;
+
+	/* The socket keeps its own reference to the program */
+	int ret = setsockopt(iface->skt, SOL_SOCKET, SO_ATTACH_BPF,
+			     &prog, sizeof(prog));
+	close(prog);
+	if (ret == -1)
+		goto filter_attach_error;
+
+	debug("dropping filtered packets in-kernel, interface '%s'",
+	      iface->name);
+	return 0;
+
+filter_attach_error:
+	einfo("cannot filter packets in-kernel, interface '%s': %s",
+	      iface->name);
+	return -1;
+}
+
+/**
+ * @brief Get the @p bpf(2) map in which in-kernel packet counts are kept for
+ *        an interface
+ *
+ * The map is a @p BPF_MAP_TYPE_ARRAY of 64-bit counters, indexed by
+ * @p IFACE_KSTAT_FILTERED and so on. It is created on first use and kept for
+ * the life of the interface, so its counts survive the raw socket and any
+ * eBPF programs being replaced.
+ *
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ * @return A file descriptor for the map if successful, or -1 if unsuccessful
+ */
+int iface_kstat_map(struct iface_t *iface)
+{
+	if (iface->kstat_map != 0)
+		return iface->kstat_map;
+
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_ARRAY;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint64_t);
+	attr.max_entries = IFACE_KSTAT_NR;
+
+	int fd = syscall(SYS_bpf, BPF_MAP_CREATE, &attr, sizeof(attr));
+	if (fd != -1)
+		iface->kstat_map = fd;
+	return fd;
+}
+
+/**
+ * @brief Get an in-kernel packet count for an interface
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ * @param key Which count, e.g. @p IFACE_KSTAT_FILTERED
+ * @return The count; 0 if nothing was counted or nothing could be
+ */
+unsigned long iface_kstat(struct iface_t *iface, uint32_t key)
+{
+	if (iface->kstat_map == 0)
+		return 0;
+
+	uint64_t val = 0;
+
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = iface->kstat_map;
+	attr.key = (uintptr_t)&key;
+	attr.value = (uintptr_t)&val;
+
+	syscall(SYS_bpf, BPF_MAP_LOOKUP_ELEM, &attr, sizeof(attr));
+	return (unsigned long)val;
+}
+
+/**
+ * @brief Set up memory-mapped @p TPACKET_V3 RX and/or TX rings on the @p skt
+ *        field of a struct iface_t
+ *
+ * Both rings share a single mapping, RX ring first. Also has the kernel reserve
+ * room for an 802.1Q tag in front of each frame in the RX ring, so that
+ * @p packet_buf() can reconstruct a tagged Ethernet header in place.
+ *
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ *              with an RX ring, a TX ring, or both
+ * @return 0 if successful, or -1 if unsuccessful
+ * @see @p packet(7), "Packet MMAP"
+ */
+static int rings(struct iface_t *iface)
+{
+	struct ring_t *rx = iface->rx_ring;
+	struct ring_t *tx = iface->tx_ring;
+	struct tpacket_req3 req;
+	size_t size = 0;
+
+	int tmp = TPACKET_V3;
+	if (setsockopt(iface->skt, SOL_PACKET, PACKET_VERSION,
+		       &tmp, sizeof(tmp)) == -1) {
+		eerr("cannot use TPACKET_V3, interface '%s': %s", iface->name);
+		return -1;
+	}
+
+	if (rx != NULL) {
+		rx->map = NULL;
+		rx->block = 0;
+		rx->frames = 0;
+		rx->frame = NULL;
+
+		/* The kernel guarantees 2 bytes before the MAC header */
+		tmp = sizeof(uint32_t);
+		if (setsockopt(iface->skt, SOL_PACKET, PACKET_RESERVE,
+			       &tmp, sizeof(tmp)) == -1) {
+			eerr("cannot reserve RX ring headroom, interface '%s': %s",
+			     iface->name);
+			return -1;
+		}
+
+		if (rx->block_size < (unsigned)iface->mtu + TPACKET3_HDRLEN + 64)
+			warning("RX ring blocks may be too small for MTU %d, "
+				"interface '%s'", iface->mtu, iface->name);
+
+		memset(&req, 0, sizeof(req));
+		req.tp_block_size = rx->block_size;
+		req.tp_block_nr = rx->block_nr;
+		req.tp_frame_size = TPACKET_ALIGNMENT << 7;	/* nominal */
+		req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size) *
+				  req.tp_block_nr;
+		req.tp_retire_blk_tov = rx->timeout;
+
+		if (setsockopt(iface->skt, SOL_PACKET, PACKET_RX_RING,
+			       &req, sizeof(req)) == -1) {
+			eerr("cannot create RX ring, interface '%s': %s",
+			     iface->name);
+			return -1;
+		}
+
+		size += (size_t)rx->block_size * rx->block_nr;
+	}
+
+	if (tx != NULL) {
+		tx->map = NULL;
+		tx->block = 0;
+		tx->frames = 0;
+
+		/* Room for the TX ring frame header and a tagged frame */
+		tx->frame_size = TPACKET_ALIGN(TPACKET_ALIGN(
+					sizeof(struct tpacket3_hdr)) +
+				 (ETH_ALEN * 2) + sizeof(uint32_t) +
+				 sizeof(uint16_t) + iface->mtu);
+
+		if (tx->frame_size > tx->block_size) {
+			err("TX ring blocks too small for MTU %d, interface '%s'",
+			    iface->mtu, iface->name);
+			return -1;
+		}
+
+		memset(&req, 0, sizeof(req));
+		req.tp_block_size = tx->block_size;
+		req.tp_block_nr = tx->block_nr;
+		req.tp_frame_size = tx->frame_size;
+		req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size) *
+				  req.tp_block_nr;
+
+		if (setsockopt(iface->skt, SOL_PACKET, PACKET_TX_RING,
+			       &req, sizeof(req)) == -1) {
+			eerr("cannot create TX ring, interface '%s': %s",
+			     iface->name);
+			return -1;
+		}
+
+		size += (size_t)tx->block_size * tx->block_nr;
+	}
+
+	uint8_t *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			    iface->skt, 0);
+	if (map == MAP_FAILED) {
+		eerr("cannot map rings, interface '%s': %s", iface->name);
+		return -1;
+	}
+
+	if (rx != NULL) {
+		rx->map = map;
+		map += (size_t)rx->block_size * rx->block_nr;
+		debug("mapped %u %u-byte RX ring blocks, interface '%s'",
+		      rx->block_nr, rx->block_size, iface->name);
+	}
+
+	if (tx != NULL) {
+		tx->map = map;
+		debug("mapped %u %u-byte TX ring frames, interface '%s'",
+		      (tx->block_size / tx->frame_size) * tx->block_nr,
+		      tx->frame_size, iface->name);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Unmap the RX and/or TX rings (if any) of a struct iface_t
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ */
+static void rings_unmap(struct iface_t *iface)
+{
+	struct ring_t *rx = iface->rx_ring;
+	struct ring_t *tx = iface->tx_ring;
+	uint8_t *map = NULL;
+	size_t size = 0;
+
+	if (rx != NULL && rx->map != NULL) {
+		map = rx->map;
+		size += (size_t)rx->block_size * rx->block_nr;
+		rx->map = NULL;
+	}
+
+	if (tx != NULL && tx->map != NULL) {
+		if (map == NULL)
+			map = tx->map;
+		size += (size_t)tx->block_size * tx->block_nr;
+		tx->map = NULL;
+	}
+
+	if (map != NULL)
+		munmap(map, size);
+}
+
+/**
+ * @brief Create a raw socket for an interface and add it to an @p epoll
+ *        instance
+ *
+ * Also set interface MAC if @p set-mac was specified in the config file, and
+ * set up RX/TX rings if @p rx-ring and/or @p tx-ring were.
  *
- * Also set interface MAC if @p set-mac was specified in the config file.
+ * If the interface already has a raw socket, the new one takes over its file
+ * descriptor, so that any worker sending on the interface in the meantime
+ * never sees a stale one. Sending fails until the new socket is bound.
  *
  * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
  *               representing network interfaces
- * @param epfd File descriptor for an @p epoll instance
- * @return The number of interfaces added to @p epoll
+ * @param iface Pointer to the <tt>struct iface_t</tt> in @p ifaces to set up
+ * @param epfd File descriptor for the @p epoll instance of its worker
+ * @return 0 if successful, or -1 if unsuccessful
  */
-int iface_init(struct iface_t *ifaces, int epfd)
+int iface_open(struct iface_t *ifaces, struct iface_t *iface, int epfd)
 {
-	int ret = 0;
+	/* Nothing of its own to open; cf. iface_init() */
+	if (iface->trunk != NULL)
+		return validate(iface) == -1 || iface->trunk->down == 1 ? -1 : 0;
+
+	rings_unmap(iface);
+	offload_detach(iface);
+
+	uint8_t first_frame = 0;
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next)
+		if (i->set_mac_from == iface->index)
+			first_frame = 1;
+
+	if (validate(iface) == -1)
+		return -1;
+
+	if (iface->set_mac[ETH_ALEN] == IFACE_SET_MAC) {
+		if (iface_set_mac(iface, iface->set_mac) == -1)
+			warning("won't try to set MAC again, "
+				"interface '%s'", iface->name);
+		memset(iface->set_mac, 0, ETH_ALEN + 1);	/* oneshot */
+	}
+
+	/* A socket with protocol 0 receives nothing, but can still send
+	 * and join multicast groups. Offloaded interfaces need no more.
+	 */
+	uint16_t proto = htons(ETH_P_ALL);
+	if (iface->offload == 1 && offload_attach(iface, ifaces) == 0)
+		proto = 0;
+
+	int skt = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, proto);
+	if (skt == -1) {
+		eerr("cannot create raw socket, interface '%s': %s",
+		     iface->name);
+		goto open_error;
+	}
+
+	if (iface->skt == 0) {
+		iface->skt = skt;
+	} else {
+		if (dup2(skt, iface->skt) == -1) {
+			eerr("cannot replace raw socket, interface '%s': %s",
+			     iface->name);
+			close(skt);
+			goto open_error;
+		}
+		close(skt);
+	}
 
 	struct sockaddr_ll sll;
 	memset(&sll, 0, sizeof(sll));
 	sll.sll_family = AF_PACKET;
-	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_protocol = proto;
+	sll.sll_ifindex = iface->index;
+	sll.sll_pkttype = PACKET_HOST | PACKET_MULTICAST;
+	if (bind(iface->skt, (struct sockaddr *)&sll, sizeof(sll)) == -1) {
+		eerr("cannot bind raw socket, interface '%s': %s",
+		     iface->name);
+		goto open_error;
+	}
+
+	if (sockopt(iface, first_frame) == -1 ||
+	    ((iface->rx_ring != NULL || iface->tx_ring != NULL) &&
+	     rings(iface) == -1) ||
+	    epoll_register(epfd, iface) == -1)
+		goto open_error;	/* error messages in function */
+	debug("initialized interface '%s', index %d, socket %d",
+	      iface->name, iface->index, iface->skt);
+
+	return 0;
+open_error:
+	rings_unmap(iface);
+	offload_detach(iface);
+	return -1;
+}
+
+/**
+ * @brief Create raw sockets for interfaces in a list and add them to the
+ *        @p epoll instances of their workers
+ *
+ * The link state of all interfaces is read first, with a single
+ * @p netlink_dump(). Virtual interfaces are ready once their trunks are.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @param epfds File descriptors for an @p epoll instance per worker, indexed by
+ *              the @p worker field of <tt>struct iface_t</tt>
+ * @return The number of interfaces added to @p epoll
+ */
+int iface_init(struct iface_t *ifaces, const int *epfds)
+{
+	int ret = 0;
+
+	iface_trunks(ifaces);
+	if (netlink_dump(ifaces) == -1)
+		return 0;
 
 	for (struct iface_t *i = ifaces; i != NULL; i = i->next) {
-		if (i->skt != 0)
-			close(i->skt);
+		i->down = 0;
+		if (i->trunk == NULL &&
+		    iface_open(ifaces, i, epfds[i->worker]) == 0)
+			++ret;
+	}
 
-		if (validate(i) == -1 || get_mac(i) == NULL)
-			continue;
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next)
+		if (i->trunk != NULL && iface_open(ifaces, i, -1) == 0)
+			++ret;
 
-		if (i->set_mac[ETH_ALEN] == IFACE_SET_MAC) {
-			if (iface_set_mac(i, i->set_mac) == -1)
-				warning("won't try to set MAC again, "
-					"interface '%s'", i->name);
-			memset(i->set_mac, 0, ETH_ALEN + 1);	/* oneshot */
-		}
+	return ret;
+}
+
+/**
+ * @brief Take the raw socket of an interface that went down out of service
+ *
+ * Removes it from the @p epoll instance of the worker receiving on it, and
+ * has every worker stop sending on it, and on any virtual interfaces on it,
+ * until @p iface_up() is done. Must be called by that worker.
+ *
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ * @param epfd File descriptor for the @p epoll instance of its worker
+ */
+void iface_down(struct iface_t *iface, int epfd)
+{
+	if (epoll_ctl(epfd, EPOLL_CTL_DEL, iface->skt, NULL) == -1)
+		ewarning("cannot unregister socket with epoll: %s");
+
+	__atomic_store_n(&iface->down, 1, __ATOMIC_RELEASE);
+	for (unsigned v = 0; iface->vlan != NULL && v < IFACE_VLANS; ++v)
+		if (iface->vlan[v] != NULL)
+			__atomic_store_n(&iface->vlan[v]->down, 1,
+					 __ATOMIC_RELEASE);
+	notice("interface '%s' went down, pausing", iface->name);
+}
+
+/**
+ * @brief Reopen the raw socket of an interface that went down
+ *
+ * Only the one interface is reinitialized; the others carry on proxying.
+ * Must be called by the main thread, after @p iface_down().
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @param iface Pointer to the <tt>struct iface_t</tt> in @p ifaces to reopen
+ * @param epfd File descriptor for the @p epoll instance of its worker
+ * @return 0 if successful, or -1 if unsuccessful
+ */
+int iface_up(struct iface_t *ifaces, struct iface_t *iface, int epfd)
+{
+	if (iface_open(ifaces, iface, epfd) == -1) {
+		warning("cannot resume, interface '%s'", iface->name);
+		return -1;
+	}
+
+	__atomic_store_n(&iface->down, 0, __ATOMIC_RELEASE);
+	for (unsigned v = 0; iface->vlan != NULL && v < IFACE_VLANS; ++v)
+		if (iface->vlan[v] != NULL)
+			__atomic_store_n(&iface->vlan[v]->down, 0,
+					 __ATOMIC_RELEASE);
+	notice("interface '%s' is back up, resuming", iface->name);
+	return 0;
+}
+
+/**
+ * @brief Close the raw socket of an interface for good
+ *
+ * Also detaches its in-kernel datapath, if any, and frees its in-kernel packet
+ * counts.
+ *
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ */
+void iface_close(struct iface_t *iface)
+{
+	rings_unmap(iface);
+	offload_detach(iface);
+
+	if (iface->skt != 0)
+		close(iface->skt);
+	iface->skt = 0;
+
+	if (iface->kstat_map != 0)
+		close(iface->kstat_map);
+	iface->kstat_map = 0;
+}
+
+/**
+ * @brief Compare two sets of filters
+ * @return 1 if they filter the same packets, or 0 if not
+ */
+static int same_filter(const struct filter_t *a, const struct filter_t *b)
+{
+	struct filter_t none = { 0, 0, 0 };
+
+	if (a == NULL)
+		a = &none;
+	if (b == NULL)
+		b = &none;
+
+	return a->type == b->type && a->code == b->code &&
+	       a->state == b->state;
+}
+
+/**
+ * @brief Compare two paths, either of which may be @p NULL
+ * @return 1 if they are the same, or 0 if not
+ */
+static int same_path(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+
+	return strcmp(a, b) == 0;
+}
 
-		i->skt = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
-		if (i->skt == -1) {
-			eerr("cannot create raw socket, interface '%s': %s",
-			     i->name);
+/**
+ * @brief Compare two sets of scripts and hooks
+ * @return 1 if they run the same scripts, coalescing them alike, and notify
+ *         the same hooks, or 0 if not
+ */
+static int same_action(const struct action_t *a, const struct action_t *b)
+{
+	struct action_t none;
+	memset(&none, 0, sizeof(none));
+
+	if (a == NULL)
+		a = &none;
+	if (b == NULL)
+		b = &none;
+
+	for (int i = 0; i < 9; ++i)
+		if (!same_path(a->type[i], b->type[i]) ||
+		    !same_path(a->hook_type[i] ? a->hook_type[i]->path : NULL,
+			       b->hook_type[i] ? b->hook_type[i]->path : NULL))
+			return 0;
+	for (int i = 0; i < 5; ++i)
+		if (!same_path(a->code[i], b->code[i]) ||
+		    !same_path(a->hook_code[i] ? a->hook_code[i]->path : NULL,
+			       b->hook_code[i] ? b->hook_code[i]->path : NULL))
+			return 0;
+	for (int i = 0; i < 6; ++i)
+		if (!same_path(a->state[i], b->state[i]) ||
+		    !same_path(a->hook_state[i] ? a->hook_state[i]->path : NULL,
+			       b->hook_state[i] ? b->hook_state[i]->path : NULL))
+			return 0;
+
+	if (a->coalesce == NULL || b->coalesce == NULL)
+		return a->coalesce == b->coalesce;
+
+	return a->coalesce->window == b->coalesce->window &&
+	       a->coalesce->mode == b->coalesce->mode &&
+	       a->coalesce->per_mac == b->coalesce->per_mac;
+}
+
+/**
+ * @brief Compare two RX or TX ring configs
+ * @return 1 if they describe the same ring, or 0 if not
+ */
+static int same_ring(const struct ring_t *a, const struct ring_t *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+
+	return a->block_nr == b->block_nr && a->block_size == b->block_size &&
+	       a->timeout == b->timeout;
+}
+
+/**
+ * @brief Compare two capture configs, either of which may be @p NULL
+ * @return 1 if they describe the same capture, or 0 if not
+ */
+static int same_capture(const struct capture_t *a, const struct capture_t *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+
+	return strcmp(a->path, b->path) == 0 && a->size == b->size &&
+	       a->interval == b->interval && a->mmap == b->mmap;
+}
+
+/**
+ * @brief Compare two rate limits, either of which may be @p NULL
+ * @return 1 if they are the same rate limit, or 0 if not
+ */
+static int same_limit(const struct limit_t *a, const struct limit_t *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+
+	return a->pps == b->pps && a->burst == b->burst;
+}
+
+/**
+ * @brief Compare two lists of interfaces named by @p egress-to
+ * @return 1 if they name the same interfaces in the same order, or 0 if not
+ */
+static int same_peers(const struct peer_t *a, const struct peer_t *b)
+{
+	for (; a != NULL && b != NULL; a = a->next, b = b->next)
+		if (strcmp(a->name, b->name) != 0)
+			return 0;
+
+	return a == b;
+}
+
+/**
+ * @brief Apply the config of an interface as reloaded to the running
+ *        interface
+ *
+ * Everything set by the parser is moved over from @p conf, except @p set-mac,
+ * which is only ever done once. A pending @p set-mac-from follows the new
+ * config; one that has already been done stays done. In return, @p conf is
+ * left holding the previous config of @p iface, for the caller to free.
+ *
+ * The raw socket of @p iface is left as is, along with its counters and link
+ * state. Any rings are unmapped if they need to be recreated.
+ *
+ * @param iface Pointer to a running <tt>struct iface_t</tt>
+ * @param conf Pointer to the <tt>struct iface_t</tt> for the same interface in
+ *             a config that was reloaded
+ * @return A combination of @p IFACE_RECONF_CHANGED and @p IFACE_RECONF_REOPEN,
+ *         or 0 if nothing changed
+ */
+int iface_reconf(struct iface_t *iface, struct iface_t *conf)
+{
+	int ret = 0;
+	void *tmp;
+
+	struct ingress_t *i0 = iface->ingress, *i1 = conf->ingress;
+	struct egress_t *e0 = iface->egress, *e1 = conf->egress;
+
+	/* The in-kernel filter goes by the ingress config */
+	if (!same_filter(i0 ? i0->filter : NULL, i1 ? i1->filter : NULL) ||
+	    !same_action(i0 ? i0->action : NULL, i1 ? i1->action : NULL))
+		ret |= IFACE_RECONF_REOPEN;
+
+	if (!same_filter(e0 ? e0->filter : NULL, e1 ? e1->filter : NULL) ||
+	    !same_action(e0 ? e0->action : NULL, e1 ? e1->action : NULL) ||
+	    (e0 && e0->tci) != (e1 && e1->tci) ||
+	    (e0 && e0->tci && memcmp(e0->tci, e1->tci, sizeof(*e0->tci)) != 0))
+		ret |= IFACE_RECONF_CHANGED;
+
+	if (!same_capture(i0 ? i0->capture : NULL, i1 ? i1->capture : NULL) ||
+	    !same_capture(e0 ? e0->capture : NULL, e1 ? e1->capture : NULL))
+		ret |= IFACE_RECONF_CHANGED;
+
+	if (!same_limit(i0 ? i0->limit : NULL, i1 ? i1->limit : NULL) ||
+	    !same_limit(i0 ? i0->limit_mac : NULL, i1 ? i1->limit_mac : NULL))
+		ret |= IFACE_RECONF_CHANGED;
+
+	if (iface->promisc != conf->promisc ||
+	    iface->hw_timestamps != conf->hw_timestamps ||
+	    iface->offload != conf->offload ||
+	    iface->worker != conf->worker ||
+	    !same_ring(iface->rx_ring, conf->rx_ring) ||
+	    !same_ring(iface->tx_ring, conf->tx_ring))
+		ret |= IFACE_RECONF_REOPEN;
+
+	if (!same_peers(iface->egress_to, conf->egress_to) ||
+	    iface->spoke != conf->spoke || iface->unicast != conf->unicast)
+		ret |= IFACE_RECONF_CHANGED;
+
+	/* The in-kernel filter of a trunk lets everything through */
+	if ((iface->vlan_nr != 0) != (conf->vlan_nr != 0))
+		ret |= IFACE_RECONF_REOPEN;
+
+	if (iface->budget != conf->budget ||
+	    (iface->set_mac_from != 0 &&
+	     iface->set_mac_from != conf->set_mac_from))
+		ret |= IFACE_RECONF_CHANGED;
+
+	tmp = iface->ingress;
+	iface->ingress = conf->ingress;
+	conf->ingress = tmp;
+
+	tmp = iface->egress;
+	iface->egress = conf->egress;
+	conf->egress = tmp;
+
+	tmp = iface->egress_to;
+	iface->egress_to = conf->egress_to;
+	conf->egress_to = tmp;
+
+	/* Rings in use stay put unless the socket is to be reopened anyway */
+	if (ret & IFACE_RECONF_REOPEN) {
+		rings_unmap(iface);
+
+		tmp = iface->rx_ring;
+		iface->rx_ring = conf->rx_ring;
+		conf->rx_ring = tmp;
+
+		tmp = iface->tx_ring;
+		iface->tx_ring = conf->tx_ring;
+		conf->tx_ring = tmp;
+	}
+
+	iface->spoke = conf->spoke;
+	iface->unicast = conf->unicast;
+	memcpy(iface->trunk_name, conf->trunk_name, IFNAMSIZ);
+	iface->vid = conf->vid;
+	iface->vlan_nr = conf->vlan_nr;
+	iface->promisc = conf->promisc;
+	iface->hw_timestamps = conf->hw_timestamps;
+	iface->offload = conf->offload;
+	iface->worker = conf->worker;
+	iface->budget = conf->budget;
+	if (iface->set_mac_from != 0)
+		iface->set_mac_from = conf->set_mac_from;
+
+	return ret | (ret & IFACE_RECONF_REOPEN ? IFACE_RECONF_CHANGED : 0);
+}
+
+/**
+ * @brief Determine whether packets received on one interface are sent on
+ *        another
+ *
+ * Packets are sent on every other interface, except that a spoke never sends
+ * them on another spoke, unless the receiving interface names the ones to send
+ * them on with @p egress-to.
+ *
+ * @param from Pointer to the <tt>struct iface_t</tt> receiving packets
+ * @param to Pointer to a <tt>struct iface_t</tt> that might send them
+ * @return 1 if @p to sends packets received on @p from, or 0 if not
+ */
+int iface_routes(const struct iface_t *from, const struct iface_t *to)
+{
+	if (from == to)
+		return 0;
+
+	if (from->egress_to == NULL)
+		return from->spoke == 0 || to->spoke == 0;
+
+	for (const struct peer_t *p = from->egress_to; p != NULL; p = p->next)
+		if (strcmp(p->name, to->name) == 0)
+			return 1;
+
+	return 0;
+}
+
+/**
+ * @brief Link the virtual interfaces in a list to their trunks
+ *
+ * Each trunk gets a table of the virtual interfaces on it, indexed by VLAN, in
+ * which the interface of each frame it receives is looked up. Called before
+ * anything refers to the @p trunk or @p vlan fields of a list, and again
+ * whenever the list changes.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ */
+void iface_trunks(struct iface_t *ifaces)
+{
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next) {
+		free(i->vlan);
+		i->vlan = NULL;
+		i->trunk = NULL;
+	}
+
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next) {
+		if (i->trunk_name[0] == '\0')
 			continue;
-		}
 
-		sll.sll_ifindex = i->index;
-		sll.sll_pkttype = PACKET_HOST | PACKET_MULTICAST;
-		if (bind(i->skt, (struct sockaddr *)&sll, sizeof(sll)) == -1) {
-			eerr("cannot bind raw socket, interface '%s': %s",
-			     i->name);
-			goto close_socket;
-		}
+		struct iface_t *t = ifaces;
+		while (strcmp(t->name, i->trunk_name) != 0)
+			t = t->next;		/* Cf. check_virtual() */
 
-		if (sockopt(i) == -1 || epoll_register(epfd, i) == -1)
-			goto close_socket;	/* error messages in function */
-		debug("initialized interface '%s', index %d, socket %d",
-		      i->name, i->index, i->skt);
+		if (t->vlan == NULL &&
+		    (t->vlan = calloc(IFACE_VLANS, sizeof(*t->vlan))) == NULL)
+			ecritdie("cannot allocate VLAN table: %s");
 
-		++ret;
-		continue;
-close_socket:
-		close(i->skt);
+		t->vlan[i->vid] = i;
+		i->trunk = t;
 	}
-	return ret;
 }
 
 /**
@@ -328,6 +1176,22 @@ int iface_count(struct iface_t *ifaces)
 	return ret;
 }
 
+/**
+ * @brief Count number of workers that interfaces in a list are sharded across
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @return One more than the highest @p worker field in the list
+ */
+unsigned iface_workers(struct iface_t *ifaces)
+{
+	unsigned ret = 1;
+	for (; ifaces != NULL; ifaces = ifaces->next)
+		if (ifaces->worker >= ret)
+			ret = ifaces->worker + 1;
+	return ret;
+}
+
 /**
  * @brief Set the MAC address of a network interface
  * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
@@ -347,12 +1211,7 @@ int iface_set_mac(struct iface_t *iface, u_char *src_mac)
 		return -1;
 	}
 
-	cur_mac = get_mac(iface);
-	if (cur_mac == NULL) {
-		err("cannot determine current MAC, interface '%s'",
-		      iface->name);
-		return -1;
-	}
+	cur_mac = iface->mac;
 
 	if (memcmp(src_mac, cur_mac, ETH_ALEN) == 0) {
 		info("MAC already set to %s, interface '%s'",
@@ -364,7 +1223,7 @@ int iface_set_mac(struct iface_t *iface, u_char *src_mac)
 	strncpy(ifr.ifr_name, iface->name, IFNAMSIZ);
 
 	/* Unnecessary, but do it anyway so as to not depend upon iface->skt. */
-	skt = socket(AF_INET, SOCK_DGRAM, 0);
+	skt = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
 	if (skt == -1) {
 		eerr("cannot create socket to set MAC, interface '%s': %s",
 		     iface->name);
@@ -419,14 +1278,14 @@ int iface_set_mac(struct iface_t *iface, u_char *src_mac)
 /**
  * @brief Convert a MAC address to a string
  * @param mac Pointer to @p ETH_ALEN bytes containing a MAC address
- * @return Static buffer containing @p mac converted to a human-readable,
- *         colon-delimited MAC address
+ * @return Static buffer (one per thread) containing @p mac converted to a
+ *         human-readable, colon-delimited MAC address
  * @note Like @p ether_ntoa(3)
  * @see @p ether_ntoa(3)
  */
-char *iface_strmac(u_char *mac)
+char *iface_strmac(const u_char *mac)
 {
-	static char buf[19];
+	static _Thread_local char buf[19];
 	snprintf(buf, sizeof(buf), "%.02x:%.02x:%.02x:%.02x:%.02x:%.02x",
 	        mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 	return buf;
@@ -0,0 +1,204 @@
+/**
+ * @file latency.c
+ * @brief Low-latency operation
+ *
+ * With a @p low-latency stanza, the raw sockets and @p epoll instances busy
+ * poll the NIC for packets rather than sleeping until an interrupt wakes them,
+ * each worker is pinned to a CPU and may run at a real-time priority, and all
+ * our memory is locked, so that the forwarding path never page faults.
+ *
+ * All of it is best effort. Whatever the kernel does not support, or we lack
+ * the privileges for (typically @p CAP_NET_ADMIN, @p CAP_SYS_NICE and
+ * @p CAP_IPC_LOCK, or the corresponding resource limits), is logged and done
+ * without.
+ */
+#define _GNU_SOURCE			/* CPU_SET(3), pthread_setaffinity_np(3) */
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include "latency.h"
+#include "log.h"
+
+/**
+ * @name Per-socket busy poll options, as of Linux 5.11
+ * @{
+ */
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL		69
+#define SO_BUSY_POLL_BUDGET		70
+#endif
+/** @} */
+
+/**
+ * @brief Per-instance @p epoll busy poll parameters, as of Linux 6.9
+ *
+ * Linux <6.9 lacks them anyway, but we may still be built against its headers
+ * and run on something newer.
+ */
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+	uint32_t busy_poll_usecs;
+	uint16_t busy_poll_budget;
+	uint8_t prefer_busy_poll;
+	uint8_t __pad;
+};
+
+#define EPIOCSPARAMS			_IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+/**
+ * @brief Packets an @p epoll instance busy polls for at a time
+ * @note The most allowed without @p CAP_NET_ADMIN.
+ */
+#define LATENCY_EPOLL_BUDGET		64
+
+extern struct latency_t latency;
+
+/**
+ * @name Affinity of the main thread
+ *
+ * Children spawned by the main thread would otherwise be stuck on its CPU,
+ * cf. @p latency_spawn().
+ *
+ * @{
+ */
+static cpu_set_t unpinned;		/**< @brief Before it was pinned */
+static cpu_set_t pinned;		/**< @brief Since */
+static uint8_t is_pinned = 0;		/**< @brief Flag: Was it pinned? */
+/** @} */
+
+/**
+ * @brief Busy poll on the raw socket of an interface
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ */
+void latency_socket(struct iface_t *iface)
+{
+	if (latency.enabled == 0 || latency.busy_poll == 0)
+		return;
+
+	int usecs = latency.busy_poll, one = 1, budget = iface->budget;
+
+	if (setsockopt(iface->skt, SOL_SOCKET, SO_BUSY_POLL,
+		       &usecs, sizeof(usecs)) == -1) {
+		einfo("cannot busy poll on interface '%s': %s", iface->name);
+		return;
+	}
+
+	if (setsockopt(iface->skt, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+		       &one, sizeof(one)) == -1 ||
+	    setsockopt(iface->skt, SOL_SOCKET, SO_BUSY_POLL_BUDGET,
+		       &budget, sizeof(budget)) == -1)
+		einfo("cannot prefer busy polling on interface '%s': %s",
+		      iface->name);
+}
+
+/**
+ * @brief Busy poll in an @p epoll instance
+ * @param epfd File descriptor for the @p epoll instance
+ */
+void latency_epoll(int epfd)
+{
+	if (latency.enabled == 0 || latency.busy_poll == 0)
+		return;
+
+	struct epoll_params params;
+	memset(&params, 0, sizeof(params));
+	params.busy_poll_usecs = latency.busy_poll;
+	params.busy_poll_budget = LATENCY_EPOLL_BUDGET;
+	params.prefer_busy_poll = 1;
+
+	if (ioctl(epfd, EPIOCSPARAMS, &params) == -1)
+		einfo("cannot busy poll in epoll instance: %s");
+}
+
+/**
+ * @brief Pin the calling worker to its CPU, and raise its priority
+ *
+ * Worker @p id gets the CPU at @p id modulo the number of CPUs configured.
+ * Anything it spawns goes back to the normal scheduling policy.
+ *
+ * @param id Worker number, 0 for the main thread
+ */
+void latency_thread(unsigned id)
+{
+	if (latency.enabled == 0)
+		return;
+
+	if (latency.cpu_nr > 0) {
+		unsigned cpu = latency.cpu[id % latency.cpu_nr];
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+
+		if (id == 0 && is_pinned == 0 &&
+		    pthread_getaffinity_np(pthread_self(), sizeof(unpinned),
+					   &unpinned) != 0)
+			CPU_ZERO(&unpinned);
+
+		int ret = pthread_setaffinity_np(pthread_self(), sizeof(set),
+						 &set);
+		if (ret != 0) {
+			errno = ret;
+			ewarning("cannot pin worker %u to CPU %u: %s", id, cpu);
+		} else {
+			debug("pinned worker %u to CPU %u", id, cpu);
+			if (id == 0 && CPU_COUNT(&unpinned) > 0) {
+				pinned = set;
+				is_pinned = 1;
+			}
+		}
+	}
+
+	if (latency.realtime > 0) {
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = latency.realtime;
+
+		/* Only affects the calling thread */
+		if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK,
+				       &param) == -1)
+			ewarning("cannot run worker %u at SCHED_FIFO priority %u: %s",
+				 id, latency.realtime);
+		else
+			debug("running worker %u at SCHED_FIFO priority %u",
+			      id, latency.realtime);
+	}
+}
+
+/**
+ * @brief Lock all our memory, now and from now on
+ *
+ * Locks are not inherited across @p fork(2), so this is done once daemonized.
+ */
+void latency_lock(void)
+{
+	if (latency.enabled == 0)
+		return;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+		ewarning("cannot lock memory: %s");
+	else
+		info("locked memory");
+}
+
+/**
+ * @brief Let a child spawned by the main thread run on any CPU
+ *
+ * Children inherit the affinity of the thread that spawns them, and scripts
+ * and hooks have no business on the CPU of worker 0. Around each
+ * @p posix_spawn(3), the main thread is unpinned, then pinned again.
+ *
+ * @param spawning Flag: About to spawn, rather than done spawning?
+ */
+void latency_spawn(uint8_t spawning)
+{
+	if (is_pinned == 0)
+		return;
+
+	cpu_set_t *set = spawning == 1 ? &unpinned : &pinned;
+	pthread_setaffinity_np(pthread_self(), sizeof(*set), set);
+}
@@ -0,0 +1,90 @@
+/**
+ * @file limit.c
+ * @brief Token bucket rate limits
+ *
+ * A bucket is kept as the time at which it will next be full, rather than as a
+ * number of tokens and when they were last topped up. Each packet that takes a
+ * token pushes that time one token's worth further out, and there is a token
+ * to take as long as it is less than a full bucket's worth away. A bucket is
+ * thus a single word, and a new one (all zeroes) starts out full.
+ */
+#include <string.h>
+#include <sys/random.h>
+#include <linux/if_ether.h>
+#include "limit.h"
+#include "log.h"
+
+/** @brief Odd multipliers hashing a MAC address to a bucket in each row */
+static const uint64_t mult[LIMIT_SKETCH_ROWS] = {
+	0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL
+};
+
+/**
+ * @brief Take a token from a bucket, if there is one
+ * @param full Pointer to the bucket, i.e. when it will next be full, in
+ *             nanoseconds
+ * @param limit The rate limit the bucket is for
+ * @param now The current time, on the clock of receive timestamps
+ * @return 1 if a token was taken, or 0 if the bucket is empty
+ */
+int limit_take(uint64_t *full, const struct limit_t *limit,
+	       const struct timespec *now)
+{
+	uint64_t t = now->tv_sec * 1000000000ULL + now->tv_nsec;
+	uint64_t cost = 1000000000ULL / limit->pps;
+	uint64_t from = *full > t ? *full : t;
+
+	if (from + cost - t > limit->burst * cost)
+		return 0;
+
+	*full = from + cost;
+	return 1;
+}
+
+/**
+ * @brief Set up a sketch, with every bucket full
+ * @param sketch Pointer to the <tt>struct sketch_t</tt>
+ */
+void limit_sketch_init(struct sketch_t *sketch)
+{
+	memset(sketch, 0, sizeof(*sketch));
+
+	if (getrandom(sketch->seed, sizeof(sketch->seed), GRND_NONBLOCK) !=
+	    sizeof(sketch->seed))
+		ewarning("cannot seed rate limits, hashing predictably: %s");
+}
+
+/**
+ * @brief Take a token from the buckets of a source address in a sketch
+ * @param sketch Pointer to the <tt>struct sketch_t</tt>
+ * @param mac The source address
+ * @param limit The rate limit the sketch is for
+ * @param now The current time, on the clock of receive timestamps
+ * @return 1 if a token was taken, or 0 if the buckets are empty
+ */
+int limit_sketch(struct sketch_t *sketch, const uint8_t *mac,
+		 const struct limit_t *limit, const struct timespec *now)
+{
+	uint64_t *bucket[LIMIT_SKETCH_ROWS];
+	uint64_t key = 0, full = UINT64_MAX;
+
+	memcpy(&key, mac, ETH_ALEN);
+
+	for (int r = 0; r < LIMIT_SKETCH_ROWS; ++r) {
+		uint64_t b = ((key ^ sketch->seed[r]) * mult[r]) >>
+			     (64 - LIMIT_SKETCH_BITS);
+
+		bucket[r] = &sketch->full[r][b];
+		if (*bucket[r] < full)
+			full = *bucket[r];
+	}
+
+	if (limit_take(&full, limit, now) == 0)
+		return 0;
+
+	for (int r = 0; r < LIMIT_SKETCH_ROWS; ++r)
+		if (*bucket[r] < full)
+			*bucket[r] = full;
+
+	return 1;
+}
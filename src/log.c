@@ -1,21 +1,80 @@
 /**
  * @file log.c
  * @brief Logging operations
+ *
+ * With @p -a, messages are not emitted by the thread that logs them. Instead,
+ * each thread that called @p log_thread() copies them into a ring of its own,
+ * and a background thread emits whatever the rings hold every
+ * @p LOG_ASYNC_INTERVAL. A thread whose ring is full drops its messages and
+ * counts them, rather than waiting.
  */
+#include <pthread.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include "args.h"
 #include "defaults.h"
 #include "log.h"
+#include "parser.h"
 #include "peapod.h"
+#include "spsc.h"
 
 #define DAEMONIZED	2		/**< @brief Console output disabled */
-#define MSGSIZ		1024		/**< @brief Log message buffer size */
+#define MSGSIZ		4096		/**< @brief Log message buffer size, cf. @p stats_dump() */
 #define TMSIZ		64		/**< @brief Timestamp buffer size */
 
-static void log_to_file(const char *msg, int level, FILE* out);
+/**
+ * @name Asynchronous logging
+ * @{
+ */
+#define LOG_ASYNC_SLOTS		1024	/**< @brief Records in the ring of each thread */
+#define LOG_ASYNC_RECSIZ	256	/**< @brief Size of a record */
+#define LOG_ASYNC_INTERVAL	10000000	/**< @brief Nanoseconds between emitting records */
+/** @} */
+
+/**
+ * @brief A record in the ring of a thread
+ *
+ * A message longer than one record spans several, which are committed at
+ * once. The first one says how many.
+ */
+struct log_rec_t {
+	struct timespec ts;		/**< @brief When the message was logged */
+	uint8_t level;			/**< @brief Level of the message */
+	uint8_t parts;			/**< @brief Number of records, in the first one */
+	uint16_t len;			/**< @brief Length of the text in this record */
+	char text[];			/**< @brief Part of the message, not terminated */
+};
+
+/** @brief Length of the text in a record */
+#define LOG_ASYNC_TEXT	(LOG_ASYNC_RECSIZ - sizeof(struct log_rec_t))
+
+/** @brief The ring of a thread */
+struct log_ring_t {
+	struct spsc_t q;		/**< @brief Records */
+	unsigned long dropped;		/**< @brief Messages dropped so far; written by the thread */
+	unsigned long reported;		/**< @brief Of those, how many were reported */
+};
+
+/**
+ * @brief A timestamp, formatted at most once per second
+ * @see @p log_to_file()
+ */
+struct log_tm_t {
+	time_t sec;			/**< @brief Second the timestamp is for */
+	char buf[TMSIZ];		/**< @brief The timestamp */
+};
+
+static void log_to_file(const char *msg, int level,
+			const struct timespec *ts, FILE* out, uint8_t flush);
+static void log_emit(const char *msg, int level, const struct timespec *ts,
+		     uint8_t flush);
+static void log_push(const char *msg, int level, const struct timespec *ts);
+static void log_drain(void);
+static void *log_work(void *arg);
+static void log_stop(void);
 
 /**
  * @name Log level descriptions
@@ -51,10 +110,21 @@ static const char *clevels[] = {
 /** @} */
 
 static FILE *log_fs = NULL;		/**< @brief Log file */
-static char log_buf[MSGSIZ] = { "" };	/**< @brief Log message buffer */
-static char log_tm[TMSIZ] = { "" };	/**< @brief Timestamp buffer */
+static _Thread_local char log_buf[MSGSIZ];	/**< @brief Log message buffer, per thread */
+static _Thread_local struct log_tm_t log_tm[2];	/**< @brief Console and file timestamps, per thread */
 extern struct args_t args;
 
+/**
+ * @name Asynchronous logging
+ * @{
+ */
+static struct log_ring_t *log_rings[IFACE_WORKERS_MAX];	/**< @brief Rings, by worker */
+static _Thread_local struct log_ring_t *log_ring = NULL;	/**< @brief Ring of the current thread, if any */
+static uint8_t log_async = 0;		/**< @brief Flag: Is the background thread running? */
+static uint8_t log_stopping = 0;	/**< @brief Flag: Should the background thread exit? */
+static pthread_t log_thr;		/**< @brief The background thread */
+/** @} */
+
 /**
  * @brief Log a message to a file or to the console
  *
@@ -63,34 +133,178 @@ extern struct args_t args;
  *
  * @param msg A message to be logged
  * @param level The level of the message
+ * @param ts When the message was logged
  * @param out File stream of log file, or @p NULL to emit to the console
+ * @param flush Flag: Flush @p out afterwards?
  * @note @p level may be the @p syslog levels (@p LOG_EMERG to @p LOG_DEBUG,
  *       i.e. 0 to 7), or our own @p LOG_DEBUGLOW (8). <br />
  *       Output to console emits to @p stderr if @p level is below
  *       @p LOG_WARNING, and to @p stdout otherwise.
  */
-static void log_to_file(const char *msg, int level, FILE* out)
+static void log_to_file(const char *msg, int level,
+			const struct timespec *ts, FILE* out, uint8_t flush)
 {
-	static struct timespec ts;
+	struct log_tm_t *tm;
 	const char *fmt;
 	const char *desc;
 
-	timespec_get(&ts, TIME_UTC);
-
 	if (out == NULL) {
 		out = level < LOG_WARNING ? stderr : stdout;
 		fmt = "%X";
 		desc = args.color ? clevels[level] : levels[level];
+		tm = &log_tm[0];
 	} else {
 		fmt = "%x %X";
 		desc = levels[level];
+		tm = &log_tm[1];
+	}
 
+	if (tm->sec != ts->tv_sec || tm->buf[0] == '\0') {
+		struct tm local;
+
+		strftime(tm->buf, TMSIZ, fmt, localtime_r(&ts->tv_sec, &local));
+		tm->sec = ts->tv_sec;
 	}
 
-	strftime(log_tm, TMSIZ, fmt, localtime(&ts.tv_sec));
 	fprintf(out, "%s.%.03ld %s %s\n",
-		log_tm, ts.tv_nsec / 1000000, desc, msg);
-	fflush(out);
+		tm->buf, ts->tv_nsec / 1000000, desc, msg);
+	if (flush)
+		fflush(out);
+}
+
+/**
+ * @brief Emit a message to the console, a log file, and/or @p syslog
+ * @param msg A message to be logged
+ * @param level The level of the message
+ * @param ts When the message was logged
+ * @param flush Flag: Flush output afterwards?
+ */
+static void log_emit(const char *msg, int level, const struct timespec *ts,
+		     uint8_t flush)
+{
+	if (args.daemon != DAEMONIZED)	/* Console output is still enabled */
+		log_to_file(msg, level, ts, NULL, flush);
+
+	if (log_fs != NULL)
+		log_to_file(msg, level, ts, log_fs, flush);
+
+	if (args.syslog == 1 && level != LOG_DEBUGLOW)
+		syslog(level, "<%d> %s", level, msg);
+}
+
+/**
+ * @brief Queue a message in the ring of the current thread
+ *
+ * If the ring doesn't have room for the whole message, it is dropped.
+ *
+ * @param msg A message to be logged
+ * @param level The level of the message
+ * @param ts When the message was logged
+ */
+static void log_push(const char *msg, int level, const struct timespec *ts)
+{
+	size_t len = strlen(msg);
+	unsigned parts = len ? (len + LOG_ASYNC_TEXT - 1) / LOG_ASYNC_TEXT : 1;
+	struct log_rec_t *rec;
+
+	for (unsigned n = 0; n < parts; ++n, msg += LOG_ASYNC_TEXT) {
+		if ((rec = spsc_reserve_nth(&log_ring->q, n)) == NULL) {
+			__atomic_store_n(&log_ring->dropped,
+					 log_ring->dropped + 1,
+					 __ATOMIC_RELAXED);
+			return;
+		}
+
+		rec->len = len - n * LOG_ASYNC_TEXT < LOG_ASYNC_TEXT ?
+			   len - n * LOG_ASYNC_TEXT : LOG_ASYNC_TEXT;
+		memcpy(rec->text, msg, rec->len);
+		if (n == 0) {
+			rec->ts = *ts;
+			rec->level = level;
+			rec->parts = parts;
+		}
+	}
+
+	spsc_commit_nr(&log_ring->q, parts);
+}
+
+/** @brief Emit whatever the rings of all threads hold, in batches */
+static void log_drain(void)
+{
+	struct log_rec_t *rec;
+	struct timespec ts;
+
+	for (unsigned id = 0; id < IFACE_WORKERS_MAX; ++id) {
+		struct log_ring_t *ring = __atomic_load_n(&log_rings[id],
+							  __ATOMIC_ACQUIRE);
+		if (ring == NULL)
+			continue;
+
+		while ((rec = spsc_peek(&ring->q)) != NULL) {
+			unsigned parts = rec->parts;
+			int level = rec->level;
+			size_t len = 0;
+
+			ts = rec->ts;
+			for (unsigned n = 0; n < parts; ++n) {
+				if (n > 0)
+					rec = spsc_peek(&ring->q);
+				memcpy(log_buf + len, rec->text, rec->len);
+				len += rec->len;
+				spsc_release(&ring->q);
+			}
+			log_buf[len] = '\0';
+
+			log_emit(log_buf, level, &ts, 0);
+		}
+
+		unsigned long dropped = __atomic_load_n(&ring->dropped,
+							__ATOMIC_RELAXED);
+		if (dropped != ring->reported) {
+			timespec_get(&ts, TIME_UTC);
+			snprintf(log_buf, MSGSIZ, "%lu messages were dropped, "
+				 "worker %u", dropped - ring->reported, id);
+			log_emit(log_buf, LOG_WARNING, &ts, 0);
+			ring->reported = dropped;
+		}
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+	if (log_fs != NULL)
+		fflush(log_fs);
+}
+
+/**
+ * @brief The background thread
+ * @param arg Unused
+ * @return @p NULL
+ */
+static void *log_work(void *arg)
+{
+	const struct timespec interval = { 0, LOG_ASYNC_INTERVAL };
+	(void)arg;
+
+	while (__atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE) == 0) {
+		log_drain();
+		nanosleep(&interval, NULL);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Stop the background thread, then emit whatever is left
+ * @note Registered with @p atexit(3).
+ */
+static void log_stop(void)
+{
+	if (__atomic_exchange_n(&log_async, 0, __ATOMIC_ACQ_REL) == 0)
+		return;
+
+	__atomic_store_n(&log_stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(log_thr, NULL);
+	log_drain();
 }
 
 /**
@@ -108,7 +322,7 @@ int log_init(void)
 	}
 
 	if (args.logfile != NULL) {
-		log_fs = fopen(args.logfile, "a");
+		log_fs = fopen(args.logfile, "ae");	/* O_CLOEXEC */
 		if (log_fs != NULL)  {
 			notice("logging to '%s'", args.logfile);
 		} else {
@@ -135,7 +349,7 @@ int log_daemonize(void)
 		return -1;
 
 	if (args.logfile != NULL) {
-		log_fs = fopen(args.logfile, "a");
+		log_fs = fopen(args.logfile, "ae");	/* O_CLOEXEC */
 		if (log_fs == NULL) {
 			eerr("cannot reopen log file '%s': %s", args.logfile);
 			return -1;
@@ -145,6 +359,65 @@ int log_daemonize(void)
 	return 0;
 }
 
+/**
+ * @brief Start logging asynchronously
+ *
+ * Sets up a ring for the main thread and starts the background thread. If that
+ * fails, logging remains synchronous.
+ *
+ * @note Must be called after daemonizing, which doesn't preserve threads.
+ */
+void log_start(void)
+{
+	int err;
+
+	__atomic_store_n(&log_async, 1, __ATOMIC_RELEASE);
+	log_thread(0);
+	if (log_ring == NULL) {
+		__atomic_store_n(&log_async, 0, __ATOMIC_RELEASE);
+		return;
+	}
+
+	if ((err = pthread_create(&log_thr, NULL, log_work, NULL)) != 0) {
+		log_ring = NULL;
+		__atomic_store_n(&log_async, 0, __ATOMIC_RELEASE);
+		errno = err;
+		ewarning("cannot log asynchronously: %s");
+		return;
+	}
+
+	atexit(log_stop);
+	info("logging asynchronously");
+}
+
+/**
+ * @brief Set up the current thread to log asynchronously, if enabled
+ *
+ * Each worker has its own ring, which is kept when the worker is restarted.
+ *
+ * @param id The worker, cf. the @p worker field of <tt>struct iface_t</tt>
+ */
+void log_thread(unsigned id)
+{
+	if (__atomic_load_n(&log_async, __ATOMIC_ACQUIRE) == 0)
+		return;
+
+	if (log_rings[id] == NULL) {
+		struct log_ring_t *ring = aligned_alloc(SPSC_CACHELINE,
+							sizeof(*ring));
+		if (ring == NULL ||
+		    spsc_init(&ring->q, LOG_ASYNC_SLOTS, LOG_ASYNC_RECSIZ) == -1) {
+			free(ring);
+			ewarning("cannot log asynchronously, worker %u: %s", id);
+			return;
+		}
+		ring->dropped = ring->reported = 0;
+		__atomic_store_n(&log_rings[id], ring, __ATOMIC_RELEASE);
+	}
+
+	log_ring = log_rings[id];
+}
+
 /**
  * @brief Log a message
  *
@@ -169,7 +442,7 @@ void log_msg(int level, const char *file, int line, const char *fmt, ...)
 	if (level > args.level)
 		return;
 
-	static int len;
+	int len;
 
 	if (line > 0) {
 		len = snprintf(log_buf, MSGSIZ, "%s:%d | ", file, line);
@@ -189,15 +462,13 @@ void log_msg(int level, const char *file, int line, const char *fmt, ...)
 	if (len > (MSGSIZ - 4))
 		sprintf(log_buf + (MSGSIZ - 4), "...");
 
-	if (args.daemon != DAEMONIZED)	/* Console output is still enabled */
-		log_to_file(log_buf, level, NULL);
-
-	if (log_fs != NULL)
-		log_to_file(log_buf, level, log_fs);
-
-	if (args.syslog == 1 && level != LOG_DEBUGLOW)
-		syslog(level, "<%d> %s", level, log_buf);
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
 
+	if (log_ring != NULL && __atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+		log_push(log_buf, level, &ts);
+	else
+		log_emit(log_buf, level, &ts, 1);
 
 	if (len > (MSGSIZ - 4)) {
 		warning("previous message too long; %d characters were lost",
@@ -0,0 +1,317 @@
+/**
+ * @file netlink.c
+ * @brief Link state of network interfaces, as reported by rtnetlink
+ *
+ * Whether each configured interface is up, its MTU and its MAC address are
+ * read all at once with a single @p RTM_GETLINK dump, then kept up to date from
+ * the link notifications the kernel sends to the @p RTMGRP_LINK group, rather
+ * than by asking the kernel about each interface in turn.
+ *
+ * @see @p rtnetlink(7)
+ */
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if_arp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "iface.h"
+#include "log.h"
+#include "netlink.h"
+#include "proxy.h"
+
+static void share(struct iface_t *ifaces, const struct iface_t *trunk);
+static void update(struct iface_t *ifaces, struct nlmsghdr *nlh,
+		   uint8_t quiet);
+static int parse(struct iface_t *ifaces, ssize_t len, uint8_t quiet);
+
+/** @brief Size of the buffer for rtnetlink messages, as per @p netlink(7) */
+#define NETLINK_BUF			8192
+
+/** @brief Socket subscribed to link notifications, or -1 */
+static int nlfd = -1;
+
+/** @brief Sequence number of the last dump requested */
+static uint32_t dump_seq = 0;
+
+/** @brief Buffer for rtnetlink messages */
+static _Alignas(struct nlmsghdr) uint8_t nlbuf[NETLINK_BUF];
+
+/**
+ * @brief Copy the link state of a trunk to the virtual interfaces on it
+ *
+ * The kernel knows nothing of virtual interfaces; they are up, and have an MTU
+ * and a MAC address, as far as their trunk does.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @param trunk Pointer to the <tt>struct iface_t</tt> in @p ifaces whose link
+ *              state changed
+ */
+static void share(struct iface_t *ifaces, const struct iface_t *trunk)
+{
+	if (trunk->vlan_nr == 0)
+		return;
+
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next) {
+		if (i->trunk != trunk)
+			continue;
+
+		i->flags = trunk->flags;
+		i->type = trunk->type;
+		i->mtu = trunk->mtu;
+		memcpy(i->mac, trunk->mac, ETH_ALEN);
+	}
+}
+
+/**
+ * @brief Update the link state of an interface from an rtnetlink message
+ *
+ * Messages about interfaces that are not configured are ignored.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @param nlh An @p RTM_NEWLINK or @p RTM_DELLINK message
+ * @param quiet Flag: Don't log changes, e.g. during a dump at startup?
+ */
+static void update(struct iface_t *ifaces, struct nlmsghdr *nlh,
+		   uint8_t quiet)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+	struct iface_t *iface;
+
+	if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+		return;
+
+	for (iface = ifaces; iface != NULL; iface = iface->next)
+		if (iface->index == (unsigned)ifi->ifi_index)
+			break;
+	if (iface == NULL)
+		return;
+
+	if (nlh->nlmsg_type == RTM_DELLINK) {
+		if (quiet != 1)
+			notice("interface '%s' was removed", iface->name);
+		iface->flags = 0;
+		share(ifaces, iface);
+		return;
+	}
+
+	unsigned flags = ifi->ifi_flags;
+	int mtu = iface->mtu;
+	u_char mac[ETH_ALEN];
+	memcpy(mac, iface->mac, ETH_ALEN);
+
+	int len = IFLA_PAYLOAD(nlh);
+	for (struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, len);
+	     rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == IFLA_MTU &&
+		    RTA_PAYLOAD(rta) >= sizeof(uint32_t))
+			mtu = *(uint32_t *)RTA_DATA(rta);
+		else if (rta->rta_type == IFLA_ADDRESS &&
+			 RTA_PAYLOAD(rta) == ETH_ALEN)
+			memcpy(mac, RTA_DATA(rta), ETH_ALEN);
+	}
+
+	if (quiet != 1) {
+		if ((flags & IFF_UP) != (iface->flags & IFF_UP))
+			info("interface '%s' is %s", iface->name,
+			     flags & IFF_UP ? "up" : "down");
+		if (mtu != iface->mtu)
+			notice("MTU changed from %d to %d, interface '%s'",
+			       iface->mtu, mtu, iface->name);
+		if (memcmp(mac, iface->mac, ETH_ALEN) != 0)
+			info("MAC changed to %s, interface '%s'",
+			     iface_strmac(mac), iface->name);
+	}
+
+	iface->flags = flags;
+	iface->type = ifi->ifi_type;
+	iface->mtu = mtu;
+	memcpy(iface->mac, mac, ETH_ALEN);
+	share(ifaces, iface);
+}
+
+/**
+ * @brief Walk the rtnetlink messages received into @p nlbuf
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @param len Number of bytes received
+ * @param quiet Flag: Don't log changes? Cf. @p update()
+ * @return 1 if the end of a dump was reached, -1 if the kernel reported an
+ *         error (in @p errno), or 0 otherwise
+ */
+static int parse(struct iface_t *ifaces, ssize_t len, uint8_t quiet)
+{
+	for (struct nlmsghdr *nlh = (struct nlmsghdr *)nlbuf;
+	     NLMSG_OK(nlh, len);
+	     nlh = NLMSG_NEXT(nlh, len)) {
+		switch (nlh->nlmsg_type) {
+		case NLMSG_DONE:
+			return 1;
+		case NLMSG_ERROR:
+			errno = -((struct nlmsgerr *)NLMSG_DATA(nlh))->error;
+			return -1;
+		case RTM_NEWLINK:
+		case RTM_DELLINK:
+			update(ifaces, nlh, quiet);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Subscribe to link notifications
+ *
+ * On the first call, creates an rtnetlink socket subscribed to @p RTMGRP_LINK.
+ * On every call, registers that socket with @p epfd, tagged with
+ * @p PROXY_TAG_NETLINK.
+ *
+ * Should be called before @p netlink_dump(), so that no change can slip in
+ * between the two.
+ *
+ * @param epfd File descriptor for an @p epoll instance
+ * @return 0 if successful, or -1 if unsuccessful
+ */
+int netlink_init(int epfd)
+{
+	if (nlfd == -1) {
+		nlfd = socket(AF_NETLINK,
+			      SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			      NETLINK_ROUTE);
+		if (nlfd == -1) {
+			eerr("cannot create rtnetlink socket: %s");
+			return -1;
+		}
+
+		struct sockaddr_nl snl;
+		memset(&snl, 0, sizeof(snl));
+		snl.nl_family = AF_NETLINK;
+		snl.nl_groups = RTMGRP_LINK;
+
+		if (bind(nlfd, (struct sockaddr *)&snl, sizeof(snl)) == -1) {
+			eerr("cannot subscribe to link notifications: %s");
+			close(nlfd);
+			nlfd = -1;
+			return -1;
+		}
+	}
+
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = PROXY_TAG_NETLINK;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, nlfd, &event) == -1) {
+		eerr("cannot register rtnetlink socket with epoll: %s");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Read the link state of all configured interfaces at once
+ *
+ * Sets the @p flags, @p type, @p mtu and @p mac fields of each interface in
+ * @p ifaces from a single @p RTM_GETLINK dump. Those of interfaces the kernel
+ * doesn't know about are cleared, and those of virtual interfaces copied from
+ * their trunks, which must already be linked, cf. @p iface_trunks().
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @return 0 if successful, or -1 if unsuccessful
+ */
+int netlink_dump(struct iface_t *ifaces)
+{
+	int ret = -1;
+
+	int skt = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (skt == -1) {
+		eerr("cannot create rtnetlink socket: %s");
+		return -1;
+	}
+
+	struct {
+		struct nlmsghdr nlh;
+		struct ifinfomsg ifi;
+	} req;
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = sizeof(req);
+	req.nlh.nlmsg_type = RTM_GETLINK;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nlh.nlmsg_seq = ++dump_seq;
+	req.ifi.ifi_family = AF_UNSPEC;
+
+	if (send(skt, &req, sizeof(req), 0) == -1) {
+		eerr("cannot request link state: %s");
+		goto dump_close;
+	}
+
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next) {
+		i->flags = 0;
+		i->type = 0;
+		i->mtu = 0;
+	}
+
+	while (1) {
+		ssize_t len = recv(skt, nlbuf, sizeof(nlbuf), 0);
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			eerr("cannot read link state: %s");
+			goto dump_close;
+		}
+
+		int done = parse(ifaces, len, 1);
+		if (done == -1) {
+			eerr("cannot read link state: %s");
+			goto dump_close;
+		}
+		if (done == 1)
+			break;
+	}
+
+	ret = 0;
+dump_close:
+	close(skt);
+	return ret;
+}
+
+/**
+ * @brief Handle pending link notifications
+ *
+ * Should the kernel have dropped any for lack of buffer space, the link state
+ * of all interfaces is read anew with @p netlink_dump().
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @return 0 if successful, or -1 if unsuccessful
+ */
+int netlink_recv(struct iface_t *ifaces)
+{
+	while (1) {
+		ssize_t len = recv(nlfd, nlbuf, sizeof(nlbuf), MSG_DONTWAIT);
+		if (len == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				warning("missed link notifications, "
+					"rereading link state");
+				if (netlink_dump(ifaces) == -1)
+					return -1;
+				continue;
+			}
+			eerr("cannot receive link notifications: %s");
+			return -1;
+		}
+
+		parse(ifaces, len, 0);
+	}
+}
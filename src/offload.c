@@ -0,0 +1,521 @@
+/**
+ * @file offload.c
+ * @brief In-kernel datapath for interfaces that don't need us to see packets
+ *
+ * An interface with @p offload set, no ingress scripts, hooks or rate limits,
+ * and no interface waiting to @p set-mac-from it can have its EAPOL packets
+ * proxied entirely by an eBPF program on its TC ingress hook, provided no other
+ * interface has egress scripts or hooks either, nor is a session table kept,
+ * which needs to see every packet. The program does what the ingress and
+ * egress phases would otherwise do: it drops ingress-filtered packets, and
+ * sends a copy of everything else to every interface it routes to (cf.
+ * @p iface_routes()) that is not filtering it on egress, with that
+ * interface's 802.1Q edits applied.
+ *
+ * The program is generated from the parsed config, so that all the decisions
+ * that don't depend on the packet are made once, here, rather than per packet.
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/pkt_cls.h>
+#include <sys/syscall.h>
+#include "iface.h"
+#include "log.h"
+#include "offload.h"
+
+/**
+ * @brief The TCX ingress attach type, as of Linux 6.6
+ *
+ * Linux <6.6 lacks it anyway, but we may still be built against its headers
+ * and run on something newer. @p BPF_F_BEFORE arrived along with it.
+ */
+#ifndef BPF_F_BEFORE
+#define BPF_TCX_INGRESS			46
+#endif
+
+/** @brief Maximum number of instructions in a generated program */
+#define OFFLOAD_INSNS_MAX		4096
+
+/**
+ * @name Registers with a fixed role in a generated program
+ *
+ * All are callee-saved, so they survive helper calls.
+ * @{
+ */
+#define R_SKB		6	/**< @brief The @p __sk_buff context */
+#define R_VLAN		7	/**< @brief Flag: Was the packet received tagged? */
+#define R_TCI		8	/**< @brief TCI of the packet as received */
+#define R_PKT		9	/**< @brief EAPOL Packet Type | EAP Code << 8 */
+/** @} */
+
+/**
+ * @name Labels in a generated program
+ * @{
+ */
+#define L_PASS		0	/**< @brief Not an EAPOL packet */
+#define L_FILTERED	1	/**< @brief Filtered on ingress */
+#define L_NEXT		2	/**< @brief End of the current egress interface */
+#define L_SKIP		3	/**< @brief Resolved before the emitting function returns */
+/** @} */
+
+/** @brief A program being generated */
+struct prog_t {
+	struct bpf_insn insn[OFFLOAD_INSNS_MAX];	/**< @brief Instructions */
+	unsigned len;			/**< @brief Number of instructions */
+	unsigned fix_at[OFFLOAD_INSNS_MAX];	/**< @brief Jumps to labels */
+	uint8_t fix_label[OFFLOAD_INSNS_MAX];	/**< @brief Their labels */
+	unsigned fix_nr;		/**< @brief Number of jumps to labels */
+};
+
+static int eligible(struct iface_t *iface, struct iface_t *ifaces);
+static void emit(struct prog_t *p, uint8_t code, uint8_t dst, uint8_t src,
+		 int16_t off, int32_t imm);
+static void jump(struct prog_t *p, uint8_t op, uint8_t dst, int32_t imm,
+		 uint8_t label);
+static void resolve(struct prog_t *p, uint8_t label);
+static void emit_filter(struct prog_t *p, struct filter_t *filter,
+			uint8_t label);
+static void emit_count(struct prog_t *p, int map, uint32_t key);
+static void emit_vlan(struct prog_t *p, struct tci_t *tci);
+static int generate(struct prog_t *p, struct iface_t *iface,
+		    struct iface_t *ifaces, int map);
+
+extern struct sessions_t sessions;
+
+/** @brief Shorthand for @p BPF_ALU64 instructions */
+#define ALU(p, op, dst, src, imm)					\
+	emit(p, BPF_ALU64 | (op) | ((src) == -1 ? BPF_K : BPF_X), dst,	\
+	     (src) == -1 ? 0 : (src), 0, imm)
+
+/** @brief Shorthand for loading a 32-bit field of the @p __sk_buff */
+#define LDX_SKB(p, dst, field)						\
+	emit(p, BPF_LDX | BPF_MEM | BPF_W, dst, R_SKB,			\
+	     offsetof(struct __sk_buff, field), 0)
+
+/** @brief Shorthand for a helper call */
+#define CALL(p, fn)	emit(p, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_##fn)
+
+/**
+ * @brief Determine whether an interface can be offloaded, and say why not
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @return 1 if the interface can be offloaded, or 0 if not
+ */
+static int eligible(struct iface_t *iface, struct iface_t *ifaces)
+{
+	struct action_t empty;
+	memset(&empty, 0, sizeof(empty));
+
+	if (sessions.max != 0) {
+		info("not offloading interface '%s', sessions are tracked",
+		     iface->name);
+		return 0;
+	}
+
+	if (iface->trunk != NULL || iface->vlan_nr != 0) {
+		info("not offloading interface '%s', it is %s trunk",
+		     iface->name, iface->trunk != NULL ? "on a" : "a");
+		return 0;
+	}
+
+	if (iface->ingress != NULL && iface->ingress->action != NULL &&
+	    memcmp(iface->ingress->action, &empty, sizeof(empty)) != 0) {
+		info("not offloading interface '%s', it has ingress actions",
+		     iface->name);
+		return 0;
+	}
+
+	if (iface->ingress != NULL && iface->ingress->capture != NULL) {
+		info("not offloading interface '%s', it has an ingress capture",
+		     iface->name);
+		return 0;
+	}
+
+	if (iface->ingress != NULL &&
+	    (iface->ingress->limit != NULL || iface->ingress->limit_mac != NULL)) {
+		info("not offloading interface '%s', it has an ingress rate limit",
+		     iface->name);
+		return 0;
+	}
+
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next) {
+		if (i->set_mac_from == iface->index) {
+			info("not offloading interface '%s', interface '%s' "
+			     "sets its MAC from it", iface->name, i->name);
+			return 0;
+		}
+
+		if (i != iface && i->egress != NULL &&
+		    i->egress->action != NULL &&
+		    memcmp(i->egress->action, &empty, sizeof(empty)) != 0) {
+			info("not offloading interface '%s', interface '%s' "
+			     "has egress actions", iface->name, i->name);
+			return 0;
+		}
+
+		if (i->trunk != NULL && iface_routes(iface, i) == 1) {
+			info("not offloading interface '%s', interface '%s' "
+			     "is virtual", iface->name, i->name);
+			return 0;
+		}
+
+		if (i != iface && i->egress != NULL &&
+		    i->egress->capture != NULL) {
+			info("not offloading interface '%s', interface '%s' "
+			     "has an egress capture", iface->name, i->name);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/** @brief Append an instruction to a program, if there is room */
+static void emit(struct prog_t *p, uint8_t code, uint8_t dst, uint8_t src,
+		 int16_t off, int32_t imm)
+{
+	if (p->len == OFFLOAD_INSNS_MAX) {
+		++p->len;		/* Overflowed; caught by generate() */
+		return;
+	}
+	if (p->len > OFFLOAD_INSNS_MAX)
+		return;
+
+	struct bpf_insn *insn = &p->insn[p->len++];
+	insn->code = code;
+	insn->dst_reg = dst;
+	insn->src_reg = src;
+	insn->off = off;
+	insn->imm = imm;
+}
+
+/**
+ * @brief Append a conditional jump (or, with @p BPF_JA, an unconditional one)
+ *        to a label
+ * @param p The program
+ * @param op @p BPF_JEQ, @p BPF_JNE, @p BPF_JGT, or @p BPF_JA
+ * @param dst Register compared with @p imm
+ * @param imm Immediate compared with @p dst
+ * @param label The label, resolved by @p resolve()
+ */
+static void jump(struct prog_t *p, uint8_t op, uint8_t dst, int32_t imm,
+		 uint8_t label)
+{
+	if (p->len < OFFLOAD_INSNS_MAX) {
+		p->fix_at[p->fix_nr] = p->len;
+		p->fix_label[p->fix_nr++] = label;
+	}
+	emit(p, BPF_JMP | op | BPF_K, dst, 0, 0, imm);
+}
+
+/**
+ * @brief Point every pending jump to a label at the next instruction
+ *
+ * Labels are only ever jumped to forwards, so a label may be reused once it
+ * has been resolved.
+ */
+static void resolve(struct prog_t *p, uint8_t label)
+{
+	unsigned n = 0;
+
+	for (unsigned i = 0; i < p->fix_nr; ++i) {
+		if (p->fix_label[i] == label) {
+			p->insn[p->fix_at[i]].off = p->len - p->fix_at[i] - 1;
+		} else {
+			p->fix_at[n] = p->fix_at[i];
+			p->fix_label[n++] = p->fix_label[i];
+		}
+	}
+
+	p->fix_nr = n;
+}
+
+/**
+ * @brief Append a jump to @p label for packets matching a filter
+ * @see @p process_filter()
+ */
+static void emit_filter(struct prog_t *p, struct filter_t *filter,
+			uint8_t label)
+{
+	if (filter == NULL)
+		return;
+
+	if (filter->type != 0) {
+		ALU(p, BPF_MOV, 1, R_PKT, 0);
+		ALU(p, BPF_AND, 1, -1, 0xff);
+		jump(p, BPF_JGT, 1, 15, L_SKIP);
+		ALU(p, BPF_MOV, 2, -1, 1);
+		ALU(p, BPF_LSH, 2, 1, 0);
+		ALU(p, BPF_AND, 2, -1, filter->type);
+		jump(p, BPF_JNE, 2, 0, label);
+		resolve(p, L_SKIP);
+	}
+
+	if (filter->code != 0) {
+		ALU(p, BPF_MOV, 1, R_PKT, 0);
+		ALU(p, BPF_AND, 1, -1, 0xff);
+		jump(p, BPF_JNE, 1, 0, L_SKIP);		/* Not EAP */
+		ALU(p, BPF_MOV, 1, R_PKT, 0);
+		ALU(p, BPF_RSH, 1, -1, 8);
+		jump(p, BPF_JGT, 1, 7, L_SKIP);		/* No usable Code */
+		ALU(p, BPF_MOV, 2, -1, 1);
+		ALU(p, BPF_LSH, 2, 1, 0);
+		ALU(p, BPF_AND, 2, -1, filter->code);
+		jump(p, BPF_JNE, 2, 0, label);
+		resolve(p, L_SKIP);
+	}
+}
+
+/** @brief Append an increment of one of the counters in @p map */
+static void emit_count(struct prog_t *p, int map, uint32_t key)
+{
+	emit(p, BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -4, key);
+	ALU(p, BPF_MOV, 2, BPF_REG_10, 0);
+	ALU(p, BPF_ADD, 2, -1, -4);
+	emit(p, BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, map);
+	emit(p, 0, 0, 0, 0, 0);
+	CALL(p, map_lookup_elem);
+	jump(p, BPF_JEQ, 0, 0, L_SKIP);
+	ALU(p, BPF_MOV, 1, -1, 1);
+	emit(p, BPF_STX | BPF_XADD | BPF_DW, 0, 1, 0, 0);
+	resolve(p, L_SKIP);
+}
+
+/**
+ * @brief Append instructions to tag, retag, or untag the packet for an
+ *        egress interface
+ *
+ * Whatever earlier egress interfaces did to it, the packet ends up as it was
+ * received, plus the edits in @p tci.
+ *
+ * @param p The program
+ * @param tci The interface's 802.1Q edits, as in <tt>struct egress_t</tt>, or
+ *            @p NULL to restore the packet as it was received
+ * @see @p packet_send()
+ */
+static void emit_vlan(struct prog_t *p, struct tci_t *tci)
+{
+	/* Untag */
+	LDX_SKB(p, 0, vlan_present);
+	jump(p, BPF_JEQ, 0, 0, L_SKIP);
+	ALU(p, BPF_MOV, 1, R_SKB, 0);
+	CALL(p, skb_vlan_pop);
+	resolve(p, L_SKIP);
+
+	if (tci != NULL && tci->pcp == TCI_NO_DOT1Q)
+		return;
+
+	/* Work out the new TCI and tag */
+	if (tci == NULL) {
+		jump(p, BPF_JEQ, R_VLAN, 0, L_SKIP);
+		ALU(p, BPF_MOV, 3, R_TCI, 0);
+	} else {
+		uint16_t mask = 0xffff, val = 0;
+		if (tci->pcp != TCI_UNTOUCHED) {
+			mask &= ~0xe000;
+			val |= tci->pcp << 13;
+		}
+		if (tci->dei != TCI_UNTOUCHED) {
+			mask &= ~0x1000;
+			val |= tci->dei << 12;
+		}
+		if (tci->vid != TCI_UNTOUCHED_16) {
+			mask &= ~0x0fff;
+			val |= tci->vid;
+		}
+
+		ALU(p, BPF_MOV, 3, -1, 0);
+		emit(p, BPF_JMP | BPF_JEQ | BPF_K, R_VLAN, 0, 1, 0);
+		ALU(p, BPF_MOV, 3, R_TCI, 0);
+		ALU(p, BPF_AND, 3, -1, mask);
+		ALU(p, BPF_OR, 3, -1, val);
+	}
+
+	ALU(p, BPF_MOV, 1, R_SKB, 0);
+	ALU(p, BPF_MOV, 2, -1, htons(ETH_P_8021Q));
+	CALL(p, skb_vlan_push);
+	resolve(p, L_SKIP);
+}
+
+/**
+ * @brief Generate the in-kernel datapath for an interface
+ *
+ * In pseudo-C:
+ * @code
+ * if (ethertype != 0x888e)
+ *         return TC_ACT_UNSPEC;
+ * if (ingress filter matches)
+ *         goto filtered;
+ * mark = OFFLOAD_MARK;
+ * for (each other interface)
+ *         if (its egress filter does not match) {
+ *                 apply its 802.1Q edits;
+ *                 bpf_clone_redirect(skb, its index, 0);
+ *         }
+ * ++counter[IFACE_KSTAT_FORWARDED];
+ * return TC_ACT_SHOT;
+ * filtered:
+ * ++counter[IFACE_KSTAT_FILTERED];
+ * return TC_ACT_SHOT;
+ * @endcode
+ *
+ * @param p The program
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing the ingress
+ *              interface
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @param map File descriptor for the ingress interface's map of counters
+ * @return 0 if successful, or -1 if the program would be too long
+ */
+static int generate(struct prog_t *p, struct iface_t *iface,
+		    struct iface_t *ifaces, int map)
+{
+	p->len = p->fix_nr = 0;
+
+	ALU(p, BPF_MOV, R_SKB, 1, 0);
+	emit(p, BPF_LD | BPF_ABS | BPF_H, 0, 0, 0, 12);	/* EtherType */
+	jump(p, BPF_JNE, 0, ETH_P_PAE, L_PASS);
+
+	emit(p, BPF_LD | BPF_ABS | BPF_B, 0, 0, 0, 15);	/* Packet Type */
+	ALU(p, BPF_MOV, R_PKT, 0, 0);
+	ALU(p, BPF_OR, R_PKT, -1, 0xff00);		/* No Code yet */
+	jump(p, BPF_JNE, 0, 0, L_SKIP);			/* Not EAP */
+	LDX_SKB(p, 0, len);
+	jump(p, BPF_JGT, 0, 18, L_NEXT);
+	jump(p, BPF_JA, 0, 0, L_SKIP);			/* Too short */
+	resolve(p, L_NEXT);
+	emit(p, BPF_LD | BPF_ABS | BPF_B, 0, 0, 0, 18);	/* EAP Code */
+	ALU(p, BPF_LSH, 0, -1, 8);
+	ALU(p, BPF_AND, R_PKT, -1, 0xff);
+	ALU(p, BPF_OR, R_PKT, 0, 0);
+	resolve(p, L_SKIP);
+
+	if (iface->ingress != NULL)
+		emit_filter(p, iface->ingress->filter, L_FILTERED);
+
+	LDX_SKB(p, R_VLAN, vlan_present);
+	LDX_SKB(p, R_TCI, vlan_tci);
+
+	/* So that our raw sockets on the egress interfaces ignore the copies */
+	emit(p, BPF_ST | BPF_MEM | BPF_W, R_SKB, 0,
+	     offsetof(struct __sk_buff, mark), OFFLOAD_MARK);
+
+	uint8_t dirty = 0;			/* Flag: May have edited tag? */
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next) {
+		if (iface_routes(iface, i) == 0)
+			continue;
+
+		struct tci_t *tci = i->egress != NULL ? i->egress->tci : NULL;
+
+		if (i->egress != NULL)
+			emit_filter(p, i->egress->filter, L_NEXT);
+
+		if (tci != NULL || dirty == 1) {
+			emit_vlan(p, tci);
+			dirty = 1;
+		}
+
+		ALU(p, BPF_MOV, 1, R_SKB, 0);
+		ALU(p, BPF_MOV, 2, -1, i->index);
+		ALU(p, BPF_MOV, 3, -1, 0);
+		CALL(p, clone_redirect);
+		resolve(p, L_NEXT);
+	}
+
+	emit_count(p, map, IFACE_KSTAT_FORWARDED);
+	ALU(p, BPF_MOV, 0, -1, TC_ACT_SHOT);
+	emit(p, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+	resolve(p, L_FILTERED);
+	emit_count(p, map, IFACE_KSTAT_FILTERED);
+	ALU(p, BPF_MOV, 0, -1, TC_ACT_SHOT);
+	emit(p, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+	resolve(p, L_PASS);
+	ALU(p, BPF_MOV, 0, -1, TC_ACT_UNSPEC);
+	emit(p, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+	return p->len > OFFLOAD_INSNS_MAX ? -1 : 0;
+}
+
+/**
+ * @brief Attach the in-kernel datapath to an interface, if it can have one
+ *
+ * Requires Linux 6.6 or later for TCX. The datapath stays attached until
+ * @p offload_detach() is called.
+ *
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ *              with @p offload set
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @return 0 if successful, or -1 if the interface is to be proxied by us
+ */
+int offload_attach(struct iface_t *iface, struct iface_t *ifaces)
+{
+	static struct prog_t prog;
+
+	if (eligible(iface, ifaces) == 0)
+		return -1;
+
+	int map = iface_kstat_map(iface);
+	if (map == -1)
+		goto offload_attach_error;
+
+	if (generate(&prog, iface, ifaces, map) == -1) {
+		info("not offloading interface '%s', too many interfaces",
+		     iface->name);
+		return -1;
+	}
+
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SCHED_CLS;
+	attr.insns = (uintptr_t)prog.insn;
+	attr.insn_cnt = prog.len;
+	attr.license = (uintptr_t)"GPL";
+
+	int fd = syscall(SYS_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+	if (fd == -1)
+		goto offload_attach_error;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = fd;
+	attr.link_create.target_ifindex = iface->index;
+	attr.link_create.attach_type = BPF_TCX_INGRESS;
+
+	/* The link keeps its own reference to the program */
+	iface->offload_link = syscall(SYS_bpf, BPF_LINK_CREATE,
+				      &attr, sizeof(attr));
+	close(fd);
+	if (iface->offload_link == -1) {
+		iface->offload_link = 0;
+		goto offload_attach_error;
+	}
+
+	info("forwarding packets in-kernel, interface '%s' (%u instructions)",
+	     iface->name, prog.len);
+	return 0;
+
+offload_attach_error:
+	ewarning("cannot offload interface '%s': %s", iface->name);
+	return -1;
+}
+
+/**
+ * @brief Detach the in-kernel datapath from an interface, if it has one
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ */
+void offload_detach(struct iface_t *iface)
+{
+	if (iface->offload_link == 0)
+		return;
+
+	close(iface->offload_link);
+	iface->offload_link = 0;
+}
@@ -2,96 +2,238 @@
  * @file packet.c
  * @brief EAPOL packet operations
  */
+#define _GNU_SOURCE			/* sendmmsg(2) */
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <linux/errqueue.h>
 #include <linux/if_packet.h>
-#include <sys/ioctl.h>
-#include <sys/time.h>
+#include <sys/socket.h>
 #include "args.h"
+#include "capture.h"
+#include "decode.h"
 #include "log.h"
 #include "packet.h"
 #include "process.h"
+#include "stats.h"
+#include "trace.h"
 
-static void dump(struct peapod_packet pkt);
-static void decode(struct peapod_packet pkt);
+/**
+ * @brief Maximum number of frames queued per egress interface
+ * @see <tt>struct txq_t</tt>, @p packet_flush()
+ */
+#define PACKET_TX_BATCH			64
+
+/** @brief Maximum length of an Ethernet header, including an 802.1Q tag */
+#define PACKET_HDR_MAX			16
+
+/** @brief Alignment of each main EAPOL packet buffer, i.e. a cache line */
+#define PACKET_BUF_ALIGN		64
+
+/**
+ * @brief Frames queued for sending on an interface without a TX ring
+ *
+ * Only the Ethernet header of each frame is copied here by @p packet_send();
+ * the EAPOL MPDU is referenced where it was received. Both are gathered by a
+ * single @p sendmmsg(2) in @p packet_flush(), or sooner if the receive buffer
+ * holding an MPDU is about to be reused (cf. @p unpin()).
+ */
+struct txq_t {
+	uint8_t hdr[PACKET_TX_BATCH][PACKET_HDR_MAX];	/**< @brief One per frame */
+	unsigned len;			/**< @brief Number of frames queued */
+	struct iovec iov[PACKET_TX_BATCH][2];	/**< @brief Header and MPDU of each frame */
+	struct mmsghdr msgs[PACKET_TX_BATCH];	/**< @brief One per frame */
+	struct timespec ts[PACKET_TX_BATCH];	/**< @brief When each frame was received, cf. @p sent() */
+};
+
+static void dump(const struct peapod_packet *packet);
+static int decode(const struct peapod_packet *packet);
+static struct tci_t tci_decode(uint16_t vlan_tci);
+static void classify(struct peapod_packet *packet);
+static void parse(struct peapod_packet *packet, struct msghdr *msg);
+static int enqueue(struct iface_t *iface, uint8_t *hdr, size_t hdr_len,
+		   uint8_t *mpdu, size_t mpdu_len, struct timespec ts);
+static void sent(struct iface_t *iface, const uint8_t *mpdu,
+		 struct timespec ts, const struct timespec *now);
+static int flush(struct iface_t *iface);
+static void unpin(void);
+static int live_recv(struct iface_t *iface, struct mmsghdr *msgs, unsigned n);
+static int live_send(struct iface_t *iface, struct mmsghdr *msgs,
+		     const struct timespec *ts, unsigned n);
+static void live_now(struct timespec *now);
+
+/** @brief The raw sockets of the interfaces */
+static const struct packet_backend_t live = { live_recv, live_send, live_now };
+
+/** @brief Where packets are received from and sent to, cf. @p packet_backend() */
+static const struct packet_backend_t *backend = &live;
 
 /**
  * @name EAPOL packet buffer
  *
  * The size of this buffer is normally 1518 bytes given a 1500-byte MTU, to
  * accommodate the standard 1514-byte Ethernet frame size plus a 4-byte 802.1Q
- * tag. We use an @p iovec with @p recvmsg(2) to split off the destination and
+ * tag. We use an @p iovec with @p recvmmsg(2) to split off the destination and
  * source MAC addresses into their own fields of a <tt>struct peapod_packet</tt>
  * structure at the point of capture, reading only the EAPOL MPDU (EtherType and
  * MTU, normally 1502 bytes) into bytes 16:. Any 802.1Q tag is obtained
  * separately via a @p PACKET_AUXDATA cmsg from the kernel. Bytes 0:15 may then
  * serve as scratch space for us to reconstruct the complete EAPOL packet.
  *
- * This allows us to do things like adding, modifying, or removing an 802.1Q tag
- * for a proxied packet on a per-egress-interface basis. We simply
- * reconstruct/modify the first 16 bytes of this buffer as needed, then call
- * @p write(2) on the socket file descriptor with the proper memory offset.
+ * Bytes 0:15 are only ever written by @p packet_buf(), for dumps and scripts.
+ * Sending never touches them, or the MPDU: each egress interface gets its own
+ * Ethernet header, built from a template (cf. @p packet_route()), which is
+ * gathered with the MPDU as it was received.
+ *
+ * There are actually @p PACKET_RX_BATCH such buffers laid end to end, one for
+ * each packet that a single @p recvmmsg(2) may receive. Each is padded out to
+ * a multiple of @p PACKET_BUF_ALIGN bytes and starts on a cache line of its
+ * own, so that the Ethernet header and the beginning of the MPDU of a packet
+ * share a single cache line, and no two packets share any.
+ *
+ * A <tt>struct peapod_packet</tt> received into one of them only describes it;
+ * the packet is passed by pointer from there on, and the buffer stays put
+ * until every frame queued with its MPDU has been sent (cf. @p unpin()).
+ * Whatever outlives that, a deferred or coalesced script, copies what it needs.
+ *
+ * Interfaces that have an RX ring do not use these buffers for receiving; their
+ * packets are processed in place in the ring (cf. @p packet_recvring()).
+ *
+ * Each worker thread has buffers of its own, as it does everything else here
+ * that is not shared by all of them.
  * @{
  */
-static uint8_t *pkt_buf = NULL;		/**< @brief Main EAPOL packet buffer */
-static int pkt_buf_size = 0;		/**< @brief Normally 1518 bytes */
+static _Thread_local uint8_t *pkt_buf = NULL;	/**< @brief Main EAPOL packet buffer */
+static int pkt_buf_size = 0;		/**< @brief Normally 1536 bytes */
 
 /**
  * @brief The EAPOL MPDU
  *
- * Points to byte 16 of the main EAPOL packet buffer, and thereby to the EAPOL
- * EtherType (0x888e) followed by the MTU (normally up to 1500 bytes).
- * @note Global
+ * Points to byte 16 of the first main EAPOL packet buffer, and thereby to the
+ * EAPOL EtherType (0x888e) followed by the MTU (normally up to 1500 bytes). The
+ * MPDU in buffer @p i is at <tt>mpdu_buf + i * pkt_buf_size</tt>.
  */
-uint8_t *mpdu_buf = NULL;
+static _Thread_local uint8_t *mpdu_buf = NULL;
+
+static int mpdu_buf_size = 0;		/**< @brief Normally 1502 bytes */
+/** @} */
 
 /**
- * @brief Normally 1502 bytes
- * @note Global
+ * @name Queued frames referencing receive buffers
+ * @see @p unpin()
+ * @{
  */
-int mpdu_buf_size = 0;
+static struct iface_t *txq_ifaces = NULL;	/**< @brief All interfaces */
+static unsigned txq_nr = 0;		/**< @brief Egress queues per interface, one per worker */
+static _Thread_local uint8_t pinned = 0;	/**< @brief Flag: Does any egress queue reference a receive buffer? */
+static _Thread_local uint8_t unpin_failed = 0;	/**< @brief Flag: Did sending fail in @p unpin()? */
 /** @} */
 
 /**
- * @brief Buffer for receiving a <tt>struct packet_auxdata_t</tt> from the
- *        kernel via @p recvmsg(2)
+ * @brief The current worker thread
+ *
+ * Selects the egress queues of the thread, cf. the @p txq field of
+ * <tt>struct iface_t</tt>.
+ */
+static _Thread_local unsigned worker = 0;
+
+/** @brief Sequence number of the last packet received by the current thread */
+static _Thread_local unsigned long seq = 0;
+
+/**
+ * @brief Sequence number of the last packet received by each worker, as of
+ *        when it last stopped
+ *
+ * A restarted worker carries on from there, so that sequence numbers are never
+ * reused for the life of the process, which @p process.c relies on. Only
+ * touched while the worker is not running, cf. @p packet_thread_exit().
+ */
+static unsigned long seq_saved[IFACE_WORKERS_MAX];
+
+/**
+ * @brief Buffers for receiving a <tt>struct packet_auxdata_t</tt> and
+ *        timestamps from the kernel via @p recvmmsg(2), one per packet
+ *
+ * There is a software timestamp, and with @p hw-timestamps, a hardware one.
+ *
  * @note Actually a <tt>struct tpacket_auxdata</tt>
  * @see @p socket(7), "Socket options"
  */
-static union {
-	struct cmsghdr cmsg;
-	uint8_t buf[CMSG_SPACE(sizeof(struct packet_auxdata_t))];
-} cmsg_buf;
+static _Thread_local _Alignas(struct cmsghdr) uint8_t cmsg_bufs[PACKET_RX_BATCH]
+	[CMSG_SPACE(sizeof(struct packet_auxdata_t)) +
+	 CMSG_SPACE(sizeof(struct timespec)) +
+	 CMSG_SPACE(sizeof(struct scm_timestamping))];
 
 /**
- * @brief A <tt>struct msghdr</tt> for @p recvmsg(2)
- * @see @p recvmsg(2)
+ * @brief <tt>struct mmsghdr</tt> structures for @p recvmmsg(2)
+ * @see @p recvmmsg(2)
  */
-static struct msghdr msg = {
-	.msg_name = NULL,
-	.msg_namelen = 0,
-	.msg_control = &cmsg_buf,
-	.msg_controllen = sizeof(cmsg_buf),
-	.msg_flags = 0
-};
+static _Thread_local struct mmsghdr msgs[PACKET_RX_BATCH];
+
+/** @brief Three <tt>struct iovec</tt> structures per packet, cf. @p msgs */
+static _Thread_local struct iovec iovs[PACKET_RX_BATCH][3];
 
 extern struct args_t args;
 
+/** @brief Receive on the raw socket of an interface, without waiting */
+static int live_recv(struct iface_t *iface, struct mmsghdr *msgs, unsigned n)
+{
+	return recvmmsg(iface->skt, msgs, n, MSG_DONTWAIT, NULL);
+}
+
+/** @brief Send on the raw socket of an interface */
+static int live_send(struct iface_t *iface, struct mmsghdr *msgs,
+		     const struct timespec *ts, unsigned n)
+{
+	(void)ts;
+
+	/* A virtual interface sends on the raw socket of its trunk */
+	int skt = iface->trunk != NULL ? iface->trunk->skt : iface->skt;
+	return sendmmsg(skt, msgs, n, 0);
+}
+
+/** @brief Get the time on @p CLOCK_REALTIME, that of kernel timestamps */
+static void live_now(struct timespec *now)
+{
+	clock_gettime(CLOCK_REALTIME, now);
+}
+
+/**
+ * @brief Receive and send packets somewhere other than the raw sockets of the
+ *        interfaces
+ * @param b Pointer to a <tt>struct packet_backend_t</tt>, or @p NULL for the
+ *          raw sockets
+ * @note Workers must not be running.
+ */
+void packet_backend(const struct packet_backend_t *b)
+{
+	backend = b != NULL ? b : &live;
+}
+
+/**
+ * @brief Get the current time, on the clock of receive timestamps
+ * @param now Where to store the time
+ */
+void packet_now(struct timespec *now)
+{
+	backend->now(now);
+}
+
 /**
  * @brief Log a hexadecimal dump of a <tt>struct peapod_packet</tt>
- * @param packet A <tt>struct peapod_packet</tt> representing an EAPOL packet
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> representing an
+ *               EAPOL packet
  */
-static void dump(struct peapod_packet packet)
+static void dump(const struct peapod_packet *packet)
 {
 	if (args.level < LOG_DEBUGLOW)
 		return;		/* Do less work if not low-level debugging. */
 
-	char buf[51] = { "" };
-	int l = 0;
+	char buf[DECODE_HEX_SIZ];
 	uint8_t *start = packet_buf(packet,
-				    packet.iface == packet.iface_orig ? 1 : 0);
+				    packet->iface == packet->iface_orig ? 1 : 0);
 
 	/* Sample output:
 	 * fe:ed:fa:ce:ca:11 EAPOL-Start to {PAE multicast MAC}, prio 3
@@ -100,97 +242,92 @@ static void dump(struct peapod_packet packet)
 	 *   0x0020:  0000 0000 0000 0000 0000 0000 0000 0000
 	 *   0x0030:  0000 0000 0000 0000 0000 0000 0000 0000
 	 */
-	for(int pos = 0; pos < packet.len; ++pos) {
-		if (pos % 16 == 0)
-			l = snprintf(buf, sizeof(buf), "  0x%.04x:  ", pos);
-
-		l += snprintf(buf + l, sizeof(buf) - l, "%.02x", start[pos]);
-
-		if (pos % 2 == 1 && pos % 16 != 15)
-			l += snprintf(buf + l, sizeof(buf) - l, " ");
-
-		if (pos % 16 == 15 || pos + 1 == packet.len)
-			debuglow("%s", buf);
+	for (size_t pos = 0; pos < (size_t)packet->len; ) {
+		pos = decode_hex(buf, start, packet->len, pos);
+		debuglow("%s", buf);
 	}
 }
 
 /**
  * @brief Log metadata for a <tt>struct peapod_packet</tt> in a
  *        <tt>tcpdump</tt>-like format
- * @param packet A <tt>struct peapod_packet</tt> representing an EAPOL packet
+ *
+ * If tracing, a trace record is written instead, and neither this nor
+ * @p dump() logs anything.
+ *
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> representing an
+ *               EAPOL packet
+ * @return 0 if the packet should also be dumped, or -1 otherwise
  */
-static void decode(struct peapod_packet packet)
+static int decode(const struct peapod_packet *packet)
 {
-	static char buf[256] = { "" };
-	static int l;
-
-	struct eapol_mpdu *mpdu = (struct eapol_mpdu *)mpdu_buf;
-
-	/* "recv 1024 bytes on 'eth0': {source MAC} > {dest MAC}" */
-	l = snprintf(buf, sizeof(buf), "%s %ld bytes on '%s'",
-		     packet.iface->name == packet.iface_orig->name ?
-		     "recv" : "send", packet.len, packet.iface->name);
-	l += snprintf(buf + l, sizeof(buf) - l, ": %s",
-		      iface_strmac(packet.h_source));
-	l += snprintf(buf + l, sizeof(buf) - l, " > %s",
-		      iface_strmac(packet.h_dest));
-
-	/* "..., vlan 0 (prio 6, dei)" */
-	if (packet.vlan_valid == 1)
-		l += snprintf(buf + l, sizeof(buf) - l,
-			      ", vlan %d (prio %d%s)",
-			      packet.tci.vid, packet.tci.pcp,
-			      packet.tci.dei == 1 ? ", dei" : "");
-
-	/* "..., EAPOL-EAP (0) v2", "..., EAPOL-Key (3) v1", */
-	l += snprintf(buf + l, sizeof(buf) - l, ", %s (%d) v%d",
-		     packet_decode(mpdu->type, eapol_types),
-		     mpdu->type, mpdu->proto_ver);
-
-	/* "..., Response/Identity (1), id 123, len 456", "..., Success" */
-	if (mpdu->type == EAPOL_EAP) {
-		struct eapol_eap *eap = &mpdu->eap;	/* convenience */
-
-		l += snprintf(buf + l, sizeof(buf) - l, ", %s",
-			      packet_decode(eap->code, eap_codes));
-
-		if (eap->code == EAP_CODE_REQUEST ||
-		    eap->code == EAP_CODE_RESPONSE)
-			l += snprintf(buf + l, sizeof(buf) - l, "/%s (%d)",
-				      packet_decode(eap->type, eap_types),
-				      eap->type);
-
-		l += snprintf(buf + l, sizeof(buf) - l, ", id %d, len %d",
-			      eap->id, ntohs(eap->len));
-	} else if (mpdu->type == EAPOL_KEY) {
-		struct eapol_key *key = &mpdu->key;
-
-		/* NOTE: Only really decodes the RC4 Descriptor Type */
-		if (key->desc_type == EAPOL_KEY_TYPE_RC4) {
-			/* "..., type RC4-128 (1)" */
-			l += snprintf(buf + l, sizeof(buf) - l,
-				      ", type %s-%d (%d)",
-				      packet_decode(key->desc_type,
-						    eapol_key_types),
-				      ntohs(key->key_len) * 8, key->desc_type);
-
-			/* "..., index 64, unicast" */
-			l += snprintf(buf + l, sizeof(buf) - l,
-				      ", index %d (%scast)",
-				      key->key_index & 0x7f,
-				      (key->key_index & 0x80) ?
-				      "uni" : "broad");
-		} else {
-			/* "..., type IEEE 802.11 (2)" */
-			l += snprintf(buf + l, sizeof(buf) - l,
-				      ", type %s (%d)",
-				      packet_decode(key->desc_type,
-						    eapol_key_types),
-				      key->desc_type);
-		}
-	}
+	if (trace_packet(packet) == 0 || args.level < LOG_DEBUG)
+		return -1;	/* Nothing would be logged anyway */
 
+	char buf[256];
+	uint8_t orig = packet->iface == packet->iface_orig ? 1 : 0;
+
+	decode_frame(buf, sizeof(buf), orig ? "recv" : "send",
+		     packet->iface->name, packet->len, packet_buf(packet, orig),
+		     packet->len);
 	debug("%s", buf);
+
+	return 0;
+}
+
+/**
+ * @brief Decode the TCI of an 802.1Q tag recovered from the kernel
+ * @param vlan_tci The @p tp_vlan_tci field of a <tt>struct tpacket_auxdata</tt>
+ *                 or a <tt>struct tpacket3_hdr</tt> (in host order)
+ * @return A <tt>struct tci_t</tt> representing an 802.1Q TCI
+ */
+static struct tci_t tci_decode(uint16_t vlan_tci)
+{
+	struct tci_t ret;
+	ret.pcp = (vlan_tci & 0xe000) >> 13;
+	ret.dei = (vlan_tci & 0x1000) >> 12;
+	ret.vid = vlan_tci & 0x0fff;
+	return ret;
+}
+
+/**
+ * @brief Finish setting up a newly received <tt>struct peapod_packet</tt>
+ *
+ * Assigns a sequence number, records the original interface, length, and VLAN
+ * tag, and extracts the EAPOL Packet Type and EAP Code from the EAPOL MPDU.
+ *
+ * A packet received on a trunk with the VLAN of a virtual interface on it is
+ * that interface's, and it is untagged, just as if it had been received on an
+ * 802.1Q subinterface of the trunk.
+ *
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> whose @p iface,
+ *               @p len, @p vlan_valid, @p tci, and @p mpdu fields are set
+ */
+static void classify(struct peapod_packet *packet)
+{
+	struct eapol_mpdu *mpdu = (struct eapol_mpdu *)packet->mpdu;
+	struct iface_t **vlan = packet->iface->vlan;
+
+	if (vlan != NULL && packet->vlan_valid == 1 &&
+	    vlan[packet->tci.vid] != NULL) {
+		packet->iface = vlan[packet->tci.vid];
+		packet->len -= sizeof(uint32_t);
+		packet->vlan_valid = 0;
+		packet->tci = (struct tci_t){ 0, 0, 0 };
+	}
+
+	packet->seq = ++seq;
+	packet->iface_orig = packet->iface;
+	packet->len_orig = packet->len;
+	packet->vlan_valid_orig = packet->vlan_valid;
+	packet->tci_orig = packet->tci;
+
+	packet->type = mpdu->type;
+	if (packet->type == EAPOL_EAP)
+		packet->code = mpdu->eap.code;
+
+	if (decode(packet) == 0)
+		dump(packet);
 }
 
 /**
@@ -223,19 +360,145 @@ void packet_init(struct iface_t *ifaces)
 		       sizeof(uint32_t) +	/* 4, (possibly) a VLAN tag */
 		       sizeof(uint16_t) +	/* 2, EtherType/size */
 		       high_mtu;
+	pkt_buf_size = (pkt_buf_size + PACKET_BUF_ALIGN - 1) &
+		       ~(PACKET_BUF_ALIGN - 1);	/* 1536 if MTU is 1500 */
 
-	pkt_buf = malloc(pkt_buf_size);		/* 1518 if MTU is 1500 */
+	mpdu_buf_size = sizeof(uint16_t) + high_mtu;		/* EtherType */
+
+	txq_nr = iface_workers(ifaces);
+	packet_ifaces(ifaces);
+	packet_thread(0);
+}
+
+/**
+ * @brief Set up the egress queues of interfaces in a list
+ *
+ * Queues are allocated for interfaces that don't have them yet, one per worker;
+ * an interface keeps its queues even if it has a TX ring, should a reloaded
+ * config take the ring away. Called by @p packet_init(), then again whenever
+ * the config is reloaded.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ */
+void packet_ifaces(struct iface_t *ifaces)
+{
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next) {
+		if (i->txq != NULL)
+			continue;
+
+		if (i->mtu + (int)sizeof(uint16_t) > mpdu_buf_size)
+			warning("MTU %d is higher than at startup, interface "
+				"'%s'; frames that large will be dropped",
+				i->mtu, i->name);
+
+		struct txq_t *txq = calloc(txq_nr, sizeof(struct txq_t));
+		if (txq == NULL)
+			ecritdie("cannot allocate egress queue, interface '%s': %s",
+				 i->name);
+
+		for (unsigned w = 0; w < txq_nr; ++w) {
+			for (int j = 0; j < PACKET_TX_BATCH; ++j) {
+				txq[w].iov[j][0].iov_base = txq[w].hdr[j];
+				txq[w].msgs[j].msg_hdr.msg_iov = txq[w].iov[j];
+				txq[w].msgs[j].msg_hdr.msg_iovlen = 2;
+			}
+		}
+
+		i->txq = txq;
+	}
+
+	txq_ifaces = ifaces;
+}
+
+/**
+ * @brief Set up the current thread as a worker
+ *
+ * Allocates the main EAPOL packet buffer of the thread. Called by
+ * @p packet_init() for the main thread, worker 0.
+ *
+ * @param id The worker, cf. the @p worker field of <tt>struct iface_t</tt>
+ */
+void packet_thread(unsigned id)
+{
+	worker = id;
+	seq = seq_saved[id];
+	if (seq == 0)
+		seq = (unsigned long)id << 48;	/* Distinct across threads */
+
+	/* 1536 per packet if MTU is 1500 */
+	pkt_buf = aligned_alloc(PACKET_BUF_ALIGN,
+				PACKET_RX_BATCH * pkt_buf_size);
 	if (pkt_buf == NULL)
 		ecritdie("cannot allocate main packet buffer: %s");
 
 	mpdu_buf = pkt_buf + (ETH_ALEN * 2) + sizeof(uint32_t);	/* + 16 */
-	mpdu_buf_size = sizeof(uint16_t) + high_mtu;		/* EtherType */
+}
+
+/**
+ * @brief Free what @p packet_thread() allocated for the current thread
+ *
+ * Anything the thread still had queued is dropped.
+ */
+void packet_thread_exit(void)
+{
+	for (struct iface_t *i = txq_ifaces; i != NULL; i = i->next)
+		if (i->txq != NULL)
+			i->txq[worker].len = 0;
+
+	free(pkt_buf);
+	pkt_buf = mpdu_buf = NULL;
+	pinned = unpin_failed = 0;
+	seq_saved[worker] = seq;
+}
+
+/**
+ * @brief Work out the Ethernet header template for an egress interface
+ *
+ * The 802.1Q tag of a packet sent on the interface is @p route->tag, plus the
+ * bits of the received tag (if any) in @p route->tci_keep. Whether it is
+ * present at all is up to @p route->dot1q.
+ *
+ * @param route Pointer to a <tt>struct route_t</tt> representing an egress
+ *              interface
+ * @param tci The 802.1Q edits of the interface, or @p NULL
+ */
+void packet_route(struct route_t *route, const struct tci_t *tci)
+{
+	struct tci_t set = { 0, 0, 0 };
+
+	if (tci == NULL) {
+		route->dot1q = ROUTE_DOT1Q_KEEP;
+		route->tci_keep = 0xffff;
+	} else if (tci->pcp == TCI_NO_DOT1Q) {
+		route->dot1q = ROUTE_DOT1Q_NONE;
+		route->tci_keep = 0;
+	} else {
+		route->dot1q = ROUTE_DOT1Q_SET;
+		route->tci_keep = 0xffff;
+
+		if (tci->pcp != TCI_UNTOUCHED) {
+			set.pcp = tci->pcp;
+			route->tci_keep &= ~0xe000;
+		}
+		if (tci->dei != TCI_UNTOUCHED) {
+			set.dei = tci->dei;
+			route->tci_keep &= ~0x1000;
+		}
+		if (tci->vid != TCI_UNTOUCHED_16) {
+			set.vid = tci->vid;
+			route->tci_keep &= ~0x0fff;
+		}
+	}
+
+	route->tag = ntohl(packet_tcitonl(set));
 }
 
 /**
  * @brief Return a pointer to a raw EAPOL packet
  *
- * Rewrites the first 16 bytes of the main packet buffer. The result shall point
+ * Rewrites the 16 bytes preceding the EAPOL MPDU of @p packet, which are in
+ * either the main packet buffer or an RX ring frame. The result shall point
  * to the beginning of a raw EAPOL packet that is either:
  * -# the original packet, including the VLAN tag, as it appeared when it was
  *    captured on the ingress interface, or
@@ -246,35 +509,38 @@ void packet_init(struct iface_t *ifaces)
  * The result may then be used by the caller to (hex)dump, Base64-encode, and/or
  * send the packet.
  *
- * @param packet A <tt>struct peapod_packet</tt> representing an EAPOL packet
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> representing an
+ *               EAPOL packet
  * @param orig Flag: Reconstruct original packet as seen on ingress interface?
  * @return Pointer to the beginning of a complete EAPOL packet
  */
-uint8_t *packet_buf(struct peapod_packet packet, uint8_t orig) {
+uint8_t *packet_buf(const struct peapod_packet *packet, uint8_t orig) {
 	uint8_t vlan_valid;
 	struct tci_t tci;
 	if (orig == 1) {
-		vlan_valid = packet.vlan_valid_orig;
-		tci = packet.tci_orig;
+		vlan_valid = packet->vlan_valid_orig;
+		tci = packet->tci_orig;
 	} else {
-		vlan_valid = packet.vlan_valid;
-		tci = packet.tci;
+		vlan_valid = packet->vlan_valid;
+		tci = packet->tci;
 	}
 
+	uint8_t *mpdu = packet->mpdu;
+
 	if (vlan_valid) {
 		uint32_t dot1q = packet_tcitonl(tci);
-		memcpy(mpdu_buf - (ETH_ALEN * 2) - sizeof(uint32_t),
-		       packet.h_dest, ETH_ALEN);
-		memcpy(mpdu_buf - ETH_ALEN - sizeof(uint32_t),
-		       packet.h_source, ETH_ALEN);
-		memcpy(mpdu_buf - sizeof(uint32_t), &dot1q, sizeof(uint32_t));
+		memcpy(mpdu - (ETH_ALEN * 2) - sizeof(uint32_t),
+		       packet->h_dest, ETH_ALEN);
+		memcpy(mpdu - ETH_ALEN - sizeof(uint32_t),
+		       packet->h_source, ETH_ALEN);
+		memcpy(mpdu - sizeof(uint32_t), &dot1q, sizeof(uint32_t));
 
-		return mpdu_buf - (ETH_ALEN * 2) - sizeof(uint32_t);  /* -16 */
+		return mpdu - (ETH_ALEN * 2) - sizeof(uint32_t);  /* -16 */
 	} else {
-		memcpy(mpdu_buf - (ETH_ALEN * 2), packet.h_dest, ETH_ALEN);
-		memcpy(mpdu_buf - ETH_ALEN, packet.h_source, ETH_ALEN);
+		memcpy(mpdu - (ETH_ALEN * 2), packet->h_dest, ETH_ALEN);
+		memcpy(mpdu - ETH_ALEN, packet->h_source, ETH_ALEN);
 
-		return mpdu_buf - (ETH_ALEN * 2);  /* -12 */
+		return mpdu - (ETH_ALEN * 2);  /* -12 */
 	}
 }
 
@@ -292,43 +558,289 @@ uint32_t packet_tcitonl(struct tci_t tci)
 }
 
 /**
- * @brief Decode a byte in an EAPOL packet to a C string
+ * @brief Queue a frame for sending on a network interface
+ *
+ * The frame is gathered into the TX ring of @p iface. Without a TX ring, only
+ * the header is copied into the egress queue of @p iface, which references
+ * the MPDU until it is sent. If there is no room left, the frames already
+ * queued on @p iface are sent first.
+ *
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ * @param hdr Pointer to the Ethernet header of the frame
+ * @param hdr_len The length of the Ethernet header
+ * @param mpdu Pointer to the EAPOL MPDU of the frame
+ * @param mpdu_len The length of the EAPOL MPDU
+ * @param ts When the frame was received
+ * @return 0 if successful, or -1 if unsuccessful
+ */
+static int enqueue(struct iface_t *iface, uint8_t *hdr, size_t hdr_len,
+		   uint8_t *mpdu, size_t mpdu_len, struct timespec ts)
+{
+	struct ring_t *ring = iface->tx_ring;
+	size_t len = hdr_len + mpdu_len;
+
+	if (ring == NULL) {
+		struct txq_t *txq = &iface->txq[worker];
+
+		if (txq->len == PACKET_TX_BATCH && flush(iface) == -1)
+			return -1;
+
+		struct iovec *iov = txq->iov[txq->len];
+		memcpy(iov[0].iov_base, hdr, hdr_len);
+		iov[0].iov_len = hdr_len;
+		iov[1].iov_base = mpdu;
+		iov[1].iov_len = mpdu_len;
+		txq->ts[txq->len] = ts;
+		++txq->len;
+
+		pinned = 1;
+		return 0;
+	}
+
+	if (len > ring->frame_size -
+		  TPACKET_ALIGN(sizeof(struct tpacket3_hdr))) {
+		crit("cannot queue %zu bytes, interface '%s'; "
+		     "was packet received on a higher MTU interface?",
+		     len, iface->name);
+		return -1;
+	}
+
+	unsigned per_block = ring->block_size / ring->frame_size;
+	unsigned frame_nr = per_block * ring->block_nr;
+
+	if (ring->frames == frame_nr && flush(iface) == -1)
+		return -1;
+
+	struct tpacket3_hdr *tp = (void *)(ring->map +
+		(ring->block / per_block) * ring->block_size +
+		(ring->block % per_block) * ring->frame_size);
+
+	if (__atomic_load_n(&tp->tp_status, __ATOMIC_ACQUIRE) !=
+	    TP_STATUS_AVAILABLE) {
+		crit("TX ring frame %u still in use, interface '%s'",
+		     ring->block, iface->name);
+		return -1;
+	}
+
+	uint8_t *frame = (uint8_t *)tp + TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+	memcpy(frame, hdr, hdr_len);
+	memcpy(frame + hdr_len, mpdu, mpdu_len);
+	tp->tp_len = len;
+	tp->tp_next_offset = 0;
+	tp->tp_sec = ts.tv_sec;		/* Only read back by flush() */
+	tp->tp_nsec = ts.tv_nsec;
+	__atomic_store_n(&tp->tp_status, TP_STATUS_SEND_REQUEST,
+			 __ATOMIC_RELEASE);
+
+	ring->block = (ring->block + 1) % frame_nr;
+	++ring->frames;
+
+	return 0;
+}
+
+/**
+ * @brief Count a frame that was sent on a network interface
  *
- * The byte may be one of the following:
- * -# the Type field of an EAPOL packet,
- * -# the Code field of an EAP packet encapsulated in an EAPOL-EAP packet, or
- * -# the Type field of an EAP-Request or EAP-Response encapsulated in an EAP
- *    packet.
+ * The time from receiving the frame to sending it goes into the latency
+ * histogram of @p iface. Both times are on the @p CLOCK_REALTIME clock, that
+ * of the receive timestamps the kernel hands us, unless the frame was
+ * timestamped in hardware.
  *
- * @param val Value of the relevant byte to decode
- * @param decode Pointer to a <tt>struct decode_t</tt> matching field values
- *               with descriptions
- * @return A description, or "Unknown" if the value does not have a
- *         corresponding description in @p decode.
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ * @param mpdu Pointer to the EAPOL MPDU of the frame
+ * @param ts When the frame was received
+ * @param now When the frame was sent
  */
-char* packet_decode(uint8_t val, const struct decode_t *decode)
+static void sent(struct iface_t *iface, const uint8_t *mpdu,
+		 struct timespec ts, const struct timespec *now)
 {
-	char *ret = "Unknown";
-	while (decode->desc != NULL) {
-		if (val == decode->val) {
-			ret = decode->desc;
+	const struct eapol_mpdu *eapol = (const struct eapol_mpdu *)mpdu;
+
+	long usec = ((now->tv_sec - ts.tv_sec) * 1000000000L +
+		     now->tv_nsec - ts.tv_nsec) / 1000;
+
+	stats_packet(iface, STATS_SENT, eapol->type, eapol->eap.code);
+	stats_time(iface, STATS_LATENCY, usec > 0 ? usec : 0);
+}
+
+/**
+ * @brief Send all frames queued on a network interface
+ *
+ * Makes a single @p send(2) if @p iface has a TX ring, or otherwise (normally)
+ * a single @p sendmmsg(2).
+ *
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ * @return 0 if successful, or -1 if unsuccessful
+ */
+static int flush(struct iface_t *iface)
+{
+	struct ring_t *ring = iface->tx_ring;
+	struct timespec now;
+	int ret = 0;
+
+	if (ring != NULL) {
+		if (ring->frames == 0)
+			return 0;
+
+		/* Blocks until the kernel is done with every frame */
+		uint8_t down = 0;
+		if (send(iface->skt, NULL, 0, 0) == -1) {
+			if (errno == ENETDOWN || errno == ENXIO) {
+				down = 1;
+				warning("dropping %u frames, interface '%s' "
+					"is down", ring->frames, iface->name);
+			} else {
+				ecrit("cannot send, interface '%s': %s",
+				      iface->name);
+				ret = -1;
+			}
+		}
+		clock_gettime(CLOCK_REALTIME, &now);
+
+		unsigned per_block = ring->block_size / ring->frame_size;
+		unsigned frame_nr = per_block * ring->block_nr;
+
+		for (unsigned i = frame_nr - ring->frames; i < frame_nr; ++i) {
+			unsigned j = (ring->block + i) % frame_nr;
+			struct tpacket3_hdr *hdr = (void *)(ring->map +
+				(j / per_block) * ring->block_size +
+				(j % per_block) * ring->frame_size);
+
+			if (hdr->tp_status == TP_STATUS_AVAILABLE) {
+				uint8_t *frame = (uint8_t *)hdr +
+					TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+				uint16_t ethertype;
+				memcpy(&ethertype, frame + ETH_ALEN * 2,
+				       sizeof(ethertype));
+
+				struct timespec ts = { hdr->tp_sec,
+						       hdr->tp_nsec };
+				sent(iface, frame + ETH_ALEN * 2 +
+					    (ethertype == htons(ETH_P_8021Q) ?
+					     sizeof(uint32_t) : 0),
+				     ts, &now);
+				continue;
+			}
+
+			stats_event(iface, STATS_SEND_ERRORS);
+			if (down == 0) {
+				crit("cannot send %d bytes (status 0x%x), "
+				     "interface '%s'",
+				     hdr->tp_len, hdr->tp_status, iface->name);
+				ret = -1;
+			}
+			hdr->tp_status = TP_STATUS_AVAILABLE;
+		}
+
+		ring->frames = 0;
+		return ret;
+	}
+
+	struct txq_t *txq = &iface->txq[worker];
+
+	unsigned done;
+	for (done = 0; done < txq->len; ) {
+		int len = backend->send(iface, &txq->msgs[done],
+					&txq->ts[done], txq->len - done);
+		if (len == -1 && (errno == ENETDOWN || errno == ENXIO)) {
+			/* Went down since they were queued; cf. iface_down() */
+			warning("dropping %u frames, interface '%s' is down",
+				txq->len - done, iface->name);
 			break;
+		} else if (len == -1) {
+			ecrit("cannot send, interface '%s': %s", iface->name);
+			ret = -1;
+			break;
+		}
+		backend->now(&now);
+
+		for (int i = done; i < (int)done + len; ++i) {
+			size_t expected = txq->iov[i][0].iov_len +
+					  txq->iov[i][1].iov_len;
+			if (txq->msgs[i].msg_len == expected) {
+				sent(iface, txq->iov[i][1].iov_base,
+				     txq->ts[i], &now);
+				continue;
+			}
+
+			stats_event(iface, STATS_SEND_ERRORS);
+			crit("sent %u bytes (expected %zu), interface '%s'; "
+			     "was packet received on a higher MTU interface?",
+			     txq->msgs[i].msg_len, expected, iface->name);
+			ret = -1;
 		}
-		++decode;
+
+		done += len;
 	}
+
+	for (; done < txq->len; ++done)
+		stats_event(iface, STATS_SEND_ERRORS);
+
+	txq->len = 0;
+	return ret;
+}
+
+/**
+ * @brief Send all frames queued on every interface before a receive buffer is
+ *        reused
+ *
+ * Frames queued without a TX ring reference the MPDU in the buffer it was
+ * received into, which must therefore stay put until they are sent. Any
+ * failure is reported by the next call to @p packet_flush().
+ */
+static void unpin(void)
+{
+	if (pinned == 0)
+		return;
+
+	for (struct iface_t *i = txq_ifaces; i != NULL; i = i->next)
+		if (flush(i) == -1)
+			unpin_failed = 1;
+
+	pinned = 0;
+}
+
+/**
+ * @brief Send all frames queued on network interfaces in a list
+ *
+ * Called once per iteration of the main event loop, after all packets received
+ * in that iteration have been proxied.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @return 0 if successful, or -1 if unsuccessful on any interface, including
+ *         while sending early to free up a receive buffer
+ */
+int packet_flush(struct iface_t *ifaces)
+{
+	int ret = unpin_failed == 1 ? -1 : 0;
+
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next)
+		if (flush(i) == -1)
+			ret = -1;
+
+	pinned = unpin_failed = 0;
 	return ret;
 }
 
 /**
  * @brief Send an EAPOL packet on a network interface
  *
- * May execute an egress script.
+ * May execute an egress script. The packet is only queued for sending; it is
+ * actually sent by the next call to @p packet_flush().
  *
- * @param packet A <tt>struct peapod_packet</tt> representing an EAPOL packet
- * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
- * @return The number of bytes successfully sent
+ * The packet is not copied. Its @p iface, @p len, @p vlan_valid and @p tci
+ * fields are rewritten in place for @p route, starting over from the fields
+ * recorded on ingress, so the same packet may be sent on one route after
+ * another.
+ *
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> representing an
+ *               EAPOL packet
+ * @param route Pointer to a <tt>struct route_t</tt> representing the egress
+ *              interface
+ * @return 0 if successful, or -1 if unsuccessful
  */
-int packet_send(struct peapod_packet packet, struct iface_t *iface)
+int packet_send(struct peapod_packet *packet, const struct route_t *route)
 {
 /*	A raw socket on a 1500 MTU iface lets us send 1514 arbitrary bytes, for
 	dest and src hwaddrs, EtherType, and MTU-sized payload. How do we bring
@@ -357,131 +869,127 @@ int packet_send(struct peapod_packet packet, struct iface_t *iface)
 		ssize_t len = write(iface->skt, buf, buf_size);	// len == 1518!
 
 		Excellent! Looks like regular old write() is the way to go.
-		TODO: Revisit this topic if/when we move to using PACKET_TX_RING.
 
 	P.S. Didn't work: write(2) with QinQ at bytes 12:19. >;]
-*/
-	packet.iface = iface;
 
-	if (iface->egress != NULL && iface->egress->tci != NULL) {
-		struct tci_t *iface_tci = iface->egress->tci;
+	P.P.S. Revisited for batching. What write(2) really had going for it was
+	the tag sitting in place at bytes 12:15 of the frame; the kernel allows
+	the extra 4 bytes only if it can see ETH_P_8021Q there
+	(cf. packet_extra_vlan_len_allowed()). It copies the frame into an skb
+	before looking, so the frame need not be one contiguous buffer after
+	all - only the 1518-byte iovec above was too long without the tag.
+
+	So frames are now gathered from two iovecs per message of sendmmsg(2):
+	hdrs and tag, built on the stack below and copied into the txq, then the
+	MPDU, pointed to where it sits in the receive buffer. The tag is in the
+	first iovec, at bytes 12:15 of the frame as the kernel puts it together,
+	and passes the check just as well. PACKET_TX_RING frames are the same
+	two parts copied back to back into the ring.
+*/
+	struct iface_t *iface = route->iface;
 
-		if (iface_tci->pcp == TCI_NO_DOT1Q) {
-			packet.vlan_valid = 0;
+	/* Start over from the packet as received, whichever egress interface
+	 * it was last sent on
+	 */
+	packet->iface = iface;
+	packet->vlan_valid = packet->vlan_valid_orig;
+	packet->tci = packet->tci_orig;
+
+	size_t mpdu_len = packet->len_orig - (ETH_ALEN * 2) -
+			  (packet->vlan_valid == 1 ? sizeof(uint32_t) : 0);
+
+	/* Fill in the template with whatever is kept of the received tag */
+	if (route->dot1q != ROUTE_DOT1Q_KEEP) {
+		uint32_t tag = route->tag;
+		if (packet->vlan_valid == 1)
+			tag |= ntohl(packet_tcitonl(packet->tci)) & route->tci_keep;
+
+		packet->vlan_valid = route->dot1q == ROUTE_DOT1Q_SET;
+		packet->tci = packet->vlan_valid == 1 ?
+			      tci_decode(tag) : (struct tci_t){ 0, 0, 0 };
+	}
 
-			memset(&packet.tci, 0, sizeof(packet.tci));
-		} else {
-			packet.vlan_valid = 1;
+	uint8_t hdr[PACKET_HDR_MAX];
+	size_t hdr_len = ETH_ALEN * 2;
 
-			if (iface_tci->pcp != TCI_UNTOUCHED)
-				packet.tci.pcp = iface_tci->pcp;
-			if (iface_tci->dei != TCI_UNTOUCHED)
-				packet.tci.dei = iface_tci->dei;
-			if (iface_tci->vid != TCI_UNTOUCHED_16)
-				packet.tci.vid = iface_tci->vid;
-		}
+	memcpy(hdr, packet->h_dest, ETH_ALEN);
+	memcpy(hdr + ETH_ALEN, packet->h_source, ETH_ALEN);
+	if (packet->vlan_valid == 1) {
+		uint32_t dot1q = packet_tcitonl(packet->tci);
+		memcpy(hdr + hdr_len, &dot1q, sizeof(uint32_t));
+		hdr_len += sizeof(uint32_t);
 	}
 
-	/* packet_buf() sets up the Ethernet header with 802.1Q edits */
-	uint8_t *start = packet_buf(packet, 0);
+	packet->len = hdr_len + mpdu_len;
 
-	if (packet.vlan_valid == 1 && packet.vlan_valid_orig == 0)
-		packet.len += sizeof(uint32_t);
-	else if (packet.vlan_valid == 0 && packet.vlan_valid_orig == 1)
-		packet.len -= sizeof(uint32_t);
+	if (route->capture != NULL)
+		capture_packet(route->capture, packet, CAPTURE_OUT);
 
 	/* Execute script on egress */
-	process_script(packet);
+	if (route->action != NULL)
+		process_script(packet, route->action);
 
-	ssize_t len = write(iface->skt, start, packet.len);
-
-	if (len == -1) {
-		ecrit("cannot send, interface '%s': %s", iface->name);
-		return -1;
-	}
-	else if (len != packet.len) {
-		crit("sent %d bytes (expected %d), interface '%s'; "
-		     "was packet received on a higher MTU interface?",
-		     len, packet.len);
+	if (enqueue(iface, hdr, hdr_len, packet->mpdu, mpdu_len,
+		    packet->ts) == -1)
 		return -1;
-	}
-
-	decode(packet);
-	dump(packet);
 
-	++iface->send_ctr;	/* Send counters are currently unused */
+	if (decode(packet) == 0)
+		dump(packet);
 
 	return 0;
 }
 
 /**
- * @brief Receive an EAPOL packet on a network interface
- * @return A <tt>struct peapod_packet</tt> representing an EAPOL packet with its
- *         @p len field set to one of the following:
- *         -# the number of bytes successfully received (if at least 60),
- *         -# -1 if an error occurred while receiving,
- *         -# -2 if fewer than 60 bytes were received (i.e. the EAPOL packet was
- *            smaller than the minimum Ethernet frame size of 64 bytes, as the
- *            4-byte FCS is not included), or
- *         -# -3 if the packet was too big to fit in the main EAPOL packet
- *            buffer (i.e. the MTU was ignored).
- * @note If at least 60 bytes were successfully received, the result will have
- *       Ethernet, EAPOL, and EAP metadata in its other fields.
+ * @brief Finish receiving an EAPOL packet with @p recvmmsg(2)
+ *
+ * Checks the length of the packet, then extracts its timestamp and VLAN tag
+ * from the control messages the kernel sent along with it. A hardware
+ * timestamp, if there is one, is preferred to the software one.
+ *
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> whose @p iface,
+ *               @p len and @p mpdu fields are set
+ * @param msg Pointer to the <tt>struct msghdr</tt> the packet was received with
+ * @note Sets the @p len field of @p packet as described in
+ *       @p packet_recvmmsg().
  */
-struct peapod_packet packet_recvmsg(struct iface_t *iface) {
-	struct peapod_packet ret;
-	memset(&ret, 0, sizeof(ret));
-
-	struct iovec iov[3] = {
-		{ ret.h_dest, ETH_ALEN },
-		{ ret.h_source, ETH_ALEN },
-		{ mpdu_buf, mpdu_buf_size }
-	};
-
-	msg.msg_iov = iov;
-	msg.msg_iovlen = 3;
-
-	// ret.len = recvmsg(iface->skt, &msg, MSG_TRUNC);	SRY DO NOT WANT
-	ret.len = recvmsg(iface->skt, &msg, 0);
-
-	if (ret.len == -1) {
-		return ret;
-	} else if (ret.len < 60) {	/* 64 bytes on the wire including FCS */
-		ret.len = -2;
-		return ret;
-	/* Not passing MSG_TRUNC to recvmsg(2); we won't ever get here.
-
-	} else if (ret.len > (ETH_ALEN * 2) + mpdu_buf_size) {
-
-		ret.len = -3;
-		return ret;
-
-	*/
+static void parse(struct peapod_packet *packet, struct msghdr *msg)
+{
+	if (packet->len < 60) {		/* 64 bytes on the wire including FCS */
+		packet->len = -2;
+		return;
 	}
+	/* Not passing MSG_TRUNC to recvmmsg(2); it can't be too long here. */
 
-	if (ioctl(iface->skt, SIOCGSTAMP, &ret.tv) == -1) {
-		eerr("cannot receive packet timestamp, interface '%s':%s",
-		     iface->name);
-		if (gettimeofday(&ret.tv, NULL) == -1)
-			eerr("cannot even set the timestamp ourselves: ");
-		else
-			warning("had to set the timestamp ourselves");
-	}
+	uint8_t stamped = 0;		/* 1: in software, 2: in hardware */
 
-	ret.iface = iface;
-	/* We don't actually copy the EAPOL MPDU per interface.
-	   We might need to in the future for PACKET_RX_RING/PACKET_TX_RING.
+	/* Reconstruct and copy VLAN tag to result if found */
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+	     cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			if (stamped == 0)
+				memcpy(&packet->ts, CMSG_DATA(cmsg),
+				       sizeof(packet->ts));
+			stamped |= 1;
+			continue;
+		}
 
-	ret.mpdu = (struct eapol_mpdu *)mpdu_buf;
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_TIMESTAMPING) {
+			struct scm_timestamping tss;
+			memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
 
-	 */
-	struct eapol_mpdu *mpdu = (struct eapol_mpdu *)mpdu_buf;
+			/* ts[2] is the raw hardware timestamp, if any */
+			if (tss.ts[2].tv_sec != 0 || tss.ts[2].tv_nsec != 0) {
+				packet->ts = tss.ts[2];
+				stamped = 2;
+			}
+			continue;
+		}
 
-	/* Reconstruct and copy VLAN tag to result if found */
-	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-	     cmsg != NULL;
-	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-		if (cmsg->cmsg_type != PACKET_AUXDATA)
+		if (cmsg->cmsg_level != SOL_PACKET ||
+		    cmsg->cmsg_type != PACKET_AUXDATA)
 			continue;
 
 		struct packet_auxdata_t *aux = (void *)CMSG_DATA(cmsg);
@@ -501,37 +1009,171 @@ struct peapod_packet packet_recvmsg(struct iface_t *iface) {
 		debuglow("\t}");
 
 		/* Looks like the non-hack alternative to MSG_TRUNC */
-		if (ret.len < aux->tp_len) {
-			ret.len = -3;
-			return ret;
+		if (packet->len < aux->tp_len) {
+			packet->len = -3;
+			return;
 		}
 
 		if (aux->tp_status & TP_STATUS_VLAN_VALID &&
 		    aux->tp_vlan_tpid == ETH_P_8021Q) {
-			/* Decode to a tci_t */
-			uint32_t dot1q;				/* convenience */
-			dot1q = aux->tp_vlan_tci;		/* not htons() */
-			ret.tci.pcp = (dot1q & 0xe000) >> 13;
-			ret.tci.dei = (dot1q & 0x1000) >> 12;
-			ret.tci.vid = dot1q & 0x0fff;
-
-			ret.len += 4;
-			ret.vlan_valid = 1;
+			packet->tci = tci_decode(aux->tp_vlan_tci);
+			packet->len += 4;
+			packet->vlan_valid = 1;
 		}
-		break;
 	}
 
-	ret.iface_orig = ret.iface;
-	ret.len_orig = ret.len;
-	ret.vlan_valid_orig = ret.vlan_valid;
-	ret.tci_orig = ret.tci;
+	if (stamped == 0) {
+		warning("had to set the timestamp ourselves, interface '%s'",
+			packet->iface->name);
+		backend->now(&packet->ts);
+	}
 
-	ret.type = mpdu->type;
-	if (ret.type == EAPOL_EAP)
-		ret.code = mpdu->eap.code;
+	classify(packet);
+}
 
-	decode(ret);
-	dump(ret);
+/**
+ * @brief Receive EAPOL packets on a network interface
+ *
+ * Receives as many packets as are ready, up to @p n, with a single non-blocking
+ * @p recvmmsg(2), or whatever stands in for it, cf. @p packet_backend(). Each
+ * packet is read into its own main EAPOL packet buffer.
+ *
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ * @param packets Array of at least @p n <tt>struct peapod_packet</tt>
+ *                structures
+ * @param n The maximum number of packets to receive, up to
+ *          @p PACKET_RX_BATCH
+ * @return The number of packets received, 0 if none were ready, or -1 if an
+ *         error occurred while receiving
+ * @note Each packet received has its @p len field set to one of the following:
+ *       -# the number of bytes successfully received (if at least 60),
+ *       -# -2 if fewer than 60 bytes were received (i.e. the EAPOL packet was
+ *          smaller than the minimum Ethernet frame size of 64 bytes, as the
+ *          4-byte FCS is not included), or
+ *       -# -3 if the packet was too big to fit in the main EAPOL packet
+ *          buffer (i.e. the MTU was ignored).
+ * @note If at least 60 bytes were successfully received, a packet will have
+ *       Ethernet, EAPOL, and EAP metadata in its other fields.
+ */
+int packet_recvmmsg(struct iface_t *iface, struct peapod_packet *packets, int n)
+{
+	if (n > PACKET_RX_BATCH)
+		n = PACKET_RX_BATCH;
+
+	unpin();				/* About to overwrite buffers */
+
+	for (int i = 0; i < n; ++i) {
+		memset(&packets[i], 0, sizeof(packets[i]));
+		packets[i].iface = iface;
+		packets[i].mpdu = mpdu_buf + i * pkt_buf_size;
+
+		iovs[i][0] = (struct iovec){ packets[i].h_dest, ETH_ALEN };
+		iovs[i][1] = (struct iovec){ packets[i].h_source, ETH_ALEN };
+		iovs[i][2] = (struct iovec){ packets[i].mpdu, mpdu_buf_size };
+
+		msgs[i].msg_hdr.msg_iov = iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 3;
+		msgs[i].msg_hdr.msg_control = cmsg_bufs[i];
+		msgs[i].msg_hdr.msg_controllen = sizeof(cmsg_bufs[i]);
+	}
+
+	// recvmmsg(iface->skt, msgs, n, MSG_TRUNC, NULL);	SRY DO NOT WANT
+	int ret = backend->recv(iface, msgs, n);
+
+	if (ret == -1)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+	for (int i = 0; i < ret; ++i) {
+		packets[i].len = msgs[i].msg_len;
+		parse(&packets[i], &msgs[i].msg_hdr);
+	}
 
 	return ret;
 }
+
+/**
+ * @brief Receive the next EAPOL packet from the RX ring of a network interface
+ *
+ * Walks the frames in the current block of the ring, if the kernel has handed
+ * it over to us, without making any system calls. A block is handed back to
+ * the kernel on the call @e after the one that returned its last frame, i.e.
+ * once that frame has been completely processed.
+ *
+ * The EAPOL MPDU is not copied; the @p mpdu field of @p packet points into the
+ * ring. The kernel leaves room before each frame for us to reconstruct the
+ * Ethernet header in place (cf. @p PACKET_RESERVE in @p iface.c).
+ *
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ *              with an RX ring
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> to fill in
+ * @return The @p len field of @p packet, set to one of the following:
+ *         -# the number of bytes in the frame (if at least 60),
+ *         -# 0 if there are no more frames ready in the ring,
+ *         -# -2 if fewer than 60 bytes were received, or
+ *         -# -3 if the frame was truncated to fit in the ring.
+ * @see @p packet_recvmmsg()
+ */
+int packet_recvring(struct iface_t *iface, struct peapod_packet *packet)
+{
+	memset(packet, 0, sizeof(*packet));
+	packet->iface = iface;
+
+	struct ring_t *ring = iface->rx_ring;
+	struct tpacket_block_desc *bd;
+
+	while (ring->frames == 0) {
+		bd = (void *)(ring->map + ring->block * ring->block_size);
+
+		/* Done walking current block, hand it back to the kernel */
+		if (ring->frame != NULL) {
+			unpin();
+			__atomic_store_n(&bd->hdr.bh1.block_status,
+					 TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+			ring->block = (ring->block + 1) % ring->block_nr;
+			ring->frame = NULL;
+			continue;
+		}
+
+		if ((__atomic_load_n(&bd->hdr.bh1.block_status,
+				     __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0)
+			return 0;
+
+		ring->frames = bd->hdr.bh1.num_pkts;
+		ring->frame = (uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt;
+	}
+
+	struct tpacket3_hdr *hdr = (void *)ring->frame;
+	uint8_t *frame = ring->frame + hdr->tp_mac;
+
+	ring->frame += hdr->tp_next_offset;
+	--ring->frames;
+
+	if (hdr->tp_snaplen < 60) {		/* see parse() */
+		packet->len = -2;
+		return packet->len;
+	} else if (hdr->tp_snaplen < hdr->tp_len) {
+		packet->len = -3;
+		return packet->len;
+	}
+
+	memcpy(packet->h_dest, frame, ETH_ALEN);
+	memcpy(packet->h_source, frame + ETH_ALEN, ETH_ALEN);
+
+	/* In hardware, with hw-timestamps and TP_STATUS_TS_RAW_HARDWARE */
+	packet->ts.tv_sec = hdr->tp_sec;
+	packet->ts.tv_nsec = hdr->tp_nsec;
+
+	packet->len = hdr->tp_snaplen;
+	packet->mpdu = frame + (ETH_ALEN * 2);
+
+	if (hdr->tp_status & TP_STATUS_VLAN_VALID &&
+	    hdr->hv1.tp_vlan_tpid == ETH_P_8021Q) {
+		packet->tci = tci_decode(hdr->hv1.tp_vlan_tci);
+		packet->len += 4;
+		packet->vlan_valid = 1;
+	}
+
+	classify(packet);
+
+	return packet->len;
+}
@@ -8,6 +8,9 @@
  */
 %define parse.error verbose
 %{
+#define _GNU_SOURCE			/* CPU_SETSIZE */
+#include <sched.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -17,6 +20,7 @@
 #include "log.h"
 #include "packet.h"
 //#include "parser.h"			/* Included in packet.h */
+#include "session.h"
 
 #define u16tob_fmt	"%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c"
 #define u8tob_fmt	"%c%c%c%c%c%c%c%c"
@@ -45,17 +49,41 @@ extern int yylex_destroy(void);
 static void allocate(void **ptr, size_t size);
 static inline void set_reset(void **dest, void **src);
 static char *validate_path(const char *path);
+static char *validate_capture(const char *path);
+static struct hook_t *get_hook(const char *path);
+static void set_type(int type, const char *path);
+static void set_code(int code, const char *path);
+static void set_state(int state, const char *path);
+static void set_limit(unsigned pps, unsigned burst);
+static void set_coalesce(void);
 
 static void print_filter(struct filter_t *filter);
 static void print_action(struct action_t *action);
+static void print_ring(const char *name, struct ring_t *ring);
+static void print_capture(struct capture_t *capture);
+static void print_limit(const char *name, struct limit_t *limit);
 static void abort_parser(void);
+static void check_virtual(struct iface_t *iface);
 static void free_iface(struct iface_t *iface);
+static void free_peers(struct peer_t *peers);
 static void free_ingress(struct ingress_t *ingress);
 static void free_egress(struct egress_t *egress);
 static void free_action(struct action_t *action);
+static void free_capture(struct capture_t *capture);
+static void free_hooks(struct hook_t *hook);
 
 static char *conffile = NULL;
+static FILE *conffd = NULL;
+static jmp_buf *reloading = NULL;	/* abort_parser() returns here if set */
 static uint8_t *loglevel = NULL;
+static struct scripts_t *scriptcfg = NULL;
+static uint8_t got_scripts = 0;
+static struct sessions_t *sessioncfg = NULL;
+static uint8_t got_sessions = 0;
+static struct latency_t *latencycfg = NULL;
+static uint8_t got_state = 0;		/* flag: a filter or action on session state */
+static unsigned workers = 1;
+static uint8_t got_workers = 0;
 
 static struct iface_t *ifaces = NULL;
 static struct iface_t *iface = NULL;
@@ -64,34 +92,125 @@ static struct egress_t *egress = NULL;
 static struct tci_t *tci = NULL;
 static struct filter_t *filter = NULL;
 static struct action_t *action = NULL;
+static struct ring_t *ring = NULL;
+static struct capture_t *capture = NULL;
+static struct coalesce_t *coalesce = NULL;
+static uint8_t hooking = 0;		/* flag: execparam is for a hook */
+static uint8_t per_mac = 0;		/* flag: ratelimitdef is per source MAC */
 
 extern int linenum;		/* lexer.l: line number in config file */
+extern struct args_t args;
 
-struct iface_t *parse_config(const char *path, uint8_t *level)
+struct iface_t *parse_config(const char *path, uint8_t *level,
+			     struct scripts_t *scripts,
+			     struct sessions_t *sessions,
+			     struct latency_t *latency)
 {
 	linenum = 1;
 
 	loglevel = level;
+	got_scripts = 0;
+	got_sessions = 0;
+	got_state = 0;
+	workers = 1;
+	got_workers = 0;
+
+	ifaces = iface = NULL;
+	ingress = NULL;
+	egress = NULL;
+	tci = NULL;
+	filter = NULL;
+	action = NULL;
+	ring = NULL;
+	capture = NULL;
+	coalesce = NULL;
+	hooking = 0;
+	per_mac = 0;
+
+	scriptcfg = scripts;
+	scriptcfg->max = SCRIPTS_MAX;
+	scriptcfg->queue = SCRIPTS_QUEUE;
+	scriptcfg->drop_oldest = 0;
+	scriptcfg->timeout = SCRIPTS_TIMEOUT;
+	scriptcfg->hooks = NULL;
+
+	sessioncfg = sessions;
+	sessioncfg->max = 0;
+	sessioncfg->timeout = SESSIONS_TIMEOUT;
+
+	latencycfg = latency;
+	memset(latencycfg, 0, sizeof(*latencycfg));
 
+	free(conffile);
 	conffile = strdup(path);
-	FILE *fd = fopen(conffile, "r");
-	if (fd == NULL) {
+	conffd = fopen(conffile, "r");
+	if (conffd == NULL) {
 		eerr("cannot open config file '%s': %s", conffile);
-		exit(EXIT_FAILURE);
+		abort_parser();
 	}
 
-	yyset_in(fd);
+	yyset_in(conffd);
 
 	if (yyparse() != 0)
 		abort_parser();
 
 	yylex_destroy();
-	fclose(fd);
+	fclose(conffd);
+	conffd = NULL;
 
 	int count = 0;
 	for (struct iface_t *i = ifaces; i != NULL; i = i->next) {
 		++count;
 
+		/* check that no two captures write the same file */
+		const char *c[2] = {
+			i->ingress && i->ingress->capture ?
+			i->ingress->capture->path : NULL,
+			i->egress && i->egress->capture ?
+			i->egress->capture->path : NULL
+		};
+		for (struct iface_t *j = i; j != NULL; j = j->next) {
+			const char *d[2] = {
+				j->ingress && j->ingress->capture ?
+				j->ingress->capture->path : NULL,
+				j->egress && j->egress->capture ?
+				j->egress->capture->path : NULL
+			};
+			for (int m = 0; m < 2; ++m) {
+				for (int n = j == i ? m + 1 : 0; n < 2; ++n) {
+					if (c[m] == NULL || d[n] == NULL ||
+					    strcmp(c[m], d[n]) != 0)
+						continue;
+					err("capture file '%s' used twice",
+					    c[m]);
+					abort_parser();
+				}
+			}
+		}
+
+		/* check that egress-to named configured interfaces */
+		for (struct peer_t *p = i->egress_to; p != NULL; p = p->next) {
+			struct iface_t *j;
+			for (j = ifaces; j != NULL; j = j->next)
+				if (strcmp(p->name, j->name) == 0)
+					break;
+
+			if (j == NULL) {
+				err("egress-to unconfigured interface '%s' on '%s'",
+				    p->name, i->name);
+				abort_parser();
+			}
+		}
+
+		if (i->unicast == 1 && got_sessions == 0) {
+			err("unicast on '%s' needs a sessions stanza in config file '%s'",
+			    i->name, conffile);
+			abort_parser();
+		}
+
+		if (i->trunk_name[0] != '\0')
+			check_virtual(i);
+
 		/* check that set-mac-from named a configured interface */
 		if (i->set_mac_from == 0)
 			continue;
@@ -117,11 +236,93 @@ struct iface_t *parse_config(const char *path, uint8_t *level)
 		abort_parser();
 	}
 
+	if (got_state == 1 && got_sessions == 0) {
+		err("session states need a sessions stanza in config file '%s'",
+		    conffile);
+		abort_parser();
+	}
+
+	/* shard interfaces without a worker across workers, in config order
+	 * (the list is in reverse); virtual ones go with their trunks
+	 */
+	int pos = count;
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next)
+		if (i->trunk != NULL)
+			--pos;
+
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next) {
+		if (i->trunk != NULL)
+			continue;
+
+		--pos;
+
+		if (i->worker == IFACE_WORKER_AUTO) {
+			i->worker = pos % workers;
+		} else if (i->worker >= workers) {
+			err("worker %u on '%s' not 0-%u", i->worker, i->name,
+			    workers - 1);
+			abort_parser();
+		}
+
+		/* a TX ring can only be written by one thread, and would
+		 * take over sending on the socket virtual interfaces share
+		 */
+		if (workers > 1 && i->tx_ring != NULL) {
+			warning("ignoring tx-ring on '%s' with workers", i->name);
+			free(i->tx_ring);
+			i->tx_ring = NULL;
+		} else if (i->vlan_nr > 0 && i->tx_ring != NULL) {
+			warning("ignoring tx-ring on trunk '%s'", i->name);
+			free(i->tx_ring);
+			i->tx_ring = NULL;
+		}
+	}
+
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next)
+		if (i->trunk != NULL)
+			i->worker = i->trunk->worker;
+
+	debuglow("scripts: max=%u, queue=%u, drop_oldest=%u, timeout=%u",
+		 scriptcfg->max, scriptcfg->queue, scriptcfg->drop_oldest,
+		 scriptcfg->timeout);
+	debuglow("sessions: max=%u, timeout=%u",
+		 sessioncfg->max, sessioncfg->timeout);
+	debuglow("latency: enabled=%u, busy_poll=%u, cpu_nr=%u, realtime=%u",
+		 latencycfg->enabled, latencycfg->busy_poll,
+		 latencycfg->cpu_nr, latencycfg->realtime);
+
 	info("loaded config from '%s'", conffile);
 
 	return ifaces;
 }
 
+/* like parse_config(), but returns NULL rather than exiting on error */
+struct iface_t *parse_reload(const char *path, uint8_t *level,
+			     struct scripts_t *scripts,
+			     struct sessions_t *sessions,
+			     struct latency_t *latency)
+{
+	jmp_buf env;
+	struct iface_t *ret = NULL;
+
+	if (setjmp(env) == 0) {
+		reloading = &env;
+		ret = parse_config(path, level, scripts, sessions, latency);
+	}
+
+	reloading = NULL;
+	return ret;
+}
+
+/* frees a list returned by parse_config() or parse_reload(), and the hooks
+ * parsed along with it unless they are NULL, i.e. were taken over
+ */
+void parser_free(struct iface_t *list, struct hook_t *hooks)
+{
+	free_iface(list);
+	free_hooks(hooks);
+}
+
 static void allocate(void **ptr, size_t size)
 {
 	if (*ptr == NULL && (*ptr = calloc(1, size)) == NULL) {
@@ -179,6 +380,183 @@ static char *validate_path(const char *path)
 	return ret;
 }
 
+/* caller responsible for free(3)ing the result */
+static char *validate_capture(const char *path)
+{
+	char *ret = args_canonpath(path, 1);
+
+	if (ret == NULL) {
+		eerr("cannot use capture file '%s' (line %d): %s",
+		     path, linenum);
+		abort_parser();
+	}
+
+	if (strcmp(path, ret) != 0) {
+		err("path to capture file '%s' must be absolute and canonical (line %d)",
+		    path, linenum);
+		free(ret);
+		abort_parser();
+	}
+
+	return ret;
+}
+
+/* a hook is started only once, however many actions name its path */
+static struct hook_t *get_hook(const char *path)
+{
+	char *canon = validate_path(path);
+
+	for (struct hook_t *h = scriptcfg->hooks; h != NULL; h = h->next) {
+		if (strcmp(h->path, canon) == 0) {
+			free(canon);
+			return h;
+		}
+	}
+
+	struct hook_t *hook = NULL;
+	allocate((void *)&hook, sizeof(struct hook_t));
+	hook->path = canon;
+	hook->skt = -1;
+	hook->next = scriptcfg->hooks;
+	scriptcfg->hooks = hook;
+
+	debuglow("hook=%p, hook->path=%s", hook, hook->path);
+	return hook;
+}
+
+static void set_type(int type, const char *path)
+{
+	if (hooking == 1)
+		action->hook_type[type] = get_hook(path);
+	else
+		action->type[type] = validate_path(path);
+}
+
+static void set_code(int code, const char *path)
+{
+	if (hooking == 1)
+		action->hook_code[code] = get_hook(path);
+	else
+		action->code[code] = validate_path(path);
+}
+
+static void set_state(int state, const char *path)
+{
+	got_state = 1;
+	if (hooking == 1)
+		action->hook_state[state] = get_hook(path);
+	else
+		action->state[state] = validate_path(path);
+}
+
+static void set_limit(unsigned pps, unsigned burst)
+{
+	struct limit_t **limit = per_mac ? &ingress->limit_mac : &ingress->limit;
+
+	if (*limit != NULL) {
+		err("rate-limit%s twice in same ingress stanza (line %d)",
+		    per_mac ? " per-mac" : "", linenum);
+		abort_parser();
+	}
+	if (pps < 1 || pps > 1000000) {
+		err("rate-limit not 1-1000000 (line %d)", linenum);
+		abort_parser();
+	}
+	if (burst < 1 || burst > 1000000) {
+		err("rate-limit burst not 1-1000000 (line %d)", linenum);
+		abort_parser();
+	}
+
+	allocate((void *)limit, sizeof(struct limit_t));
+	(*limit)->pps = pps;
+	(*limit)->burst = burst;
+}
+
+/* a virtual interface has only its trunk's raw socket, and its VLAN; it is
+ * numbered after both, unless replayed
+ */
+static void check_virtual(struct iface_t *iface)
+{
+	struct iface_t *trunk;
+	for (trunk = ifaces; trunk != NULL; trunk = trunk->next)
+		if (strcmp(iface->trunk_name, trunk->name) == 0)
+			break;
+
+	if (trunk == NULL) {
+		err("trunk unconfigured interface '%s' on '%s'",
+		    iface->trunk_name, iface->name);
+		abort_parser();
+	}
+
+	if (trunk->trunk_name[0] != '\0') {
+		err("trunk '%s' of '%s' is itself on a trunk",
+		    trunk->name, iface->name);
+		abort_parser();
+	}
+
+	for (struct iface_t *i = iface->next; i != NULL; i = i->next) {
+		if (i->vid == iface->vid &&
+		    strcmp(i->trunk_name, iface->trunk_name) == 0) {
+			err("vlan %u twice on trunk '%s'",
+			    iface->vid, trunk->name);
+			abort_parser();
+		}
+	}
+
+	const char *opt = NULL;
+	if (iface->promisc == 1)
+		opt = "promiscuous";
+	else if (iface->hw_timestamps == 1)
+		opt = "hw-timestamps";
+	else if (iface->rx_ring != NULL)
+		opt = "rx-ring";
+	else if (iface->tx_ring != NULL)
+		opt = "tx-ring";
+	else if (iface->budget != IFACE_BUDGET)
+		opt = "budget";
+	else if (iface->offload == 1)
+		opt = "offload";
+	else if (iface->worker != IFACE_WORKER_AUTO)
+		opt = "worker";
+	else if (iface->set_mac[ETH_ALEN] == IFACE_SET_MAC)
+		opt = "set-mac";
+	else if (iface->set_mac_from != 0)
+		opt = "set-mac-from";
+
+	if (opt != NULL) {
+		err("%s on virtual interface '%s', belongs on trunk '%s'",
+		    opt, iface->name, trunk->name);
+		abort_parser();
+	}
+
+	struct tci_t *t = iface->egress ? iface->egress->tci : NULL;
+	if (t != NULL &&
+	    (t->pcp == TCI_NO_DOT1Q || t->vid != TCI_UNTOUCHED_16)) {
+		err("dot1q on virtual interface '%s' cannot change its vlan",
+		    iface->name);
+		abort_parser();
+	}
+
+	if (args.replay == NULL)
+		iface->index = IFACE_VIRTUAL_INDEX(trunk->index, iface->vid);
+	iface->trunk = trunk;
+	++trunk->vlan_nr;
+}
+
+/* coalesce goes with the exec options of the same stanza */
+static void set_coalesce(void)
+{
+	if (coalesce == NULL)
+		return;
+
+	if (action == NULL) {
+		err("coalesce without exec in same stanza (line %d)", linenum);
+		abort_parser();
+	}
+
+	set_reset((void *)&action->coalesce, (void *)&coalesce);
+}
+
 void parser_print_ifaces(struct iface_t *list)
 {
 	if (list == NULL) {
@@ -192,12 +570,14 @@ void parser_print_ifaces(struct iface_t *list)
 	debuglow("\t  mtu=%d", list->mtu);
 	debuglow("\t  skt=%d", list->skt);
 	debuglow("\t  recv_ctr=%d", list->recv_ctr);
-	debuglow("\t  send_ctr=%d", list->send_ctr);
 	if (list->ingress != NULL) {
 		struct ingress_t *ingress = list->ingress;
 		debuglow("\t  ingress: %p {", ingress);
 		print_action(ingress->action);
 		print_filter(ingress->filter);
+		print_capture(ingress->capture);
+		print_limit("limit", ingress->limit);
+		print_limit("limit_mac", ingress->limit_mac);
 		debuglow("\t  }");
 	} else {
 		debuglow("\t  ingress: %p", list->ingress);
@@ -217,11 +597,26 @@ void parser_print_ifaces(struct iface_t *list)
 		}
 		print_filter(egress->filter);
 		print_action(egress->action);
+		print_capture(egress->capture);
 		debuglow("\t  }");
 	} else {
 		debuglow("\t  egress: %p", list->egress);
 	}
+	debuglow("\t  egress_to: %p", list->egress_to);
+	for (struct peer_t *p = list->egress_to; p != NULL; p = p->next)
+		debuglow("\t    '%s'", p->name);
+	debuglow("\t  spoke=%u", list->spoke);
+	debuglow("\t  unicast=%u", list->unicast);
+	debuglow("\t  trunk='%s' %p", list->trunk_name, list->trunk);
+	debuglow("\t  vid=%u", list->vid);
+	debuglow("\t  vlan_nr=%u", list->vlan_nr);
 	debuglow("\t  promisc=%u", list->promisc);
+	debuglow("\t  hw_timestamps=%u", list->hw_timestamps);
+	print_ring("rx_ring", list->rx_ring);
+	print_ring("tx_ring", list->tx_ring);
+	debuglow("\t  budget=%u", list->budget);
+	debuglow("\t  offload=%u", list->offload);
+	debuglow("\t  worker=%u", list->worker);
 	debuglow("\t  set_mac='%s',0x%.02x",
 		 iface_strmac(list->set_mac),
 		 list->set_mac[ETH_ALEN]);
@@ -243,6 +638,7 @@ static void print_filter(struct filter_t *filter)
 	debuglow("\t    filter: %p {", filter);
 	debuglow("\t      type=0b" u16tob_fmt, u16tob(filter->type));
 	debuglow("\t      code=0b" u8tob_fmt, u8tob(filter->code));
+	debuglow("\t      state=0b" u8tob_fmt, u8tob(filter->state));
 	debuglow("\t    }");
 }
 
@@ -263,6 +659,81 @@ static void print_action(struct action_t *action)
 	for (int i = EAP_CODE_REQUEST; i <= EAP_CODE_FAILURE; ++i)
 		debuglow("\t        '%s',", action->code[i]);
 	debuglow("\t      }");
+
+	debuglow("\t      state: %p {", action->state);
+	for (int i = SESSION_STARTED; i <= SESSION_LOGGED_OFF; ++i)
+		debuglow("\t        '%s',", action->state[i]);
+	debuglow("\t      }");
+
+	debuglow("\t      hook_type: %p {", action->hook_type);
+	for (int i = EAPOL_EAP; i <= EAPOL_ANNOUNCEMENT_REQ; ++i)
+		debuglow("\t        '%s',", action->hook_type[i] ?
+			 action->hook_type[i]->path : NULL);
+	debuglow("\t      }");
+
+	debuglow("\t      hook_code: %p {", action->hook_code);
+	for (int i = EAP_CODE_REQUEST; i <= EAP_CODE_FAILURE; ++i)
+		debuglow("\t        '%s',", action->hook_code[i] ?
+			 action->hook_code[i]->path : NULL);
+	debuglow("\t      }");
+
+	debuglow("\t      hook_state: %p {", action->hook_state);
+	for (int i = SESSION_STARTED; i <= SESSION_LOGGED_OFF; ++i)
+		debuglow("\t        '%s',", action->hook_state[i] ?
+			 action->hook_state[i]->path : NULL);
+	debuglow("\t      }");
+
+	if (action->coalesce != NULL) {
+		debuglow("\t      coalesce: %p {", action->coalesce);
+		debuglow("\t        window=%u", action->coalesce->window);
+		debuglow("\t        mode=%u", action->coalesce->mode);
+		debuglow("\t        per_mac=%u", action->coalesce->per_mac);
+		debuglow("\t      }");
+	} else {
+		debuglow("\t      coalesce: %p", action->coalesce);
+	}
+	debuglow("\t    }");
+}
+
+static void print_ring(const char *name, struct ring_t *ring)
+{
+	if (ring == NULL) {
+		debuglow("\t  %s: %p", name, ring);
+		return;
+	}
+
+	debuglow("\t  %s: %p {", name, ring);
+	debuglow("\t    block_nr=%u", ring->block_nr);
+	debuglow("\t    block_size=%u", ring->block_size);
+	debuglow("\t    timeout=%u", ring->timeout);
+	debuglow("\t  }");
+}
+
+static void print_capture(struct capture_t *capture)
+{
+	if (capture == NULL) {
+		debuglow("\t    capture: %p", capture);
+		return;
+	}
+
+	debuglow("\t    capture: %p {", capture);
+	debuglow("\t      path='%s'", capture->path);
+	debuglow("\t      size=%u", capture->size);
+	debuglow("\t      interval=%u", capture->interval);
+	debuglow("\t      mmap=%u", capture->mmap);
+	debuglow("\t    }");
+}
+
+static void print_limit(const char *name, struct limit_t *limit)
+{
+	if (limit == NULL) {
+		debuglow("\t    %s: %p", name, limit);
+		return;
+	}
+
+	debuglow("\t    %s: %p {", name, limit);
+	debuglow("\t      pps=%u", limit->pps);
+	debuglow("\t      burst=%u", limit->burst);
 	debuglow("\t    }");
 }
 
@@ -274,9 +745,31 @@ static void abort_parser(void)
 	free(tci);
 	free(filter);
 	free_action(action);
+	free_capture(capture);
+	free(coalesce);
 	free_iface(iface);
 	free_iface(ifaces);
+	free_hooks(scriptcfg->hooks);
 	free(conffile);
+	ifaces = iface = NULL;
+	ingress = NULL;
+	egress = NULL;
+	tci = NULL;
+	filter = NULL;
+	action = NULL;
+	capture = NULL;
+	coalesce = NULL;
+	scriptcfg->hooks = NULL;
+	conffile = NULL;
+
+	if (conffd != NULL) {
+		yylex_destroy();
+		fclose(conffd);
+		conffd = NULL;
+	}
+
+	if (reloading != NULL)
+		longjmp(*reloading, 1);
 	exit(EXIT_FAILURE);
 }
 
@@ -286,16 +779,33 @@ static void free_iface(struct iface_t *iface)
 		return;
 	free_ingress(iface->ingress);
 	free_egress(iface->egress);
+	free_peers(iface->egress_to);
+	free(iface->vlan);
+	free(iface->rx_ring);
+	free(iface->tx_ring);
 	free_iface(iface->next);
 	free(iface);
 }
 
+static void free_peers(struct peer_t *peers)
+{
+	struct peer_t *next;
+	for (; peers != NULL; peers = next) {
+		next = peers->next;
+		free(peers);
+	}
+}
+
 static void free_ingress(struct ingress_t *ingress)
 {
 	if (ingress == NULL)
 		return;
 	free(ingress->filter);
 	free_action(ingress->action);
+	free_capture(ingress->capture);
+	free(ingress->limit);
+	free(ingress->limit_mac);
+	free(ingress);
 }
 
 static void free_egress(struct egress_t *egress)
@@ -305,16 +815,39 @@ static void free_egress(struct egress_t *egress)
 	free(egress->tci);
 	free(egress->filter);
 	free_action(egress->action);
+	free_capture(egress->capture);
+	free(egress);
 }
 
 static void free_action(struct action_t *action)
 {
 	if (action == NULL)
 		return;
-	for (int i = 0; i < 5; ++i)
+	for (int i = 0; i < 9; ++i)
 		free(action->type[i]);
 	for (int i = 1; i < 5; ++i)
 		free(action->code[i]);
+	for (int i = 1; i < 6; ++i)
+		free(action->state[i]);
+	free(action->coalesce);
+	free(action);
+}
+
+static void free_capture(struct capture_t *capture)
+{
+	if (capture == NULL)
+		return;
+	free(capture->path);
+	free(capture);
+}
+
+static void free_hooks(struct hook_t *hook)
+{
+	if (hook == NULL)
+		return;
+	free_hooks(hook->next);
+	free(hook->path);
+	free(hook);
 }
 
 static void yyerror(const char *str)
@@ -335,12 +868,24 @@ static void yyerror(const char *str)
 %token		T_INGRESS
 %token		T_EGRESS
 %token		T_DOT1Q
+%token		T_EGRESS_TO
+%token		T_SPOKE
+%token		T_UNICAST
+%token		T_TRUNK
+%token		T_VLAN
 
 %token		T_SET_MAC
 %token		T_SET_MAC_FROM
 %token		T_PROMISCUOUS
+%token		T_HW_TIMESTAMPS
+%token		T_RX_RING
+%token		T_TX_RING
+%token		T_BUDGET
+%token		T_OFFLOAD
+%token		T_WORKER
 %token		T_FILTER
 %token		T_EXEC
+%token		T_HOOK
 
 %token		T_ALL
 %token		T_EAP
@@ -358,11 +903,48 @@ static void yyerror(const char *str)
 %token		T_SUCCESS
 %token		T_FAILURE
 
+%token		T_STARTED
+%token		T_AUTHENTICATING
+%token		T_AUTHENTICATED
+%token		T_FAILED
+%token		T_LOGGED_OFF
+
 %token		T_PRIORITY
 %token		T_DROP_ELIGIBLE
 %token		T_ID
 %token		T_NO
 
+%token		T_BLOCKS
+%token		T_BLOCK_SIZE
+%token		T_TIMEOUT
+
+%token		T_CAPTURE
+%token		T_SIZE
+%token		T_INTERVAL
+%token		T_MMAP
+%token		T_RATE_LIMIT
+%token		T_PER_MAC
+%token		T_BURST
+%token		T_COALESCE
+%token		T_TRAILING
+%token		T_BATCH
+
+%token		T_WORKERS
+
+%token		T_SCRIPTS
+%token		T_MAX
+%token		T_QUEUE
+%token		T_OVERFLOW
+%token		T_DROP_NEWEST
+%token		T_DROP_OLDEST
+
+%token		T_SESSIONS
+
+%token		T_LOW_LATENCY
+%token		T_BUSY_POLL
+%token		T_CPU
+%token		T_REALTIME
+
 %token		T_BAD_TOKEN
 
 %union {
@@ -377,6 +959,10 @@ grammar		: grammar basedef
 		;
 
 basedef		: verbositydef
+		| workersdef
+		| scriptsdef
+		| sessionsdef
+		| latencydef
 		| ifacedef
 		;
 
@@ -390,9 +976,188 @@ verbositydef	: T_VERBOSITY NUMBER ';'
 		}
 		;
 
+workersdef	: T_WORKERS NUMBER ';'
+		{
+			if (got_workers == 1) {
+				err("workers twice in config file (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			if ($2 < 1 || $2 > IFACE_WORKERS_MAX) {
+				err("workers not 1-%d (line %d)",
+				    IFACE_WORKERS_MAX, linenum);
+				abort_parser();
+			}
+			got_workers = 1;
+			workers = $2;
+		}
+		;
+
+
+scriptsdef	: scriptshead '{' scriptsparams '}' ';'
+		| scriptshead '{' '}' ';'
+		;
+
+scriptshead	: T_SCRIPTS
+		{
+			if (got_scripts == 1) {
+				err("scripts stanza twice in config file (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			got_scripts = 1;
+		}
+		;
+
+scriptsparams	: scriptsparams scriptsparam
+		| scriptsparam
+		;
+
+scriptsparam	: T_MAX NUMBER ';'
+		{
+			if ($2 < 1 || $2 > 1024) {
+				err("scripts max not 1-1024 (line %d)", linenum);
+				abort_parser();
+			}
+			scriptcfg->max = $2;
+		}
+		| T_QUEUE NUMBER ';'
+		{
+			if ($2 > 65535) {
+				err("scripts queue not 0-65535 (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			scriptcfg->queue = $2;
+		}
+		| T_OVERFLOW T_DROP_NEWEST ';'
+		{
+			scriptcfg->drop_oldest = 0;
+		}
+		| T_OVERFLOW T_DROP_OLDEST ';'
+		{
+			scriptcfg->drop_oldest = 1;
+		}
+		| T_TIMEOUT NUMBER ';'
+		{
+			if ($2 > 86400) {
+				err("scripts timeout not 0-86400 (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			scriptcfg->timeout = $2;
+		}
+		;
+
+sessionsdef	: sessionshead ';'
+		| sessionshead '{' sessionsparams '}' ';'
+		;
+
+sessionshead	: T_SESSIONS
+		{
+			if (got_sessions == 1) {
+				err("sessions stanza twice in config file (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			got_sessions = 1;
+			sessioncfg->max = SESSIONS_MAX;
+		}
+		;
+
+sessionsparams	: sessionsparams sessionsparam
+		| sessionsparam
+		;
+
+sessionsparam	: T_MAX NUMBER ';'
+		{
+			if ($2 < 1 || $2 > 1048576) {
+				err("sessions max not 1-1048576 (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			sessioncfg->max = $2;
+		}
+		| T_TIMEOUT NUMBER ';'
+		{
+			if ($2 > 604800) {
+				err("sessions timeout not 0-604800 (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			sessioncfg->timeout = $2;
+		}
+		;
+
+latencydef	: latencyhead ';'
+		| latencyhead '{' latencyparams '}' ';'
+		;
+
+latencyhead	: T_LOW_LATENCY
+		{
+			if (latencycfg->enabled == 1) {
+				err("low-latency stanza twice in config file (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			latencycfg->enabled = 1;
+			latencycfg->busy_poll = LATENCY_BUSY_POLL;
+		}
+		;
+
+latencyparams	: latencyparams latencyparam
+		| latencyparam
+		;
+
+latencyparam	: T_BUSY_POLL NUMBER ';'
+		{
+			if ($2 > 1000000) {
+				err("low-latency busy-poll not 0-1000000 (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			latencycfg->busy_poll = $2;
+		}
+		| T_CPU cpus ';'
+		| T_REALTIME NUMBER ';'
+		{
+			if ($2 < 1 || $2 > 99) {
+				err("low-latency realtime not 1-99 (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			latencycfg->realtime = $2;
+		}
+		;
+
+cpus		: cpus cpu
+		| cpu
+		;
+
+cpu		: NUMBER
+		{
+			if ($1 >= CPU_SETSIZE) {
+				err("low-latency cpu not 0-%d (line %d)",
+				    CPU_SETSIZE - 1, linenum);
+				abort_parser();
+			}
+			if (latencycfg->cpu_nr == IFACE_WORKERS_MAX) {
+				err("low-latency cpu more than %d times (line %d)",
+				    IFACE_WORKERS_MAX, linenum);
+				abort_parser();
+			}
+			latencycfg->cpu[latencycfg->cpu_nr++] = $1;
+		}
+		;
 
 ifacedef	: ifacehead '{' ifaceparams '}' ';'
 		{
+			if (iface->index == 0 && iface->trunk_name[0] == '\0') {
+				err("no interface '%s' found (line %d)",
+				    iface->name, linenum);
+				abort_parser();
+			}
+
 			if (iface->set_mac_from != 0) {
 				if (iface->set_mac[ETH_ALEN] == IFACE_SET_MAC) {
 					err("both set-mac and set-mac-from on '%s' (line %d)",
@@ -418,6 +1183,12 @@ ifacedef	: ifacehead '{' ifaceparams '}' ';'
 		}
 		| ifacehead ';' /* empty params */
 		{
+			if (iface->index == 0) {
+				err("no interface '%s' found (line %d)",
+				    iface->name, linenum);
+				abort_parser();
+			}
+
 			iface->next = ifaces;
 
 			debuglow("got iface definition for '%s' %p",
@@ -434,11 +1205,17 @@ ifacehead	: T_IFACE STRING
 				abort_parser();
 			}
 
-			unsigned index = if_nametoindex($2);
-			if (index == 0) {
-				eerr("no interface '%s' found (line %d): %s",
-				     $2, linenum);
-				abort_parser();
+			/* replayed interfaces need not exist, and are numbered
+			 * in config order instead; nor need virtual ones, which
+			 * are numbered once their trunk is known
+			 */
+			unsigned index = 1;
+			if (args.replay != NULL) {
+				for (struct iface_t *i = ifaces;
+				     i != NULL; i = i->next)
+					++index;
+			} else {
+				index = if_nametoindex($2);
 			}
 
 			for (struct iface_t *i = ifaces;
@@ -454,6 +1231,8 @@ ifacehead	: T_IFACE STRING
 
 			strncpy(iface->name, $2, IFNAMSIZ);
 			iface->index = index;
+			iface->budget = IFACE_BUDGET;
+			iface->worker = IFACE_WORKER_AUTO;
 
 			debuglow("iface=%p, iface->name=%s, iface->index=%d",
 				 iface, iface->name, iface->index);
@@ -467,14 +1246,25 @@ ifaceparams	: ifaceparams ifaceparam
 ifaceparam	: ingressdef
 		| egressdef
 		| promiscuousdef
+		| hwtimestampsdef
 		| setmacdef
 		| setmacfromdef
+		| egresstodef
+		| spokedef
+		| unicastdef
+		| trunkdef
+		| ringdef
+		| budgetdef
+		| offloaddef
+		| workerdef
 		;
 
 ingressdef	: ingresshead '{' ingressparams '}' ';'
 		{
+			set_coalesce();
 			set_reset((void *)&ingress->filter, (void *)&filter);
 			set_reset((void *)&ingress->action, (void *)&action);
+			set_reset((void *)&ingress->capture, (void *)&capture);
 
 			debuglow("got ingress definition %p", ingress);
 		}
@@ -498,7 +1288,31 @@ ingressparams	: ingressparams ingressparam
 		;
 
 ingressparam	: execdef
+		| hookdef
 		| filterdef
+		| capturedef
+		| ratelimitdef
+		| coalescedef
+		;
+
+ratelimitdef	: ratelimithead NUMBER ';'
+		{
+			set_limit($2, $2);
+		}
+		| ratelimithead NUMBER T_BURST NUMBER ';'
+		{
+			set_limit($2, $4);
+		}
+		;
+
+ratelimithead	: T_RATE_LIMIT
+		{
+			per_mac = 0;
+		}
+		| T_RATE_LIMIT T_PER_MAC
+		{
+			per_mac = 1;
+		}
 		;
 
 
@@ -579,6 +1393,31 @@ filtertype	: T_ALL
 		{
 			filter->code |= 1 << EAP_CODE_FAILURE;
 		}
+		| T_STARTED
+		{
+			filter->state |= 1 << SESSION_STARTED;
+			got_state = 1;
+		}
+		| T_AUTHENTICATING
+		{
+			filter->state |= 1 << SESSION_AUTHENTICATING;
+			got_state = 1;
+		}
+		| T_AUTHENTICATED
+		{
+			filter->state |= 1 << SESSION_AUTHENTICATED;
+			got_state = 1;
+		}
+		| T_FAILED
+		{
+			filter->state |= 1 << SESSION_FAILED;
+			got_state = 1;
+		}
+		| T_LOGGED_OFF
+		{
+			filter->state |= 1 << SESSION_LOGGED_OFF;
+			got_state = 1;
+		}
 		;
 
 execdef		: exechead execparam ';'
@@ -590,6 +1429,21 @@ execdef		: exechead execparam ';'
 exechead	: T_EXEC
 		{
 			allocate((void *)&action, sizeof(struct action_t));
+			hooking = 0;
+			debuglow("action=%p", action);
+		}
+		;
+
+hookdef		: hookhead execparam ';'
+		{
+			debuglow("got hook definition %p", action);
+		}
+		;
+
+hookhead	: T_HOOK
+		{
+			allocate((void *)&action, sizeof(struct action_t));
+			hooking = 1;
 			debuglow("action=%p", action);
 		}
 		;
@@ -599,59 +1453,79 @@ execparam	: T_ALL STRING
 			for (int i = EAPOL_EAP;
 			     i <= EAPOL_ANNOUNCEMENT_REQ;
 			     ++i)
-				action->type[i] = validate_path($2);
+				set_type(i, $2);
 		}
 		| T_EAP STRING
 		{
-			action->type[EAPOL_EAP] = validate_path($2);
+			set_type(EAPOL_EAP, $2);
 		}
 		| T_START STRING
 		{
-			action->type[EAPOL_START] = validate_path($2);
+			set_type(EAPOL_START, $2);
 		}
 		| T_LOGOFF STRING
 		{
-			action->type[EAPOL_LOGOFF] = validate_path($2);
+			set_type(EAPOL_LOGOFF, $2);
 		}
 		| T_KEY STRING
 		{
-			action->type[EAPOL_KEY] = validate_path($2);
+			set_type(EAPOL_KEY, $2);
 		}
 		| T_ENCAPSULATED_ASF_ALERT STRING
 		{
-			action->type[EAPOL_ENCAPSULATED_ASF_ALERT] = validate_path($2);
+			set_type(EAPOL_ENCAPSULATED_ASF_ALERT, $2);
 		}
 		| T_MKA STRING
 		{
-			action->type[EAPOL_MKA] = validate_path($2);
+			set_type(EAPOL_MKA, $2);
 		}
 		| T_ANNOUNCEMENT_GENERIC STRING
 		{
-			action->type[EAPOL_ANNOUNCEMENT_GENERIC] = validate_path($2);
+			set_type(EAPOL_ANNOUNCEMENT_GENERIC, $2);
 		}
 		| T_ANNOUNCEMENT_SPECIFIC STRING
 		{
-			action->type[EAPOL_ANNOUNCEMENT_SPECIFIC] = validate_path($2);
+			set_type(EAPOL_ANNOUNCEMENT_SPECIFIC, $2);
 		}
 		| T_ANNOUNCEMENT_REQ STRING
 		{
-			action->type[EAPOL_ANNOUNCEMENT_REQ] = validate_path($2);
+			set_type(EAPOL_ANNOUNCEMENT_REQ, $2);
 		}
 		| T_REQUEST STRING
 		{
-			action->code[EAP_CODE_REQUEST] = validate_path($2);
+			set_code(EAP_CODE_REQUEST, $2);
 		}
 		| T_RESPONSE STRING
 		{
-			action->code[EAP_CODE_RESPONSE] = validate_path($2);
+			set_code(EAP_CODE_RESPONSE, $2);
 		}
 		| T_SUCCESS STRING
 		{
-			action->code[EAP_CODE_SUCCESS] = validate_path($2);
+			set_code(EAP_CODE_SUCCESS, $2);
 		}
 		| T_FAILURE STRING
 		{
-			action->code[EAP_CODE_FAILURE] = validate_path($2);
+			set_code(EAP_CODE_FAILURE, $2);
+		}
+		| T_STARTED STRING
+		{
+			set_state(SESSION_STARTED, $2);
+		}
+		| T_AUTHENTICATING STRING
+		{
+			set_state(SESSION_AUTHENTICATING, $2);
+		}
+		| T_AUTHENTICATED STRING
+		{
+			set_state(SESSION_AUTHENTICATED, $2);
+		}
+		| T_FAILED STRING
+		{
+			set_state(SESSION_FAILED, $2);
+		}
+		| T_LOGGED_OFF STRING
+		{
+			set_state(SESSION_LOGGED_OFF, $2);
 		}
 		;
 
@@ -664,10 +1538,12 @@ egressdef	: T_EGRESS '{' egressparams '}' ';'
 			}
 
 			allocate((void *)&egress, sizeof(struct egress_t));
+			set_coalesce();
 
 			set_reset((void *)&egress->tci, (void *)&tci);
 			set_reset((void *)&egress->filter, (void *)&filter);
 			set_reset((void *)&egress->action, (void *)&action);
+			set_reset((void *)&egress->capture, (void *)&capture);
 
 			debuglow("got egress definition %p", egress);
 		}
@@ -679,7 +1555,116 @@ egressparams	: egressparams egressparam
 
 egressparam	: filterdef
 		| execdef
+		| hookdef
 		| dot1qdef
+		| capturedef
+		| coalescedef
+		;
+
+coalescedef	: coalescehead ';'
+		{
+			debuglow("got coalesce definition %p", coalesce);
+		}
+		| coalescehead coalesceopts ';'
+		{
+			debuglow("got coalesce definition %p", coalesce);
+		}
+		;
+
+coalescehead	: T_COALESCE NUMBER
+		{
+			if (coalesce != NULL) {
+				err("coalesce twice in same stanza (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			if ($2 < 1 || $2 > 3600000) {
+				err("coalesce not 1-3600000 (line %d)", linenum);
+				abort_parser();
+			}
+			allocate((void *)&coalesce, sizeof(struct coalesce_t));
+			coalesce->window = $2;
+			debuglow("coalesce=%p", coalesce);
+		}
+		;
+
+coalesceopts	: coalesceopts coalesceopt
+		| coalesceopt
+		;
+
+coalesceopt	: T_PER_MAC
+		{
+			coalesce->per_mac = 1;
+		}
+		| T_TRAILING
+		{
+			if (coalesce->mode != COALESCE_LEADING) {
+				err("coalesce trailing and batch are exclusive (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			coalesce->mode = COALESCE_TRAILING;
+		}
+		| T_BATCH
+		{
+			if (coalesce->mode != COALESCE_LEADING) {
+				err("coalesce trailing and batch are exclusive (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			coalesce->mode = COALESCE_BATCH;
+		}
+		;
+
+capturedef	: capturehead ';'
+		{
+			debuglow("got capture definition %p", capture);
+		}
+		| capturehead '{' captureparams '}' ';'
+		{
+			debuglow("got capture definition %p", capture);
+		}
+		;
+
+capturehead	: T_CAPTURE STRING
+		{
+			if (capture != NULL) {
+				err("capture twice in same stanza (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			allocate((void *)&capture, sizeof(struct capture_t));
+			capture->path = validate_capture($2);
+			debuglow("capture=%p", capture);
+		}
+		;
+
+captureparams	: captureparams captureparam
+		| captureparam
+		;
+
+captureparam	: T_SIZE NUMBER ';'
+		{
+			if ($2 < 1 || $2 > 65535) {
+				err("capture size not 1-65535 (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			capture->size = $2;
+		}
+		| T_INTERVAL NUMBER ';'
+		{
+			if ($2 < 1 || $2 > 604800) {
+				err("capture interval not 1-604800 (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			capture->interval = $2;
+		}
+		| T_MMAP ';'
+		{
+			capture->mmap = 1;
+		}
 		;
 
 dot1qdef	: dot1qhead '{' dot1qparams '}' ';'
@@ -760,6 +1745,190 @@ promiscuousdef	: T_PROMISCUOUS ';'
 		}
 		;
 
+hwtimestampsdef	: T_HW_TIMESTAMPS ';'
+		{
+			iface->hw_timestamps = 1;
+		}
+		;
+
+budgetdef	: T_BUDGET NUMBER ';'
+		{
+			if ($2 < 1 || $2 > 65535) {
+				err("budget not 1-65535 (line %d)", linenum);
+				abort_parser();
+			}
+			iface->budget = $2;
+		}
+		;
+
+egresstodef	: T_EGRESS_TO egresstonames ';'
+		;
+
+egresstonames	: egresstonames egresstoname
+		| egresstoname
+		;
+
+egresstoname	: STRING
+		{
+			if (strlen($1) > IFNAMSIZ - 1) {
+				err("interface name '%s' too long (line %d)",
+				    $1, linenum);
+				abort_parser();
+			}
+
+			if (strcmp($1, iface->name) == 0) {
+				err("egress-to self on '%s' (line %d)",
+				    iface->name, linenum);
+				abort_parser();
+			}
+
+			/* keep them in config order */
+			struct peer_t **p;
+			for (p = &iface->egress_to; *p != NULL; p = &(*p)->next) {
+				if (strcmp($1, (*p)->name) == 0) {
+					err("egress-to '%s' twice on '%s' (line %d)",
+					    $1, iface->name, linenum);
+					abort_parser();
+				}
+			}
+
+			allocate((void *)p, sizeof(struct peer_t));
+			strcpy((*p)->name, $1);
+		}
+		;
+
+spokedef	: T_SPOKE ';'
+		{
+			iface->spoke = 1;
+		}
+		;
+
+unicastdef	: T_UNICAST ';'
+		{
+			iface->unicast = 1;
+		}
+		;
+
+trunkdef	: T_TRUNK STRING T_VLAN NUMBER ';'
+		{
+			if (iface->trunk_name[0] != '\0') {
+				err("trunk twice in same iface stanza (line %d)",
+				    linenum);
+				abort_parser();
+			}
+
+			if (strlen($2) > IFNAMSIZ - 1) {
+				err("interface name '%s' too long (line %d)",
+				    $2, linenum);
+				abort_parser();
+			}
+
+			if ($4 < 1 || $4 > 4094) {
+				err("trunk vlan not 1-4094 (line %d)", linenum);
+				abort_parser();
+			}
+
+			strcpy(iface->trunk_name, $2);
+			iface->vid = $4;
+		}
+		;
+
+offloaddef	: T_OFFLOAD ';'
+		{
+			iface->offload = 1;
+		}
+		;
+
+workerdef	: T_WORKER NUMBER ';'
+		{
+			if ($2 >= IFACE_WORKERS_MAX) {
+				err("worker not 0-%d (line %d)",
+				    IFACE_WORKERS_MAX - 1, linenum);
+				abort_parser();
+			}
+			iface->worker = $2;
+		}
+		;
+
+ringdef		: ringhead ';'
+		{
+			debuglow("got ring definition %p", ring);
+		}
+		| ringhead '{' ringparams '}' ';'
+		{
+			debuglow("got ring definition %p", ring);
+		}
+		;
+
+ringhead	: T_RX_RING
+		{
+			if (iface->rx_ring != NULL) {
+				err("rx-ring twice in same iface stanza (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			allocate((void *)&iface->rx_ring, sizeof(struct ring_t));
+			ring = iface->rx_ring;
+			ring->block_nr = RING_BLOCK_NR;
+			ring->block_size = RING_BLOCK_SIZE;
+			ring->timeout = RING_TIMEOUT;
+			debuglow("rx-ring=%p", ring);
+		}
+		| T_TX_RING
+		{
+			if (iface->tx_ring != NULL) {
+				err("tx-ring twice in same iface stanza (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			allocate((void *)&iface->tx_ring, sizeof(struct ring_t));
+			ring = iface->tx_ring;
+			ring->block_nr = RING_BLOCK_NR;
+			ring->block_size = RING_BLOCK_SIZE;
+			debuglow("tx-ring=%p", ring);
+		}
+		;
+
+ringparams	: ringparams ringparam
+		| ringparam
+		;
+
+ringparam	: T_BLOCKS NUMBER ';'
+		{
+			if ($2 < 1 || $2 > 1024) {
+				err("ring blocks not 1-1024 (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			ring->block_nr = $2;
+		}
+		| T_BLOCK_SIZE NUMBER ';'
+		{
+			unsigned pagesize = getpagesize();
+			if ($2 < pagesize || $2 % pagesize != 0 ||
+			    $2 > (1 << 22)) {
+				err("ring block-size not a multiple of %u up to 4194304 (line %d)",
+				    pagesize, linenum);
+				abort_parser();
+			}
+			ring->block_size = $2;
+		}
+		| T_TIMEOUT NUMBER ';'
+		{
+			if (ring == iface->tx_ring) {
+				err("timeout in tx-ring stanza (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			if ($2 > 1000) {
+				err("rx-ring timeout not 0-1000 (line %d)",
+				    linenum);
+				abort_parser();
+			}
+			ring->timeout = $2;
+		}
+		;
+
 setmacdef	: T_SET_MAC MAC ';'
 		{
 			if ($2[0] & (1 << 0)) {
@@ -781,13 +1950,19 @@ setmacfromdef	: T_SET_MAC_FROM STRING ';'
 				abort_parser();
 			}
 
-			unsigned index = if_nametoindex($2);
-			if (index == 0) {
-				eerr("no interface '%s' found (line %d): %s",
-				     $2, linenum);
-				abort_parser();
-			}
+			/* what it would be set from is not there to set */
+			if (args.replay != NULL) {
+				warning("ignoring set-mac-from on '%s' when replaying (line %d)",
+					iface->name, linenum);
+			} else {
+				unsigned index = if_nametoindex($2);
+				if (index == 0) {
+					eerr("no interface '%s' found (line %d): %s",
+					     $2, linenum);
+					abort_parser();
+				}
 
-			iface->set_mac_from = index;
+				iface->set_mac_from = index;
+			}
 		}
 		;
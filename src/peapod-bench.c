@@ -0,0 +1,518 @@
+/**
+ * @file peapod-bench.c
+ * @brief Measure how fast @p peapod proxies EAPOL packets
+ *
+ * Sends EAPOL packets on one interface, at a given rate or as fast as
+ * possible, and receives them on another once @p peapod has proxied them
+ * there. Each packet carries a sequence number and the time it was sent,
+ * which is compared with the time the kernel received it to work out its
+ * forwarding latency.
+ *
+ * Prints a single line of results, as pairs of field names and values, e.g.
+ * @code
+ *   plain: sent 100000 received 100000 dropped 0 pps 98765 p50_us 21.4 p99_us 48.0 p999_us 97.3
+ * @endcode
+ * which @p bench/bench.sh collects and compares with a baseline.
+ */
+#define _GNU_SOURCE			/* recvmmsg(2), sendmmsg(2) */
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <sys/socket.h>
+#include "defaults.h"
+#include "packet.h"
+
+/** @brief Length of each packet sent, at least enough for an EAPOL-Key */
+#define BENCH_FRAME_LEN			96
+
+/** @brief Packets sent or received with one @p sendmmsg(2) or @p recvmmsg(2) */
+#define BENCH_BATCH			32
+
+/** @brief "peab", cf. <tt>struct bench_stamp_t</tt> */
+#define BENCH_MAGIC			0x70656162
+
+/** @brief Most packet types that may be sent in turn */
+#define BENCH_TYPES			16
+
+/**
+ * @brief What each packet carries in its last bytes, after the EAPOL MPDU
+ *
+ * Found relative to the end of the packet as received, so that an 802.1Q tag
+ * added or removed in between does not matter.
+ */
+struct bench_stamp_t {
+	uint32_t magic;			/**< @brief @p BENCH_MAGIC */
+	uint32_t pad;			/**< @brief Unused */
+	uint64_t seq;			/**< @brief Sequence number */
+	uint64_t sent;			/**< @brief When it was sent, in nanoseconds on @p CLOCK_REALTIME */
+}__attribute__((packed));
+
+/** @brief A benchmark run, as set up by @p main() */
+struct bench_t {
+	int tx;				/**< @brief Socket to send on */
+	int rx;				/**< @brief Socket to receive on */
+	uint64_t count;			/**< @brief Packets to send */
+	uint64_t rate;			/**< @brief Packets per second, or 0 for as fast as possible */
+	uint8_t types[BENCH_TYPES];	/**< @brief EAPOL Packet Types to send in turn */
+	unsigned type_nr;		/**< @brief Number of @p types */
+	uint16_t filtered;		/**< @brief Bitmask of EAPOL Packet Types the proxy drops */
+	unsigned wait;			/**< @brief Milliseconds to wait for stragglers */
+	uint64_t started;		/**< @brief When sending started, in nanoseconds */
+	uint8_t done;			/**< @brief Flag: Has everything been sent? */
+	uint64_t expected;		/**< @brief Packets the proxy should not drop */
+	uint64_t received;		/**< @brief Packets received */
+	uint64_t last;			/**< @brief When the last packet was received, in nanoseconds */
+	uint32_t *latency;		/**< @brief Latency of each packet received, in nanoseconds */
+};
+
+static uint64_t now_ns(void);
+static int open_socket(const char *name, int *index);
+static int parse_types(const char *list, uint8_t *types, unsigned max);
+static size_t build(uint8_t *frame, uint8_t type, uint64_t seq);
+static void *send_all(void *arg);
+static void recv_all(struct bench_t *b);
+static int cmp_u32(const void *a, const void *b);
+
+/** @brief Program usage string */
+static const char usage[] = {
+"Usage: %s [-h] [-r <pps>] [-n <count>] [-t <types>] [-f <types>] [-w <ms>]\n"
+"       [-l <label>] <tx-iface> <rx-iface>\n"
+"\n"
+"Send EAPOL packets on <tx-iface> for %s to proxy to <rx-iface>, and report how\n"
+"many made it and how long they took.\n"
+"\n"
+"  -r, --rate=PPS       send PPS packets per second (default: as fast as\n"
+"                       possible)\n"
+"  -n, --count=N        send N packets (default: 100000)\n"
+"  -t, --types=LIST     send these types in turn, out of start, eap, key,\n"
+"                       logoff (default: eap)\n"
+"  -f, --filtered=LIST  expect the proxy to drop these types\n"
+"  -w, --wait=MS        wait MS milliseconds for packets still on their way\n"
+"                       after sending (default: 500)\n"
+"  -l, --label=LABEL    label the results (default: bench)\n"
+"  -h, --help           print this help and exit\n"
+};
+
+/** @brief An array of <tt>struct option</tt> structures for @p getopt_long(3) */
+static struct option long_opts[] = {
+	{ "rate", required_argument, NULL, 'r' },
+	{ "count", required_argument, NULL, 'n' },
+	{ "types", required_argument, NULL, 't' },
+	{ "filtered", required_argument, NULL, 'f' },
+	{ "wait", required_argument, NULL, 'w' },
+	{ "label", required_argument, NULL, 'l' },
+	{ "help", no_argument, NULL, 'h' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/** @brief Names of the EAPOL Packet Types that may be sent */
+static const char *const type_names[] = {
+	[EAPOL_EAP] = "eap",
+	[EAPOL_START] = "start",
+	[EAPOL_LOGOFF] = "logoff",
+	[EAPOL_KEY] = "key"
+};
+
+/** @brief Port Access Entity group address, cf. @p iface.c */
+static const uint8_t pae_grp_mac[ETH_ALEN] = {
+	0x01, 0x80, 0xc2, 0x00, 0x00, 0x03
+};
+
+/** @brief A locally administered source address */
+static const uint8_t bench_mac[ETH_ALEN] = {
+	0x02, 0x00, 0x00, 0x00, 0xbe, 0x01
+};
+
+/**
+ * @brief Get the time on @p CLOCK_REALTIME, which receive timestamps are on
+ * @return The time in nanoseconds
+ */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Open a raw socket for EAPOL packets, bound to an interface
+ * @param name Name of the interface
+ * @param index Pointer to where to store the interface index
+ * @return The socket, or -1 if unsuccessful
+ */
+static int open_socket(const char *name, int *index)
+{
+	struct sockaddr_ll sll;
+	int bufsiz = 1 << 22, one = 1;
+
+	if ((*index = if_nametoindex(name)) == 0) {
+		fprintf(stderr, "no interface '%s' found: %s\n", name,
+			strerror(errno));
+		return -1;
+	}
+
+	int skt = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htons(ETH_P_PAE));
+	if (skt == -1) {
+		fprintf(stderr, "cannot open socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_PAE);
+	sll.sll_ifindex = *index;
+	if (bind(skt, (struct sockaddr *)&sll, sizeof(sll)) == -1) {
+		fprintf(stderr, "cannot bind socket to '%s': %s\n", name,
+			strerror(errno));
+		close(skt);
+		return -1;
+	}
+
+	/* Not fatal; only makes drops on our end more likely */
+	if (setsockopt(skt, SOL_SOCKET, SO_RCVBUFFORCE, &bufsiz,
+		       sizeof(bufsiz)) == -1)
+		setsockopt(skt, SOL_SOCKET, SO_RCVBUF, &bufsiz, sizeof(bufsiz));
+	if (setsockopt(skt, SOL_SOCKET, SO_SNDBUFFORCE, &bufsiz,
+		       sizeof(bufsiz)) == -1)
+		setsockopt(skt, SOL_SOCKET, SO_SNDBUF, &bufsiz, sizeof(bufsiz));
+	setsockopt(skt, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+
+	return skt;
+}
+
+/**
+ * @brief Parse a comma-separated list of EAPOL Packet Type names
+ * @param list The list
+ * @param types Array to store the types in
+ * @param max Size of @p types
+ * @return Number of types, or -1 if a name is unknown or there are too many
+ */
+static int parse_types(const char *list, uint8_t *types, unsigned max)
+{
+	char buf[256], *save = NULL;
+	unsigned n = 0;
+
+	snprintf(buf, sizeof(buf), "%s", list);
+	for (char *name = strtok_r(buf, ",", &save); name != NULL;
+	     name = strtok_r(NULL, ",", &save)) {
+		uint8_t t;
+
+		for (t = 0; t < sizeof(type_names) / sizeof(*type_names); ++t)
+			if (strcmp(type_names[t], name) == 0)
+				break;
+		if (t == sizeof(type_names) / sizeof(*type_names) || n == max) {
+			fprintf(stderr, "unknown type or too many types: '%s'\n",
+				name);
+			return -1;
+		}
+		types[n++] = t;
+	}
+
+	return n;
+}
+
+/**
+ * @brief Build a packet to send, less its timestamp
+ * @param frame Buffer of @p BENCH_FRAME_LEN bytes for the packet
+ * @param type EAPOL Packet Type
+ * @param seq Sequence number
+ * @return Length of the packet
+ */
+static size_t build(uint8_t *frame, uint8_t type, uint64_t seq)
+{
+	struct eapol_mpdu *mpdu = (struct eapol_mpdu *)(frame + ETH_ALEN * 2);
+	struct bench_stamp_t stamp = { BENCH_MAGIC, 0, seq, 0 };
+	uint16_t body_len = 0;
+
+	memset(frame, 0, BENCH_FRAME_LEN);
+	memcpy(frame, pae_grp_mac, ETH_ALEN);
+	memcpy(frame + ETH_ALEN, bench_mac, ETH_ALEN);
+
+	mpdu->ether_type = htons(ETH_P_PAE);
+	mpdu->proto_ver = 2;
+	mpdu->type = type;
+
+	if (type == EAPOL_EAP) {
+		/* Request/Identity */
+		mpdu->eap.code = EAP_CODE_REQUEST;
+		mpdu->eap.id = seq & 0xff;
+		mpdu->eap.len = htons(sizeof(struct eapol_eap));
+		mpdu->eap.type = EAP_TYPE_IDENTITY;
+		body_len = sizeof(struct eapol_eap);
+	} else if (type == EAPOL_KEY) {
+		mpdu->key.desc_type = EAPOL_KEY_TYPE_RC4;
+		mpdu->key.key_len = htons(16);
+		mpdu->key.key_index = 0x80 | 1;
+		body_len = sizeof(struct eapol_key);
+	}
+	mpdu->pkt_body_len = htons(body_len);
+
+	memcpy(frame + BENCH_FRAME_LEN - sizeof(stamp), &stamp, sizeof(stamp));
+
+	return BENCH_FRAME_LEN;
+}
+
+/**
+ * @brief Send all packets of a benchmark run
+ *
+ * Packets are sent in batches, each on schedule for the rate asked for, and
+ * each stamped just before it is sent.
+ *
+ * @param arg Pointer to the <tt>struct bench_t</tt> of the run
+ * @return @p NULL
+ */
+static void *send_all(void *arg)
+{
+	struct bench_t *b = arg;
+	uint8_t frames[BENCH_BATCH][BENCH_FRAME_LEN];
+	struct iovec iov[BENCH_BATCH];
+	struct mmsghdr msgs[BENCH_BATCH];
+	unsigned batch = BENCH_BATCH;
+
+	/* Keep bursts short at low rates */
+	if (b->rate > 0 && b->rate / 10000 < batch)
+		batch = b->rate / 10000 > 0 ? b->rate / 10000 : 1;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (unsigned i = 0; i < BENCH_BATCH; ++i) {
+		iov[i].iov_base = frames[i];
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	b->started = now_ns();
+
+	for (uint64_t seq = 0; seq < b->count; ) {
+		unsigned n = b->count - seq < batch ? b->count - seq : batch;
+
+		if (b->rate > 0) {
+			uint64_t due = b->started + seq * 1000000000 / b->rate;
+			struct timespec ts = { due / 1000000000,
+					       due % 1000000000 };
+			clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts,
+					NULL);
+		}
+
+		for (unsigned i = 0; i < n; ++i) {
+			uint8_t type = b->types[(seq + i) % b->type_nr];
+			iov[i].iov_len = build(frames[i], type, seq + i);
+
+			uint64_t sent = now_ns();
+			memcpy(frames[i] + BENCH_FRAME_LEN - sizeof(sent), &sent,
+			       sizeof(sent));
+		}
+
+		int len = sendmmsg(b->tx, msgs, n, 0);
+		if (len == -1) {
+			if (errno == ENOBUFS || errno == EAGAIN)
+				continue;	/* Try the same batch again */
+			fprintf(stderr, "cannot send: %s\n", strerror(errno));
+			break;
+		}
+		seq += len;
+	}
+
+	__atomic_store_n(&b->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/**
+ * @brief Receive packets until all are in or no more are coming
+ * @param b Pointer to the <tt>struct bench_t</tt> of the run
+ */
+static void recv_all(struct bench_t *b)
+{
+	uint8_t frames[BENCH_BATCH][BENCH_FRAME_LEN + 4];
+	_Alignas(struct cmsghdr) uint8_t cmsgs[BENCH_BATCH]
+		[CMSG_SPACE(sizeof(struct timespec))];
+	struct iovec iov[BENCH_BATCH];
+	struct mmsghdr msgs[BENCH_BATCH];
+	struct timeval tv = { 0, 100000 };
+	uint64_t idle_since = 0;
+
+	setsockopt(b->rx, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	while (b->received < b->expected) {
+		memset(msgs, 0, sizeof(msgs));
+		for (unsigned i = 0; i < BENCH_BATCH; ++i) {
+			iov[i].iov_base = frames[i];
+			iov[i].iov_len = sizeof(frames[i]);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_control = cmsgs[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(cmsgs[i]);
+		}
+
+		int len = recvmmsg(b->rx, msgs, BENCH_BATCH, MSG_WAITFORONE,
+				   NULL);
+		uint64_t now = now_ns();
+
+		if (len <= 0) {
+			if (len == -1 && errno != EAGAIN && errno != EINTR) {
+				fprintf(stderr, "cannot receive: %s\n",
+					strerror(errno));
+				return;
+			}
+
+			/* Nothing for a while once everything was sent */
+			if (__atomic_load_n(&b->done, __ATOMIC_ACQUIRE) == 0)
+				continue;
+			if (idle_since == 0)
+				idle_since = now;
+			else if (now - idle_since >= b->wait * 1000000ULL)
+				return;
+			continue;
+		}
+		idle_since = 0;
+
+		for (int i = 0; i < len; ++i) {
+			struct bench_stamp_t stamp;
+			uint64_t at = now;
+			size_t flen = msgs[i].msg_len;
+
+			if (flen < sizeof(stamp) + ETH_ALEN * 2)
+				continue;
+			memcpy(&stamp, frames[i] + flen - sizeof(stamp),
+			       sizeof(stamp));
+			if (stamp.magic != BENCH_MAGIC ||
+			    b->received == b->expected)
+				continue;
+
+			struct msghdr *msg = &msgs[i].msg_hdr;
+			for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+			     cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+				if (cmsg->cmsg_level == SOL_SOCKET &&
+				    cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+					struct timespec ts;
+					memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+					at = (uint64_t)ts.tv_sec * 1000000000 +
+					     ts.tv_nsec;
+				}
+			}
+
+			uint64_t lat = at > stamp.sent ? at - stamp.sent : 0;
+			b->latency[b->received++] = lat > UINT32_MAX ?
+						    UINT32_MAX : lat;
+			b->last = at;
+		}
+	}
+}
+
+/** @brief Compare two latencies, for @p qsort(3) */
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * @brief Main function
+ * @param argc The number of command-line arguments
+ * @param argv A vector of command-line arguments
+ * @return 0 if successful, or 1 if unsuccessful
+ */
+int main(int argc, char *argv[])
+{
+	struct bench_t b;
+	const char *label = "bench";
+	uint8_t filtered[BENCH_TYPES];
+	int c, n, tx_index, rx_index;
+
+	memset(&b, 0, sizeof(b));
+	b.count = 100000;
+	b.types[0] = EAPOL_EAP;
+	b.type_nr = 1;
+	b.wait = 500;
+
+	while ((c = getopt_long(argc, argv, "r:n:t:f:w:l:h", long_opts,
+				NULL)) != -1) {
+		switch (c) {
+		case 'r':
+			b.rate = strtoull(optarg, NULL, 10);
+			break;
+		case 'n':
+			b.count = strtoull(optarg, NULL, 10);
+			break;
+		case 't':
+			if ((n = parse_types(optarg, b.types, BENCH_TYPES)) < 1)
+				return 1;
+			b.type_nr = n;
+			break;
+		case 'f':
+			if ((n = parse_types(optarg, filtered, BENCH_TYPES)) < 0)
+				return 1;
+			for (int i = 0; i < n; ++i)
+				b.filtered |= 1 << filtered[i];
+			break;
+		case 'w':
+			b.wait = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			label = optarg;
+			break;
+		case 'h':
+			printf(usage, argv[0], PEAPOD_PROGRAM);
+			return 0;
+		default:
+			fprintf(stderr, usage, argv[0], PEAPOD_PROGRAM);
+			return 1;
+		}
+	}
+	if (argc - optind != 2 || b.count == 0) {
+		fprintf(stderr, usage, argv[0], PEAPOD_PROGRAM);
+		return 1;
+	}
+
+	for (uint64_t seq = 0; seq < b.count; ++seq)
+		if ((b.filtered & 1 << b.types[seq % b.type_nr]) == 0)
+			++b.expected;
+
+	if ((b.latency = calloc(b.expected + 1, sizeof(uint32_t))) == NULL) {
+		fprintf(stderr, "cannot allocate memory: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if ((b.tx = open_socket(argv[optind], &tx_index)) == -1 ||
+	    (b.rx = open_socket(argv[optind + 1], &rx_index)) == -1)
+		return 1;
+
+	pthread_t sender;
+	if ((errno = pthread_create(&sender, NULL, send_all, &b)) != 0) {
+		fprintf(stderr, "cannot start sender: %s\n", strerror(errno));
+		return 1;
+	}
+	recv_all(&b);
+	pthread_join(sender, NULL);
+
+	/* Rate at which packets came out the other end */
+	uint64_t elapsed = b.last > b.started ? b.last - b.started : 0;
+	uint64_t pps = elapsed > 0 ? b.received * 1000000000 / elapsed : 0;
+
+	qsort(b.latency, b.received, sizeof(uint32_t), cmp_u32);
+
+#define PCTL(p) (b.received > 0 ? \
+		 b.latency[(b.received - 1) * (p) / 1000] / 1000.0 : 0.0)
+
+	printf("%s: sent %" PRIu64 " received %" PRIu64 " dropped %" PRIu64
+	       " pps %" PRIu64 " p50_us %.1f p99_us %.1f p999_us %.1f\n",
+	       label, b.count, b.received, b.expected - b.received, pps,
+	       PCTL(500), PCTL(990), PCTL(999));
+
+#undef PCTL
+
+	free(b.latency);
+	close(b.tx);
+	close(b.rx);
+	return 0;
+}
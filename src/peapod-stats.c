@@ -0,0 +1,327 @@
+/**
+ * @file peapod-stats.c
+ * @brief Print the statistics a running @p peapod publishes
+ *
+ * Maps the statistics region read-only and sums up the counters of each
+ * interface over all workers, without @p peapod itself taking part in any way.
+ * Output is either plain text or in the Prometheus text exposition format.
+ *
+ * @see <tt>struct stats_region_t</tt>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "defaults.h"
+#include "stats.h"
+
+static struct stats_region_t *map_region(const char *path, size_t *size);
+static void get(const struct stats_region_t *region, unsigned n,
+		struct stats_t *sum);
+static void print_plain(const struct stats_region_t *region);
+static void print_prometheus(const struct stats_region_t *region);
+
+/** @brief Attempts at mapping a region that is not being replaced */
+#define MAP_ATTEMPTS			5
+
+/** @brief Flag: Were any counters left out for being stale? */
+static uint8_t stale = 0;
+
+/** @brief Names of histograms as Prometheus metrics, cf. @p stats_hist_names */
+static const char *const hist_metrics[STATS_HISTS] = {
+	"peapod_latency_seconds", "peapod_script_seconds"
+};
+
+/** @brief Help for histograms as Prometheus metrics */
+static const char *const hist_help[STATS_HISTS] = {
+	"Time from receiving an EAPOL packet to sending it",
+	"Time from executing a script to its exit"
+};
+
+/** @brief Program usage string */
+static const char usage[] = {
+"Usage: %s [-ph] [<statsfile>]\n"
+"\n"
+"Print the statistics %s publishes with -S (default: %s).\n"
+"\n"
+"  -p, --prometheus     print in the Prometheus text exposition format\n"
+"  -h, --help           print this help and exit\n"
+};
+
+/** @brief An array of <tt>struct option</tt> structures for @p getopt_long(3) */
+static struct option long_opts[] = {
+	{ "prometheus", no_argument, NULL, 'p' },
+	{ "help", no_argument, NULL, 'h' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/**
+ * @brief Map and validate a statistics region
+ * @param path Path of the statistics file
+ * @param size Pointer to where to store the size of the mapping
+ * @return A pointer to the mapping, or @p NULL if unsuccessful
+ */
+static struct stats_region_t *map_region(const char *path, size_t *size)
+{
+	struct stats_region_t *region;
+	struct stat st;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "cannot open '%s': %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) == -1 ||
+	    (size_t)st.st_size < sizeof(struct stats_region_t)) {
+		fprintf(stderr, "not a statistics file: '%s'\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	*size = st.st_size;
+	region = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (region == MAP_FAILED) {
+		fprintf(stderr, "cannot map '%s': %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	if (region->magic != STATS_MAGIC || region->version != STATS_VERSION ||
+	    region->stats_size != sizeof(struct stats_t) ||
+	    region->size > *size ||
+	    region->stats_offset < sizeof(struct stats_region_t) +
+				   region->iface_nr * sizeof(region->iface[0]) ||
+	    region->stats_offset % _Alignof(struct stats_t) != 0 ||
+	    region->stats_offset + (uint64_t)region->iface_nr *
+				   region->worker_nr *
+				   sizeof(struct stats_t) > region->size) {
+		fprintf(stderr, "not a statistics file or wrong version: '%s'\n",
+			path);
+		munmap(region, *size);
+		return NULL;
+	}
+
+	return region;
+}
+
+/**
+ * @brief Get the counters of an interface, summed over all workers
+ *
+ * Counters of a worker that stopped halfway through updating them are left
+ * out, with a warning, cf. @p stats_sum().
+ *
+ * @param region Pointer to the statistics region
+ * @param n Index of the interface
+ * @param sum Pointer to a <tt>struct stats_t</tt> for the result
+ */
+static void get(const struct stats_region_t *region, unsigned n,
+		struct stats_t *sum)
+{
+	const struct stats_t *stats = (const struct stats_t *)
+		((const uint8_t *)region + region->stats_offset);
+
+	unsigned nr = stats_sum(sum, &stats[n * region->worker_nr],
+				region->worker_nr);
+	if (nr > 0) {
+		fprintf(stderr, "counters of %u of %u workers on '%.*s' are stale, left out\n",
+			nr, region->worker_nr, IFNAMSIZ, region->iface[n].name);
+		stale = 1;
+	}
+}
+
+/**
+ * @brief Print the statistics of all interfaces as plain text
+ *
+ * Only nonzero counters are printed.
+ *
+ * @param region Pointer to the statistics region
+ */
+static void print_plain(const struct stats_region_t *region)
+{
+	time_t started = region->started;
+	char buf[32];
+
+	strftime(buf, sizeof(buf), "%F %T", localtime(&started));
+	printf("%s %" PRId64 ", started %s\n", PEAPOD_PROGRAM, region->pid, buf);
+
+	for (unsigned n = 0; n < region->iface_nr; ++n) {
+		const struct stats_iface_t *iface = &region->iface[n];
+		struct stats_t sum;
+
+		get(region, n, &sum);
+		printf("\n%.*s (index %u, worker %u):\n", IFNAMSIZ, iface->name,
+		       iface->index, iface->worker);
+
+		for (int p = 0; p < STATS_PACKETS; ++p) {
+			const char *sep = ":";
+
+			printf("  %-16s", stats_packet_names[p]);
+			for (int t = 0; t < STATS_TYPES; ++t) {
+				if (sum.type[p][t] == 0)
+					continue;
+				printf("%s %s %" PRIu64, sep,
+				       stats_type_names[t], sum.type[p][t]);
+				sep = ",";
+			}
+			for (int c = 0; c < STATS_CODES; ++c) {
+				if (sum.code[p][c] == 0)
+					continue;
+				printf("%s %s %" PRIu64, sep,
+				       stats_code_names[c], sum.code[p][c]);
+				sep = ",";
+			}
+			printf("%s\n", *sep == ':' ? ": none" : "");
+		}
+
+		for (int e = 0; e < STATS_EVENTS; ++e)
+			printf("  %-16s: %" PRIu64 "\n", stats_event_names[e],
+			       sum.event[e]);
+
+		for (int h = 0; h < STATS_HISTS; ++h) {
+			const struct hist_t *hist = &sum.hist[h];
+			uint64_t count = 0;
+
+			for (int b = 0; b < STATS_BUCKETS; ++b)
+				count += hist->bucket[b];
+			printf("  %-16s: count %" PRIu64 ", mean %" PRIu64
+			       ", max %" PRIu64 "\n", stats_hist_names[h], count,
+			       count ? hist->sum / count : 0, hist->max);
+		}
+	}
+}
+
+/**
+ * @brief Print the statistics of all interfaces in the Prometheus text
+ *        exposition format
+ *
+ * Histogram buckets are cumulative, as Prometheus expects. Durations are
+ * converted to seconds.
+ *
+ * @param region Pointer to the statistics region
+ */
+static void print_prometheus(const struct stats_region_t *region)
+{
+	struct stats_t sums[region->iface_nr ? region->iface_nr : 1];
+
+	for (unsigned n = 0; n < region->iface_nr; ++n)
+		get(region, n, &sums[n]);
+
+#define IFACE(n) IFNAMSIZ, region->iface[n].name
+
+	printf("# HELP peapod_start_time_seconds When peapod started, in seconds since the Epoch\n"
+	       "# TYPE peapod_start_time_seconds gauge\n"
+	       "peapod_start_time_seconds %" PRId64 "\n", region->started);
+
+	printf("# HELP peapod_packets_total EAPOL packets by EAPOL Packet Type\n"
+	       "# TYPE peapod_packets_total counter\n");
+	for (unsigned n = 0; n < region->iface_nr; ++n)
+		for (int p = 0; p < STATS_PACKETS; ++p)
+			for (int t = 0; t < STATS_TYPES; ++t)
+				printf("peapod_packets_total{iface=\"%.*s\",what=\"%s\",type=\"%s\"} %" PRIu64 "\n",
+				       IFACE(n), stats_packet_names[p],
+				       stats_type_names[t], sums[n].type[p][t]);
+
+	printf("# HELP peapod_eap_packets_total EAPOL-EAP packets by EAP Code\n"
+	       "# TYPE peapod_eap_packets_total counter\n");
+	for (unsigned n = 0; n < region->iface_nr; ++n)
+		for (int p = 0; p < STATS_PACKETS; ++p)
+			for (int c = 0; c < STATS_CODES; ++c)
+				printf("peapod_eap_packets_total{iface=\"%.*s\",what=\"%s\",code=\"%s\"} %" PRIu64 "\n",
+				       IFACE(n), stats_packet_names[p],
+				       stats_code_names[c], sums[n].code[p][c]);
+
+	printf("# HELP peapod_events_total Dropped frames, send errors and scripts\n"
+	       "# TYPE peapod_events_total counter\n");
+	for (unsigned n = 0; n < region->iface_nr; ++n)
+		for (int e = 0; e < STATS_EVENTS; ++e)
+			printf("peapod_events_total{iface=\"%.*s\",event=\"%s\"} %" PRIu64 "\n",
+			       IFACE(n), stats_event_names[e], sums[n].event[e]);
+
+	for (int h = 0; h < STATS_HISTS; ++h) {
+		printf("# HELP %s %s\n# TYPE %s histogram\n", hist_metrics[h],
+		       hist_help[h], hist_metrics[h]);
+
+		for (unsigned n = 0; n < region->iface_nr; ++n) {
+			const struct hist_t *hist = &sums[n].hist[h];
+			uint64_t count = 0;
+
+			for (int b = 0; b < STATS_BUCKETS - 1; ++b) {
+				count += hist->bucket[b];
+				printf("%s_bucket{iface=\"%.*s\",le=\"%.9g\"} %" PRIu64 "\n",
+				       hist_metrics[h], IFACE(n),
+				       (double)(1ULL << b) / 1e6, count);
+			}
+			count += hist->bucket[STATS_BUCKETS - 1];
+			printf("%s_bucket{iface=\"%.*s\",le=\"+Inf\"} %" PRIu64 "\n"
+			       "%s_sum{iface=\"%.*s\"} %.6f\n"
+			       "%s_count{iface=\"%.*s\"} %" PRIu64 "\n",
+			       hist_metrics[h], IFACE(n), count,
+			       hist_metrics[h], IFACE(n), (double)hist->sum / 1e6,
+			       hist_metrics[h], IFACE(n), count);
+		}
+	}
+
+#undef IFACE
+}
+
+/**
+ * @brief Main function
+ * @param argc The number of command-line arguments
+ * @param argv A vector of command-line arguments
+ * @return 0 if successful, or 1 if unsuccessful or any counters were stale
+ */
+int main(int argc, char *argv[])
+{
+	const char *path = PEAPOD_STATS_PATH;
+	uint8_t prometheus = 0;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "ph", long_opts, NULL)) != -1) {
+		switch (c) {
+		case 'p':
+			prometheus = 1;
+			break;
+		case 'h':
+			printf(usage, argv[0], PEAPOD_PROGRAM, PEAPOD_STATS_PATH);
+			return 0;
+		default:
+			fprintf(stderr, usage, argv[0], PEAPOD_PROGRAM,
+				PEAPOD_STATS_PATH);
+			return 1;
+		}
+	}
+	if (optind < argc)
+		path = argv[optind];
+
+	/* A region being replaced is followed to the new one */
+	struct stats_region_t *region = NULL;
+	size_t size = 0;
+	for (int i = 0; i < MAP_ATTEMPTS; ++i) {
+		if (region != NULL)
+			munmap(region, size);
+		if ((region = map_region(path, &size)) == NULL)
+			return 1;
+		if (__atomic_load_n(&region->replaced, __ATOMIC_ACQUIRE) == 0)
+			break;
+	}
+
+	if (kill(region->pid, 0) == -1 && errno == ESRCH)
+		fprintf(stderr, "%s %" PRId64 " is not running, statistics are stale\n",
+			PEAPOD_PROGRAM, region->pid);
+
+	if (prometheus)
+		print_prometheus(region);
+	else
+		print_plain(region);
+
+	munmap(region, size);
+	return stale;
+}
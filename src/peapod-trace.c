@@ -0,0 +1,221 @@
+/**
+ * @file peapod-trace.c
+ * @brief Print the packets recorded in a trace file
+ *
+ * Renders each record the way @p peapod itself logs packets with @p -vv, or
+ * with @p -x, @p -vvv, from the oldest record still in the file to the latest.
+ * The file may be read while @p peapod is still writing it.
+ *
+ * @see <tt>struct trace_region_t</tt>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "decode.h"
+#include "defaults.h"
+#include "trace.h"
+
+static struct trace_region_t *map_trace(const char *path, size_t *size);
+static const char *iface_name(const struct trace_region_t *trace,
+			      uint32_t index);
+static int print_rec(const struct trace_region_t *trace,
+		     const struct trace_rec_t *rec, uint64_t n, uint8_t hex);
+
+/** @brief Program usage string */
+static const char usage[] = {
+"Usage: %s [-xh] [<tracefile>]\n"
+"\n"
+"Print the packets %s records with -T (default: %s).\n"
+"\n"
+"  -x, --hex            also print a hexadecimal dump of each packet, as far\n"
+"                       as it was recorded\n"
+"  -h, --help           print this help and exit\n"
+};
+
+/** @brief An array of <tt>struct option</tt> structures for @p getopt_long(3) */
+static struct option long_opts[] = {
+	{ "hex", no_argument, NULL, 'x' },
+	{ "help", no_argument, NULL, 'h' },
+	{ NULL, 0, NULL, 0 }
+};
+
+/**
+ * @brief Map and validate a trace file
+ * @param path Path of the trace file
+ * @param size Pointer to where to store the size of the mapping
+ * @return A pointer to the mapping, or @p NULL if unsuccessful
+ */
+static struct trace_region_t *map_trace(const char *path, size_t *size)
+{
+	struct trace_region_t *trace;
+	struct stat st;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "cannot open '%s': %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) == -1 ||
+	    (size_t)st.st_size < sizeof(struct trace_region_t)) {
+		fprintf(stderr, "not a trace file: '%s'\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	*size = st.st_size;
+	trace = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (trace == MAP_FAILED) {
+		fprintf(stderr, "cannot map '%s': %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	if (trace->magic != TRACE_MAGIC || trace->version != TRACE_VERSION ||
+	    trace->rec_size != sizeof(struct trace_rec_t) ||
+	    trace->nr == 0 || (trace->nr & (trace->nr - 1)) != 0 ||
+	    trace->iface_nr > TRACE_IFACES ||
+	    trace->rec_offset < sizeof(struct trace_region_t) ||
+	    trace->rec_offset + (uint64_t)trace->nr *
+				sizeof(struct trace_rec_t) > *size) {
+		fprintf(stderr, "not a trace file or wrong version: '%s'\n",
+			path);
+		munmap(trace, *size);
+		return NULL;
+	}
+
+	return trace;
+}
+
+/**
+ * @brief Look up the name of an interface in a trace file
+ * @param trace Pointer to the trace file
+ * @param index Interface index
+ * @return The name of the interface that last had @p index, or "?"
+ */
+static const char *iface_name(const struct trace_region_t *trace,
+			      uint32_t index)
+{
+	static char name[IFNAMSIZ];
+
+	for (uint32_t n = trace->iface_nr; n > 0; --n) {
+		if (trace->iface[n - 1].index == index) {
+			memcpy(name, trace->iface[n - 1].name, IFNAMSIZ - 1);
+			return name;
+		}
+	}
+
+	return "?";
+}
+
+/**
+ * @brief Print a record
+ * @param trace Pointer to the trace file
+ * @param rec Pointer to the record
+ * @param n Number of the record
+ * @param hex Flag: Also print a hexadecimal dump?
+ * @return 0 if successful, or -1 if the record is incomplete or was
+ *         overwritten while being printed
+ */
+static int print_rec(const struct trace_region_t *trace,
+		     const struct trace_rec_t *rec, uint64_t n, uint8_t hex)
+{
+	struct trace_rec_t copy;
+	uint8_t frame[ETH_ALEN * 2 + sizeof(uint32_t) + sizeof(copy.mpdu)];
+	size_t off = ETH_ALEN * 2;
+	char tm[64], buf[256];
+
+	if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != n + 1)
+		return -1;
+	memcpy(&copy, rec, sizeof(copy));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != n + 1 ||
+	    copy.caplen > sizeof(copy.mpdu))
+		return -1;
+
+	/* Put the packet back together as peapod would have logged it */
+	memcpy(frame, copy.h_dest, ETH_ALEN);
+	memcpy(frame + ETH_ALEN, copy.h_source, ETH_ALEN);
+	if (copy.vlan_valid == 1) {
+		frame[off++] = 0x81;
+		frame[off++] = 0x00;
+		frame[off++] = copy.tci >> 8;
+		frame[off++] = copy.tci & 0xff;
+	}
+	memcpy(frame + off, copy.mpdu, copy.caplen);
+	off += copy.caplen;
+
+	time_t sec = copy.sec;
+	struct tm local;
+	strftime(tm, sizeof(tm), "%x %X", localtime_r(&sec, &local));
+
+	decode_frame(buf, sizeof(buf),
+		     copy.dir == TRACE_RECV ? "recv" : "send",
+		     iface_name(trace, copy.index), copy.len, frame, off);
+	printf("%s.%09" PRIu32 " %s\n", tm, copy.nsec, buf);
+
+	for (size_t pos = 0; hex && pos < off; ) {
+		pos = decode_hex(buf, frame, off, pos);
+		printf("%s\n", buf);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Main function
+ * @param argc The number of command-line arguments
+ * @param argv A vector of command-line arguments
+ * @return 0 if successful, or 1 if unsuccessful
+ */
+int main(int argc, char *argv[])
+{
+	const char *path = PEAPOD_TRACE_PATH;
+	uint8_t hex = 0;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "xh", long_opts, NULL)) != -1) {
+		switch (c) {
+		case 'x':
+			hex = 1;
+			break;
+		case 'h':
+			printf(usage, argv[0], PEAPOD_PROGRAM, PEAPOD_TRACE_PATH);
+			return 0;
+		default:
+			fprintf(stderr, usage, argv[0], PEAPOD_PROGRAM,
+				PEAPOD_TRACE_PATH);
+			return 1;
+		}
+	}
+	if (optind < argc)
+		path = argv[optind];
+
+	size_t size;
+	struct trace_region_t *trace = map_trace(path, &size);
+	if (trace == NULL)
+		return 1;
+
+	const struct trace_rec_t *recs = (const struct trace_rec_t *)
+		((const uint8_t *)trace + trace->rec_offset);
+	uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+	uint64_t skipped = 0;
+
+	for (uint64_t n = head > trace->nr ? head - trace->nr : 0; n < head; ++n)
+		if (print_rec(trace, &recs[n & (trace->nr - 1)], n, hex) == -1)
+			++skipped;
+
+	if (skipped > 0)
+		fprintf(stderr, "skipped %" PRIu64 " incomplete records\n",
+			skipped);
+
+	munmap(trace, size);
+	return 0;
+}
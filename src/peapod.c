@@ -9,6 +9,10 @@
 #include <signal.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/syscall.h>
+#if __has_include(<linux/close_range.h>)
+#include <linux/close_range.h>		/* CLOSE_RANGE_CLOEXEC */
+#endif
 #include "args.h"
 #include "daemonize.h"
 #include "defaults.h"
@@ -36,7 +40,8 @@ static const char usage[] = {
 "\n"
 "%s - EAPOL Proxy Daemon\n"
 "\n"
-"Usage: %s [-dtsqnoh] [-vvv] [-p <pidfile>] [-c <conffile>] [-l [<logfile>]]\n"
+"Usage: %s [-dtsaqnoh] [-vvv] [-p <pidfile>] [-c <conffile>] [-l [<logfile>]]\n"
+"           [-S [<statsfile>]] [-T [<tracefile>]] [-r <capfile> [-w <outfile>]]\n"
 "\n"
 "Mandatory arguments are mandatory for both forms of an option.\n"
 "\n"
@@ -47,8 +52,19 @@ static const char usage[] = {
 "  -t, --test           test config file and exit\n"
 "\n"
 "  -l, --log[=PATH]     output to a log file (default: %s)\n"
+"  -S, --stats[=PATH]   publish statistics in a file (default: %s)\n"
+"  -T, --trace[=PATH]   record packets in a trace file instead of decoding\n"
+"                       them in the log (default: %s)\n"
+"\n"
+"  -r, --replay=PATH    replay packets from a pcap or pcapng file instead of\n"
+"                       proxying live ones, as fast as possible, and exit\n"
+"  -w, --out=PATH       write packets replayed with -r to a pcapng file\n"
+"                       instead of sending them\n"
+"  -n, --no-exec        log scripts and hooks instead of executing them\n"
 "\n"
 "  -s, --syslog         output to syslog\n"
+"  -a, --async-log      output from a background thread, dropping messages\n"
+"                       rather than waiting when it falls behind\n"
 "\n"
 "  -v                   verbosity of output - can be specified up to 3 times\n"
 "                       -v:   additionally output informational messages\n"
@@ -84,6 +100,24 @@ extern struct args_t args;
  */
 struct iface_t *ifaces;
 
+/**
+ * @brief Script execution limits
+ * @note Global
+ */
+struct scripts_t scripts;
+
+/**
+ * @brief Session table limits
+ * @note Global
+ */
+struct sessions_t sessions;
+
+/**
+ * @brief Low-latency options
+ * @note Global
+ */
+struct latency_t latency;
+
 /**
  * @brief Print usage information to @p stderr and exit
  * @param status The exit status to pass to the @p exit(2) system call
@@ -91,7 +125,8 @@ struct iface_t *ifaces;
 static void help_exit(int status)
 {
 	cerr(usage, PEAPOD_PROGRAM, PEAPOD_PROGRAM, PEAPOD_PID_PATH,
-	     PEAPOD_CONF_PATH, PEAPOD_LOG_PATH, PEAPOD_PROGRAM, PEAPOD_VERSION);
+	     PEAPOD_CONF_PATH, PEAPOD_LOG_PATH, PEAPOD_STATS_PATH,
+	     PEAPOD_TRACE_PATH, PEAPOD_PROGRAM, PEAPOD_VERSION);
 	exit(status);
 }
 
@@ -128,10 +163,20 @@ static void signal_handler(int sig)
 /**
  * @brief Close all open file descriptors except @p stdin, @p stdout, and
  *        @p stderr
+ *
+ * Uses a single @p close_range(2) where the kernel supports it, rather than
+ * one @p close(2) per possible file descriptor; the latter adds up when the
+ * file descriptor limit is high.
+ *
  * @return 0 if successful, or -1 if unsuccessful
  */
 int peapod_close_fds(void)
 {
+#ifdef SYS_close_range
+	if (syscall(SYS_close_range, 3, ~0U, 0) == 0)
+		return 0;
+#endif
+
 	for (int i = getdtablesize() - 1; i > 2; --i) {
 		if (close(i) == -1 && errno != EBADF) {
 			ecrit("couldn't close file descriptor %d: %s", i);
@@ -141,6 +186,37 @@ int peapod_close_fds(void)
 	return 0;
 }
 
+/**
+ * @brief Set @p FD_CLOEXEC on all open file descriptors except @p stdin,
+ *        @p stdout, and @p stderr
+ *
+ * Everything we open ourselves is opened close-on-exec. This takes care of
+ * anything we inherited, so that scripts and hooks never see any of it without
+ * our having to close file descriptors before every @p execve(2).
+ *
+ * @return 0 if successful, or -1 if unsuccessful
+ */
+int peapod_cloexec_fds(void)
+{
+#if defined(SYS_close_range) && defined(CLOSE_RANGE_CLOEXEC)
+	if (syscall(SYS_close_range, 3, ~0U, CLOSE_RANGE_CLOEXEC) == 0)
+		return 0;
+#endif
+
+	for (int i = getdtablesize() - 1; i > 2; --i) {
+		int flags = fcntl(i, F_GETFD);
+		if (flags == -1)
+			continue;		/* Not open */
+
+		if (fcntl(i, F_SETFD, flags | FD_CLOEXEC) == -1) {
+			ecrit("couldn't set close-on-exec on file descriptor %d: %s",
+			      i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 /**
  * @brief Redirect @p stdin, @p stdout, and @p stderr to @p /dev/null
  * @return 0 if successful, or -1 if unsuccessful
@@ -216,6 +292,9 @@ int main(int argc, char *argv[])
 	if (args_get(argc, argv) == -1)
 		help_exit(EXIT_FAILURE);
 
+	if (peapod_cloexec_fds() == -1)
+		exit(EXIT_FAILURE);
+
 	if (args.help == 1)
 		help_exit(EXIT_SUCCESS);
 
@@ -224,7 +303,8 @@ int main(int argc, char *argv[])
 		args.level = LOG_WARNING;
 		uint8_t dummy;
 		printf("testing config file\n");
-		ifaces = parse_config(args.conffile, &dummy);
+		ifaces = parse_config(args.conffile, &dummy, &scripts,
+				      &sessions, &latency);
 		printf("config file at '%s' seems valid, exiting\n",
 		       args.conffile);
 		exit(EXIT_SUCCESS);
@@ -233,14 +313,15 @@ int main(int argc, char *argv[])
 	if (log_init() == -1)
 		help_exit(EXIT_FAILURE);
 
-	ifaces = parse_config(args.conffile, &args.level);
+	ifaces = parse_config(args.conffile, &args.level, &scripts, &sessions,
+			      &latency);
 
 	uid_t uid = getuid();
 
 	info("running as user %d", (int)uid);
 
 	/* We'll probably faceplant soon, but perhaps we have privileges */
-	if (uid != 0)
+	if (uid != 0 && args.replay == NULL)
 		warning("not running as root");
 
 	/* Sanitize the environment */
@@ -249,8 +330,14 @@ int main(int argc, char *argv[])
 	if (args.daemon == 1)
 		daemonize(args.pidfile);
 
+	if (args.async == 1)
+		log_start();
+
 	debuglow("printing interface list");
 	parser_print_ifaces(ifaces);
 
+	if (args.replay != NULL)
+		proxy_replay(ifaces);
+
 	proxy(ifaces);
 }
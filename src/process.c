@@ -3,182 +3,1285 @@
  * @brief Process an EAPOL packet
  */
 #include <stdio.h>
+#include <signal.h>
+#include <spawn.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
 
 #include "args.h"
 #include "b64enc.h"
+#include "decode.h"
+#include "latency.h"
 #include "log.h"
 #include "packet.h"
-#include "peapod.h"
 #include "process.h"
+#include "proxy.h"
+#include "session.h"
+#include "spsc.h"
+#include "stats.h"
 
-static void script(struct peapod_packet packet, char *script);
+/**
+ * @brief Maximum number of environment variables set for a script, not
+ *        counting those inherited from @p environ
+ */
+#define PROCESS_ENV_MAX		29
+
+/**
+ * @brief Number of script/hook events each worker thread can have waiting for
+ *        the main thread
+ * @see @p process_script()
+ */
+#define PROCESS_DEFER_NR	256
+
+/**
+ * @brief Seconds between asking a timed out script to terminate with
+ *        @p SIGTERM and killing it with @p SIGKILL
+ */
+#define PROCESS_KILL_GRACE	1
+
+/**
+ * @brief Bytes reserved per script for the values of variables other than
+ *        @p PKT_ORIG and @p PKT, names included
+ */
+#define PROCESS_ENV_STR		2048
+
+/** @brief Minimum seconds between starts of a hook that keeps exiting */
+#define PROCESS_HOOK_BACKOFF	1
+
+/** @brief Maximum size of an event record sent to a hook */
+#define PROCESS_HOOK_MAX	65536
+
+/** @brief Size of the socket send buffer for a hook */
+#define PROCESS_HOOK_SNDBUF	(1 << 20)
+
+/**
+ * @brief Number of coalescing windows that can be open at once
+ * @see @p coalesce()
+ */
+#define PROCESS_WINDOWS_NR	128
+
+/**
+ * @brief An event record being built by @p hook_put()
+ *
+ * A record is a sequence of fields, each made up of the 2-byte length of its
+ * name, the 2-byte length of its value (both big-endian), its name, and its
+ * value, without any terminators or padding.
+ */
+struct record_t {
+	uint8_t buf[PROCESS_HOOK_MAX];	/**< @brief The record */
+	size_t len;			/**< @brief Length of the record so far */
+};
+
+/**
+ * @brief A script waiting to be executed or being executed
+ *
+ * The environment of a script is captured when it is submitted, since the
+ * packet it describes will be long gone by the time it is executed. It is
+ * built in an arena owned by the slot, so submitting a script never allocates.
+ */
+struct job_t {
+	char *path;			/**< @brief Path of the script, or @p NULL if slot is free */
+	/**
+	 * @brief Environment for @p execve(2)
+	 *
+	 * Points to the start of the slot's arena. The variables it points to
+	 * follow the array itself.
+	 */
+	char **envp;
+	pid_t pid;			/**< @brief Process ID once executed */
+	uint8_t killed;			/**< @brief Flag: Was the script sent @p SIGTERM? */
+	struct iface_t *iface;		/**< @brief Interface whose ingress/egress phase the script is for */
+	struct timespec started;	/**< @brief When the script was executed */
+	struct timespec deadline;	/**< @brief When to give up on the script */
+};
+
+/**
+ * @name Kinds of field value
+ * @see @p field_fn
+ * @{
+ */
+#define FIELD_STRING		0	/**< @brief A C string */
+#define FIELD_FRAME		1	/**< @brief An Ethernet frame */
+#define FIELD_FRAME_ORIG	2	/**< @brief The Ethernet frame as received */
+/** @} */
+
+/** @brief An environment being built by @p environment() */
+struct env_t {
+	unsigned long seq;		/**< @brief Sequence number of the packet */
+	char **var;			/**< @brief Next free element of the array */
+	char **var_end;			/**< @brief End of the array, less the terminator */
+	char *str;			/**< @brief Next free byte of the arena */
+	char *str_end;			/**< @brief End of the arena */
+};
+
+/**
+ * @brief Callback for @p fields()
+ * @see @p env_put(), @p hook_put()
+ */
+typedef int (*field_fn)(void *ctx, const char *name, const uint8_t *val,
+			size_t len, uint8_t frame);
+
+/**
+ * @brief A coalescing window of a script
+ *
+ * Opened by an event for a script, or with @p per-mac for a script and source
+ * address, that has no window open. Any more events until it closes are
+ * coalesced with that one: they are either dropped, or with @p trailing or
+ * @p batch, take its place in being held back until then.
+ *
+ * @see <tt>struct coalesce_t</tt>
+ */
+struct window_t {
+	const struct action_t *action;	/**< @brief Action of the script, or @p NULL if slot is free */
+	char *path;			/**< @brief Path of the script */
+	uint8_t mac[ETH_ALEN];		/**< @brief Source address with @p per-mac, else all zeroes */
+	uint8_t pending;		/**< @brief Flag: Is an event held back? */
+	unsigned long events;		/**< @brief Events in the window so far */
+	struct timespec opened;		/**< @brief Timestamp of the first event */
+	struct timespec deadline;	/**< @brief When to stop holding back an event, on @p CLOCK_MONOTONIC */
+	char what[64];			/**< @brief What the event held back is, cf. @p execute() */
+	char why[64];			/**< @brief Why it would execute the script, cf. @p execute() */
+	struct peapod_packet packet;	/**< @brief The event held back; @p mpdu points into @p frame */
+	uint8_t *frame;			/**< @brief 16 bytes of scratch space, then the MPDU */
+};
+
+static int fields(const struct peapod_packet *packet, field_fn put, void *ctx);
+static int environment(char **envp, const struct peapod_packet *packet);
+static int env_put(void *ctx, const char *name, const uint8_t *val,
+		   size_t len, uint8_t frame);
+static int hook_put(void *ctx, const char *name, const uint8_t *val,
+		    size_t len, uint8_t frame);
+static void hook_start(struct hook_t *hook);
+static void hook_send(struct hook_t *hook, const struct peapod_packet *packet);
+static time_t uptime(void);
+static void submit(char *path, const struct peapod_packet *packet);
+static void defer(const struct peapod_packet *packet,
+		  const struct action_t *action);
+static void spawn(struct job_t *job);
+static void reap(pid_t pid, int status);
+static void expire(void);
+static void rehook(struct action_t *action, struct hook_t *from,
+		   struct hook_t *to);
+static void notify(struct hook_t *hook, const struct peapod_packet *packet);
+static void execute(const char *what, const char *why, char *path,
+		    const struct peapod_packet *packet);
+static void keep(uint8_t *frame, struct peapod_packet *packet);
+static int closed(const struct window_t *w, const struct timespec *ts);
+static void hold(struct window_t *w, const char *what, const char *why,
+		 const struct peapod_packet *packet);
+static void release(struct window_t *w);
+static void close_windows(uint8_t all);
+static int coalesce(const struct action_t *action, const char *what,
+		    const char *why, char *path,
+		    const struct peapod_packet *packet);
 
 extern struct args_t args;
+extern struct scripts_t scripts;
 extern char **environ;
-extern uint8_t *mpdu_buf;
-extern int mpdu_buf_size;
 
 /**
- * @brief Execute a script
+ * @name Script executor state
+ * @{
+ */
+static struct job_t *running = NULL;	/**< @brief @p scripts.max slots */
+static unsigned running_nr = 0;		/**< @brief Number of slots in use */
+static struct job_t *queue = NULL;	/**< @brief Circular queue of @p scripts.queue jobs */
+static unsigned queue_head = 0;		/**< @brief Index of oldest queued job */
+static unsigned queue_len = 0;		/**< @brief Number of queued jobs */
+static int sfd = -1;			/**< @brief @p signalfd(2) for @p SIGCHLD */
+static unsigned environ_nr = 0;		/**< @brief Number of variables in @p environ */
+static size_t arena_size = 0;		/**< @brief Size of the arena owned by each slot */
+static posix_spawnattr_t script_attr;	/**< @brief @p posix_spawn(3) attributes for scripts */
+static posix_spawn_file_actions_t script_fa;	/**< @brief @p posix_spawn(3) file actions for scripts */
+static posix_spawnattr_t hook_attr;	/**< @brief @p posix_spawn(3) attributes for hooks */
+/** @} */
+
+/**
+ * @brief A script/hook event passed from a worker thread to the main thread
+ *
+ * Carries a copy of the frame, since the buffer it was received into is soon
+ * reused.
+ */
+struct deferred_t {
+	struct peapod_packet packet;	/**< @brief The packet; @p mpdu is fixed up on arrival */
+	const struct action_t *action;	/**< @brief As passed to @p process_script() */
+	uint8_t frame[];		/**< @brief 16 bytes of scratch space, then the MPDU */
+};
+
+/**
+ * @name Events passed from worker threads to the main thread
+ * @see @p process_script()
+ * @{
+ */
+static struct spsc_t *deferred = NULL;	/**< @brief One ring per worker, indexed by worker */
+static unsigned deferred_nr = 0;	/**< @brief Number of workers */
+static int efd = -1;			/**< @brief @p eventfd(2) waking the main thread */
+static _Thread_local struct spsc_t *defer_to = NULL;	/**< @brief Ring of the current worker thread, or @p NULL */
+static _Thread_local uint8_t defer_wake = 0;	/**< @brief Flag: Committed anything since @p process_wake()? */
+static _Thread_local unsigned defer_dropped = 0;	/**< @brief Events dropped since @p process_wake() */
+/** @} */
+
+/**
+ * @name Coalescing windows
+ *
+ * Only ever used by the main thread. Windows are closed by packets, according
+ * to their timestamps, except that one holding back an event is also closed
+ * once its length has passed, in case no more packets come.
+ *
+ * @{
+ */
+static struct window_t *windows = NULL;	/**< @brief @p PROCESS_WINDOWS_NR windows */
+static unsigned windows_held = 0;	/**< @brief Number of windows holding back an event */
+/** @} */
+
+/**
+ * @brief The original frame of the latest packet, Base64-encoded
+ *
+ * Keyed on nothing but the sequence number of the packet, which is unique for
+ * the life of the process, workers restarting included, cf. @p packet.c.
+ */
+static struct {
+	unsigned long seq;		/**< @brief Sequence number of the packet, or 0 */
+	char *buf;			/**< @brief The encoded frame */
+	size_t len;			/**< @brief Length of @p buf, excluding the terminator */
+} orig_b64;
+
+/**
+ * @brief Extract the fields describing an EAPOL packet for a script or hook
  *
- * The script is run with several environment variables set containing at least
- * the entire Base64-encoded Ethernet frame encapsulating an EAPOL packet at the
- * time of capture on an ingress interface, the entire frame that is being sent
- * (if applicable) on an egress interface (which may differ from the original in
- * its 802.1Q tag), and associated metadata extracted from @p packet.
+ * The fields contain at least the entire Ethernet frame encapsulating an EAPOL
+ * packet at the time of capture on an ingress interface, the entire frame that
+ * is being sent (if applicable) on an egress interface (which may differ from
+ * the original in its 802.1Q tag), and associated metadata extracted from
+ * @p packet. Each is passed to @p put in turn.
  *
- * @param packet A <tt>struct peapod_packet</tt> representing an EAPOL packet
- * @param script Path of the script to be executed
- * @see The @p env.sh example script for a listing of the possible environment
- *      variables and their values
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> representing an
+ *               EAPOL packet
+ * @param put Called once per field with @p ctx, the field's name, its value,
+ *            the length of its value, and what kind of value it is; the
+ *            current frame is passed as @p FIELD_FRAME_ORIG if it does not
+ *            differ from the original
+ * @param ctx Passed to @p put unchanged
+ * @return 0 if successful, or -1 if @p put was unsuccessful
+ * @see The @p env.sh example script for a listing of the possible fields and
+ *      their values
  */
-static void script(struct peapod_packet packet, char *script)
+static int fields(const struct peapod_packet *packet, field_fn put, void *ctx)
 {
-	pid_t pid = fork();
-	if (pid == -1) {
-		warning("never mind, cannot fork for script execution");
+	char buf[128] = { "" };
+	const char *str;
+
+#define FIELD(name, val)						\
+	do {								\
+		str = (val);						\
+		if (put(ctx, name, (uint8_t *)str, strlen(str),		\
+			FIELD_STRING) == -1)				\
+			return -1;					\
+	} while (0)
+
+	snprintf(buf, sizeof(buf), "%ld.%06ld",
+		 packet->ts.tv_sec, packet->ts.tv_nsec / 1000);
+	FIELD("PKT_TIME", buf);
+
+	FIELD("PKT_DEST", iface_strmac(packet->h_dest));
+	FIELD("PKT_SOURCE", iface_strmac(packet->h_source));
+
+	snprintf(buf, sizeof(buf), "%d", packet->type);
+	FIELD("PKT_TYPE", buf);
+	FIELD("PKT_TYPE_DESC", packet_decode(packet->type, eapol_types));
+
+	if (packet->type == EAPOL_EAP && packet->code > 0) {
+		struct eapol_mpdu *mpdu = (struct eapol_mpdu *)packet->mpdu;
+		snprintf(buf, sizeof(buf), "%d", packet->code);
+		FIELD("PKT_CODE", buf);
+		FIELD("PKT_CODE_DESC", packet_decode(packet->code, eap_codes));
+
+		snprintf(buf, sizeof(buf), "%d", mpdu->eap.id);
+		FIELD("PKT_ID", buf);
+
+		if (eap_codes[packet->code].flags & DECODE_TYPE) {
+			const struct decode_t *t = &eap_types[mpdu->eap.type];
+			const struct eap_expanded *x = (void *)(&mpdu->eap + 1);
+
+			snprintf(buf, sizeof(buf), "%d", mpdu->eap.type);
+			FIELD("PKT_REQRESP_TYPE", buf);
+			FIELD("PKT_REQRESP_DESC",
+			      packet_decode(mpdu->eap.type, eap_types));
+
+			/* Well within the minimum frame size */
+			if (t->flags & DECODE_EXPANDED &&
+			    ntohs(mpdu->eap.len) >= sizeof(mpdu->eap) + t->len) {
+				snprintf(buf, sizeof(buf), "%.02x%.02x%.02x",
+					 x->vendor_id[0], x->vendor_id[1],
+					 x->vendor_id[2]);
+				FIELD("PKT_REQRESP_VENDOR_ID", buf);
+				snprintf(buf, sizeof(buf), "%u",
+					 ntohl(x->vendor_type));
+				FIELD("PKT_REQRESP_VENDOR_TYPE", buf);
+			}
+		}
+	}
+
+	if (packet->state != SESSION_NONE) {
+		FIELD("PKT_SESSION_SUPPLICANT",
+		      iface_strmac(packet->supplicant));
+		FIELD("PKT_SESSION_STATE", session_state_desc(packet->state));
+		FIELD("PKT_SESSION_STATE_PREV",
+		      session_state_desc(packet->state_prev));
+
+		snprintf(buf, sizeof(buf), "%lu", packet->session_packets);
+		FIELD("PKT_SESSION_PACKETS", buf);
+
+		snprintf(buf, sizeof(buf), "%ld.%06ld",
+			 packet->session_start.tv_sec,
+			 packet->session_start.tv_nsec / 1000);
+		FIELD("PKT_SESSION_START", buf);
+	}
+
+	if (packet->coalesced != 0) {
+		snprintf(buf, sizeof(buf), "%lu", packet->coalesced);
+		FIELD("PKT_COALESCED", buf);
+
+		snprintf(buf, sizeof(buf), "%ld.%06ld",
+			 packet->coalesced_start.tv_sec,
+			 packet->coalesced_start.tv_nsec / 1000);
+		FIELD("PKT_COALESCED_START", buf);
+	}
+
+	snprintf(buf, sizeof(buf), "%ld", packet->len_orig);
+	FIELD("PKT_LENGTH_ORIG", buf);
+
+	if (put(ctx, "PKT_ORIG", packet_buf(packet, 1), packet->len_orig,
+		FIELD_FRAME_ORIG) == -1)
+		return -1;
+
+	FIELD("PKT_IFACE_ORIG", packet->iface_orig->name);
+
+	snprintf(buf, sizeof(buf), "%d", packet->iface_orig->mtu);
+	FIELD("PKT_IFACE_MTU_ORIG", buf);
+
+	if (packet->vlan_valid_orig == 1) {
+		snprintf(buf, sizeof(buf), "%.08x",
+			 ntohl(packet_tcitonl(packet->tci_orig)));
+		FIELD("PKT_DOT1Q_TCI_ORIG", buf + 4);		/* TCI only */
+	}
+
+	snprintf(buf, sizeof(buf), "%ld", packet->len);
+	FIELD("PKT_LENGTH", buf);
+
+	uint8_t kind = FIELD_FRAME;
+	if (packet->len == packet->len_orig &&
+	    packet->vlan_valid == packet->vlan_valid_orig &&
+	    (packet->vlan_valid == 0 ||
+	     packet_tcitonl(packet->tci) == packet_tcitonl(packet->tci_orig)))
+		kind = FIELD_FRAME_ORIG;
+
+	if (put(ctx, "PKT", packet_buf(packet, 0), packet->len, kind) == -1)
+		return -1;
+
+	FIELD("PKT_IFACE", packet->iface->name);
+
+	snprintf(buf, sizeof(buf), "%d", packet->iface->mtu);
+	FIELD("PKT_IFACE_MTU", buf);
+
+	if (packet->vlan_valid == 1) {
+		snprintf(buf, sizeof(buf), "%.08x",
+			 ntohl(packet_tcitonl(packet->tci)));
+		FIELD("PKT_DOT1Q_TCI", buf + 4);		/* TCI only */
+	}
+
+#undef FIELD
+
+	return 0;
+}
+
+/**
+ * @brief Build the environment for a script
+ *
+ * The environment contains whatever was in @p environ when the script executor
+ * was set up, plus one variable per field extracted by @p fields(). Ethernet
+ * frames are Base64-encoded. The original frame is encoded only once per
+ * packet, however many scripts it is submitted to.
+ *
+ * @param envp The arena of a slot in @p running or @p queue
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> representing an
+ *               EAPOL packet
+ * @return 0 if successful, or -1 if the arena is too small
+ * @note The variables inherited from @p environ are not copied; @p envp only
+ *       points to them.
+ */
+static int environment(char **envp, const struct peapod_packet *packet)
+{
+	struct env_t env;
+	env.seq = packet->seq;
+	env.var = envp;
+	env.var_end = envp + environ_nr + PROCESS_ENV_MAX;
+	env.str = (char *)(env.var_end + 1);
+	env.str_end = (char *)envp + arena_size;
+
+	memcpy(env.var, environ, environ_nr * sizeof(char *));
+	env.var += environ_nr;
+
+	int ret = fields(packet, env_put, &env);
+	*env.var = NULL;
+	return ret;
+}
+
+/**
+ * @brief Append a variable to an environment being built by @p environment()
+ *
+ * A @p field_fn.
+ *
+ * @param ctx Pointer to a <tt>struct env_t</tt>
+ * @param name Name of the variable
+ * @param val Value of the variable
+ * @param len Length of @p val
+ * @param frame Kind of value; Ethernet frames are Base64-encoded
+ * @return 0 if successful, or -1 if the environment would be too big
+ */
+static int env_put(void *ctx, const char *name, const uint8_t *val,
+		   size_t len, uint8_t frame)
+{
+	struct env_t *env = ctx;
+	size_t name_len = strlen(name);
+	size_t val_len = frame != FIELD_STRING ? b64len(len) : len + 1;
+
+	if (env->var == env->var_end ||
+	    (size_t)(env->str_end - env->str) < name_len + 1 + val_len)
+		return -1;
+
+	char *var = env->str;
+	memcpy(var, name, name_len);
+	var[name_len] = '=';
+
+	if (frame == FIELD_FRAME_ORIG) {
+		if (orig_b64.seq != env->seq) {
+			orig_b64.len = b64enc_to(orig_b64.buf, val, len);
+			orig_b64.seq = env->seq;
+		}
+		val_len = orig_b64.len + 1;
+		memcpy(var + name_len + 1, orig_b64.buf, val_len);
+	} else if (frame == FIELD_FRAME) {
+		val_len = b64enc_to(var + name_len + 1, val, len) + 1;
+	} else {
+		memcpy(var + name_len + 1, val, len);
+		var[name_len + 1 + len] = '\0';
+	}
+
+	env->str += name_len + 1 + val_len;
+	*env->var++ = var;
+	return 0;
+}
+
+/**
+ * @brief Append a field to an event record for a hook
+ *
+ * A @p field_fn. Ethernet frames are appended as is.
+ *
+ * @param ctx Pointer to a <tt>struct record_t</tt>
+ * @param name Name of the field
+ * @param val Value of the field
+ * @param len Length of @p val
+ * @param frame Unused; frames are always raw
+ * @return 0 if successful, or -1 if the record would be too long
+ */
+static int hook_put(void *ctx, const char *name, const uint8_t *val,
+		    size_t len, uint8_t frame)
+{
+	(void)frame;
+
+	struct record_t *rec = ctx;
+	size_t name_len = strlen(name);
+
+	if (rec->len + 4 + name_len + len > sizeof(rec->buf))
+		return -1;
+
+	uint16_t lens[2] = { htons(name_len), htons(len) };
+	memcpy(rec->buf + rec->len, lens, sizeof(lens));
+	memcpy(rec->buf + rec->len + 4, name, name_len);
+	memcpy(rec->buf + rec->len + 4 + name_len, val, len);
+	rec->len += 4 + name_len + len;
+
+	return 0;
+}
+
+/**
+ * @brief Start a hook
+ *
+ * The hook gets its end of a new @p SOCK_SEQPACKET socket on @p stdin, so each
+ * <tt>read(2)</tt> it does returns exactly one event record. Its @p stdout and
+ * @p stderr are redirected to @p /dev/null as for a script.
+ *
+ * @param hook Pointer to a <tt>struct hook_t</tt> that is not running
+ */
+static void hook_start(struct hook_t *hook)
+{
+	int sv[2];
+
+	hook->started = uptime();
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+		ewarning("cannot create socket for hook '%s': %s", hook->path);
+		return;
+	}
+
+	posix_spawn_file_actions_t fa;
+	char *argv[] = { hook->path, NULL };
+	pid_t pid;
+	int err;
+
+	if ((err = posix_spawn_file_actions_init(&fa)) == 0) {
+		if ((err = posix_spawn_file_actions_adddup2(&fa, sv[1],
+							    STDIN_FILENO)) == 0 &&
+		    (err = posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO,
+							    "/dev/null",
+							    O_WRONLY, 0)) == 0 &&
+		    (err = posix_spawn_file_actions_addopen(&fa, STDERR_FILENO,
+							    "/dev/null",
+							    O_RDWR, 0)) == 0) {
+			latency_spawn(1);
+			err = posix_spawn(&pid, hook->path, &fa, &hook_attr,
+					  argv, environ);
+			latency_spawn(0);
+		}
+		posix_spawn_file_actions_destroy(&fa);
+	}
+
+	close(sv[1]);
+
+	if (err != 0) {
+		warning("cannot start hook '%s': %s", hook->path, strerror(err));
+		close(sv[0]);
+		return;
+	}
+
+	/* Some room for bursts; best effort */
+	int size = PROCESS_HOOK_SNDBUF;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+	hook->skt = sv[0];
+	hook->pid = pid;
+	info("started hook '%s' (pid %d)", hook->path, (int)pid);
+}
+
+/**
+ * @brief Send an event record describing an EAPOL packet to a hook
+ *
+ * Never blocks. If the hook is not running or not keeping up, the event is
+ * dropped; this is logged once per run of dropped events.
+ *
+ * @param hook Pointer to a <tt>struct hook_t</tt>
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> representing an
+ *               EAPOL packet
+ */
+static void hook_send(struct hook_t *hook, const struct peapod_packet *packet)
+{
+	static struct record_t rec;
+
+	rec.len = 0;
+	if (fields(packet, hook_put, &rec) == -1) {
+		warning("event too big for hook '%s'", hook->path);
+		return;
+	}
+
+	if (hook->skt != -1 &&
+	    send(hook->skt, rec.buf, rec.len, MSG_DONTWAIT | MSG_NOSIGNAL)
+	    == (ssize_t)rec.len) {
+		if (hook->dropped > 0)
+			info("hook '%s' is keeping up again, %u events dropped",
+			     hook->path, hook->dropped);
+		hook->dropped = 0;
+		return;
+	}
+
+	if (hook->dropped++ == 0)
+		warning("hook '%s' is not keeping up, dropping events",
+			hook->path);
+}
+
+/**
+ * @brief Get the number of seconds since some unspecified point in the past
+ * @return The number of seconds on the @p CLOCK_MONOTONIC clock
+ */
+static time_t uptime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/**
+ * @brief Execute a script now if possible, or queue it for later
+ *
+ * At most @p scripts.max scripts are executed at a time. Beyond that, up to
+ * @p scripts.queue more are queued, after which either the newest or the oldest
+ * queued script is dropped, depending on @p scripts.drop_oldest. A slot is
+ * chosen before the script's environment is built, so a dropped script costs
+ * next to nothing.
+ *
+ * @param path Path of the script to be executed
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> representing an
+ *               EAPOL packet
+ */
+static void submit(char *path, const struct peapod_packet *packet)
+{
+	struct job_t *job = NULL;
+
+	if (running_nr < scripts.max) {
+		for (unsigned i = 0; i < scripts.max; ++i) {
+			if (running[i].path == NULL) {
+				job = &running[i];
+				break;
+			}
+		}
+	} else if (queue_len == scripts.queue) {
+		if (scripts.drop_oldest == 0 || scripts.queue == 0) {
+			warning("too many scripts, not executing '%s'", path);
+			return;
+		}
+
+		warning("too many scripts, not executing '%s' queued earlier",
+			queue[queue_head].path);
+		queue_head = (queue_head + 1) % scripts.queue;
+		--queue_len;
+	}
+
+	if (job == NULL)
+		job = &queue[(queue_head + queue_len) % scripts.queue];
+
+	if (environment(job->envp, packet) == -1) {
+		warning("never mind, environment too big for script '%s'",
+			path);
 		return;
 	}
-	else if (pid > 0) {
-		int status;
 
-		if (waitpid(-1, &status, 0) == -1)
-			ewarning("cannot wait for script execution: %s");
-		else if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
-			warning("script did not exit cleanly (code %d)",
-				WEXITSTATUS(status));
+	job->path = path;
+	job->pid = 0;
+	job->killed = 0;
+	job->iface = packet->iface;
+
+	if (job < running || job >= running + scripts.max) {
+		++queue_len;
+		debug("queued script '%s' (%u queued)", path, queue_len);
+		return;
+	}
+
+	spawn(job);
+}
+
+/**
+ * @brief Pass a script/hook event from a worker thread to the main thread
+ *
+ * The main thread picks it up in @p process_deferred() once woken up by
+ * @p process_wake(). The event is dropped if the main thread is too far
+ * behind.
+ *
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> representing an
+ *               EAPOL packet
+ * @param action As passed to @p process_script()
+ */
+static void defer(const struct peapod_packet *packet,
+		  const struct action_t *action)
+{
+	struct deferred_t *d = spsc_reserve(defer_to);
+	if (d == NULL) {
+		++defer_dropped;
+		return;
+	}
+
+	d->packet = *packet;
+	d->action = action;
+	keep(d->frame, &d->packet);
+
+	spsc_commit(defer_to);
+	defer_wake = 1;
+}
+
+/**
+ * @brief Execute a script in a slot of @p running
+ *
+ * The script runs in its own process group, so that a timed out script can be
+ * killed along with anything it started. @p posix_spawn(3) does not copy our
+ * page tables the way @p fork(2) would, and nothing we have open survives into
+ * the script, since it is all close-on-exec.
+ *
+ * @param job Pointer to a <tt>struct job_t</tt> in @p running
+ * @note Frees the slot again if the script cannot be executed.
+ */
+static void spawn(struct job_t *job)
+{
+	char *argv[] = { job->path, NULL };	/* provided to execve(2) */
+	pid_t pid;
+
+	latency_spawn(1);
+	int err = posix_spawn(&pid, job->path, &script_fa, &script_attr,
+			      argv, job->envp);
+	latency_spawn(0);
+	if (err != 0) {
+		warning("never mind, cannot execute script '%s': %s",
+			job->path, strerror(err));
+		stats_event(job->iface, STATS_SCRIPTS_FAILED);
+		job->path = NULL;
+		return;
+	}
+
+	job->pid = pid;
+	clock_gettime(CLOCK_MONOTONIC, &job->started);
+	if (scripts.timeout > 0) {
+		job->deadline = job->started;
+		job->deadline.tv_sec += scripts.timeout;
+	}
+	++running_nr;
+	stats_event(job->iface, STATS_SCRIPTS);
+
+	debug("executing script '%s' (pid %d)", job->path, (int)pid);
+}
+
+/**
+ * @brief Log how a script or hook exited
+ *
+ * Frees the script's slot in @p running. A hook is restarted later by
+ * @p process_jobs().
+ *
+ * @param pid Process ID of the script or hook
+ * @param status Status from @p waitpid(2)
+ */
+static void reap(pid_t pid, int status)
+{
+	for (struct hook_t *h = scripts.hooks; h != NULL; h = h->next) {
+		if (h->pid != pid)
+			continue;
+
+		if (WIFSIGNALED(status))
+			warning("hook '%s' was terminated by a signal, restarting",
+				h->path);
+		else
+			warning("hook '%s' exited (code %d), restarting",
+				h->path, WEXITSTATUS(status));
+
+		close(h->skt);
+		h->skt = -1;
+		h->pid = 0;
+		return;
+	}
+
+	for (unsigned i = 0; i < scripts.max; ++i) {
+		struct job_t *job = &running[i];
+
+		if (job->path == NULL || job->pid != pid)
+			continue;
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		stats_time(job->iface, STATS_SCRIPT_TIME,
+			   (now.tv_sec - job->started.tv_sec) * 1000000L +
+			   (now.tv_nsec - job->started.tv_nsec) / 1000);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			stats_event(job->iface, STATS_SCRIPTS_FAILED);
+
+		if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+			warning("script '%s' did not exit cleanly (code %d)",
+				job->path, WEXITSTATUS(status));
+		else if (WIFSIGNALED(status) && job->killed == 1)
+			warning("script '%s' timed out and was terminated",
+				job->path);
 		else if (WIFSIGNALED(status))
-			warning("script was terminated by a signal");
+			warning("script '%s' was terminated by a signal",
+				job->path);
 
+		job->path = NULL;
+		--running_nr;
 		return;
 	}
+}
 
-	/* We may now mostly dispense with things like "handling errors" */
-	closelog();			/* Goodbye, syslog... */
-	peapod_close_fds();		/* sockets/epoll/logfile */
-	peapod_redir_stdfds();		/* stdin/out/err */
+/**
+ * @brief Terminate scripts that have run past their deadline
+ *
+ * A timed out script's process group is first sent @p SIGTERM and, if it is
+ * still around @p PROCESS_KILL_GRACE seconds later, @p SIGKILL.
+ */
+static void expire(void)
+{
+	if (scripts.timeout == 0 || running_nr == 0)
+		return;
 
-	/* Set up a bunch of environment variables for the script to use.
-	 * TODO: Allocate and fill a new **environ to pass to execve(2)
-	 *       as its *envp[] parameter instead of using setenv(3).
-	 *       The latter is, of course, the lazier way ;)
-	 */
-	char *argv[] = { script, NULL };	/* provided to execve(2) */
-	char buf[128] = { "" };
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	snprintf(buf, sizeof(buf), "%ld.%ld",
-		 packet.tv.tv_sec, packet.tv.tv_usec);
-	setenv("PKT_TIME", buf, 1);
+	for (unsigned i = 0; i < scripts.max; ++i) {
+		struct job_t *job = &running[i];
 
-	setenv("PKT_DEST", iface_strmac(packet.h_dest), 1);
-	setenv("PKT_SOURCE", iface_strmac(packet.h_source), 1);
+		if (job->path == NULL ||
+		    job->deadline.tv_sec > now.tv_sec ||
+		    (job->deadline.tv_sec == now.tv_sec &&
+		     job->deadline.tv_nsec > now.tv_nsec))
+			continue;
 
-	snprintf(buf, sizeof(buf), "%d", packet.type);
-	setenv("PKT_TYPE", buf, 1);
-	setenv("PKT_TYPE_DESC", packet_decode(packet.type, eapol_types), 1);
+		if (job->killed == 0) {
+			info("script '%s' timed out after %u seconds",
+			     job->path, scripts.timeout);
+			kill(-job->pid, SIGTERM);
+			job->killed = 1;
+		} else {
+			kill(-job->pid, SIGKILL);
+		}
 
-	if (packet.type == EAPOL_EAP && packet.code > 0) {
-		struct eapol_mpdu *mpdu = (struct eapol_mpdu *)mpdu_buf;
-		snprintf(buf, sizeof(buf), "%d", packet.code);
-		setenv("PKT_CODE", buf, 1);
-		setenv("PKT_CODE_DESC", packet_decode(packet.code,
-						      eap_codes), 1);
+		job->deadline = now;
+		job->deadline.tv_sec += PROCESS_KILL_GRACE;
+	}
+}
 
-		snprintf(buf, sizeof(buf), "%d", mpdu->eap.id);
-		setenv("PKT_ID", buf, 1);
+/**
+ * @brief Set up the script executor and register it with an @p epoll instance
+ *
+ * The first call allocates the executor's slots, each with an arena big enough
+ * for the environment of a script run on any of @p ifaces, creates a
+ * @p signalfd(2) for @p SIGCHLD, and starts every configured hook. Every call
+ * registers that @p signalfd(2) with @p epfd, tagged with
+ * @p PROXY_TAG_SCRIPTS. With more than one worker, also sets up a queue of
+ * events for each worker other than the main thread, and registers an
+ * @p eventfd(2) for them tagged with @p PROXY_TAG_DEFERRED.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt>
+ * @param epfd File descriptor for an @p epoll instance
+ * @return 0 if successful, or -1 if unsuccessful
+ * @note @p SIGCHLD is blocked, and must stay blocked, for @p signalfd(2) to
+ *       receive it. Scripts and hooks start with an empty signal mask.
+ */
+int process_init(struct iface_t *ifaces, int epfd)
+{
+	if (sfd == -1) {
+		int high_mtu = 0;
+		for (struct iface_t *i = ifaces; i != NULL; i = i->next)
+			if (high_mtu < i->mtu)
+				high_mtu = i->mtu;
 
-		if (packet.code == 1 || packet.code == 2) {
-			snprintf(buf, sizeof(buf), "%d", mpdu->eap.type);
-			setenv("PKT_REQRESP_TYPE", buf, 1);
-			setenv("PKT_REQRESP_DESC",
-			       packet_decode(mpdu->eap.type, eap_types), 1);
+		while (environ[environ_nr] != NULL)
+			++environ_nr;
+
+		/* PKT_ORIG and PKT, each a frame with a VLAN tag */
+		size_t frame_len = ETH_HLEN + sizeof(uint32_t) + high_mtu;
+
+		arena_size = (environ_nr + PROCESS_ENV_MAX + 1) * sizeof(char *) +
+			     PROCESS_ENV_STR +
+			     2 * (sizeof("PKT_ORIG=") + b64len(frame_len));
+		arena_size = (arena_size + sizeof(char *) - 1) &
+			     ~(sizeof(char *) - 1);
+
+		unsigned slots = scripts.max + scripts.queue;
+		running = calloc(slots, sizeof(struct job_t));
+		char *arenas = malloc(slots * arena_size);
+		orig_b64.buf = malloc(b64len(frame_len));
+		if (running == NULL || arenas == NULL || orig_b64.buf == NULL) {
+			ecrit("cannot allocate script executor: %s");
+			return -1;
+		}
+
+		queue = running + scripts.max;
+		for (unsigned i = 0; i < slots; ++i)
+			running[i].envp = (char **)(arenas + i * arena_size);
+
+		windows = calloc(PROCESS_WINDOWS_NR, sizeof(struct window_t));
+		uint8_t *frames = malloc(PROCESS_WINDOWS_NR * frame_len);
+		if (windows == NULL || frames == NULL) {
+			ecrit("cannot allocate coalescing windows: %s");
+			return -1;
+		}
+
+		for (unsigned i = 0; i < PROCESS_WINDOWS_NR; ++i)
+			windows[i].frame = frames + i * frame_len;
+
+		sigset_t sigchld, sigempty;
+		sigemptyset(&sigchld);
+		sigaddset(&sigchld, SIGCHLD);
+		sigprocmask(SIG_BLOCK, &sigchld, NULL);
+		sigemptyset(&sigempty);
+
+		int err;
+		if ((err = posix_spawnattr_init(&hook_attr)) != 0 ||
+		    (err = posix_spawnattr_setflags(&hook_attr,
+						    POSIX_SPAWN_SETSIGMASK)) != 0 ||
+		    (err = posix_spawnattr_setsigmask(&hook_attr,
+						      &sigempty)) != 0 ||
+		    (err = posix_spawnattr_init(&script_attr)) != 0 ||
+		    (err = posix_spawnattr_setflags(&script_attr,
+						    POSIX_SPAWN_SETSIGMASK |
+						    POSIX_SPAWN_SETPGROUP)) != 0 ||
+		    (err = posix_spawnattr_setsigmask(&script_attr,
+						      &sigempty)) != 0 ||
+		    (err = posix_spawnattr_setpgroup(&script_attr, 0)) != 0 ||
+		    (err = posix_spawn_file_actions_init(&script_fa)) != 0 ||
+		    (err = posix_spawn_file_actions_addopen(&script_fa,
+							    STDIN_FILENO,
+							    "/dev/null",
+							    O_RDONLY, 0)) != 0 ||
+		    (err = posix_spawn_file_actions_addopen(&script_fa,
+							    STDOUT_FILENO,
+							    "/dev/null",
+							    O_WRONLY, 0)) != 0 ||
+		    (err = posix_spawn_file_actions_addopen(&script_fa,
+							    STDERR_FILENO,
+							    "/dev/null",
+							    O_RDWR, 0)) != 0) {
+			crit("cannot set up script execution: %s",
+			     strerror(err));
+			return -1;
+		}
+
+		sfd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC);
+		if (sfd == -1) {
+			ecrit("cannot create signalfd for scripts: %s");
+			return -1;
+		}
+
+		for (struct hook_t *h = scripts.hooks;
+		     h != NULL && args.noexec == 0; h = h->next)
+			hook_start(h);
+
+		deferred_nr = iface_workers(ifaces);
+		if (deferred_nr > 1) {
+			deferred = aligned_alloc(SPSC_CACHELINE, deferred_nr *
+						 sizeof(struct spsc_t));
+			if (deferred == NULL) {
+				ecrit("cannot allocate worker queues: %s");
+				return -1;
+			}
+
+			for (unsigned i = 1; i < deferred_nr; ++i) {
+				if (spsc_init(&deferred[i], PROCESS_DEFER_NR,
+					      sizeof(struct deferred_t) +
+					      frame_len) == -1) {
+					ecrit("cannot allocate worker queues: %s");
+					return -1;
+				}
+			}
+
+			efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (efd == -1) {
+				ecrit("cannot create eventfd for workers: %s");
+				return -1;
+			}
 		}
 	}
 
-	snprintf(buf, sizeof(buf), "%ld", packet.len_orig);
-	setenv("PKT_LENGTH_ORIG", buf, 1);
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = PROXY_TAG_SCRIPTS;
 
-	char *b64buf = b64enc(packet_buf(packet, 1), packet.len_orig);
-	setenv("PKT_ORIG", b64buf, 1);
-	free(b64buf);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &event) == -1) {
+		eerr("cannot register script executor with epoll: %s");
+		return -1;
+	}
 
-	setenv("PKT_IFACE_ORIG", packet.iface_orig->name, 1);
+	event.data.ptr = PROXY_TAG_DEFERRED;
 
-	snprintf(buf, sizeof(buf), "%d", packet.iface_orig->mtu);
-	setenv("PKT_IFACE_MTU_ORIG", buf, 1);
+	if (efd != -1 && epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &event) == -1) {
+		eerr("cannot register worker queues with epoll: %s");
+		return -1;
+	}
 
-	if (packet.vlan_valid_orig == 1) {
-		snprintf(buf, sizeof(buf), "%.08x",
-			 ntohl(packet_tcitonl(packet.tci_orig)));
-		setenv("PKT_DOT1Q_TCI_ORIG", buf + 4, 1);	/* TCI only */
+	return 0;
+}
+
+/**
+ * @brief Set up the current thread as a worker other than the main thread
+ *
+ * From then on, @p process_script() defers to the main thread.
+ *
+ * @param id The worker, cf. the @p worker field of <tt>struct iface_t</tt>
+ */
+void process_thread(unsigned id)
+{
+	defer_to = &deferred[id];
+}
+
+/**
+ * @brief Wake up the main thread for any events deferred to it
+ *
+ * Called by a worker thread once per wakeup, after proxying whatever was
+ * ready, so that the main thread is woken up only once for all of it.
+ */
+void process_wake(void)
+{
+	if (defer_dropped > 0) {
+		warning("dropped %u script/hook events; main thread is behind",
+			defer_dropped);
+		defer_dropped = 0;
 	}
 
-	snprintf(buf, sizeof(buf), "%ld", packet.len);
-	setenv("PKT_LENGTH", buf, 1);
+	if (defer_wake == 0)
+		return;
 
-	b64buf = b64enc(packet_buf(packet, 0), packet.len);
-	setenv("PKT", b64buf, 1);
-	free(b64buf);
+	uint64_t one = 1;
+	if (write(efd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		ewarning("cannot wake main thread: %s");
+	defer_wake = 0;
+}
 
-	setenv("PKT_IFACE", packet.iface->name, 1);
+/**
+ * @brief Handle the events deferred to the main thread by worker threads
+ * @see @p process_script()
+ */
+void process_deferred(void)
+{
+	uint64_t count;
+	if (read(efd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+		ewarning("cannot read eventfd for workers: %s");
 
-	snprintf(buf, sizeof(buf), "%d", packet.iface->mtu);
-	setenv("PKT_IFACE_MTU", buf, 1);
+	for (unsigned i = 1; i < deferred_nr; ++i) {
+		struct deferred_t *d;
 
-	if (packet.vlan_valid == 1) {
-		snprintf(buf, sizeof(buf), "%.08x",
-			 ntohl(packet_tcitonl(packet.tci)));
-		setenv("PKT_DOT1Q_TCI", buf + 4, 1);		/* TCI only */
+		while ((d = spsc_peek(&deferred[i])) != NULL) {
+			d->packet.mpdu = d->frame + (ETH_ALEN * 2) +
+					 sizeof(uint32_t);
+			process_script(&d->packet, d->action);
+			spsc_release(&deferred[i]);
+		}
+	}
+}
+
+/**
+ * @brief Substitute a running hook for one in a reloaded config
+ * @param action Pointer to a <tt>struct action_t</tt>, or @p NULL
+ * @param from The hook in the reloaded config
+ * @param to The running hook with the same path
+ */
+static void rehook(struct action_t *action, struct hook_t *from,
+		   struct hook_t *to)
+{
+	if (action == NULL)
+		return;
+
+	for (int i = 0; i < 9; ++i)
+		if (action->hook_type[i] == from)
+			action->hook_type[i] = to;
+	for (int i = 0; i < 5; ++i)
+		if (action->hook_code[i] == from)
+			action->hook_code[i] = to;
+	for (int i = 0; i < 6; ++i)
+		if (action->hook_state[i] == from)
+			action->hook_state[i] = to;
+}
+
+/**
+ * @brief Apply the script limits and hooks of a reloaded config
+ *
+ * Hooks that are already running are kept, and the actions in @p ifaces made
+ * to point to them; new hooks are started. Hooks no longer named by any
+ * action keep running. Of the limits, only @p timeout and @p overflow can
+ * change without a restart, since slots are allocated up front.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces, as reloaded
+ * @param conf The script limits and hooks parsed along with @p ifaces
+ */
+void process_reload(struct iface_t *ifaces, struct scripts_t *conf)
+{
+	if (conf->max != scripts.max || conf->queue != scripts.queue)
+		warning("restart to change script max or queue");
+
+	scripts.timeout = conf->timeout;
+	scripts.drop_oldest = conf->drop_oldest;
+
+	/* Windows belong to the actions of the old config */
+	close_windows(1);
+
+	struct hook_t *next;
+	for (struct hook_t *h = conf->hooks; h != NULL; h = next) {
+		next = h->next;
+
+		struct hook_t *r;
+		for (r = scripts.hooks; r != NULL; r = r->next)
+			if (strcmp(r->path, h->path) == 0)
+				break;
+
+		if (r == NULL) {
+			h->next = scripts.hooks;
+			scripts.hooks = h;
+			if (args.noexec == 0)
+				hook_start(h);
+			continue;
+		}
+
+		for (struct iface_t *i = ifaces; i != NULL; i = i->next) {
+			rehook(i->ingress ? i->ingress->action : NULL, h, r);
+			rehook(i->egress ? i->egress->action : NULL, h, r);
+		}
+
+		free(h->path);
+		free(h);
+	}
+
+	conf->hooks = NULL;
+}
+
+/**
+ * @brief Check whether any scripts are executing or waiting to
+ *
+ * Scripts held back by coalescing windows count as waiting.
+ *
+ * @return 1 if none are, or 0 if any are
+ * @note A script refers to its path in the config it was submitted with.
+ */
+int process_idle(void)
+{
+	return running_nr == 0 && queue_len == 0 && windows_held == 0;
+}
+
+/**
+ * @brief Get the time until the script executor next needs to run
+ * @return The number of milliseconds until a running script times out, a
+ *         hook is due to be restarted or a coalescing window has held back
+ *         an event for long enough (0 if any is overdue), or -1 if none is
+ *         pending; suitable as the @p timeout parameter of
+ *         @p epoll_pwait(2)
+ */
+int process_timeout(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	long ms = -1;
+	for (struct hook_t *h = scripts.hooks;
+	     h != NULL && args.noexec == 0; h = h->next) {
+		if (h->pid != 0)
+			continue;
+
+		long left = (h->started + PROCESS_HOOK_BACKOFF - now.tv_sec) *
+			    1000;
+		if (left < 0)
+			left = 0;
+		if (ms == -1 || left < ms)
+			ms = left;
+	}
+
+	for (unsigned i = 0; i < PROCESS_WINDOWS_NR && windows_held > 0; ++i) {
+		struct window_t *w = &windows[i];
+		if (w->action == NULL || w->pending == 0)
+			continue;
+
+		long left = (w->deadline.tv_sec - now.tv_sec) * 1000 +
+			    (w->deadline.tv_nsec - now.tv_nsec) / 1000000 + 1;
+		if (left < 0)
+			left = 0;
+		if (ms == -1 || left < ms)
+			ms = left;
+	}
+
+	if (scripts.timeout == 0 || running_nr == 0)
+		return (int)ms;
+
+	for (unsigned i = 0; i < scripts.max; ++i) {
+		struct job_t *job = &running[i];
+		if (job->path == NULL)
+			continue;
+
+		long left = (job->deadline.tv_sec - now.tv_sec) * 1000 +
+			    (job->deadline.tv_nsec - now.tv_nsec) / 1000000 + 1;
+		if (left < 0)
+			left = 0;
+		if (ms == -1 || left < ms)
+			ms = left;
+	}
+
+	return (int)ms;
+}
+
+/**
+ * @brief Run the script executor
+ *
+ * Reaps scripts and hooks that have exited, terminates scripts that have timed
+ * out, executes scripts held back by coalescing windows that are due, executes
+ * queued scripts as slots free up, and restarts hooks. Call whenever the @p signalfd(2)
+ * registered by @p process_init() is ready, or @p process_timeout() reaches 0.
+ */
+void process_jobs(void)
+{
+	struct signalfd_siginfo ssi;
+	while (read(sfd, &ssi, sizeof(ssi)) == sizeof(ssi))
+		;			/* SIGCHLDs coalesce; just drain them */
+
+	int status;
+	pid_t pid;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		reap(pid, status);
+
+	expire();
+	close_windows(0);
+
+	while (queue_len > 0 && running_nr < scripts.max) {
+		struct job_t *job = &queue[queue_head];
+		queue_head = (queue_head + 1) % scripts.queue;
+		--queue_len;
+
+		for (unsigned i = 0; i < scripts.max; ++i) {
+			if (running[i].path != NULL)
+				continue;
+
+			/* Trade arenas rather than copy the environment */
+			struct job_t free_slot = running[i];
+			running[i] = *job;
+			*job = free_slot;
+			job->path = NULL;
+			spawn(&running[i]);
+			break;
+		}
 	}
 
-	if (execve(script, argv, environ) == -1)
-		exit(errno);	/* We failed and can't really signal why :) */
+	time_t now = uptime();
+	for (struct hook_t *h = scripts.hooks;
+	     h != NULL && args.noexec == 0; h = h->next)
+		if (h->pid == 0 && h->started + PROCESS_HOOK_BACKOFF <= now)
+			hook_start(h);
 }
 
 /**
  * @brief Determine if an EAPOL packet should be filtered (dropped)
  *
- * @p packet should contain enough information to determine whether an ingress
- * or egress filter should be applied.
+ * Whether @p filter is an ingress or egress filter is determined from
+ * @p packet.
  *
- * @param packet A <tt>struct peapod_packet</tt> representing an EAPOL packet
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> representing an
+ *               EAPOL packet
+ * @param filter The filter of the current interface in @p packet
  * @return 1 if the EAPOL packet should be filtered, or 0 if not
  */
-int process_filter(struct peapod_packet packet)
+int process_filter(const struct peapod_packet *packet,
+		   const struct filter_t *filter)
 {
-	static uint8_t phase;
-	static struct filter_t *filter;
-	static char *prefix, *desc;
-
-	/* Basic sanity checks */
-	if (packet.iface_orig == packet.iface &&
-	    packet.iface->ingress != NULL &&
-	    packet.iface->ingress->filter != NULL) {
-		phase = PROCESS_INGRESS;
-		filter = packet.iface->ingress->filter;
-	} else if (packet.iface_orig != packet.iface &&
-		   packet.iface->egress != NULL &&
-		   packet.iface->egress->filter != NULL) {
-		phase = PROCESS_EGRESS;
-		filter = packet.iface->egress->filter;
-	} else {
-		return 0;
-	}
+	uint8_t phase;
+	const char *prefix, *desc;
+	char state[32] = { "" };
 
+	phase = packet->iface_orig == packet->iface ?
+		PROCESS_INGRESS : PROCESS_EGRESS;
 	desc = NULL;
 
 	/* Build log message */
-	if (filter->type & (uint16_t)(1 << packet.type)) {
+	if (packet->type < 16 && filter->type & (uint16_t)(1 << packet->type)) {
 		prefix = "";
-		desc = packet_decode(packet.type, eapol_types);
-	} else if (packet.type == EAPOL_EAP &&
-		   filter->code & (uint8_t)(1 << packet.code)) {
+		desc = packet_decode(packet->type, eapol_types);
+	} else if (packet->type == EAPOL_EAP && packet->code < 8 &&
+		   filter->code & (uint8_t)(1 << packet->code)) {
 		prefix = "EAP-";
-		desc = packet_decode(packet.code, eap_codes);
+		desc = packet_decode(packet->code, eap_codes);
+	} else if (packet->state != SESSION_NONE &&
+		   filter->state & (uint8_t)(1 << packet->state_prev)) {
+		prefix = packet->type == EAPOL_EAP ? "EAP-" : "";
+		desc = packet->type == EAPOL_EAP ?
+		       packet_decode(packet->code, eap_codes) :
+		       packet_decode(packet->type, eapol_types);
+		snprintf(state, sizeof(state), " of %s supplicant",
+			 session_state_desc(packet->state_prev));
 	}
 
 	if (desc == NULL)
@@ -186,78 +1289,369 @@ int process_filter(struct peapod_packet packet)
 
 	/* Log filter application */
 	if (phase == PROCESS_INGRESS) {
-		info("filtered %s%s received on '%s'",
-		     prefix, desc, packet.iface_orig->name);
+		info("filtered %s%s%s received on '%s'",
+		     prefix, desc, state, packet->iface_orig->name);
 	} else {
-		info("filtered %s%s received on '%s' from being sent on '%s'",
-		     prefix, desc, packet.iface_orig->name, packet.iface->name);
+		info("filtered %s%s%s received on '%s' from being sent on '%s'",
+		     prefix, desc, state, packet->iface_orig->name,
+		     packet->iface->name);
 	}
 
 	return 1;
 }
 
 /**
- * @brief A wrapper for @p script()
+ * @brief Notify a hook of an EAPOL packet
  *
- * @p packet should contain enough information to determine whether an ingress
- * or egress script should be executed, upon which @p script() is called with
- * the appropriate parameters extracted from @p packet.
+ * With @p -n, the hook is only logged.
  *
- * @param packet A <tt>struct peapod_packet</tt> representing an EAPOL packet
+ * @param hook The hook
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> representing an
+ *               EAPOL packet
  */
-void process_script(struct peapod_packet packet)
+static void notify(struct hook_t *hook, const struct peapod_packet *packet)
 {
-	static uint8_t phase;
-	static struct action_t *action;
-	static char *prefix, *desc, *path;
-
-	/* Basic sanity checks */
-	if (packet.iface_orig == packet.iface &&
-	    packet.iface->ingress != NULL &&
-	    packet.iface->ingress->action != NULL) {
-		phase = PROCESS_INGRESS;
-		action = packet.iface->ingress->action;
-	} else if (packet.iface_orig != packet.iface &&
-		   packet.iface->egress != NULL &&
-		   packet.iface->egress->action != NULL) {
-		phase = PROCESS_EGRESS;
-		action = packet.iface->egress->action;
+	if (args.noexec == 1) {
+		debug("would notify hook '%s'", hook->path);
 	} else {
+		debug("notifying hook '%s'", hook->path);
+		hook_send(hook, packet);
+	}
+}
+
+/**
+ * @brief Log and submit a script for an EAPOL packet
+ *
+ * With @p -n, the script is only logged.
+ *
+ * @param what What the packet is, e.g. "EAP-Success"
+ * @param why Appended to the log message, e.g. the session state transition
+ * @param path Path to the script
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> representing an
+ *               EAPOL packet
+ */
+static void execute(const char *what, const char *why, char *path,
+		    const struct peapod_packet *packet)
+{
+	/* Log script execution; don't use a logging macro */
+	if (packet->iface_orig == packet->iface)
+		log_msg(args.quiet == 1 ? LOG_INFO : LOG_NOTICE, NULL, 0,
+			"received %s on '%s'%s; executing '%s'",
+			what, packet->iface->name, why, path);
+	else
+		log_msg(args.quiet == 1 ? LOG_INFO : LOG_NOTICE, NULL, 0,
+			"sending %s from '%s' on '%s'%s; executing '%s'",
+			what, packet->iface_orig->name, packet->iface->name,
+			why, path);
+
+	if (args.noexec == 0)
+		submit(path, packet);
+}
+
+/**
+ * @brief Copy the MPDU of an EAPOL packet, to keep it past its buffer
+ * @param frame 16 bytes of scratch space, then room for the MPDU
+ * @param packet Pointer to a <tt>struct peapod_packet</tt>; its @p mpdu is
+ *               pointed to the copy
+ */
+static void keep(uint8_t *frame, struct peapod_packet *packet)
+{
+	size_t mpdu_len = packet->len_orig - (ETH_ALEN * 2) -
+			  (packet->vlan_valid_orig == 1 ? sizeof(uint32_t) : 0);
+
+	memcpy(frame + (ETH_ALEN * 2) + sizeof(uint32_t), packet->mpdu,
+	       mpdu_len);
+	packet->mpdu = frame + (ETH_ALEN * 2) + sizeof(uint32_t);
+}
+
+/**
+ * @brief Check whether a coalescing window has closed
+ * @param w Pointer to a <tt>struct window_t</tt> in use
+ * @param ts Timestamp of the packet at hand
+ * @return 1 if the window had closed by @p ts, or 0 if not
+ */
+static int closed(const struct window_t *w, const struct timespec *ts)
+{
+	int64_t ns = (int64_t)(ts->tv_sec - w->opened.tv_sec) * 1000000000 +
+		     (ts->tv_nsec - w->opened.tv_nsec);
+
+	return ns >= (int64_t)w->action->coalesce->window * 1000000;
+}
+
+/**
+ * @brief Hold back an event in a coalescing window, in place of any other
+ * @param w Pointer to a <tt>struct window_t</tt> in use
+ * @param what What the packet is, cf. @p execute()
+ * @param why Why the script would be executed, cf. @p execute()
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> representing an
+ *               EAPOL packet
+ */
+static void hold(struct window_t *w, const char *what, const char *why,
+		 const struct peapod_packet *packet)
+{
+	snprintf(w->what, sizeof(w->what), "%s", what);
+	snprintf(w->why, sizeof(w->why), "%s", why);
+	w->packet = *packet;
+	keep(w->frame, &w->packet);
+
+	if (w->pending == 0) {
+		w->pending = 1;
+		++windows_held;
+	}
+}
+
+/**
+ * @brief Close a coalescing window, executing its script for the event it
+ *        held back, if any
+ *
+ * With @p batch, the script is told how many events it is executed for.
+ *
+ * @param w Pointer to a <tt>struct window_t</tt> in use; freed
+ */
+static void release(struct window_t *w)
+{
+	if (w->pending == 1) {
+		char why[96];
+		struct peapod_packet packet = w->packet;
+
+		if (w->action->coalesce->mode == COALESCE_BATCH) {
+			packet.coalesced = w->events;
+			packet.coalesced_start = w->opened;
+		}
+
+		snprintf(why, sizeof(why), "%s, %lu event%s coalesced",
+			 w->why, w->events, w->events == 1 ? "" : "s");
+		execute(w->what, why, w->path, &packet);
+
+		w->pending = 0;
+		--windows_held;
+	}
+
+	w->action = NULL;
+}
+
+/**
+ * @brief Close coalescing windows that have held back an event for too long
+ * @param all Flag: Close every window, whether or not it is due?
+ */
+static void close_windows(uint8_t all)
+{
+	struct timespec now;
+
+	if (windows == NULL || (windows_held == 0 && all == 0))
 		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for (unsigned i = 0; i < PROCESS_WINDOWS_NR; ++i) {
+		struct window_t *w = &windows[i];
+
+		if (w->action == NULL)
+			continue;
+
+		if (all == 1 ||
+		    (w->pending == 1 &&
+		     (w->deadline.tv_sec < now.tv_sec ||
+		      (w->deadline.tv_sec == now.tv_sec &&
+		       w->deadline.tv_nsec <= now.tv_nsec))))
+			release(w);
 	}
+}
+
+/**
+ * @brief Coalesce an event for a script with others in its window
+ *
+ * Without a window open for the script (and source address, with
+ * @p per-mac), one is opened. By default, its first event executes the script
+ * right away, and the rest are dropped. With @p trailing or @p batch, each
+ * event is held back in place of the one before it, and the last executes the
+ * script when the window closes.
+ *
+ * Windows go by packet timestamps, so that replayed captures coalesce as they
+ * would have live. One holding back an event also closes on its own once its
+ * length has passed, cf. @p close_windows().
+ *
+ * @param action The scripts and hooks of the current interface in @p packet
+ * @param what What the packet is, cf. @p execute()
+ * @param why Why the script would be executed, cf. @p execute()
+ * @param path Path to the script
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> representing an
+ *               EAPOL packet
+ * @return 1 if the script is to be executed right away, or 0 if not
+ */
+static int coalesce(const struct action_t *action, const char *what,
+		    const char *why, char *path,
+		    const struct peapod_packet *packet)
+{
+	const struct coalesce_t *c = action->coalesce;
+	struct window_t *w = NULL, *spare = NULL, *oldest = NULL;
+	uint8_t mac[ETH_ALEN] = { 0 };
+
+	if (c->per_mac == 1)
+		memcpy(mac, packet->state != SESSION_NONE ?
+		       packet->supplicant : packet->h_source, ETH_ALEN);
+
+	for (unsigned i = 0; i < PROCESS_WINDOWS_NR; ++i) {
+		struct window_t *v = &windows[i];
+
+		if (v->action == action && v->path == path &&
+		    memcmp(v->mac, mac, ETH_ALEN) == 0) {
+			w = v;
+			break;
+		}
+
+		if (spare == NULL &&
+		    (v->action == NULL ||
+		     (v->pending == 0 && closed(v, &packet->ts) == 1)))
+			spare = v;
+
+		if (v->action != NULL &&
+		    (oldest == NULL ||
+		     v->opened.tv_sec < oldest->opened.tv_sec ||
+		     (v->opened.tv_sec == oldest->opened.tv_sec &&
+		      v->opened.tv_nsec < oldest->opened.tv_nsec)))
+			oldest = v;
+	}
+
+	if (w != NULL && closed(w, &packet->ts) == 1)
+		release(w);
+
+	if (w != NULL && w->action != NULL) {
+		++w->events;
+		stats_event(packet->iface, STATS_SCRIPTS_COALESCED);
+
+		if (c->mode == COALESCE_LEADING)
+			debug("not executing '%s' for %s, coalesced into an "
+			      "earlier event", path, what);
+		else
+			hold(w, what, why, packet);
+
+		return 0;
+	}
+
+	if (w == NULL) {
+		w = spare != NULL ? spare : oldest;
+		if (w->action != NULL) {
+			if (w->pending == 1)
+				debug("too many coalescing windows, closing "
+				      "one for '%s' early", w->path);
+			release(w);
+		}
+	}
+
+	w->action = action;
+	w->path = path;
+	memcpy(w->mac, mac, ETH_ALEN);
+	w->events = 1;
+	w->opened = packet->ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &w->deadline);
+	w->deadline.tv_sec += c->window / 1000;
+	w->deadline.tv_nsec += (c->window % 1000) * 1000000;
+	if (w->deadline.tv_nsec >= 1000000000) {
+		w->deadline.tv_nsec -= 1000000000;
+		++w->deadline.tv_sec;
+	}
+
+	if (c->mode == COALESCE_LEADING)
+		return 1;
+
+	hold(w, what, why, packet);
+	return 0;
+}
+
+/**
+ * @brief Execute a script and/or notify a hook for an EAPOL packet
+ *
+ * Whether @p action holds ingress or egress scripts and hooks is determined
+ * from @p packet. A matching script is submitted to the script executor along
+ * with an environment built from @p packet. The script is executed
+ * asynchronously; this never waits for it. Likewise for a matching hook, which
+ * is sent an event record built from @p packet.
+ *
+ * Should @p packet have moved its supplicant into another session state, the
+ * script and hook for that state are submitted and notified as well.
+ *
+ * On a worker thread other than the main thread, the script executor and
+ * hooks are out of reach, so the whole lot is handed over to the main thread
+ * instead (cf. @p process_deferred()).
+ *
+ * With @p -n, the script is logged as usual but not executed, and the hook is
+ * not notified.
+ *
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> representing an
+ *               EAPOL packet
+ * @param action The scripts and hooks of the current interface in @p packet
+ */
+void process_script(const struct peapod_packet *packet,
+		    const struct action_t *action)
+{
+	const char *prefix, *desc;
+	char what[64], why[64];
+	char *path;
+	struct hook_t *hook;
+	uint8_t transition;
+
+	if (defer_to != NULL) {
+		defer(packet, action);		/* Not the main thread */
+		return;
+	}
+
+	/* Notify hook; too cheap and frequent to be worth a notice each */
+	hook = NULL;
+	if (packet->type <= EAPOL_ANNOUNCEMENT_REQ)
+		hook = action->hook_type[packet->type];
+	if (hook == NULL && packet->type == EAPOL_EAP &&
+	    EAP_CODE_REQUEST <= packet->code && packet->code <= EAP_CODE_FAILURE)
+		hook = action->hook_code[packet->code];
+
+	if (hook != NULL)
+		notify(hook, packet);
+
+	/* Plus once more on entering a session state, unless already done */
+	transition = packet->state != packet->state_prev &&
+		     packet->state < SESSION_STATES;
+	if (transition && action->hook_state[packet->state] != NULL &&
+	    action->hook_state[packet->state] != hook)
+		notify(action->hook_state[packet->state], packet);
 
 	path = NULL;
 
 	/* Build log message */
-	if (packet.type <= EAPOL_ANNOUNCEMENT_REQ &&
-	    action->type[packet.type] != NULL) {
+	if (packet->type <= EAPOL_ANNOUNCEMENT_REQ &&
+	    action->type[packet->type] != NULL) {
 		prefix = "";
-		desc = packet_decode(packet.type, eapol_types);
-		path = action->type[packet.type];
-	} else if (packet.type == EAPOL_EAP &&
-		   EAP_CODE_REQUEST <= packet.code &&
-		   packet.code <= EAP_CODE_FAILURE &&
-		   action->code[packet.code] != NULL) {
+		desc = packet_decode(packet->type, eapol_types);
+		path = action->type[packet->type];
+	} else if (packet->type == EAPOL_EAP &&
+		   EAP_CODE_REQUEST <= packet->code &&
+		   packet->code <= EAP_CODE_FAILURE &&
+		   action->code[packet->code] != NULL) {
 		prefix = "EAP-";
-		desc = packet_decode(packet.code, eap_codes);
-		path = action->code[packet.code];
+		desc = packet_decode(packet->code, eap_codes);
+		path = action->code[packet->code];
+	} else {
+		prefix = packet->type == EAPOL_EAP ? "EAP-" : "";
+		desc = packet->type == EAPOL_EAP ?
+		       packet_decode(packet->code, eap_codes) :
+		       packet_decode(packet->type, eapol_types);
 	}
 
-	if (path == NULL)
-		return;
+	snprintf(what, sizeof(what), "%s%s", prefix, desc);
 
-	/* Log script execution; don't use a logging macro */
-	if (phase == PROCESS_INGRESS)
-		log_msg(args.quiet == 1 ? LOG_INFO : LOG_NOTICE, NULL, 0,
-			"received %s%s on '%s'; executing '%s'",
-			prefix, desc, packet.iface->name, path);
-	else if (phase == PROCESS_EGRESS)
-		log_msg(args.quiet == 1 ? LOG_INFO : LOG_NOTICE, NULL, 0,
-			"sending %s%s from '%s' on '%s'; executing '%s'",
-			prefix, desc, packet.iface_orig->name,
-			packet.iface->name, path);
-	else
-		return;
+	if (path != NULL &&
+	    (action->coalesce == NULL ||
+	     coalesce(action, what, "", path, packet) == 1))
+		execute(what, "", path, packet);
 
-	script(packet, path);
+	if (transition && action->state[packet->state] != NULL &&
+	    action->state[packet->state] != path) {
+		snprintf(why, sizeof(why), ", supplicant %s now %s",
+			 iface_strmac(packet->supplicant),
+			 session_state_desc(packet->state));
+		if (action->coalesce == NULL ||
+		    coalesce(action, what, why, action->state[packet->state],
+			     packet) == 1)
+			execute(what, why, action->state[packet->state], packet);
+	}
 }
@@ -2,19 +2,113 @@
  * @file proxy.c
  * @brief Main event loop, related operations
  */
+#include <pthread.h>
 #include <signal.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include "args.h"
+#include "capture.h"
+#include "latency.h"
+#include "limit.h"
 #include "log.h"
+#include "netlink.h"
 #include "packet.h"
 #include "process.h"
+#include "proxy.h"
+#include "replay.h"
+#include "session.h"
+#include "stats.h"
+#include "trace.h"
 
-static void check_signals(void);
+static void check_signals(struct iface_t *ifaces);
+static const struct action_t *resolve_action(const struct action_t *action);
+static void make_plans(struct iface_t *ifaces);
 static int create_epoll(void);
+static int init_epoll(struct iface_t *ifaces);
+static void start_workers(struct iface_t *ifaces);
+static void stop_workers(void);
+static struct iface_t *reload(struct iface_t *ifaces);
+static void *work(void *arg);
 static void spurious_event(char *name, uint32_t events);
+static void link_down(struct iface_t *iface, int epfd);
+static int link_event(struct iface_t *iface, uint32_t events, int epfd);
+static void relink(struct iface_t *ifaces);
+static void learn_mac(struct iface_t *ifaces, unsigned from, u_char *mac,
+		      uint8_t oneshot);
+static int admit(struct plan_t *plan, const struct peapod_packet *pkt);
+static int forward(struct iface_t *ifaces, struct peapod_packet *pkt);
+static int drain(struct iface_t *ifaces, struct iface_t *iface, int epfd);
+
+/**
+ * @brief Maximum number of @p epoll events handled per wakeup
+ * @see @p proxy()
+ */
+#define PROXY_MAX_EVENTS		32
+
+/**
+ * @brief The dispatch plan of an ingress interface
+ *
+ * The config of every interface boils down to what happens to the packets it
+ * receives, which is worked out once by @p make_plans() rather than per packet.
+ *
+ * @see The @p plan field of <tt>struct iface_t</tt>
+ */
+struct plan_t {
+	struct filter_t filter;		/**< @brief Ingress filter, or all zeroes */
+	const struct action_t *action;	/**< @brief Ingress scripts/hooks, or @p NULL */
+	struct capture_t *capture;	/**< @brief Ingress capture, or @p NULL */
+	uint8_t set_mac;		/**< @brief Flag: Does another interface have @p set-mac-from this one? */
+	uint8_t unicast;		/**< @brief Flag: Send packets for a supplicant only where it was last seen? */
+	struct route_t *route;		/**< @brief Egress interfaces, cf. @p iface_routes() */
+	unsigned route_nr;		/**< @brief Number of egress interfaces */
+	/**
+	 * @name Ingress rate limits
+	 *
+	 * The limits are all zeroes if not set. The buckets are only ever used
+	 * by the worker of the interface, and start out full with each plan.
+	 *
+	 * @see @p admit()
+	 * @{
+	 */
+	struct limit_t limit;		/**< @brief For the interface as a whole */
+	struct limit_t limit_mac;	/**< @brief For each source MAC address */
+	uint64_t full;			/**< @brief Bucket of the interface, cf. @p limit_take() */
+	struct sketch_t sketch;		/**< @brief Buckets of source addresses not in the session table */
+	/** @} */
+};
+
+/** @brief The dispatch plans of all interfaces, followed by all their routes */
+static struct plan_t *plans = NULL;
+
+/**
+ * @brief A worker thread other than the main thread
+ *
+ * Each worker receives packets on the interfaces assigned to it and forwards
+ * them, sending on its own queue of each egress interface.
+ *
+ * @see The @p worker field of <tt>struct iface_t</tt>
+ */
+struct worker_t {
+	pthread_t thread;		/**< @brief The thread */
+	unsigned id;			/**< @brief Worker number, never 0 */
+	struct iface_t *ifaces;		/**< @brief All interfaces */
+};
+
+static struct worker_t *workers = NULL;	/**< @brief Indexed by worker number */
+static unsigned workers_nr = 1;		/**< @brief Number of workers, main thread included */
+static int *epfds = NULL;		/**< @brief @p epoll instance of each worker */
+static int stop_efd = -1;		/**< @brief @p eventfd(2) telling workers to stop */
+static int fail_efd = -1;		/**< @brief @p eventfd(2) telling main thread a worker stopped */
+static int down_efd = -1;		/**< @brief @p eventfd(2) telling main thread an interface went down */
+
+/**
+ * @brief Configs replaced by @p reload(), kept until no script refers to them
+ * @see @p process_idle()
+ */
+static struct iface_t *retired = NULL;
 
 extern volatile sig_atomic_t sig_hup;
 extern volatile sig_atomic_t sig_int;
@@ -22,13 +116,18 @@ extern volatile sig_atomic_t sig_usr1;
 extern volatile sig_atomic_t sig_term;
 
 extern struct args_t args;
+extern struct latency_t latency;
 
-/** @brief Check and set signal counters */
-static void check_signals(void) {
-	if (sig_hup > 0) {
-		notice("received SIGHUP");
-		--sig_hup;
-	}
+/**
+ * @brief Check and set signal counters
+ *
+ * On @p SIGUSR1, logs per-interface counters and histograms, and sessions.
+ * @p SIGHUP is left to the main event loop, which reloads the config.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ */
+static void check_signals(struct iface_t *ifaces) {
 	if (sig_int > 0) {
 		warning("exiting on SIGINT");
 		--sig_int;
@@ -37,6 +136,8 @@ static void check_signals(void) {
 	if (sig_usr1 > 0) {
 		notice("received SIGUSR1");
 		--sig_usr1;
+		stats_dump(ifaces);
+		session_dump(ifaces);
 	}
 	if (sig_term > 0) {
 		warning("exiting on SIGTERM");
@@ -45,19 +146,434 @@ static void check_signals(void) {
 	}
 }
 
+/**
+ * @brief Resolve a set of scripts and hooks to @p NULL if it is empty
+ * @param action Pointer to a <tt>struct action_t</tt>, or @p NULL
+ * @return @p action, or @p NULL if it has neither scripts nor hooks
+ */
+static const struct action_t *resolve_action(const struct action_t *action)
+{
+	struct action_t empty;
+	memset(&empty, 0, sizeof(empty));
+
+	if (action == NULL || memcmp(action, &empty, sizeof(empty)) == 0)
+		return NULL;
+
+	return action;
+}
+
+/**
+ * @brief Work out the dispatch plan of each interface
+ *
+ * The plans are laid out in one array, followed by the routes of each plan in
+ * turn. A plan only has routes to the interfaces that @p iface_routes() says
+ * its interface sends on. A route to a virtual interface always tags packets
+ * with its VLAN, whatever else its @p dot1q stanza says.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ */
+static void make_plans(struct iface_t *ifaces)
+{
+	unsigned n = iface_count(ifaces);
+
+	free(plans);
+	plans = calloc(1, n * sizeof(struct plan_t) +
+			  n * (n - 1) * sizeof(struct route_t));
+	if (plans == NULL)
+		ecritdie("cannot allocate dispatch plan: %s");
+
+	struct plan_t *p = plans;
+	struct route_t *r = (struct route_t *)(plans + n);
+
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next, ++p) {
+		i->plan = p;
+		p->route = r;
+		p->unicast = i->unicast;
+
+		if (i->ingress != NULL) {
+			if (i->ingress->filter != NULL)
+				p->filter = *i->ingress->filter;
+			p->action = resolve_action(i->ingress->action);
+			p->capture = i->ingress->capture;
+			if (i->ingress->limit != NULL)
+				p->limit = *i->ingress->limit;
+			if (i->ingress->limit_mac != NULL) {
+				p->limit_mac = *i->ingress->limit_mac;
+				limit_sketch_init(&p->sketch);
+			}
+		}
+
+		for (struct iface_t *e = ifaces; e != NULL; e = e->next) {
+			if (e->set_mac_from == i->index)
+				p->set_mac = 1;
+
+			if (iface_routes(i, e) == 0)
+				continue;
+
+			const struct tci_t *tci = NULL;
+			struct tci_t vlan;
+
+			r->iface = e;
+			if (e->egress != NULL) {
+				if (e->egress->filter != NULL)
+					r->filter = *e->egress->filter;
+				r->action = resolve_action(e->egress->action);
+				r->capture = e->egress->capture;
+				tci = e->egress->tci;
+			}
+
+			if (e->trunk != NULL) {
+				vlan = (struct tci_t){ TCI_UNTOUCHED,
+						       TCI_UNTOUCHED, 0 };
+				if (tci != NULL)
+					vlan = *tci;
+				vlan.vid = e->vid;
+				tci = &vlan;
+			}
+
+			packet_route(r, tci);
+			++r;
+		}
+
+		p->route_nr = r - p->route;
+	}
+}
+
 /**
  * @brief Create an @p epoll instance
  * @return 0 if successful, -1 if unsuccessful
  */
 static int create_epoll(void)
 {
-	int ret = epoll_create(1);
+	int ret = epoll_create1(EPOLL_CLOEXEC);
 	if (ret == -1)
 		ecritdie("cannot create epoll instance: %s\n");
 
 	return ret;
 }
 
+/**
+ * @brief Create the @p epoll instance of each worker and initialize interfaces
+ *
+ * The main thread's instance is also returned.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @return Number of interfaces ready, as returned by @p iface_init()
+ */
+static int init_epoll(struct iface_t *ifaces)
+{
+	struct epoll_event event;
+	event.events = EPOLLIN;
+
+	for (unsigned w = 0; w < workers_nr; ++w) {
+		epfds[w] = create_epoll();
+		latency_epoll(epfds[w]);
+
+		if (w == 0) {
+			event.data.ptr = PROXY_TAG_DOWN;
+			if (epoll_ctl(epfds[w], EPOLL_CTL_ADD, down_efd,
+				      &event) == -1)
+				ecritdie("cannot register eventfd with epoll: %s");
+
+			/* Before iface_init() reads the link state */
+			if (netlink_init(epfds[w]) == -1)
+				critdie("cannot monitor links");
+		}
+
+		/* Other workers stop on request; the main thread restarts */
+		event.data.ptr = w == 0 ? PROXY_TAG_WORKERS : PROXY_TAG_STOP;
+		if (workers_nr > 1 &&
+		    epoll_ctl(epfds[w], EPOLL_CTL_ADD,
+			      w == 0 ? fail_efd : stop_efd, &event) == -1)
+			ecritdie("cannot register workers with epoll: %s");
+	}
+
+	return iface_init(ifaces, epfds);
+}
+
+/**
+ * @brief Start all workers other than the main thread
+ *
+ * Workers are started with all signals blocked, so that signals are only ever
+ * handled by the main thread.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ */
+static void start_workers(struct iface_t *ifaces)
+{
+	sigset_t sigall, sigcurrent;
+	sigfillset(&sigall);
+	pthread_sigmask(SIG_SETMASK, &sigall, &sigcurrent);
+
+	for (unsigned w = 1; w < workers_nr; ++w) {
+		workers[w].id = w;
+		workers[w].ifaces = ifaces;
+
+		int ret = pthread_create(&workers[w].thread, NULL, work,
+					 &workers[w]);
+		if (ret != 0) {
+			errno = ret;
+			ecritdie("cannot start worker %u: %s", w);
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &sigcurrent, NULL);
+
+	if (workers_nr > 1)
+		info("started %u workers", workers_nr - 1);
+}
+
+/**
+ * @brief Stop all workers other than the main thread and wait for them to exit
+ *
+ * Workers that already stopped on error are simply waited for. Their @p epoll
+ * instances are left open, for @p start_workers() to pick up where they left
+ * off.
+ */
+static void stop_workers(void)
+{
+	uint64_t count = 1;
+
+	if (workers_nr == 1)
+		return;
+
+	if (write(stop_efd, &count, sizeof(count)) == -1)
+		ecritdie("cannot stop workers: %s");
+
+	for (unsigned w = 1; w < workers_nr; ++w)
+		pthread_join(workers[w].thread, NULL);
+
+	/* Reset both eventfds for the next start */
+	if (read(stop_efd, &count, sizeof(count)) == -1 ||
+	    (read(fail_efd, &count, sizeof(count)) == -1 && errno != EAGAIN))
+		ecritdie("cannot reset workers: %s");
+}
+
+/**
+ * @brief Reload the config file and apply it to the running proxy
+ *
+ * Interfaces are matched by name between the running config and the reloaded
+ * one. Those in both keep their raw sockets, rings and counters, unless the
+ * change in their config calls for a new socket, cf. @p iface_reconf(); those
+ * only in the reloaded config are opened and those no longer in it closed.
+ * Should anything change, offloaded interfaces are reopened, since their
+ * in-kernel datapath refers to the others.
+ *
+ * Workers are stopped for the duration. A reloaded config that cannot be
+ * parsed, or that calls for more workers than are running, is rejected and the
+ * running config is kept as is.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @return The interfaces as reloaded, or @p ifaces if the config was rejected
+ */
+static struct iface_t *reload(struct iface_t *ifaces)
+{
+	struct scripts_t conf_scripts;
+	struct sessions_t conf_sessions;
+	struct latency_t conf_latency;
+	uint8_t level = args.level;
+
+	struct iface_t *conf = parse_reload(args.conffile, &level,
+					    &conf_scripts, &conf_sessions,
+					    &conf_latency);
+	if (conf == NULL) {
+		err("cannot reload config, keeping current config");
+		return ifaces;
+	}
+
+	/* Memory stays locked and workers pinned as they were */
+	if (memcmp(&conf_latency, &latency, sizeof(latency)) != 0)
+		warning("restart to change low-latency options, keeping current "
+			"ones");
+
+	if (iface_workers(conf) > workers_nr) {
+		err("restart to use more than %u workers, keeping current "
+		    "config", workers_nr);
+		parser_free(conf, conf_scripts.hooks);
+		return ifaces;
+	}
+
+	stop_workers();
+	if (workers_nr > 1)
+		process_deferred();	/* Events refer to the running config */
+
+	uint8_t *reopen = calloc(iface_count(conf), 1);
+	if (reopen == NULL)
+		ecritdie("cannot allocate memory: %s");
+
+	struct iface_t *list = NULL, **tail = &list;
+	struct iface_t *next, **o;
+	uint8_t changed = 0;
+	unsigned n = 0;
+
+	for (struct iface_t *c = conf; c != NULL; c = next, ++n) {
+		next = c->next;
+
+		for (o = &ifaces; *o != NULL; o = &(*o)->next)
+			if (strcmp((*o)->name, c->name) == 0 &&
+			    (*o)->index == c->index)
+				break;
+
+		struct iface_t *i = c;
+		if (*o == NULL) {
+			info("adding interface '%s'", c->name);
+			reopen[n] = 1;
+			changed = 1;
+		} else {
+			i = *o;
+			*o = i->next;
+
+			int ret = iface_reconf(i, c);
+			if (ret != 0)
+				info("updating interface '%s'", i->name);
+			reopen[n] = (ret & IFACE_RECONF_REOPEN) != 0;
+			changed |= ret != 0;
+
+			c->next = retired;	/* Now holds the old config */
+			retired = c;
+		}
+
+		i->next = NULL;
+		*tail = i;
+		tail = &i->next;
+	}
+
+	/* Whatever is left is no longer configured */
+	for (struct iface_t *i = ifaces; i != NULL; i = next) {
+		next = i->next;
+		info("removing interface '%s'", i->name);
+		iface_close(i);
+		free(i->txq);
+		i->txq = NULL;
+		i->stats = NULL;	/* Went with the old stats region */
+		i->next = retired;
+		retired = i;
+		changed = 1;
+	}
+
+	iface_trunks(list);
+	if (netlink_dump(list) == -1)
+		warning("link state may be stale");
+
+	n = 0;
+	for (struct iface_t *i = list; i != NULL; i = i->next, ++n) {
+		if (i->trunk != NULL)
+			continue;		/* Goes with its trunk, below */
+
+		if (reopen[n] == 0 &&
+		    (changed == 0 || (i->offload == 0 && i->offload_link == 0)))
+			continue;
+
+		/* Its worker may have changed */
+		for (unsigned w = 0; w < workers_nr && i->skt != 0; ++w)
+			epoll_ctl(epfds[w], EPOLL_CTL_DEL, i->skt, NULL);
+
+		if (iface_open(list, i, epfds[i->worker]) == 0) {
+			__atomic_store_n(&i->down, 0, __ATOMIC_RELEASE);
+		} else {
+			__atomic_store_n(&i->down, 1, __ATOMIC_RELEASE);
+			warning("pausing until it is back up, interface '%s'",
+				i->name);
+		}
+	}
+	free(reopen);
+
+	for (struct iface_t *i = list; i != NULL; i = i->next)
+		if (i->trunk != NULL)
+			__atomic_store_n(&i->down, i->trunk->down,
+					 __ATOMIC_RELEASE);
+
+	make_plans(list);
+	packet_ifaces(list);
+	stats_ifaces(list, workers_nr);
+	trace_ifaces(list);
+	capture_ifaces(list, retired);
+	process_reload(list, &conf_scripts);
+	session_reload(&conf_sessions);
+	args.level = level;
+
+	start_workers(list);
+	notice(changed ? "reloaded config" : "reloaded config, no changes");
+	return list;
+}
+
+/**
+ * @brief Event loop of a worker other than the main thread
+ *
+ * A pared-down version of the main event loop in @p proxy() that only receives
+ * and forwards packets, deferring scripts and hooks to the main thread. On
+ * error, the main thread is told to restart the proxy, which is the only way
+ * a worker exits other than when told to stop.
+ *
+ * @param arg Pointer to the <tt>struct worker_t</tt> of this worker
+ * @return @p NULL
+ */
+static void *work(void *arg)
+{
+	struct worker_t *w = arg;
+	struct iface_t *iface;
+	struct epoll_event events[PROXY_MAX_EVENTS];
+	uint64_t one = 1;
+
+	packet_thread(w->id);
+	process_thread(w->id);
+	stats_thread(w->id);
+	log_thread(w->id);
+	latency_thread(w->id);
+
+	while (1) {
+		int nfds = epoll_wait(epfds[w->id], events, PROXY_MAX_EVENTS,
+				      -1);
+		if (nfds == -1) {
+			if (errno == EINTR)
+				continue;
+			ecrit("worker %u cannot wait for epoll events: %s",
+			      w->id);
+			goto work_error;
+		}
+
+		for (int e = 0; e < nfds; ++e) {
+			if (events[e].data.ptr == PROXY_TAG_STOP)
+				goto work_exit;
+
+			iface = events[e].data.ptr;
+
+			if (events[e].events != EPOLLIN) {
+				if (link_event(iface, events[e].events,
+					       epfds[w->id]) == 0)
+					continue;
+				packet_flush(w->ifaces);
+				goto work_error;
+			}
+
+			debuglow("got an EPOLLIN event, interface '%s'",
+				 iface->name);
+
+			if (drain(w->ifaces, iface, epfds[w->id]) == -1) {
+				packet_flush(w->ifaces);
+				goto work_error;
+			}
+		}
+
+		if (packet_flush(w->ifaces) == -1)
+			goto work_error;
+
+		process_wake();
+	}
+
+work_error:
+	process_wake();
+	if (write(fail_efd, &one, sizeof(one)) == -1)
+		ecritdie("worker %u cannot fail: %s", w->id);
+work_exit:
+	packet_thread_exit();
+	return NULL;
+}
+
 /**
  * @brief Log an error on receiving a spurious @p epoll event
  * @param name The name of a network interface
@@ -84,6 +600,310 @@ static void spurious_event(char *name, uint32_t events)
 	    events, desc, name);
 }
 
+/**
+ * @brief Take an interface that went down out of service
+ *
+ * The main thread is told, so that it can reopen the interface once it is back
+ * up, even if it has already heard so from the kernel.
+ *
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ * @param epfd File descriptor for the @p epoll instance of the current worker
+ * @see @p iface_down(), @p relink()
+ */
+static void link_down(struct iface_t *iface, int epfd)
+{
+	uint64_t one = 1;
+
+	iface_down(iface, epfd);
+	if (write(down_efd, &one, sizeof(one)) == -1)
+		ewarning("cannot wake main thread: %s");
+}
+
+/**
+ * @brief Handle an @p epoll event other than @p EPOLLIN on an interface
+ *
+ * A raw socket reports @p ENETDOWN once if its interface goes down; only that
+ * interface is then taken out of service. Anything else is unexpected.
+ *
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ * @param events The @p events field of a <tt>struct epoll_event</tt>
+ * @param epfd File descriptor for the @p epoll instance of the current worker
+ * @return 0 if the interface went down, or -1 if the event was spurious
+ */
+static int link_event(struct iface_t *iface, uint32_t events, int epfd)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if (events & EPOLLERR &&
+	    getsockopt(iface->skt, SOL_SOCKET, SO_ERROR, &err, &len) == 0 &&
+	    err == ENETDOWN) {
+		link_down(iface, epfd);
+		return 0;
+	}
+
+	spurious_event(iface->name, events);
+	return -1;
+}
+
+/**
+ * @brief Reopen every interface that went down and is now back up
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @see @p iface_up()
+ */
+static void relink(struct iface_t *ifaces)
+{
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next)
+		if (__atomic_load_n(&i->down, __ATOMIC_ACQUIRE) == 1 &&
+		    i->flags & IFF_UP && i->trunk == NULL)
+			iface_up(ifaces, i, epfds[i->worker]);
+}
+
+/**
+ * @brief Set the MAC address of interfaces with @p set-mac-from an interface
+ *
+ * Without @p oneshot, an interface already set to the address of a supplicant
+ * that is still authenticated keeps it, and one that cannot be set is tried
+ * again next time.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @param from Index of the interface the address was learned on
+ * @param mac The address
+ * @param oneshot Flag: Never try again, whether successful or not?
+ */
+static void learn_mac(struct iface_t *ifaces, unsigned from, u_char *mac,
+		      uint8_t oneshot)
+{
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next) {
+		if (i->set_mac_from != from)
+			continue;
+
+		if (oneshot == 0 &&
+		    (memcmp(i->mac, mac, ETH_ALEN) == 0 ||
+		     session_state(i->mac) == SESSION_AUTHENTICATED))
+			continue;
+
+		/* If iface_set_mac() gets as far as bringing interface
+		 * down, it is reopened once it is back up
+		 */
+		if (oneshot == 1)
+			i->set_mac_from = 0;
+		if (iface_set_mac(i, mac) == 0) {
+			notice("set MAC to %s, interface '%s'",
+			       iface_strmac(mac), i->name);
+		} else if (oneshot == 1) {
+			warning("won't try to autoset MAC again, "
+				"interface %s", i->name);
+		}
+	}
+}
+
+/**
+ * @brief Apply the ingress rate limits of an interface to a received packet
+ *
+ * The per-address limit is applied first, so that a single source flooding an
+ * interface uses up only its own tokens and not those of the interface too.
+ * Tracked supplicants have their buckets in the session table; any other
+ * source address, or every one without a session table, is limited through
+ * the sketch of the interface.
+ *
+ * @param plan Pointer to the <tt>struct plan_t</tt> of the interface
+ * @param pkt Pointer to a <tt>struct peapod_packet</tt> representing an EAPOL
+ *            packet received on it
+ * @return 1 if @p pkt may go on, or 0 if it is to be dropped
+ */
+static int admit(struct plan_t *plan, const struct peapod_packet *pkt)
+{
+	if (plan->limit_mac.pps != 0) {
+		int ret = session_limit(pkt->h_source, &plan->limit_mac,
+					&pkt->ts);
+		if (ret == -1)
+			ret = limit_sketch(&plan->sketch, pkt->h_source,
+					   &plan->limit_mac, &pkt->ts);
+		if (ret == 0)
+			return 0;
+	}
+
+	if (plan->limit.pps != 0 &&
+	    limit_take(&plan->full, &plan->limit, &pkt->ts) == 0)
+		return 0;
+
+	return 1;
+}
+
+/**
+ * @brief Process a received EAPOL packet and proxy it to egress interfaces
+ *
+ * Everything in the main event loop that happens between receiving a packet and
+ * waiting for the next one, i.e. the bulk of the ingress and egress phases.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @param pkt Pointer to a <tt>struct peapod_packet</tt> representing an EAPOL
+ *            packet; rewritten in place for each egress interface
+ * @return 0 if successful (including if @p pkt was dropped), or -1 if @p pkt
+ *         could not be sent on an egress interface
+ * @see @p proxy()
+ */
+static int forward(struct iface_t *ifaces, struct peapod_packet *pkt)
+{
+	struct iface_t *iface = pkt->iface;
+	struct plan_t *plan = iface->plan;
+
+	if (pkt->len == -2 || pkt->len == -3) {
+		/* Runt frames might not be a huge deal, but drop them
+		 * anyway. Giant frames were too big to fit in the
+		 * packet buffer.
+		 */
+		warning("dropping %s frame, interface '%s'",
+			pkt->len == -2 ? "runt" : "giant",
+			iface->name);
+		stats_event(iface, pkt->len == -2 ? STATS_RUNT : STATS_GIANT);
+		return 0;
+	}
+
+	++iface->recv_ctr;
+	stats_packet(iface, STATS_RECEIVED, pkt->type, pkt->code);
+
+	if (plan->capture != NULL)
+		capture_packet(plan->capture, pkt, CAPTURE_IN);
+
+	/* Drop whatever exceeds a rate limit before it can cost any more */
+	if (admit(plan, pkt) == 0) {
+		debug("rate limiting packet from %s, interface '%s'",
+		      iface_strmac(pkt->h_source), iface->name);
+		stats_packet(iface, STATS_RATE_LIMITED, pkt->type, pkt->code);
+		return 0;
+	}
+
+	session_update(pkt);
+
+	/* Set MAC of another interface to source address of first
+	 * Ethernet frame with EAPOL MPDU entering on current interface,
+	 * or with sessions, to that of each supplicant to authenticate.
+	 */
+	if (pkt->state == SESSION_AUTHENTICATED &&
+	    pkt->state_prev != SESSION_AUTHENTICATED &&
+	    pkt->supplicant_iface != 0)
+		learn_mac(ifaces, pkt->supplicant_iface, pkt->supplicant, 0);
+	else if (plan->set_mac == 1 && iface->recv_ctr == 1 &&
+		 session_enabled() == 0)
+		learn_mac(ifaces, iface->index, pkt->h_source, 1);
+
+	if (plan->action != NULL)
+		process_script(pkt, plan->action);
+
+	/* The filter bits this packet would match, if any */
+	uint16_t type = pkt->type < 16 ? 1 << pkt->type : 0;
+	uint8_t code = pkt->type == EAPOL_EAP && pkt->code < 8 ? 1 << pkt->code : 0;
+	uint8_t state = pkt->state != SESSION_NONE ? 1 << pkt->state_prev : 0;
+
+	if ((plan->filter.type & type || plan->filter.code & code ||
+	     plan->filter.state & state) &&
+	    process_filter(pkt, &plan->filter) == 1) {
+		stats_packet(iface, STATS_FILTERED_IN, pkt->type, pkt->code);
+		return 0;
+	}
+
+	/* Begin egress phase */
+	const struct route_t *first = plan->route;
+	const struct route_t *last = plan->route + plan->route_nr;
+
+	/* Send what is for a supplicant only where it was last seen, if that
+	 * is somewhere this interface sends to at all
+	 */
+	if (plan->unicast == 1 && pkt->supplicant_iface != 0 &&
+	    memcmp(pkt->supplicant, pkt->h_source, ETH_ALEN) != 0) {
+		for (const struct route_t *r = first; r < last; ++r) {
+			if (r->iface->index == pkt->supplicant_iface) {
+				first = r;
+				last = r + 1;
+				break;
+			}
+		}
+	}
+
+	for (const struct route_t *r = first; r < last; ++r) {
+		if (__atomic_load_n(&r->iface->down, __ATOMIC_RELAXED) == 1)
+			continue;		/* cf. iface_down() */
+
+		if (r->filter.type & type || r->filter.code & code ||
+		    r->filter.state & state) {
+			pkt->iface = r->iface;
+			if (process_filter(pkt, &r->filter) == 1) {
+				stats_packet(r->iface, STATS_FILTERED_OUT,
+					     pkt->type, pkt->code);
+				continue;
+			}
+		}
+
+		/* Hand off 802.1Q tag editing and egress script
+		 * execution to packet_send().
+		 */
+		if (packet_send(pkt, r) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Receive and forward the EAPOL packets ready on an interface
+ *
+ * Packets are received until none are left or the receive budget of @p iface
+ * is exhausted, whichever comes first. Any packets left over are picked up on
+ * a later wakeup, since @p epoll is level-triggered.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @param iface Pointer to the <tt>struct iface_t</tt> with packets ready
+ * @param epfd File descriptor for the @p epoll instance of the current worker
+ * @return 0 if successful, or -1 if a packet could not be received or sent
+ * @see @p proxy()
+ */
+static int drain(struct iface_t *ifaces, struct iface_t *iface, int epfd)
+{
+	struct peapod_packet pkts[PACKET_RX_BATCH];
+	struct peapod_packet pkt;
+	unsigned budget = iface->budget;
+
+	if (iface->rx_ring != NULL) {
+		/* Walk the frames the kernel has handed over */
+		while (budget-- > 0 && packet_recvring(iface, &pkt) != 0)
+			if (forward(ifaces, &pkt) == -1)
+				return -1;
+
+		return 0;
+	}
+
+	while (budget > 0) {
+		int n = budget < PACKET_RX_BATCH ? budget : PACKET_RX_BATCH;
+		int len = packet_recvmmsg(iface, pkts, n);
+
+		if (len == -1 && errno == ENETDOWN) {
+			link_down(iface, epfd);	/* Beat EPOLLERR to it */
+			return 0;
+		} else if (len == -1) {
+			ecrit("cannot receive, interface '%s': %s",
+			      iface->name);
+			return -1;
+		}
+
+		for (int i = 0; i < len; ++i)
+			if (forward(ifaces, &pkts[i]) == -1)
+				return -1;
+
+		if (len < n)
+			break;			/* Nothing left for now */
+
+		budget -= len;
+	}
+
+	return 0;
+}
+
 /**
  * @brief Main event loop
  *
@@ -91,14 +911,17 @@ static void spurious_event(char *name, uint32_t events)
  * -# <b>Ingress phase</b>: Receive an EAPOL packet (@p packet) on a configured
  *    interface (@p iface). <br />
  *    @p packet is an Ethernet frame containing an EAPOL MPDU and @p iface is a
- *    network interface configured in the config file.
+ *    network interface configured in the config file. Everything that follows
+ *    is done for each packet ready on each interface with packets ready, up to
+ *    the receive budget of each interface.
  *     - If @p packet is the first EAPOL packet to be received on @p iface, and
  *       any @e other interfaces are configured to have their MAC address set
  *       from the source MAC address of such a packet:
  *         - Set each such interface's MAC address.
  *         - Drop @p packet entirely and restart the loop.
  *     - If @p iface has an ingress script defined matching the EAPOL Packet
- *       Type or EAP Code of @p packet, execute the ingress script.
+ *       Type or EAP Code of @p packet, execute the ingress script. <br />
+ *       Scripts are executed asynchronously and never hold up proxying.
  *     - If @p iface has an ingress filter defined matching @p packet, apply
  *       the ingress filter (i.e. drop @p packet entirely and restart the loop).
  * -# <b>Egress phase</b>: Proxy @packet to other configured interfaces ("egress
@@ -113,9 +936,22 @@ static void spurious_event(char *name, uint32_t events)
  *       proxying @p packet on the next egress interface.
  *     - If @p eiface has an egress script defined matching @p epacket, execute
  *       the egress script.
- *     - Send @p epacket on @p eiface.
+ *     - Queue @p epacket for sending on @p eiface.
+ * -# Once every ready interface has been serviced, send all packets queued on
+ *    each egress interface at once.
+ * -# Reap scripts that have exited, terminate scripts that have timed out, and
+ *    execute any queued scripts that now fit.
  * -# Restart the loop.
  *
+ * With more than one worker, the main thread is worker 0 and other workers run
+ * the ingress and egress phases for their own interfaces in @p work(), handing
+ * their scripts and hooks over to the main thread. Should any worker fail, all
+ * of them are stopped and the proxy is restarted as a whole.
+ *
+ * An interface going down is not a failure: its raw socket is taken out of
+ * service until the kernel reports it back up, then reopened by the main
+ * thread, while the other interfaces carry on.
+ *
  * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
  *               representing network interfaces
  */
@@ -123,143 +959,266 @@ void proxy(struct iface_t *ifaces)
 {
 	sigset_t sigcurrent;
 	sigprocmask(SIG_SETMASK, NULL, &sigcurrent);
-	sigset_t sigempty;
-	sigemptyset(&sigempty);
+	sigset_t sigchld;			/* Keep SIGCHLD for signalfd(2) */
+	sigemptyset(&sigchld);
+	sigaddset(&sigchld, SIGCHLD);
 
 	struct timespec ts = { (time_t)10, 0 };
 
-	int epfd = create_epoll();		/* epoll file descriptor */
-	struct epoll_event event;		/* One event at a time */
+	workers_nr = iface_workers(ifaces);
+	epfds = calloc(workers_nr, sizeof(int));
+	workers = calloc(workers_nr, sizeof(struct worker_t));
+	if (epfds == NULL || workers == NULL)
+		ecritdie("cannot allocate workers: %s");
+
+	down_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (down_efd == -1)
+		ecritdie("cannot create eventfd: %s");
+
+	if (workers_nr > 1) {
+		stop_efd = eventfd(0, EFD_CLOEXEC);
+		fail_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (stop_efd == -1 || fail_efd == -1)
+			ecritdie("cannot create eventfd for workers: %s");
+	}
+
+	struct epoll_event events[PROXY_MAX_EVENTS];
 
 	int num_ifaces = iface_count(ifaces);
-	int rdy_ifaces = iface_init(ifaces, epfd);
+	int rdy_ifaces = init_epoll(ifaces);
+	int epfd = epfds[0];			/* epoll file descriptor */
 
 	info("%d interfaces are ready", rdy_ifaces);
 
 	packet_init(ifaces);
+	stats_ifaces(ifaces, workers_nr);
+	trace_ifaces(ifaces);
+	capture_ifaces(ifaces, NULL);
+	make_plans(ifaces);
+
+	if (process_init(ifaces, epfd) == -1)
+		critdie("cannot start script executor");
+
+	if (session_init() == -1)
+		critdie("cannot track sessions");
 
-	uint8_t ignore_epollerr = 0;		/* flag */
+	/* Everything the forwarding path touches is in place by now */
+	latency_lock();
+	latency_thread(0);
 
 	notice("starting proxy");
+	start_workers(ifaces);
 
 	struct iface_t *iface;
-	struct peapod_packet pkt;
+	int nfds;
+	uint8_t jobs;				/* flag */
 
 	while (1) {
-		check_signals();
+		check_signals(ifaces);
+
+		if (sig_hup > 0) {
+			notice("reloading config on SIGHUP");
+			--sig_hup;
+			ifaces = reload(ifaces);
+			num_ifaces = rdy_ifaces = iface_count(ifaces);
+		}
+
+		/* Nothing refers to old configs once scripts are done */
+		if (retired != NULL && process_idle() == 1) {
+			parser_free(retired, NULL);
+			retired = NULL;
+		}
 
 		/* Begin ingress phase */
 		if (num_ifaces != rdy_ifaces)
 			ecritdie("some interfaces are not ready");
 
-		if (epoll_pwait(epfd, &event, 1, -1, &sigempty) == -1) {
+		nfds = epoll_pwait(epfd, events, PROXY_MAX_EVENTS,
+				   process_timeout(), &sigchld);
+		if (nfds == -1) {
 			if (errno == EINTR)
-				goto proxy_error;
+				continue;	/* Signals are checked above */
 			else
 				ecritdie("cannot wait for epoll events: %s");
 		}
 
-		/* Received an EAPOL packet? */
-		iface = event.data.ptr ? event.data.ptr : NULL;
-
-		if (!(event.events & EPOLLIN)) {
-			/* Brought an interface down, along with its sockets */
-			if (ignore_epollerr == 1 && event.events & EPOLLERR)
-				goto proxy_ignore_epollerr;
-
-			/* We're here for some other reason */
-			spurious_event(iface ? iface->name : NULL,
-				       event.events);
-			goto proxy_error;
-		}
-
-		debuglow("got an EPOLLIN event, interface '%s'", iface->name);
+		jobs = nfds == 0;		/* A script timed out */
 
-		pkt = packet_recvmsg(iface);
+		for (int e = 0; e < nfds; ++e) {
+			/* A script exited? */
+			if (events[e].data.ptr == PROXY_TAG_SCRIPTS) {
+				jobs = 1;
+				continue;
+			}
 
-		if (pkt.len == -1) {
-			ecrit("cannot receive, interface '%s': %s",
-			      iface->name);
-			goto proxy_error;
-		} else if (pkt.len == -2 || pkt.len == -3) {
-			/* Runt frames might not be a huge deal, but drop them
-			 * anyway. Giant frames were too big to fit in the
-			 * packet buffer.
-			 */
-			warning("dropping %s frame, interface '%s'",
-				pkt.len == -2 ? "runt" : "giant",
-				iface->name);
-			continue;
-		}
+			/* Another worker has scripts/hooks for us? */
+			if (events[e].data.ptr == PROXY_TAG_DEFERRED) {
+				process_deferred();
+				continue;
+			}
 
-		++iface->recv_ctr;
+			/* Another worker stopped on error? */
+			if (events[e].data.ptr == PROXY_TAG_WORKERS) {
+				packet_flush(ifaces);
+				goto proxy_error;
+			}
 
-		/* Set MAC of another interface to source address of first
-		 * Ethernet frame with EAPOL MPDU entering on current interface.
-		 */
-		for (struct iface_t *i = ifaces;
-		     i != NULL && iface->recv_ctr == 1;
-		     i = i->next) {
-			if (i->set_mac_from != iface->index)
+			/* A link changed? */
+			if (events[e].data.ptr == PROXY_TAG_NETLINK) {
+				if (netlink_recv(ifaces) == -1)
+					warning("link state may be stale");
+				relink(ifaces);
 				continue;
+			}
 
-			/* If iface_set_mac() gets as far as bringing interface
-			 * down, proxy loop will restart unless -o was passed
-			 */
-			i->set_mac_from = 0;  /* oneshot */
-			if (iface_set_mac(i, pkt.h_source) == 0) {
-				ignore_epollerr = 1;
-				/* Emit this in place of an error */
-				notice("set MAC, interface '%s', restarting",
-				       i->name);
-			} else {
-				warning("won't try to autoset MAC again, "
-					"interface %s", i->name);
+			/* A worker took an interface out of service? */
+			if (events[e].data.ptr == PROXY_TAG_DOWN) {
+				uint64_t count;
+				if (read(down_efd, &count, sizeof(count)) == -1)
+					ewarning("cannot read eventfd: %s");
+				relink(ifaces);
+				continue;
 			}
-		}
 
-		process_script(pkt);
+			/* Received an EAPOL packet? */
+			iface = events[e].data.ptr ? events[e].data.ptr : NULL;
 
-		if (process_filter(pkt) == 1)
-			continue;
+			if (events[e].events != EPOLLIN) {
+				/* Went down? Then the others carry on */
+				if (link_event(iface, events[e].events,
+					       epfd) == 0)
+					continue;
 
-		/* Begin egress phase */
-		for (struct iface_t *i = ifaces; i != NULL; i = i->next) {
-			if (i == iface)
-				continue;
+				/* Don't leave anything from earlier events
+				 * queued; errors have been logged already.
+				 */
+				packet_flush(ifaces);
+				goto proxy_error;
+			}
 
-			if (process_filter(pkt) == 1)
-				continue;		/* "approximates" ;) */
+			debuglow("got an EPOLLIN event, interface '%s'",
+				 iface->name);
 
-			/* Hand off 802.1Q tag editing and egress script
-			 * execution to packet_send().
-			 */
-			if (packet_send(pkt, i) == -1)
+			if (drain(ifaces, iface, epfd) == -1) {
+				packet_flush(ifaces);
 				goto proxy_error;
+			}
 		}
 
+		/* Egress phase ends with sending everything queued above */
+		if (packet_flush(ifaces) == -1)
+			goto proxy_error;
+
+		/* Scripts are dealt with only once packets are on their way */
+		if (jobs == 1 || process_timeout() == 0)
+			process_jobs();
+
 		continue;
 
 proxy_error:
 		if (args.oneshot != 1) {
-proxy_ignore_epollerr:
-			sigprocmask(SIG_SETMASK, &sigempty, &sigcurrent);
-			check_signals();
-			ignore_epollerr = 0;		/* oneshot */
-			close(epfd);
+			stop_workers();
+			sigprocmask(SIG_SETMASK, &sigchld, &sigcurrent);
+			check_signals(ifaces);
+			for (unsigned w = 0; w < workers_nr; ++w)
+				close(epfds[w]);
 
 			notice("restarting proxy in 10 seconds");
 			nanosleep(&ts, NULL);
 
-			check_signals();
-			epfd = create_epoll();
-			rdy_ifaces = iface_init(ifaces, epfd);
+			check_signals(ifaces);
+			rdy_ifaces = init_epoll(ifaces);
+			epfd = epfds[0];
+			if (process_init(ifaces, epfd) == -1)
+				critdie("cannot restart script executor");
 			sigprocmask(SIG_BLOCK, &sigcurrent, NULL);
 
 			notice("starting proxy");
+			start_workers(ifaces);
 		} else {
 			notice("exiting on error, goodbye");
 			exit(EXIT_FAILURE);
 		}
 	}
 }
+
+/**
+ * @brief Replay a capture file through the proxy, then exit
+ *
+ * Runs the ingress and egress phases of @p proxy() for each packet in the
+ * capture file given with @p -r, on the main thread alone, as fast as
+ * possible; packets are sent wherever @p -w says, if anywhere (cf.
+ * @p replay.h). Once the last packet is sent, waits for any scripts still
+ * executing, logs how long it all took and the counters of each interface,
+ * and exits.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ */
+void proxy_replay(struct iface_t *ifaces)
+{
+	sigset_t sigchld;			/* Keep SIGCHLD for signalfd(2) */
+	sigemptyset(&sigchld);
+	sigaddset(&sigchld, SIGCHLD);
+
+	struct epoll_event events[PROXY_MAX_EVENTS];
+	struct timespec start, end;
+
+	if (replay_open(ifaces) == -1)
+		critdie("cannot replay capture file");
+
+	iface_trunks(ifaces);
+
+	packet_init(ifaces);
+	stats_ifaces(ifaces, 1);
+	trace_ifaces(ifaces);
+	capture_ifaces(ifaces, NULL);
+	make_plans(ifaces);
+
+	int epfd = create_epoll();
+	if (process_init(ifaces, epfd) == -1)
+		critdie("cannot start script executor");
+
+	if (session_init() == -1)
+		critdie("cannot track sessions");
+
+	notice("replaying '%s'", args.replay);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	struct iface_t *iface;
+	while ((iface = replay_next()) != NULL) {
+		check_signals(ifaces);
+
+		if (drain(ifaces, iface, -1) == -1 || packet_flush(ifaces) == -1)
+			critdie("cannot replay capture file");
+
+		if (process_timeout() == 0)
+			process_jobs();
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	/* Scripts don't know they're being replayed */
+	while (process_idle() == 0) {
+		check_signals(ifaces);
+		if (epoll_pwait(epfd, events, PROXY_MAX_EVENTS,
+				process_timeout(), &sigchld) == -1 &&
+		    errno != EINTR)
+			ecritdie("cannot wait for epoll events: %s");
+		process_jobs();
+	}
+
+	double secs = (end.tv_sec - start.tv_sec) +
+		      (end.tv_nsec - start.tv_nsec) / 1e9;
+	unsigned long received = 0;
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next)
+		received += i->recv_ctr;
+
+	notice("replayed %lu packets in %.3f seconds (%.0f packets per second)",
+	       received, secs, secs > 0 ? received / secs : 0);
+
+	stats_dump(ifaces);
+	session_dump(ifaces);
+	replay_close();
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,685 @@
+/**
+ * @file replay.c
+ * @brief Offline replay of pcap and pcapng files
+ *
+ * With @p -r, packets are read from a capture file instead of being received
+ * on the interfaces, and with @p -w, written to a pcapng file instead of being
+ * sent on them; either way, they go through the same filters, scripts, 802.1Q
+ * tag edits and dispatch as live packets do, only as fast as they can. This
+ * takes nothing but the config and the capture file: the interfaces in the
+ * config need not exist, and are numbered in the order they are configured.
+ *
+ * Packets are read in place from the capture file mapped by @p mmap(2), and
+ * handed over the way the kernel would hand them over to a raw socket: with
+ * the 802.1Q tag, if any, stripped and put in a @p PACKET_AUXDATA cmsg, and the
+ * timestamp in a @p SCM_TIMESTAMPNS cmsg, so that nothing past
+ * @p packet_recvmmsg() can tell the difference. Time stands still at the
+ * timestamp of the last packet received, and each packet is sent before the
+ * next one is received, making the output of a replay depend on nothing but
+ * its input.
+ *
+ * A packet in a pcapng file is taken to be received on the configured
+ * interface named by its Interface Description Block, or the first configured
+ * interface if there is none. Packets marked as sent (e.g. in a capture file
+ * written by @p peapod itself) are skipped, as are packets other than EAPOL
+ * packets, which a raw socket would never see.
+ *
+ * The output file has one Interface Description Block per interface, in
+ * config order, and an Enhanced Packet Block per packet sent, timestamped when
+ * the packet was received.
+ *
+ * @see @p proxy_replay()
+ */
+#define _GNU_SOURCE			/* struct mmsghdr */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "args.h"
+#include "capture.h"
+#include "log.h"
+#include "replay.h"
+
+/**
+ * @name pcap and pcapng magic numbers, block types and option codes
+ * @{
+ */
+#define PCAP_MAGIC_USEC			0xa1b2c3d4	/**< @brief pcap, microseconds */
+#define PCAP_MAGIC_NSEC			0xa1b23c4d	/**< @brief pcap, nanoseconds */
+#define PCAP_HDR_LEN			24	/**< @brief Length of the pcap file header */
+#define PCAP_REC_LEN			16	/**< @brief Length of a pcap record header */
+#define PCAPNG_SHB			0x0a0d0d0a	/**< @brief Section Header Block */
+#define PCAPNG_IDB			0x00000001	/**< @brief Interface Description Block */
+#define PCAPNG_SPB			0x00000003	/**< @brief Simple Packet Block */
+#define PCAPNG_EPB			0x00000006	/**< @brief Enhanced Packet Block */
+#define PCAPNG_BYTE_ORDER		0x1a2b3c4d	/**< @brief Byte-order magic */
+#define PCAPNG_IF_NAME			2	/**< @brief @p if_name */
+#define PCAPNG_IF_TSRESOL		9	/**< @brief @p if_tsresol */
+#define PCAPNG_EPB_FLAGS		2	/**< @brief @p epb_flags */
+#define PCAPNG_EPB_INBOUND		1	/**< @brief @p epb_flags direction */
+#define PCAPNG_EPB_OUTBOUND		2	/**< @brief Ditto */
+#define PCAPNG_LINKTYPE_ETHERNET	1	/**< @brief @p LINKTYPE_ETHERNET */
+/** @} */
+
+/** @brief Round a length up to the 32-bit boundary pcapng pads everything to */
+#define PCAPNG_PAD(len)			(((len) + 3) & ~(size_t)3)
+
+/** @brief An interface described in the current section of a pcapng file */
+struct replay_if_t {
+	struct iface_t *iface;		/**< @brief Configured interface its packets are received on */
+	uint64_t rate;			/**< @brief Timestamp units per second */
+	uint8_t ethernet;		/**< @brief Flag: Is its link type Ethernet? */
+};
+
+/** @brief A packet read from the capture file */
+struct replay_rec_t {
+	struct iface_t *iface;		/**< @brief Interface to receive it on */
+	struct timespec ts;		/**< @brief When it was captured */
+	const uint8_t *data;		/**< @brief The frame, in the capture file */
+	uint32_t caplen;		/**< @brief Length of @p data */
+	uint32_t len;			/**< @brief Length of the frame on the wire */
+};
+
+static uint16_t rd16(const uint8_t *p);
+static uint32_t rd32(const uint8_t *p);
+static int read_pcap(void);
+static int read_idb(const uint8_t *body, size_t len);
+static int read_pcapng(void);
+static int eapol(const struct replay_rec_t *rec);
+static size_t scatter(struct iovec *iov, size_t iovlen, size_t off,
+		      const uint8_t *src, size_t len);
+static void deliver(struct mmsghdr *msg, const struct replay_rec_t *rec);
+static int replay_recv(struct iface_t *iface, struct mmsghdr *msgs,
+		       unsigned n);
+static int replay_send(struct iface_t *iface, struct mmsghdr *msgs,
+		       const struct timespec *ts, unsigned n);
+static void replay_now(struct timespec *now);
+static int out_open(struct iface_t *ifaces);
+
+/** @brief Replaying through @p replay_recv() and @p replay_send() */
+static const struct packet_backend_t backend = {
+	replay_recv, replay_send, replay_now
+};
+
+/**
+ * @name The capture file being replayed
+ * @{
+ */
+static const uint8_t *map = NULL;	/**< @brief As mapped by @p mmap(2) */
+static size_t map_len = 0;		/**< @brief Length of @p map */
+static size_t pos = 0;			/**< @brief Offset of the next record or block */
+static uint8_t format = 0;		/**< @brief @p REPLAY_PCAP or @p REPLAY_PCAPNG */
+static uint8_t swapped = 0;		/**< @brief Flag: Written in the other byte order? */
+static uint64_t pcap_rate = 0;		/**< @brief Timestamp units per second, pcap only */
+static struct replay_if_t *ifs = NULL;	/**< @brief Interfaces in the current section, pcapng only */
+static unsigned ifs_nr = 0;		/**< @brief Number of @p ifs */
+/** @} */
+
+static struct iface_t *replay_ifaces = NULL;	/**< @brief All interfaces */
+static struct iface_t *first = NULL;	/**< @brief The first interface configured */
+static struct replay_rec_t rec;		/**< @brief The next packet to replay */
+static uint8_t rec_ready = 0;		/**< @brief Flag: Is @p rec yet to be received? */
+static struct timespec clock_now;	/**< @brief Timestamp of the last packet received */
+static unsigned long read_nr = 0;	/**< @brief Packets read */
+static unsigned long skipped_nr = 0;	/**< @brief Packets read but not replayed */
+
+/**
+ * @name The file replayed packets are written to
+ * @{
+ */
+static FILE *out = NULL;		/**< @brief The file, or @p NULL if not writing one */
+static unsigned long written_nr = 0;	/**< @brief Packets written */
+/** @} */
+
+extern struct args_t args;
+
+/** @brief Read a 16-bit integer in the byte order of the capture file */
+static uint16_t rd16(const uint8_t *p)
+{
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return swapped ? __builtin_bswap16(v) : v;
+}
+
+/** @brief Read a 32-bit integer in the byte order of the capture file */
+static uint32_t rd32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return swapped ? __builtin_bswap32(v) : v;
+}
+
+/**
+ * @brief Read the next record of a pcap file into @p rec
+ * @return 0 if a packet was read, or -1 at the end of the file
+ */
+static int read_pcap(void)
+{
+	if (pos + PCAP_REC_LEN > map_len)
+		return -1;
+
+	const uint8_t *hdr = map + pos;
+	uint32_t caplen = rd32(hdr + 8);
+	if (pos + PCAP_REC_LEN + caplen > map_len) {
+		warning("capture file '%s' is truncated", args.replay);
+		return -1;
+	}
+
+	rec.iface = first;
+	rec.ts.tv_sec = rd32(hdr);
+	rec.ts.tv_nsec = rd32(hdr + 4) * (1000000000 / pcap_rate);
+	rec.data = hdr + PCAP_REC_LEN;
+	rec.caplen = caplen;
+	rec.len = rd32(hdr + 12);
+
+	pos += PCAP_REC_LEN + caplen;
+	return 0;
+}
+
+/**
+ * @brief Add an interface described by an Interface Description Block to @p ifs
+ * @param body The body of the block
+ * @param len Length of @p body
+ * @return 0 if successful, or -1 if unsuccessful
+ */
+static int read_idb(const uint8_t *body, size_t len)
+{
+	struct replay_if_t *grown = realloc(ifs, (ifs_nr + 1) * sizeof(*ifs));
+	if (grown == NULL)
+		return -1;
+	ifs = grown;
+
+	struct replay_if_t *i = &ifs[ifs_nr++];
+	i->iface = first;
+	i->rate = 1000000;			/* Microseconds by default */
+	i->ethernet = len >= 8 && rd16(body) == PCAPNG_LINKTYPE_ETHERNET;
+
+	for (size_t o = 8; o + 4 <= len; ) {
+		uint16_t code = rd16(body + o), olen = rd16(body + o + 2);
+		const uint8_t *val = body + o + 4;
+
+		if (code == 0 || o + 4 + olen > len)
+			break;			/* opt_endofopt, or malformed */
+
+		if (code == PCAPNG_IF_NAME) {
+			struct iface_t *c;
+			for (c = replay_ifaces; c != NULL; c = c->next)
+				if (strnlen(c->name, IFNAMSIZ) == olen &&
+				    memcmp(c->name, val, olen) == 0)
+					break;
+			if (c != NULL)
+				i->iface = c;
+			else
+				info("replaying packets of interface '%.*s' on '%s'",
+				     olen, val, first->name);
+		} else if (code == PCAPNG_IF_TSRESOL && olen >= 1) {
+			uint8_t r = val[0] & 0x7f;
+			if (r > 18)
+				r = 18;		/* Out of range for 64 bits */
+			i->rate = 1;
+			while (r-- > 0)
+				i->rate *= val[0] & 0x80 ? 2 : 10;
+		}
+
+		o += 4 + PCAPNG_PAD(olen);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Read the next block of a pcapng file, into @p rec if it holds a packet
+ * @return 0 if a packet was read, 1 if the block holds no packet, or -1 at the
+ *         end of the file
+ */
+static int read_pcapng(void)
+{
+	if (pos + 12 > map_len)
+		return -1;
+
+	const uint8_t *blk = map + pos;
+	uint32_t type = rd32(blk);
+
+	/* Each section has a byte order of its own */
+	if (type == PCAPNG_SHB) {
+		uint32_t bom;
+		if (pos + 16 > map_len)
+			return -1;
+		memcpy(&bom, blk + 8, sizeof(bom));
+		swapped = bom != PCAPNG_BYTE_ORDER;
+		ifs_nr = 0;
+	}
+
+	uint32_t len = rd32(blk + 4);
+	if (len < 12 || len % 4 != 0 || pos + len > map_len) {
+		warning("capture file '%s' is truncated or malformed",
+			args.replay);
+		return -1;
+	}
+	pos += len;
+
+	const uint8_t *body = blk + 8;
+	size_t body_len = len - 12;
+
+	switch (type) {
+	case PCAPNG_IDB:
+		if (read_idb(body, body_len) == -1) {
+			eerr("cannot read capture file '%s': %s", args.replay);
+			return -1;
+		}
+		return 1;
+
+	case PCAPNG_EPB:
+		if (body_len < 20)
+			return 1;
+
+		uint32_t id = rd32(body);
+		uint32_t caplen = rd32(body + 12);
+		if (id >= ifs_nr || 20 + (size_t)caplen > body_len)
+			return 1;
+
+		/* Skip what the interface sent rather than received */
+		for (size_t o = 20 + PCAPNG_PAD(caplen); o + 4 <= body_len; ) {
+			uint16_t code = rd16(body + o), olen = rd16(body + o + 2);
+			if (code == 0 || o + 4 + olen > body_len)
+				break;
+			if (code == PCAPNG_EPB_FLAGS && olen == 4 &&
+			    (rd32(body + o + 4) & 0x3) == PCAPNG_EPB_OUTBOUND)
+				caplen = 0;
+			o += 4 + PCAPNG_PAD(olen);
+		}
+
+		uint64_t t = (uint64_t)rd32(body + 4) << 32 | rd32(body + 8);
+		uint64_t rate = ifs[id].rate;
+
+		rec.iface = ifs[id].ethernet ? ifs[id].iface : NULL;
+		rec.ts.tv_sec = t / rate;
+		/* Finer than nanoseconds is rounded down to nanoseconds */
+		rec.ts.tv_nsec = rate <= 1000000000 ?
+				 t % rate * 1000000000 / rate :
+				 t % rate / (rate / 1000000000);
+		rec.data = body + 20;
+		rec.caplen = caplen;
+		rec.len = caplen == 0 ? 0 : rd32(body + 16);
+		return 0;
+
+	case PCAPNG_SPB:
+		if (body_len < 4 || ifs_nr == 0)
+			return 1;
+
+		rec.iface = ifs[0].ethernet ? ifs[0].iface : NULL;
+		rec.ts = clock_now;		/* No timestamp of its own */
+		rec.data = body + 4;
+		rec.len = rd32(body);
+		rec.caplen = rec.len < body_len - 4 ? rec.len : body_len - 4;
+		return 0;
+
+	default:
+		return 1;
+	}
+}
+
+/**
+ * @brief Check whether a raw socket would receive a packet
+ * @param r Pointer to the packet
+ * @return 1 if it is an EAPOL packet, possibly with an 802.1Q tag, or 0 if not
+ */
+static int eapol(const struct replay_rec_t *r)
+{
+	if (r->iface == NULL || r->caplen < ETH_HLEN)
+		return 0;
+
+	uint16_t ethertype = r->data[12] << 8 | r->data[13];
+	if (ethertype == ETH_P_8021Q && r->caplen >= ETH_HLEN + 4)
+		ethertype = r->data[16] << 8 | r->data[17];
+
+	return ethertype == ETH_P_PAE;
+}
+
+/**
+ * @brief Copy into a vector of buffers, as @p readv(2) would
+ * @param iov The buffers
+ * @param iovlen Number of buffers
+ * @param off Bytes already copied into the buffers
+ * @param src What to copy
+ * @param len Length of @p src
+ * @return Bytes copied, which may be fewer than @p len if the buffers are full
+ */
+static size_t scatter(struct iovec *iov, size_t iovlen, size_t off,
+		      const uint8_t *src, size_t len)
+{
+	size_t done = 0;
+
+	for (size_t i = 0; i < iovlen && done < len; ++i) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+
+		size_t n = iov[i].iov_len - off;
+		if (n > len - done)
+			n = len - done;
+
+		memcpy((uint8_t *)iov[i].iov_base + off, src + done, n);
+		done += n;
+		off = 0;
+	}
+
+	return done;
+}
+
+/**
+ * @brief Hand over a packet as the kernel would with @p recvmmsg(2)
+ *
+ * Frames shorter than the minimum Ethernet frame size are padded, as they
+ * would have been on the wire.
+ *
+ * @param msg The <tt>struct mmsghdr</tt> to receive the packet with
+ * @param r Pointer to the packet
+ */
+static void deliver(struct mmsghdr *msg, const struct replay_rec_t *r)
+{
+	static const uint8_t zeroes[ETH_ZLEN];
+	struct msghdr *m = &msg->msg_hdr;
+	size_t tag = 0, copied, len;
+	uint16_t tci = 0;
+
+	if ((r->data[12] << 8 | r->data[13]) == ETH_P_8021Q) {
+		tag = 4;
+		tci = r->data[14] << 8 | r->data[15];
+	}
+
+	copied = scatter(m->msg_iov, m->msg_iovlen, 0, r->data, ETH_ALEN * 2);
+	copied += scatter(m->msg_iov, m->msg_iovlen, copied,
+			  r->data + ETH_ALEN * 2 + tag,
+			  r->caplen - ETH_ALEN * 2 - tag);
+	len = (r->len > r->caplen ? r->len : r->caplen) - tag;
+
+	if (copied < ETH_ZLEN && copied == r->caplen - tag) {
+		copied += scatter(m->msg_iov, m->msg_iovlen, copied, zeroes,
+				  ETH_ZLEN - copied);
+		len = copied;
+	}
+	msg->msg_len = copied;
+	m->msg_flags = copied < len ? MSG_TRUNC : 0;
+
+	/* What parse() gets from the kernel otherwise */
+	uint8_t *ctl = m->msg_control;
+	struct cmsghdr *cmsg = (struct cmsghdr *)ctl;
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_TIMESTAMPNS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(struct timespec));
+	memcpy(CMSG_DATA(cmsg), &r->ts, sizeof(struct timespec));
+
+	struct packet_auxdata_t aux = {
+		.tp_status = TP_STATUS_USER |
+			     (tag > 0 ? TP_STATUS_VLAN_VALID |
+					TP_STATUS_VLAN_TPID_VALID : 0),
+		.tp_len = len,
+		.tp_snaplen = copied,
+		.tp_mac = 0,
+		.tp_net = ETH_HLEN,
+		.tp_vlan_tci = tci,
+		.tp_vlan_tpid = tag > 0 ? ETH_P_8021Q : 0
+	};
+	cmsg = (struct cmsghdr *)(ctl + CMSG_SPACE(sizeof(struct timespec)));
+	cmsg->cmsg_level = SOL_PACKET;
+	cmsg->cmsg_type = PACKET_AUXDATA;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(aux));
+	memcpy(CMSG_DATA(cmsg), &aux, sizeof(aux));
+
+	m->msg_controllen = CMSG_SPACE(sizeof(struct timespec)) +
+			    CMSG_SPACE(sizeof(aux));
+}
+
+/**
+ * @brief Receive the next packet, if due on an interface
+ *
+ * One packet at a time, so that each is sent before time moves on to the
+ * next, as if @p peapod took no time at all.
+ *
+ * @see <tt>struct packet_backend_t</tt>
+ */
+static int replay_recv(struct iface_t *iface, struct mmsghdr *msgs,
+		       unsigned n)
+{
+	if (n == 0 || replay_next() != iface)
+		return 0;
+
+	deliver(&msgs[0], &rec);
+	clock_now = rec.ts;
+	rec_ready = 0;
+	return 1;
+}
+
+/**
+ * @brief Write packets to the output file, if any
+ * @see <tt>struct packet_backend_t</tt>
+ */
+static int replay_send(struct iface_t *iface, struct mmsghdr *msgs,
+		       const struct timespec *ts, unsigned n)
+{
+	uint8_t hdr[CAPTURE_EPB_HDR], opts[CAPTURE_BLOCK_MAX];
+	uint8_t pad[3] = { 0, 0, 0 };
+
+	for (unsigned i = 0; i < n; ++i) {
+		struct msghdr *m = &msgs[i].msg_hdr;
+		uint32_t len = 0, total;
+
+		for (size_t v = 0; v < m->msg_iovlen; ++v)
+			len += m->msg_iov[v].iov_len;
+		msgs[i].msg_len = len;
+
+		if (out == NULL)
+			continue;
+
+		/* Interfaces are numbered in config order, as are the IDBs */
+		size_t opts_len = capture_epb(hdr, opts, iface->index - 1,
+					      ts[i], len, CAPTURE_OUT, NULL);
+		memcpy(&total, hdr + sizeof(uint32_t), sizeof(total));
+
+		if (fwrite_unlocked(hdr, sizeof(hdr), 1, out) != 1)
+			return -1;
+		for (size_t v = 0; v < m->msg_iovlen; ++v)
+			if (fwrite_unlocked(m->msg_iov[v].iov_base, 1,
+					    m->msg_iov[v].iov_len, out) !=
+			    m->msg_iov[v].iov_len)
+				return -1;
+		if (fwrite_unlocked(pad, 1, PCAPNG_PAD(len) - len, out) !=
+		    PCAPNG_PAD(len) - len ||
+		    fwrite_unlocked(opts, 1, opts_len, out) != opts_len ||
+		    fwrite_unlocked(&total, sizeof(total), 1, out) != 1)
+			return -1;
+
+		++written_nr;
+	}
+
+	return n;
+}
+
+/**
+ * @brief Get the timestamp of the last packet received
+ * @see <tt>struct packet_backend_t</tt>
+ */
+static void replay_now(struct timespec *now)
+{
+	*now = clock_now;
+}
+
+/**
+ * @brief Create the output file and describe the interfaces in it
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @return 0 if successful, or -1 if unsuccessful
+ */
+static int out_open(struct iface_t *ifaces)
+{
+	uint8_t buf[CAPTURE_BLOCK_MAX];
+	size_t len;
+
+	if ((out = fopen(args.replay_out, "we")) == NULL)
+		return -1;
+	setvbuf(out, NULL, _IOFBF, REPLAY_BUFSIZ);
+
+	len = capture_shb(buf);
+	if (fwrite_unlocked(buf, 1, len, out) != len)
+		return -1;
+
+	/* The list is in reverse config order, the IDBs in config order */
+	unsigned n = iface_count(ifaces);
+	for (unsigned index = 1; index <= n; ++index) {
+		struct iface_t *i = ifaces;
+		while (i->index != index)
+			i = i->next;
+
+		len = capture_idb(buf, i->name);
+		if (fwrite_unlocked(buf, 1, len, out) != len)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Open the capture file to replay, and the file to write replayed
+ *        packets to, if any
+ *
+ * From then on, packets are received from and sent to these files instead of
+ * the interfaces, cf. @p packet_backend(). What only makes sense for a live
+ * interface, i.e. RX and TX rings, is dropped from the config.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @return 0 if successful, or -1 if unsuccessful
+ */
+int replay_open(struct iface_t *ifaces)
+{
+	struct stat st;
+	uint32_t magic;
+
+	replay_ifaces = ifaces;
+	for (first = ifaces; first->index != 1; first = first->next)
+		;
+
+	int fd = open(args.replay, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		eerr("cannot open capture file '%s': %s", args.replay);
+		return -1;
+	}
+
+	if (fstat(fd, &st) == -1 || st.st_size < PCAP_HDR_LEN) {
+		err("not a capture file: '%s'", args.replay);
+		close(fd);
+		return -1;
+	}
+
+	map_len = st.st_size;
+	map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		eerr("cannot map capture file '%s': %s", args.replay);
+		return -1;
+	}
+	madvise((void *)map, map_len, MADV_SEQUENTIAL);
+
+	memcpy(&magic, map, sizeof(magic));
+	if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC ||
+	    __builtin_bswap32(magic) == PCAP_MAGIC_USEC ||
+	    __builtin_bswap32(magic) == PCAP_MAGIC_NSEC) {
+		format = REPLAY_PCAP;
+		swapped = magic != PCAP_MAGIC_USEC && magic != PCAP_MAGIC_NSEC;
+		pcap_rate = rd32(map) == PCAP_MAGIC_NSEC ? 1000000000 : 1000000;
+		pos = PCAP_HDR_LEN;
+
+		if (rd32(map + 20) != PCAPNG_LINKTYPE_ETHERNET) {
+			err("capture file '%s' is not of Ethernet packets",
+			    args.replay);
+			return -1;
+		}
+	} else if (magic == PCAPNG_SHB) {
+		format = REPLAY_PCAPNG;
+		pos = 0;
+	} else {
+		err("not a pcap or pcapng file: '%s'", args.replay);
+		return -1;
+	}
+
+	if (args.replay_out != NULL && out_open(ifaces) == -1) {
+		eerr("cannot write '%s': %s", args.replay_out);
+		return -1;
+	}
+
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next) {
+		if (i->rx_ring != NULL || i->tx_ring != NULL)
+			info("not replaying through rings, interface '%s'",
+			     i->name);
+		free(i->rx_ring);
+		free(i->tx_ring);
+		i->rx_ring = i->tx_ring = NULL;
+		i->mtu = ETH_DATA_LEN;
+		i->flags = IFF_UP | IFF_RUNNING;
+	}
+
+	packet_backend(&backend);
+	return 0;
+}
+
+/**
+ * @brief Find the interface the next packet to replay is due on
+ * @return Pointer to the <tt>struct iface_t</tt> to receive the packet on, or
+ *         @p NULL if there are no packets left
+ */
+struct iface_t *replay_next(void)
+{
+	while (rec_ready == 0 && map != NULL) {
+		int ret = format == REPLAY_PCAP ? read_pcap() : read_pcapng();
+		if (ret == -1)
+			break;
+		if (ret == 1)
+			continue;
+
+		++read_nr;
+		if (eapol(&rec) == 1)
+			rec_ready = 1;
+		else
+			++skipped_nr;
+	}
+
+	return rec_ready == 1 ? rec.iface : NULL;
+}
+
+/**
+ * @brief Finish the output file, if any, and close the capture file
+ * @note Logs how much was replayed.
+ */
+void replay_close(void)
+{
+	notice("read %lu packets from '%s', skipped %lu sent or not EAPOL",
+	       read_nr, args.replay, skipped_nr);
+
+	if (out != NULL) {
+		if (fclose(out) == EOF)
+			eerr("cannot finish '%s': %s", args.replay_out);
+		else
+			notice("wrote %lu packets to '%s'", written_nr,
+			       args.replay_out);
+		out = NULL;
+	}
+
+	if (map != NULL)
+		munmap((void *)map, map_len);
+	map = NULL;
+	free(ifs);
+	ifs = NULL;
+	ifs_nr = 0;
+
+	packet_backend(NULL);
+}
@@ -0,0 +1,550 @@
+/**
+ * @file session.c
+ * @brief Per-supplicant session table
+ *
+ * Tracks each supplicant seen, by MAC address, in an open-addressing hash
+ * table with linear probing. The sessions themselves are preallocated, so that
+ * the memory used is bounded by the config, and kept in a list from most to
+ * least recently seen, so that the least recently seen is the one forgotten
+ * when it goes idle or the table is full.
+ *
+ * Packets sent by a supplicant (EAPOL-Start, EAPOL-Logoff and EAP-Response)
+ * belong to the session of their source address, and packets sent to one
+ * (EAP-Request, EAP-Success and EAP-Failure) to that of their destination
+ * address. Authenticators usually send the latter to the PAE group address
+ * instead, in which case they are matched to a recently seen supplicant on
+ * another interface by EAP Identifier.
+ *
+ * The table is shared by all workers under a single mutex, taken once per
+ * packet, twice with a per-address rate limit. This is deliberate: matching
+ * by EAP Identifier and forgetting the least recently seen session both need
+ * one order of recency over all supplicants, which tables sharded by address
+ * or kept per worker would split, and the supplicant and the authenticator are
+ * on different interfaces, so usually on different workers. It costs little:
+ * the lock is held for a probe or two and a list splice, the walk in
+ * @p find_group() is bounded by @p SESSION_WALK, expiry forgets no more
+ * sessions than were ever tracked, and EAPOL comes at rates far below where
+ * that would queue up workers. Without a @p sessions stanza the lock is never
+ * taken.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include "iface.h"
+#include "limit.h"
+#include "log.h"
+#include "session.h"
+
+/** @brief End of the list of sessions, or an unused slot */
+#define SESSION_NIL			(~(uint32_t)0)
+
+/** @brief The session of a supplicant */
+struct session_t {
+	uint8_t mac[ETH_ALEN];		/**< @brief MAC address of the supplicant */
+	uint8_t state;			/**< @brief Session state */
+	uint8_t id;			/**< @brief Last EAP Identifier */
+	uint8_t code;			/**< @brief Last EAP Code, or 0 */
+	uint8_t type;			/**< @brief Last EAP Request/Response Type, or 0 */
+	unsigned iface;			/**< @brief Index of the interface on which the supplicant was last seen, or 0 */
+	unsigned long packets;		/**< @brief Packets in the session */
+	struct timespec first;		/**< @brief When the supplicant was first seen */
+	struct timespec last;		/**< @brief When the session last saw a packet */
+	uint64_t full;			/**< @brief Ingress rate limit bucket of the supplicant, cf. @p limit_take() */
+	uint32_t newer;			/**< @brief Next more recently seen session, or free session */
+	uint32_t older;			/**< @brief Next less recently seen session */
+};
+
+static inline uint32_t hash(const uint8_t *mac);
+static uint32_t *probe(const uint8_t *mac);
+static void unlink_lru(uint32_t s);
+static void push_lru(uint32_t s);
+static void forget(uint32_t s);
+static uint32_t track(const uint8_t *mac);
+static void expire(const struct timespec *now);
+static uint32_t find_group(const struct peapod_packet *packet);
+
+/**
+ * @name The session table
+ * @note Shared by all workers, and guarded by @p lock; cf. the file comment
+ *       for why there is only one.
+ * @{
+ */
+static struct session_t *table = NULL;	/**< @brief The sessions, or @p NULL if not tracking any */
+static uint32_t *slots = NULL;		/**< @brief Hash table of indexes into @p table, or @p SESSION_NIL */
+static unsigned shift = 0;		/**< @brief 64 less the base 2 logarithm of the number of slots */
+static uint64_t seed = 0;		/**< @brief Keys the hash, so that supplicants cannot pick their slots */
+static uint32_t newest = SESSION_NIL;	/**< @brief Most recently seen session */
+static uint32_t oldest = SESSION_NIL;	/**< @brief Least recently seen session */
+static uint32_t unused = SESSION_NIL;	/**< @brief List of free sessions, linked through @p newer */
+static unsigned count = 0;		/**< @brief Sessions in use */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/** @} */
+
+/** @brief Names of the session states, as in the config file */
+static const char *const state_descs[SESSION_STATES] = {
+	[SESSION_NONE] = "none",
+	[SESSION_STARTED] = "started",
+	[SESSION_AUTHENTICATING] = "authenticating",
+	[SESSION_AUTHENTICATED] = "authenticated",
+	[SESSION_FAILED] = "failed",
+	[SESSION_LOGGED_OFF] = "logged-off"
+};
+
+extern struct sessions_t sessions;
+
+/**
+ * @brief Hash a MAC address to a slot
+ * @param mac A MAC address
+ * @return Index of the first slot in @p slots to probe
+ */
+static inline uint32_t hash(const uint8_t *mac)
+{
+	uint64_t key = 0;
+
+	memcpy(&key, mac, ETH_ALEN);
+	return ((key ^ seed) * 0x9e3779b97f4a7c15ULL) >> shift;
+}
+
+/**
+ * @brief Find the slot of a MAC address
+ * @param mac A MAC address
+ * @return The slot holding the session of @p mac, or the empty slot where it
+ *         would go
+ * @note Never more than half the slots are in use, so an empty one is always
+ *       found.
+ */
+static uint32_t *probe(const uint8_t *mac)
+{
+	uint32_t mask = (1U << (64 - shift)) - 1;
+
+	for (uint32_t i = hash(mac);; i = (i + 1) & mask)
+		if (slots[i] == SESSION_NIL ||
+		    memcmp(table[slots[i]].mac, mac, ETH_ALEN) == 0)
+			return &slots[i];
+}
+
+/**
+ * @brief Take a session out of the list of sessions
+ * @param s Index of the session in @p table
+ */
+static void unlink_lru(uint32_t s)
+{
+	struct session_t *ses = &table[s];
+
+	if (ses->newer != SESSION_NIL)
+		table[ses->newer].older = ses->older;
+	else
+		newest = ses->older;
+
+	if (ses->older != SESSION_NIL)
+		table[ses->older].newer = ses->newer;
+	else
+		oldest = ses->newer;
+}
+
+/**
+ * @brief Put a session at the head of the list of sessions
+ * @param s Index of the session in @p table
+ */
+static void push_lru(uint32_t s)
+{
+	table[s].newer = SESSION_NIL;
+	table[s].older = newest;
+
+	if (newest != SESSION_NIL)
+		table[newest].newer = s;
+	else
+		oldest = s;
+
+	newest = s;
+}
+
+/**
+ * @brief Forget a session
+ *
+ * Its slot is emptied by shifting back any slots after it that would no longer
+ * be found otherwise, rather than by leaving a tombstone.
+ *
+ * @param s Index of the session in @p table
+ */
+static void forget(uint32_t s)
+{
+	uint32_t mask = (1U << (64 - shift)) - 1;
+	uint32_t i = probe(table[s].mac) - slots;
+
+	for (uint32_t j = (i + 1) & mask;
+	     slots[j] != SESSION_NIL;
+	     j = (j + 1) & mask) {
+		uint32_t k = hash(table[slots[j]].mac);
+
+		/* Whatever is in slot j stays put if it hashed to (i, j] */
+		if (i < j ? (k <= i || k > j) : (k <= i && k > j)) {
+			slots[i] = slots[j];
+			i = j;
+		}
+	}
+	slots[i] = SESSION_NIL;
+
+	unlink_lru(s);
+	table[s].newer = unused;
+	unused = s;
+	--count;
+}
+
+/**
+ * @brief Start tracking a supplicant
+ *
+ * Should the table be full, the least recently seen session is forgotten to
+ * make room.
+ *
+ * @param mac MAC address of the supplicant, not already tracked
+ * @return Index of its session in @p table
+ */
+static uint32_t track(const uint8_t *mac)
+{
+	if (unused == SESSION_NIL) {
+		debug("session table full, forgetting supplicant %s",
+		      iface_strmac(table[oldest].mac));
+		forget(oldest);
+	}
+
+	uint32_t s = unused;
+	unused = table[s].newer;
+	++count;
+
+	memset(&table[s], 0, sizeof(table[s]));
+	memcpy(table[s].mac, mac, ETH_ALEN);
+	*probe(mac) = s;
+	push_lru(s);
+
+	return s;
+}
+
+/**
+ * @brief Forget sessions that have been idle for too long
+ * @param now The current time, on the clock of receive timestamps
+ */
+static void expire(const struct timespec *now)
+{
+	if (sessions.timeout == 0)
+		return;
+
+	while (oldest != SESSION_NIL &&
+	       table[oldest].last.tv_sec + sessions.timeout < now->tv_sec) {
+		debug("forgetting idle supplicant %s",
+		      iface_strmac(table[oldest].mac));
+		forget(oldest);
+	}
+}
+
+/**
+ * @brief Find the session an EAP packet sent to the PAE group address is for
+ *
+ * An EAP-Success or EAP-Failure echoes the Identifier of the EAP-Response it
+ * answers. An EAP-Request has nothing to go by, and is taken to be for the
+ * most recently seen supplicant that is authenticating.
+ *
+ * @param packet A <tt>struct peapod_packet</tt> representing an EAP-Request,
+ *               EAP-Success or EAP-Failure
+ * @return Index of the session in @p table, or @p SESSION_NIL if none of the
+ *         @p SESSION_WALK most recently seen sessions on another interface
+ *         fits
+ */
+static uint32_t find_group(const struct peapod_packet *packet)
+{
+	struct eapol_mpdu *mpdu = (struct eapol_mpdu *)packet->mpdu;
+	uint32_t s = newest;
+
+	for (int n = 0; n < SESSION_WALK && s != SESSION_NIL;
+	     ++n, s = table[s].older) {
+		struct session_t *ses = &table[s];
+
+		if (ses->iface == packet->iface->index)
+			continue;
+
+		if (packet->code == EAP_CODE_REQUEST ?
+		    ses->state == SESSION_STARTED ||
+		    ses->state == SESSION_AUTHENTICATING :
+		    ses->code == EAP_CODE_RESPONSE && ses->id == mpdu->eap.id)
+			return s;
+	}
+
+	return SESSION_NIL;
+}
+
+/**
+ * @brief Set up the session table
+ * @return 0 if successful, or -1 if unsuccessful
+ * @note Does nothing without a @p sessions stanza in the config.
+ */
+int session_init(void)
+{
+	if (sessions.max == 0)
+		return 0;
+
+	unsigned bits = 1;
+	while ((1U << bits) < 2 * sessions.max)
+		++bits;
+	shift = 64 - bits;
+
+	table = calloc(sessions.max, sizeof(*table));
+	slots = malloc((1U << bits) * sizeof(*slots));
+	if (table == NULL || slots == NULL) {
+		ecrit("cannot allocate session table: %s");
+		free(table);
+		free(slots);
+		table = NULL;
+		slots = NULL;
+		return -1;
+	}
+
+	memset(slots, 0xff, (1U << bits) * sizeof(*slots));	/* SESSION_NIL */
+
+	for (uint32_t s = 0; s < sessions.max; ++s)
+		table[s].newer = s + 1 < sessions.max ? s + 1 : SESSION_NIL;
+	unused = 0;
+
+	if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed)) {
+		ewarning("cannot seed session table, hashing predictably: %s");
+		seed = 0;
+	}
+
+	info("tracking up to %u supplicants", sessions.max);
+	return 0;
+}
+
+/**
+ * @brief Apply the session table limits of a reloaded config
+ *
+ * Only @p timeout can change without a restart, since sessions are allocated
+ * up front.
+ *
+ * @param conf The session table limits parsed along with a reloaded config
+ */
+void session_reload(const struct sessions_t *conf)
+{
+	if (conf->max != sessions.max)
+		warning("restart to change sessions max");
+
+	pthread_mutex_lock(&lock);
+	sessions.timeout = conf->timeout;
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Check whether supplicants are being tracked
+ * @return 1 if they are, or 0 if not
+ */
+int session_enabled(void)
+{
+	return table != NULL;
+}
+
+/**
+ * @brief Update the session an EAPOL packet belongs to
+ *
+ * Supplicants are tracked starting with the first EAPOL-Start, EAPOL-Logoff or
+ * EAP-Response they send, or EAP-Request sent to them directly. Other packets
+ * only update a session that already exists, e.g. an EAPOL-Key by either its
+ * source or its destination address.
+ *
+ * The session state after the packet, and before it, is recorded in @p packet
+ * along with a few more details of the session, for filters and scripts. Both
+ * states are left as @p SESSION_NONE if the packet belongs to no session.
+ *
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> representing a
+ *               received EAPOL packet
+ */
+void session_update(struct peapod_packet *packet)
+{
+	struct eapol_mpdu *mpdu = (struct eapol_mpdu *)packet->mpdu;
+	uint8_t code = 0, by_supplicant = 0;
+	uint32_t s, *slot;
+
+	if (table == NULL)
+		return;
+
+	if (packet->type == EAPOL_EAP &&
+	    EAP_CODE_REQUEST <= packet->code &&
+	    packet->code <= EAP_CODE_FAILURE)
+		code = packet->code;
+
+	by_supplicant = packet->type == EAPOL_START ||
+			packet->type == EAPOL_LOGOFF ||
+			code == EAP_CODE_RESPONSE;
+
+	pthread_mutex_lock(&lock);
+
+	expire(&packet->ts);
+
+	if (by_supplicant) {
+		if (packet->h_source[0] & 0x01)		/* Bogus */
+			goto out;
+
+		slot = probe(packet->h_source);
+		s = *slot != SESSION_NIL ? *slot : track(packet->h_source);
+		table[s].iface = packet->iface->index;
+	} else if (code != 0) {
+		if (packet->h_dest[0] & 0x01)
+			s = find_group(packet);
+		else if ((s = *probe(packet->h_dest)) == SESSION_NIL &&
+			 code == EAP_CODE_REQUEST)
+			s = track(packet->h_dest);
+	} else {
+		if ((s = *probe(packet->h_source)) == SESSION_NIL &&
+		    (packet->h_dest[0] & 0x01) == 0)
+			s = *probe(packet->h_dest);
+	}
+
+	if (s == SESSION_NIL)
+		goto out;
+
+	struct session_t *ses = &table[s];
+
+	if (ses->packets == 0)
+		ses->first = packet->ts;
+
+	packet->state_prev = ses->state;
+
+	if (packet->type == EAPOL_START)
+		ses->state = SESSION_STARTED;
+	else if (packet->type == EAPOL_LOGOFF)
+		ses->state = SESSION_LOGGED_OFF;
+	else if (code == EAP_CODE_REQUEST || code == EAP_CODE_RESPONSE)
+		ses->state = SESSION_AUTHENTICATING;
+	else if (code == EAP_CODE_SUCCESS)
+		ses->state = SESSION_AUTHENTICATED;
+	else if (code == EAP_CODE_FAILURE)
+		ses->state = SESSION_FAILED;
+
+	if (code != 0) {
+		ses->id = mpdu->eap.id;
+		ses->code = code;
+		ses->type = code <= EAP_CODE_RESPONSE ? mpdu->eap.type : 0;
+	}
+
+	++ses->packets;
+	ses->last = packet->ts;
+
+	if (s != newest) {
+		unlink_lru(s);
+		push_lru(s);
+	}
+
+	packet->state = ses->state;
+	memcpy(packet->supplicant, ses->mac, ETH_ALEN);
+	packet->supplicant_iface = ses->iface;
+	packet->session_packets = ses->packets;
+	packet->session_start = ses->first;
+
+out:
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Look up the session state of a supplicant
+ * @param mac MAC address of the supplicant
+ * @return The session state, or @p SESSION_NONE if it is not tracked
+ */
+uint8_t session_state(const uint8_t *mac)
+{
+	uint8_t ret = SESSION_NONE;
+
+	if (table == NULL)
+		return ret;
+
+	pthread_mutex_lock(&lock);
+	uint32_t s = *probe(mac);
+	if (s != SESSION_NIL)
+		ret = table[s].state;
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+/**
+ * @brief Take a token from the ingress rate limit bucket of a supplicant
+ *
+ * Each tracked supplicant has a bucket of its own, kept with its session and
+ * forgotten along with it.
+ *
+ * @param mac Source address of a received EAPOL packet
+ * @param limit The per-address rate limit of the interface it was received on
+ * @param now When it was received
+ * @return 1 if a token was taken, 0 if the bucket is empty, or -1 if @p mac
+ *         is not tracked
+ */
+int session_limit(const uint8_t *mac, const struct limit_t *limit,
+		  const struct timespec *now)
+{
+	int ret = -1;
+
+	if (table == NULL)
+		return ret;
+
+	pthread_mutex_lock(&lock);
+	uint32_t s = *probe(mac);
+	if (s != SESSION_NIL)
+		ret = limit_take(&table[s].full, limit, now);
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+/**
+ * @brief Describe a session state
+ * @param state A session state
+ * @return Its name, as in the config file
+ */
+const char *session_state_desc(uint8_t state)
+{
+	return state < SESSION_STATES ? state_descs[state] : "unknown";
+}
+
+/**
+ * @brief Log how many supplicants are in each session state, then each session
+ *
+ * The totals are logged at @p LOG_NOTICE, and the sessions at @p LOG_INFO from
+ * most to least recently seen.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ */
+void session_dump(struct iface_t *ifaces)
+{
+	unsigned states[SESSION_STATES] = { 0 };
+	struct timespec now;
+
+	if (table == NULL)
+		return;
+
+	packet_now(&now);
+	pthread_mutex_lock(&lock);
+
+	for (uint32_t s = newest; s != SESSION_NIL; s = table[s].older)
+		++states[table[s].state];
+
+	notice("sessions: %u of %u, %u started, %u authenticating, "
+	       "%u authenticated, %u failed, %u logged off", count,
+	       sessions.max, states[SESSION_STARTED],
+	       states[SESSION_AUTHENTICATING], states[SESSION_AUTHENTICATED],
+	       states[SESSION_FAILED], states[SESSION_LOGGED_OFF]);
+
+	for (uint32_t s = newest; s != SESSION_NIL; s = table[s].older) {
+		struct session_t *ses = &table[s];
+		const char *name = "?";
+
+		for (struct iface_t *i = ifaces; i != NULL; i = i->next)
+			if (i->index == ses->iface)
+				name = i->name;
+
+		info("  %s %s on '%s', %lu packets, last EAP Identifier %u, "
+		     "idle %lds", iface_strmac(ses->mac),
+		     session_state_desc(ses->state), name, ses->packets,
+		     ses->id, (long)(now.tv_sec - ses->last.tv_sec));
+	}
+
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,122 @@
+/**
+ * @file spsc.c
+ * @brief Lock-free single-producer, single-consumer rings
+ *
+ * The producer owns @p head and the consumer owns @p tail. Each only reads the
+ * other's index, with acquire semantics, to pair with the release that made
+ * the slots in between visible. Indices run freely and wrap around; only
+ * their difference matters.
+ */
+#include <stdlib.h>
+#include "spsc.h"
+
+/**
+ * @brief Set up a ring
+ * @param q Pointer to a <tt>struct spsc_t</tt>
+ * @param nr Number of slots, rounded up to a power of 2
+ * @param size Size of a slot in bytes
+ * @return 0 if successful, or -1 if unsuccessful
+ */
+int spsc_init(struct spsc_t *q, unsigned nr, size_t size)
+{
+	unsigned n = 1;
+	while (n < nr)
+		n <<= 1;
+
+	/* Keep slots pointer-aligned */
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	q->slots = malloc(n * size);
+	if (q->slots == NULL)
+		return -1;
+
+	q->size = size;
+	q->nr = n;
+	q->head = q->tail = 0;
+
+	return 0;
+}
+
+/**
+ * @brief Free a ring set up by @p spsc_init()
+ * @param q Pointer to a <tt>struct spsc_t</tt>
+ */
+void spsc_free(struct spsc_t *q)
+{
+	free(q->slots);
+	q->slots = NULL;
+}
+
+/**
+ * @brief Reserve the next free slot; producer only
+ * @param q Pointer to a <tt>struct spsc_t</tt>
+ * @return Pointer to the slot, or @p NULL if the ring is full
+ */
+void *spsc_reserve(struct spsc_t *q)
+{
+	return spsc_reserve_nth(q, 0);
+}
+
+/**
+ * @brief Reserve a free slot past the next one; producer only
+ *
+ * Lets the producer fill several slots and commit them at once, so that the
+ * consumer sees all or none of them.
+ *
+ * @param q Pointer to a <tt>struct spsc_t</tt>
+ * @param n Number of slots past the next free one, i.e. 0 for the next one
+ * @return Pointer to the slot, or @p NULL if the ring is too full
+ * @see @p spsc_commit_nr()
+ */
+void *spsc_reserve_nth(struct spsc_t *q, unsigned n)
+{
+	unsigned tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+	if (q->head - tail + n >= q->nr)
+		return NULL;
+
+	return q->slots + ((q->head + n) & (q->nr - 1)) * q->size;
+}
+
+/**
+ * @brief Hand the slot last reserved over to the consumer; producer only
+ * @param q Pointer to a <tt>struct spsc_t</tt>
+ */
+void spsc_commit(struct spsc_t *q)
+{
+	spsc_commit_nr(q, 1);
+}
+
+/**
+ * @brief Hand the slots last reserved over to the consumer; producer only
+ * @param q Pointer to a <tt>struct spsc_t</tt>
+ * @param nr Number of slots
+ */
+void spsc_commit_nr(struct spsc_t *q, unsigned nr)
+{
+	__atomic_store_n(&q->head, q->head + nr, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Get the oldest committed slot; consumer only
+ * @param q Pointer to a <tt>struct spsc_t</tt>
+ * @return Pointer to the slot, or @p NULL if the ring is empty
+ */
+void *spsc_peek(struct spsc_t *q)
+{
+	unsigned head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+	if (head == q->tail)
+		return NULL;
+
+	return q->slots + (q->tail & (q->nr - 1)) * q->size;
+}
+
+/**
+ * @brief Hand the slot last peeked at back to the producer; consumer only
+ * @param q Pointer to a <tt>struct spsc_t</tt>
+ */
+void spsc_release(struct spsc_t *q)
+{
+	__atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,420 @@
+/**
+ * @file stats.c
+ * @brief Per-interface counters and latency histograms
+ *
+ * Counters are kept per worker and only summed up when read, so that counting
+ * a packet is nothing more than an increment of memory no other thread writes.
+ * They live in the statistics region, which may be a file other processes map
+ * and read at any time, cf. <tt>struct stats_region_t</tt>. Each update is
+ * bracketed by the sequence lock of the counters it touches; the stores are
+ * relaxed atomic ones, which compile to plain ones.
+ */
+#define _GNU_SOURCE			/* asprintf(3) */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "args.h"
+#include "iface.h"
+#include "log.h"
+#include "packet.h"
+#include "stats.h"
+
+static void add(uint64_t *ctr, uint64_t n);
+static void lock(struct stats_t *stats);
+static void unlock(struct stats_t *stats);
+static struct stats_region_t *map_file(const char *path, size_t size);
+static void put(const char *fmt, ...);
+static void put_packets(const char *name, const struct stats_t *sum,
+			unsigned what);
+static void put_hist(const char *name, const struct hist_t *hist);
+
+/** @brief Size of the buffer a dump is built in */
+#define STATS_DUMP_MAX			4096
+
+extern struct args_t args;
+
+/**
+ * @name The statistics region
+ * @see <tt>struct stats_region_t</tt>
+ * @{
+ */
+static struct stats_region_t *region = NULL;	/**< @brief As mapped by @p mmap(2) */
+static size_t region_size = 0;		/**< @brief Size of the mapping */
+static time_t started = 0;		/**< @brief When the first region was set up */
+/** @} */
+
+static unsigned stats_nr = 1;		/**< @brief Counters per interface, one per worker */
+static _Thread_local unsigned worker = 0;	/**< @brief Selects the counters of the current thread */
+
+/**
+ * @name Dump being built
+ * @see @p put()
+ * @{
+ */
+static char dump_buf[STATS_DUMP_MAX];	/**< @brief The dump */
+static size_t dump_len = 0;		/**< @brief Length of the dump so far */
+/** @} */
+
+/**
+ * @brief Add to a counter of the current thread
+ * @param ctr Pointer to the counter
+ * @param n Amount to add
+ */
+static void add(uint64_t *ctr, uint64_t n)
+{
+	__atomic_store_n(ctr, __atomic_load_n(ctr, __ATOMIC_RELAXED) + n,
+			 __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Begin updating counters of the current thread
+ * @param stats Pointer to the counters
+ */
+static void lock(struct stats_t *stats)
+{
+	__atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Finish updating counters of the current thread
+ * @param stats Pointer to the counters
+ */
+static void unlock(struct stats_t *stats)
+{
+	__atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Create a file and map it
+ * @param path Path of the file, replaced if it exists
+ * @param size Size of the file
+ * @return A pointer to the mapping, or @p MAP_FAILED if unsuccessful
+ */
+static struct stats_region_t *map_file(const char *path, size_t size)
+{
+	struct stats_region_t *map = MAP_FAILED;
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	if (fd == -1)
+		return MAP_FAILED;
+
+	if (ftruncate(fd, size) == 0)
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	int errsv = errno;
+	close(fd);
+	if (map == MAP_FAILED) {
+		unlink(path);
+		errno = errsv;
+	}
+
+	return map;
+}
+
+/**
+ * @brief Append to the dump being built
+ *
+ * Anything that doesn't fit is cut off.
+ *
+ * @param fmt, ... @p printf(3)-style format and variable arguments
+ */
+__attribute__((format (printf, 1, 2)))
+static void put(const char *fmt, ...)
+{
+	if (dump_len >= sizeof(dump_buf) - 1)
+		return;
+
+	va_list vlist;
+	va_start(vlist, fmt);
+	int len = vsnprintf(dump_buf + dump_len, sizeof(dump_buf) - dump_len,
+			    fmt, vlist);
+	va_end(vlist);
+
+	if (len > 0)
+		dump_len += len;
+	if (dump_len > sizeof(dump_buf) - 1)
+		dump_len = sizeof(dump_buf) - 1;
+}
+
+/**
+ * @brief Append one kind of packet counter to the dump being built
+ *
+ * Only nonzero counters are included.
+ *
+ * @param name Name of the counter
+ * @param sum Counters of an interface, summed over all workers
+ * @param what @p STATS_RECEIVED or another packet counter
+ */
+static void put_packets(const char *name, const struct stats_t *sum,
+			unsigned what)
+{
+	const char *sep = "";
+
+	put("\"%s\":{", name);
+	for (int i = 0; i < STATS_TYPES; ++i) {
+		if (sum->type[what][i] == 0)
+			continue;
+		put("%s\"%s\":%" PRIu64, sep, stats_type_names[i],
+		    sum->type[what][i]);
+		sep = ",";
+	}
+	for (int i = 0; i < STATS_CODES; ++i) {
+		if (sum->code[what][i] == 0)
+			continue;
+		put("%s\"%s\":%" PRIu64, sep, stats_code_names[i],
+		    sum->code[what][i]);
+		sep = ",";
+	}
+	put("},");
+}
+
+/**
+ * @brief Append a histogram to the dump being built
+ *
+ * Buckets are listed in order, up to the last nonempty one.
+ *
+ * @param name Name of the histogram
+ * @param hist The histogram, summed over all workers
+ */
+static void put_hist(const char *name, const struct hist_t *hist)
+{
+	uint64_t count = 0;
+	int last = -1;
+
+	for (int b = 0; b < STATS_BUCKETS; ++b) {
+		count += hist->bucket[b];
+		if (hist->bucket[b] != 0)
+			last = b;
+	}
+
+	put("\"%s\":{\"count\":%" PRIu64 ",\"mean\":%" PRIu64
+	    ",\"max\":%" PRIu64 ",\"log2\":[",
+	    name, count, count ? hist->sum / count : 0, hist->max);
+	for (int b = 0; b <= last; ++b)
+		put("%s%" PRIu64, b ? "," : "", hist->bucket[b]);
+	put("]}");
+}
+
+/**
+ * @brief Set up the statistics region for interfaces in a list
+ *
+ * The region is (re)built for the interfaces in the list, one set of counters
+ * per interface per worker. Interfaces that already have counters keep them,
+ * e.g. when the config is reloaded; interfaces that are gone lose theirs.
+ *
+ * If a statistics file was requested, the new region is written next to it and
+ * then renamed into its place, so that readers never see a partial one. A
+ * region that cannot be put in a file is kept in anonymous memory instead.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @param nr Number of workers, main thread included
+ * @note Workers must not be running.
+ */
+void stats_ifaces(struct iface_t *ifaces, unsigned nr)
+{
+	struct stats_region_t *old = region;
+	size_t old_size = region_size;
+	unsigned old_nr = stats_nr;
+	unsigned n = 0;
+	char *tmp = NULL;
+
+	if (stats_nr < nr)
+		stats_nr = nr;
+	if (started == 0)
+		started = time(NULL);
+
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next)
+		++n;
+
+	size_t offset = sizeof(*region) + n * sizeof(region->iface[0]);
+	offset = (offset + _Alignof(struct stats_t) - 1) &
+		 ~(_Alignof(struct stats_t) - 1);
+	region_size = offset + (size_t)n * stats_nr * sizeof(struct stats_t);
+
+	region = MAP_FAILED;
+	if (args.statsfile != NULL) {
+		if (asprintf(&tmp, "%s.new", args.statsfile) == -1)
+			tmp = NULL;
+		else
+			region = map_file(tmp, region_size);
+		if (region == MAP_FAILED) {
+			ewarning("cannot create statistics file '%s'",
+				 args.statsfile);
+			free(tmp);
+			tmp = NULL;
+		}
+	}
+
+	if (region == MAP_FAILED &&
+	    (region = mmap(NULL, region_size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		ecritdie("cannot allocate statistics region");
+
+	region->magic = STATS_MAGIC;
+	region->version = STATS_VERSION;
+	region->size = region_size;
+	region->stats_size = sizeof(struct stats_t);
+	region->stats_offset = offset;
+	region->iface_nr = n;
+	region->worker_nr = stats_nr;
+	region->pid = getpid();
+	region->started = started;
+
+	struct stats_t *stats = (struct stats_t *)((uint8_t *)region + offset);
+	n = 0;
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next, ++n) {
+		struct stats_iface_t *entry = &region->iface[n];
+
+		memcpy(entry->name, i->name,
+		       strnlen(i->name, sizeof(entry->name) - 1));
+		entry->index = i->index;
+		entry->worker = i->worker;
+
+		if (i->stats != NULL)
+			memcpy(stats, i->stats, old_nr * sizeof(struct stats_t));
+		i->stats = stats;
+		stats += stats_nr;
+	}
+
+	if (tmp != NULL) {
+		if (rename(tmp, args.statsfile) == -1) {
+			ewarning("cannot replace statistics file '%s'",
+				 args.statsfile);
+			unlink(tmp);
+		}
+		free(tmp);
+	}
+
+	if (old != NULL) {
+		__atomic_store_n(&old->replaced, 1, __ATOMIC_RELEASE);
+		munmap(old, old_size);
+	}
+}
+
+/**
+ * @brief Set up the current thread as a worker
+ * @param id The worker, cf. the @p worker field of <tt>struct iface_t</tt>
+ */
+void stats_thread(unsigned id)
+{
+	worker = id;
+}
+
+/**
+ * @brief Count a packet on an interface
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ * @param what @p STATS_RECEIVED, @p STATS_SENT, @p STATS_FILTERED_IN,
+ *             @p STATS_FILTERED_OUT or @p STATS_RATE_LIMITED
+ * @param type EAPOL Packet Type of the packet
+ * @param code EAP Code of the packet, if it is an EAPOL-EAP packet
+ */
+void stats_packet(struct iface_t *iface, unsigned what, uint8_t type,
+		  uint8_t code)
+{
+	if (iface->stats == NULL)
+		return;
+
+	struct stats_t *stats = &iface->stats[worker];
+
+	lock(stats);
+	add(&stats->type[what][type < STATS_TYPES - 1 ? type : STATS_TYPES - 1],
+	    1);
+	if (type == EAPOL_EAP)
+		add(&stats->code[what][code < STATS_CODES ? code : 0], 1);
+	unlock(stats);
+}
+
+/**
+ * @brief Count an event on an interface
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ * @param what @p STATS_RUNT or another event counter
+ */
+void stats_event(struct iface_t *iface, unsigned what)
+{
+	if (iface->stats == NULL)
+		return;
+
+	struct stats_t *stats = &iface->stats[worker];
+
+	lock(stats);
+	add(&stats->event[what], 1);
+	unlock(stats);
+}
+
+/**
+ * @brief Add a duration to a histogram of an interface
+ * @param iface Pointer to a <tt>struct iface_t</tt> representing an interface
+ * @param what @p STATS_LATENCY or @p STATS_SCRIPT_TIME
+ * @param usec The duration in microseconds
+ */
+void stats_time(struct iface_t *iface, unsigned what, uint64_t usec)
+{
+	if (iface->stats == NULL)
+		return;
+
+	struct stats_t *stats = &iface->stats[worker];
+	struct hist_t *hist = &stats->hist[what];
+
+	int b = usec == 0 ? 0 : 64 - __builtin_clzll(usec);
+	if (b >= STATS_BUCKETS)
+		b = STATS_BUCKETS - 1;
+
+	lock(stats);
+	add(&hist->bucket[b], 1);
+	add(&hist->sum, usec);
+	if (usec > hist->max)
+		__atomic_store_n(&hist->max, usec, __ATOMIC_RELAXED);
+	unlock(stats);
+}
+
+/**
+ * @brief Log the counters and histograms of all interfaces
+ *
+ * Everything goes into one log message, a JSON object following the word
+ * "stats", so that it can be picked out of a log and parsed as a whole. The
+ * counters of each interface are summed over all workers first.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ */
+void stats_dump(struct iface_t *ifaces)
+{
+	dump_len = 0;
+	put("{\"ifaces\":[");
+
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next) {
+		struct stats_t sum;
+
+		if (i->stats != NULL)
+			stats_sum(&sum, i->stats, stats_nr);
+		else
+			memset(&sum, 0, sizeof(sum));
+
+		put("%s{\"name\":\"%s\",", i == ifaces ? "" : ",", i->name);
+		for (int p = 0; p < STATS_PACKETS; ++p)
+			put_packets(stats_packet_names[p], &sum, p);
+		for (int e = 0; e < STATS_EVENTS; ++e)
+			put("\"%s\":%" PRIu64 ",", stats_event_names[e], sum.event[e]);
+		put("\"filtered-in-kernel\":%lu,\"forwarded-in-kernel\":%lu,",
+		    iface_kstat(i, IFACE_KSTAT_FILTERED),
+		    iface_kstat(i, IFACE_KSTAT_FORWARDED));
+		for (int h = 0; h < STATS_HISTS; ++h) {
+			if (h > 0)
+				put(",");
+			put_hist(stats_hist_names[h], &sum.hist[h]);
+		}
+		put("}");
+	}
+
+	put("]}");
+	notice("stats %s", dump_buf);
+}
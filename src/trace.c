@@ -0,0 +1,168 @@
+/**
+ * @file trace.c
+ * @brief Binary packet trace
+ *
+ * With @p -T, every packet received or sent is recorded in a trace file instead
+ * of being decoded and dumped in the log. A record is a fixed-size copy of
+ * what @p peapod-trace needs to do the decoding later, so recording a packet
+ * costs little more than a @p memcpy(3) into memory mapped in advance.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "args.h"
+#include "log.h"
+#include "trace.h"
+
+_Static_assert(sizeof(struct trace_rec_t) == TRACE_RECSIZ,
+	       "struct trace_rec_t must be TRACE_RECSIZ bytes");
+
+static int trace_open(const char *path);
+
+/**
+ * @name The trace file
+ * @see <tt>struct trace_region_t</tt>
+ * @{
+ */
+static struct trace_region_t *trace = NULL;	/**< @brief As mapped by @p mmap(2), or @p NULL if not tracing */
+static struct trace_rec_t *recs = NULL;	/**< @brief The records */
+/** @} */
+
+extern struct args_t args;
+
+/**
+ * @brief Create, size and map a trace file
+ *
+ * The whole file is allocated on disk and faulted in up front, so that writing
+ * a record never has to wait for either.
+ *
+ * @param path Path of the trace file, replaced if it exists
+ * @return 0 if successful, or -1 if unsuccessful
+ */
+static int trace_open(const char *path)
+{
+	size_t offset = (sizeof(*trace) + 63) & ~(size_t)63;
+	size_t size = offset + (size_t)TRACE_RECORDS * sizeof(*recs);
+	int err;
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return -1;
+
+	if ((err = posix_fallocate(fd, 0, size)) != 0) {
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	trace = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, fd, 0);
+	err = errno;
+	close(fd);
+	if (trace == MAP_FAILED) {
+		trace = NULL;
+		errno = err;
+		return -1;
+	}
+
+	recs = (struct trace_rec_t *)((uint8_t *)trace + offset);
+
+	trace->magic = TRACE_MAGIC;
+	trace->version = TRACE_VERSION;
+	trace->rec_size = sizeof(*recs);
+	trace->rec_offset = offset;
+	trace->nr = TRACE_RECORDS;
+
+	return 0;
+}
+
+/**
+ * @brief Name interfaces in a list in the trace file, if tracing
+ *
+ * Opens the trace file the first time. Interfaces already named are skipped.
+ *
+ * @param ifaces Pointer to a list of <tt>struct iface_t</tt> structures
+ *               representing network interfaces
+ * @note Workers must not be running.
+ */
+void trace_ifaces(struct iface_t *ifaces)
+{
+	if (args.tracefile == NULL)
+		return;
+
+	if (trace == NULL) {
+		if (trace_open(args.tracefile) == -1) {
+			ewarning("cannot trace to '%s', not tracing: %s",
+				 args.tracefile);
+			args.tracefile = NULL;
+			return;
+		}
+		notice("tracing packets to '%s'", args.tracefile);
+	}
+
+	for (struct iface_t *i = ifaces; i != NULL; i = i->next) {
+		uint32_t n;
+
+		for (n = 0; n < trace->iface_nr; ++n)
+			if (trace->iface[n].index == i->index &&
+			    strncmp(trace->iface[n].name, i->name,
+				    IFNAMSIZ) == 0)
+				break;
+		if (n < trace->iface_nr)
+			continue;
+
+		if (n == TRACE_IFACES) {
+			warning("cannot name interface '%s' in trace file",
+				i->name);
+			continue;
+		}
+
+		memcpy(trace->iface[n].name, i->name,
+		       strnlen(i->name, IFNAMSIZ - 1));
+		trace->iface[n].index = i->index;
+		++trace->iface_nr;
+	}
+}
+
+/**
+ * @brief Record a packet in the trace file, if tracing
+ *
+ * May be called by any worker at any time.
+ *
+ * @param packet Pointer to a <tt>struct peapod_packet</tt> representing an
+ *               EAPOL packet that was just received or sent
+ * @return 0 if the packet was recorded, or -1 if not tracing
+ */
+int trace_packet(const struct peapod_packet *packet)
+{
+	if (trace == NULL)
+		return -1;
+
+	uint64_t n = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+	struct trace_rec_t *rec = &recs[n & (TRACE_RECORDS - 1)];
+	size_t mpdu_len = packet->len - ETH_ALEN * 2 -
+			  (packet->vlan_valid == 1 ? sizeof(uint32_t) : 0);
+
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	rec->sec = packet->ts.tv_sec;
+	rec->nsec = packet->ts.tv_nsec;
+	rec->index = packet->iface->index;
+	rec->len = packet->len;
+	rec->tci = packet->tci.pcp << 13 | packet->tci.dei << 12 |
+		   packet->tci.vid;
+	rec->vlan_valid = packet->vlan_valid;
+	rec->dir = packet->iface == packet->iface_orig ? TRACE_RECV : TRACE_SEND;
+	rec->caplen = mpdu_len < sizeof(rec->mpdu) ? mpdu_len : sizeof(rec->mpdu);
+	memcpy(rec->h_dest, packet->h_dest, ETH_ALEN);
+	memcpy(rec->h_source, packet->h_source, ETH_ALEN);
+	memcpy(rec->mpdu, packet->mpdu, rec->caplen);
+
+	__atomic_store_n(&rec->seq, n + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}